@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * A view of part of a shared, reference counted byte buffer.
+ *
+ *     Slices are cheap to copy and keep the whole backing buffer alive, so one read from a pipe
+ *     can be split into messages that are decoded, queued for publish and staged for writing
+ *     without copying the bytes. Constness is shallow, like a shared_ptr: the bytes are
+ *     writable through any slice and nothing should modify a buffer once it has been sliced.
+ */
+class BufferSlice {
+public:
+  BufferSlice() : offset( 0 ), len( 0 ) {}
+
+  /// Take ownership of bytes, the slice covers all of them
+  explicit BufferSlice( std::vector<uint8_t>&& bytes )
+    : buf( std::make_shared<std::vector<uint8_t>>( std::move( bytes ) ) ), offset( 0 ), len( buf->size() ) {}
+
+  BufferSlice( std::shared_ptr<std::vector<uint8_t>> bufVal, size_t offsetVal, size_t lenVal )
+    : buf( std::move( bufVal ) ), offset( offsetVal ), len( lenVal ) {}
+
+  uint8_t* data() const { return buf ? buf->data() + offset : nullptr; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+
+  const uint8_t* begin() const { return data(); }
+  const uint8_t* end() const { return data() + len; }
+
+  /// A slice of this slice sharing the same backing buffer
+  BufferSlice sub( size_t subOffset, size_t subLen ) const { return BufferSlice( buf, offset + subOffset, subLen ); }
+
+  /// An owned copy, for APIs that need to take the bytes
+  std::vector<uint8_t> copy() const { return std::vector<uint8_t>( begin(), end() ); }
+
+private:
+  std::shared_ptr<std::vector<uint8_t>> buf;
+  size_t offset;
+  size_t len;
+};
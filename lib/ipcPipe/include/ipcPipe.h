@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Transport used between the endpoint processes
+ */
+enum class IpcTransport {
+  fifo,  ///< Named pipe at the given path
+  shm    ///< Shared memory ring with eventfd notification, rendezvous on <path>.shm
+};
+
+/// Transport selected with the QMSG_IPC environment variable ( "fifo" or "shm" ), default fifo
+IpcTransport ipcTransportFromEnv();
+
+struct ShmRingHeader;
+
+/**
+ * One direction of a byte stream between two processes, with the same semantics as a named
+ *     pipe: opening blocks until the other end opens, read blocks until there is at least one
+ *     byte and returns 0 once the writer has closed, write blocks until everything is written.
+ *
+ *     The shm transport is a single producer single consumer ring in a shared memory segment.
+ *     The reader creates the segment and two eventfds and passes the eventfds to the writer over
+ *     a UNIX socket. Data never goes through the kernel and an eventfd is only signalled when the
+ *     other side is asleep waiting for it, so a busy stream costs no syscalls per message.
+ */
+class IpcPipe {
+public:
+  IpcPipe();
+  ~IpcPipe();
+
+  IpcPipe( const IpcPipe& ) = delete;
+  IpcPipe& operator=( const IpcPipe& ) = delete;
+
+  int openRead( const std::string& path, IpcTransport transport = ipcTransportFromEnv() );
+  int openWrite( const std::string& path, IpcTransport transport = ipcTransportFromEnv() );
+  void close();
+
+  /// File descriptor that select()/poll() reports readable when read() will not block
+  int getFD() const;
+
+  ssize_t read( void* buf, size_t len );
+  ssize_t write( const void* buf, size_t len );
+  ssize_t writev( const struct iovec* iov, int iovcnt );
+
+  /// Read exactly len bytes unless the writer closes first
+  ssize_t readAll( void* buf, size_t len );
+
+  /// In non blocking mode writes return what fit, or -1 with EAGAIN, instead of waiting
+  int setNonBlocking( bool nonBlocking );
+
+  IpcTransport transport() const { return type; }
+
+private:
+  size_t ringRead( void* buf, size_t len );
+  size_t ringWrite( const void* buf, size_t len, uint64_t head );
+  void armReader();
+  void notifyReader();
+  void notifyWriter();
+
+  IpcTransport type;
+  bool isWriter;
+  bool nonBlocking;
+  int fd;                  ///< FIFO, or the data eventfd for shm
+  int spaceFD;             ///< shm only, signalled by the reader when space frees up
+  ShmRingHeader* ring;
+  unsigned char* ringData;
+  size_t mapLen;
+  std::string shmName;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <bufferSlice.h>
+#include <ipcPipe.h>
+
+/**
+ * Output staging for an IpcPipe.
+ *
+ *     Messages queued during one loop iteration are written together by flush() with a single
+ *     writev. The pipe is switched to non blocking mode, and whatever does not fit because the
+ *     reader is behind stays staged for the next flush() rather than stalling the loop.
+ *     Slices are written straight from their shared buffer without copying.
+ */
+class IpcWriteStage {
+public:
+  explicit IpcWriteStage( IpcPipe& pipe );
+
+  void queue( BufferSlice msg );
+  void queue( std::vector<uint8_t>&& msg );
+  void queue( const void* data, size_t len );
+
+  /// Write as much as the pipe takes. Returns -1 only on a real error such as the reader closing.
+  int flush();
+
+  bool pending() const { return !chunks.empty(); }
+  size_t pendingBytes() const { return stagedBytes; }
+
+private:
+  IpcPipe& pipe;
+  std::deque<BufferSlice> chunks;
+  size_t frontOffset;   ///< bytes of chunks.front() already written
+  size_t stagedBytes;
+};
@@ -0,0 +1,560 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <new>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <ipcPipe.h>
+
+static const uint32_t shmRingMagic = 0x716d7367; // "qmsg"
+static const size_t shmRingCapacity = 1 << 20;   // must be a power of 2
+
+static_assert( ATOMIC_LLONG_LOCK_FREE == 2, "shared memory ring needs lock free 64 bit atomics" );
+
+/**
+ * Layout at the start of the shared memory segment, the ring data follows it. head and tail are
+ *     free running byte counts written only by the writer and reader respectively.
+ */
+struct ShmRingHeader {
+  uint32_t magic;
+  uint32_t capacity;
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) std::atomic<uint32_t> readerWaiting;  ///< reader needs a signal on the data eventfd
+  std::atomic<uint32_t> writerWaiting;              ///< writer needs a signal on the space eventfd
+  std::atomic<uint32_t> closed;
+};
+
+static const size_t shmHeaderLen = ( sizeof( ShmRingHeader ) + 63 ) & ~size_t( 63 );
+
+
+IpcTransport ipcTransportFromEnv() {
+  const char* ipcVar = getenv( "QMSG_IPC" );
+  if ( ipcVar && ( strcmp( ipcVar, "shm" ) == 0 ) ) {
+    return IpcTransport::shm;
+  }
+  return IpcTransport::fifo;
+}
+
+
+#ifdef __linux__
+
+// Spin briefly before sleeping when there is another core that can fill the ring meanwhile
+static int readSpinLimit() {
+  static const int limit = ( sysconf( _SC_NPROCESSORS_ONLN ) > 1 ) ? 4000 : 0;
+  return limit;
+}
+
+static int shmSocketPath( const std::string& path, struct sockaddr_un& addr ) {
+  std::string sockPath = path + ".shm";
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  if ( sockPath.size() >= sizeof( addr.sun_path ) ) {
+    std::cerr << "IPC socket path too long: " << sockPath << std::endl;
+    return -1;
+  }
+  strncpy( addr.sun_path, sockPath.c_str(), sizeof( addr.sun_path ) - 1 );
+  return 0;
+}
+
+static int sendFDs( int sock, const int* fds, int numFDs ) {
+  char byte = 'q';
+  struct iovec iov = { &byte, 1 };
+  union {
+    char buf[ CMSG_SPACE( 3 * sizeof( int ) ) ];
+    struct cmsghdr align;
+  } control;
+  memset( &control, 0, sizeof( control ) );
+  assert( numFDs <= 3 );
+
+  struct msghdr msg;
+  memset( &msg, 0, sizeof( msg ) );
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE( numFDs * sizeof( int ) );
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN( numFDs * sizeof( int ) );
+  memcpy( CMSG_DATA( cmsg ), fds, numFDs * sizeof( int ) );
+
+  return ( sendmsg( sock, &msg, 0 ) == 1 ) ? 0 : -1;
+}
+
+static int recvFDs( int sock, int* fds, int numFDs ) {
+  char byte;
+  struct iovec iov = { &byte, 1 };
+  union {
+    char buf[ CMSG_SPACE( 3 * sizeof( int ) ) ];
+    struct cmsghdr align;
+  } control;
+  assert( numFDs <= 3 );
+
+  struct msghdr msg;
+  memset( &msg, 0, sizeof( msg ) );
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE( numFDs * sizeof( int ) );
+
+  if ( recvmsg( sock, &msg, 0 ) != 1 ) {
+    return -1;
+  }
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+  if ( ( cmsg == NULL ) || ( cmsg->cmsg_type != SCM_RIGHTS ) ||
+       ( cmsg->cmsg_len != CMSG_LEN( numFDs * sizeof( int ) ) ) ) {
+    return -1;
+  }
+  memcpy( fds, CMSG_DATA( cmsg ), numFDs * sizeof( int ) );
+  return 0;
+}
+
+#endif
+
+
+IpcPipe::IpcPipe()
+  : type( IpcTransport::fifo ), isWriter( false ), nonBlocking( false ), fd( -1 ), spaceFD( -1 ),
+    ring( NULL ), ringData( NULL ), mapLen( 0 ) {
+}
+
+IpcPipe::~IpcPipe() {
+  close();
+}
+
+
+int IpcPipe::openRead( const std::string& path, IpcTransport transport ) {
+  assert( fd < 0 );
+  isWriter = false;
+  type = transport;
+
+#ifndef __linux__
+  if ( type == IpcTransport::shm ) {
+    std::clog << "IPC: shm transport needs Linux, using fifo for " << path << std::endl;
+    type = IpcTransport::fifo;
+  }
+#endif
+
+  if ( type == IpcTransport::fifo ) {
+    fd = ::open( path.c_str(), O_RDONLY );
+    return ( fd >= 0 ) ? 0 : -1;
+  }
+
+#ifdef __linux__
+  // Create the ring and eventfds, then hand them to the writer once it connects
+  int memFD = memfd_create( "qmsg-ipc", MFD_CLOEXEC );
+  if ( memFD < 0 ) {
+    perror( "IPC: memfd_create failed" );
+    return -1;
+  }
+  mapLen = shmHeaderLen + shmRingCapacity;
+  if ( ftruncate( memFD, mapLen ) != 0 ) {
+    perror( "IPC: could not size shared memory" );
+    ::close( memFD );
+    return -1;
+  }
+  void* mem = mmap( NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, memFD, 0 );
+  if ( mem == MAP_FAILED ) {
+    perror( "IPC: mmap failed" );
+    ::close( memFD );
+    return -1;
+  }
+  ring = new (mem) ShmRingHeader();
+  ring->magic = shmRingMagic;
+  ring->capacity = shmRingCapacity;
+  ring->head.store( 0 );
+  ring->tail.store( 0 );
+  ring->readerWaiting.store( 1 );
+  ring->writerWaiting.store( 0 );
+  ring->closed.store( 0 );
+  ringData = (unsigned char*)mem + shmHeaderLen;
+
+  fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  spaceFD = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  assert( fd >= 0 );
+  assert( spaceFD >= 0 );
+
+  struct sockaddr_un addr;
+  int err = shmSocketPath( path, addr );
+  if ( err ) {
+    ::close( memFD );
+    return -1;
+  }
+  unlink( addr.sun_path );
+
+  int listenFD = socket( AF_UNIX, SOCK_STREAM, 0 );
+  assert( listenFD >= 0 );
+  if ( ( bind( listenFD, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 ) ||
+       ( listen( listenFD, 1 ) != 0 ) ) {
+    perror( "IPC: could not listen for shm writer" );
+    ::close( listenFD );
+    ::close( memFD );
+    return -1;
+  }
+
+  int sock = accept( listenFD, NULL, NULL );
+  ::close( listenFD );
+  unlink( addr.sun_path );
+  if ( sock < 0 ) {
+    perror( "IPC: accept of shm writer failed" );
+    ::close( memFD );
+    return -1;
+  }
+
+  int fds[3] = { memFD, fd, spaceFD };
+  err = sendFDs( sock, fds, 3 );
+  ::close( sock );
+  ::close( memFD );
+  if ( err ) {
+    std::cerr << "IPC: could not pass shm ring to writer of " << path << std::endl;
+    return -1;
+  }
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+
+int IpcPipe::openWrite( const std::string& path, IpcTransport transport ) {
+  assert( fd < 0 );
+  isWriter = true;
+  type = transport;
+
+#ifndef __linux__
+  if ( type == IpcTransport::shm ) {
+    std::clog << "IPC: shm transport needs Linux, using fifo for " << path << std::endl;
+    type = IpcTransport::fifo;
+  }
+#endif
+
+  if ( type == IpcTransport::fifo ) {
+    fd = ::open( path.c_str(), O_WRONLY );
+    if ( fd < 0 ) {
+      return -1;
+    }
+    return nonBlocking ? setNonBlocking( true ) : 0;
+  }
+
+#ifdef __linux__
+  struct sockaddr_un addr;
+  if ( shmSocketPath( path, addr ) ) {
+    return -1;
+  }
+
+  // Like opening a FIFO, wait for the reader to show up
+  int sock = -1;
+  while ( true ) {
+    sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+    assert( sock >= 0 );
+    if ( connect( sock, (struct sockaddr*)&addr, sizeof( addr ) ) == 0 ) {
+      break;
+    }
+    int e = errno;
+    ::close( sock );
+    if ( ( e != ENOENT ) && ( e != ECONNREFUSED ) ) {
+      perror( "IPC: could not connect to shm reader" );
+      return -1;
+    }
+    usleep( 10 * 1000 );
+  }
+
+  int fds[3];
+  int err = recvFDs( sock, fds, 3 );
+  ::close( sock );
+  if ( err ) {
+    std::cerr << "IPC: did not get shm ring from reader of " << path << std::endl;
+    return -1;
+  }
+
+  struct stat st;
+  fstat( fds[0], &st );
+  mapLen = st.st_size;
+  void* mem = mmap( NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0 );
+  ::close( fds[0] );
+  if ( mem == MAP_FAILED ) {
+    perror( "IPC: mmap failed" );
+    ::close( fds[1] );
+    ::close( fds[2] );
+    return -1;
+  }
+  ring = (ShmRingHeader*)mem;
+  ringData = (unsigned char*)mem + shmHeaderLen;
+  fd = fds[1];
+  spaceFD = fds[2];
+
+  if ( ( ring->magic != shmRingMagic ) || ( shmHeaderLen + ring->capacity != mapLen ) ) {
+    std::cerr << "IPC: bad shm ring from reader of " << path << std::endl;
+    close();
+    return -1;
+  }
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+
+void IpcPipe::close() {
+#ifdef __linux__
+  if ( ring ) {
+    ring->closed.store( 1 );
+    eventfd_write( isWriter ? fd : spaceFD, 1 ); // wake the other side so it sees the close
+    munmap( ring, mapLen );
+    ring = NULL;
+    ringData = NULL;
+  }
+#endif
+  if ( spaceFD >= 0 ) {
+    ::close( spaceFD );
+    spaceFD = -1;
+  }
+  if ( fd >= 0 ) {
+    ::close( fd );
+    fd = -1;
+  }
+}
+
+
+int IpcPipe::getFD() const {
+  return fd;
+}
+
+
+int IpcPipe::setNonBlocking( bool nonBlockingVal ) {
+  nonBlocking = nonBlockingVal;
+  if ( type != IpcTransport::fifo ) {
+    return 0;
+  }
+
+  int flags = fcntl( fd, F_GETFL );
+  if ( flags < 0 ) {
+    return -1;
+  }
+  flags = nonBlocking ? ( flags | O_NONBLOCK ) : ( flags & ~O_NONBLOCK );
+  return fcntl( fd, F_SETFL, flags );
+}
+
+
+size_t IpcPipe::ringRead( void* buf, size_t len ) {
+  const uint64_t tail = ring->tail.load( std::memory_order_relaxed );
+  const uint64_t head = ring->head.load( std::memory_order_acquire );
+  const size_t mask = ring->capacity - 1;
+
+  size_t n = std::min<uint64_t>( head - tail, len );
+  if ( n == 0 ) {
+    return 0;
+  }
+  size_t offset = tail & mask;
+  size_t first = std::min( n, ring->capacity - offset );
+  memcpy( buf, ringData + offset, first );
+  memcpy( (unsigned char*)buf + first, ringData, n - first );
+
+  ring->tail.store( tail + n, std::memory_order_seq_cst );
+  notifyWriter();
+  return n;
+}
+
+
+// Copies as much as fits at head without publishing it, so a whole writev becomes visible to the
+// reader at once.
+size_t IpcPipe::ringWrite( const void* buf, size_t len, uint64_t head ) {
+  const uint64_t tail = ring->tail.load( std::memory_order_seq_cst );
+  const size_t mask = ring->capacity - 1;
+
+  size_t n = std::min<uint64_t>( ring->capacity - ( head - tail ), len );
+  if ( n == 0 ) {
+    return 0;
+  }
+  size_t offset = head & mask;
+  size_t first = std::min( n, ring->capacity - offset );
+  memcpy( ringData + offset, buf, first );
+  memcpy( ringData, (const unsigned char*)buf + first, n - first );
+  return n;
+}
+
+
+// Called by the reader whenever it finds the ring empty. Clears the data eventfd so select()
+// stops reporting it, then asks the writer for a signal. If data raced in meanwhile, and the
+// writer did not take the request, the eventfd is set again so select() does not miss it.
+void IpcPipe::armReader() {
+#ifdef __linux__
+  eventfd_t count;
+  eventfd_read( fd, &count );
+
+  ring->readerWaiting.store( 1, std::memory_order_seq_cst );
+  if ( ring->head.load( std::memory_order_seq_cst ) != ring->tail.load( std::memory_order_relaxed ) ) {
+    if ( ring->readerWaiting.exchange( 0 ) ) {
+      eventfd_write( fd, 1 );
+    }
+  }
+#endif
+}
+
+
+void IpcPipe::notifyReader() {
+#ifdef __linux__
+  if ( ring->readerWaiting.load( std::memory_order_seq_cst ) && ring->readerWaiting.exchange( 0 ) ) {
+    eventfd_write( fd, 1 );
+  }
+#endif
+}
+
+
+void IpcPipe::notifyWriter() {
+#ifdef __linux__
+  if ( ring->writerWaiting.load( std::memory_order_seq_cst ) && ring->writerWaiting.exchange( 0 ) ) {
+    eventfd_write( spaceFD, 1 );
+  }
+#endif
+}
+
+
+ssize_t IpcPipe::read( void* buf, size_t len ) {
+  assert( !isWriter );
+  if ( type == IpcTransport::fifo ) {
+    return ::read( fd, buf, len );
+  }
+  if ( ring == NULL ) {
+    errno = EBADF;
+    return -1;
+  }
+
+#ifdef __linux__
+  int spins = readSpinLimit();
+  while ( true ) {
+    size_t n = ringRead( buf, len );
+    if ( n > 0 ) {
+      if ( ring->head.load( std::memory_order_acquire ) == ring->tail.load( std::memory_order_relaxed ) ) {
+        armReader();
+      }
+      return n;
+    }
+    if ( ring->closed.load() ) {
+      return 0;
+    }
+    if ( spins-- > 0 ) {
+      continue;
+    }
+
+    armReader();
+    if ( ring->head.load( std::memory_order_seq_cst ) != ring->tail.load( std::memory_order_relaxed ) ) {
+      continue;
+    }
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if ( ( poll( &pfd, 1, -1 ) < 0 ) && ( errno != EINTR ) ) {
+      return -1;
+    }
+  }
+#else
+  return -1;
+#endif
+}
+
+
+ssize_t IpcPipe::readAll( void* buf, size_t len ) {
+  size_t got = 0;
+  while ( got < len ) {
+    ssize_t n = read( (unsigned char*)buf + got, len - got );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      return -1;
+    }
+    if ( n == 0 ) {
+      break;
+    }
+    got += n;
+  }
+  return got;
+}
+
+
+ssize_t IpcPipe::write( const void* buf, size_t len ) {
+  struct iovec iov = { const_cast<void*>( buf ), len };
+  return writev( &iov, 1 );
+}
+
+
+ssize_t IpcPipe::writev( const struct iovec* iov, int iovcnt ) {
+  assert( isWriter );
+  if ( type == IpcTransport::fifo ) {
+    return ::writev( fd, iov, iovcnt );
+  }
+  if ( ring == NULL ) {
+    errno = EBADF;
+    return -1;
+  }
+
+#ifdef __linux__
+  ssize_t total = 0;
+  uint64_t head = ring->head.load( std::memory_order_relaxed );
+  for ( int i = 0; i < iovcnt; i++ ) {
+    const unsigned char* ptr = (const unsigned char*)iov[i].iov_base;
+    size_t left = iov[i].iov_len;
+
+    while ( left > 0 ) {
+      if ( ring->closed.load() ) {
+        errno = EPIPE;
+        return -1;
+      }
+
+      size_t n = ringWrite( ptr, left, head );
+      if ( n > 0 ) {
+        ptr += n;
+        left -= n;
+        total += n;
+        head += n;
+        continue;
+      }
+
+      // Ring is full, publish what is there so the reader drains it and wait for space
+      ring->head.store( head, std::memory_order_seq_cst );
+      notifyReader();
+      if ( nonBlocking ) {
+        if ( total == 0 ) {
+          errno = EAGAIN;
+          return -1;
+        }
+        return total;
+      }
+      ring->writerWaiting.store( 1, std::memory_order_seq_cst );
+      if ( head - ring->tail.load( std::memory_order_seq_cst ) < ring->capacity ) {
+        continue;
+      }
+      struct pollfd pfd = { spaceFD, POLLIN, 0 };
+      if ( ( poll( &pfd, 1, -1 ) < 0 ) && ( errno != EINTR ) ) {
+        return -1;
+      }
+      eventfd_t count;
+      eventfd_read( spaceFD, &count );
+    }
+  }
+
+  ring->head.store( head, std::memory_order_seq_cst );
+  notifyReader();
+  return total;
+#else
+  return -1;
+#endif
+}
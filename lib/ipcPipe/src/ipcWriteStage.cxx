@@ -0,0 +1,86 @@
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <sys/uio.h>
+
+#include <ipcWriteStage.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+
+IpcWriteStage::IpcWriteStage( IpcPipe& pipeVal )
+  : pipe( pipeVal ), frontOffset( 0 ), stagedBytes( 0 ) {
+  pipe.setNonBlocking( true );
+}
+
+
+void IpcWriteStage::queue( BufferSlice msg ) {
+  if ( msg.empty() ) {
+    return;
+  }
+  stagedBytes += msg.size();
+  chunks.push_back( std::move( msg ) );
+}
+
+
+void IpcWriteStage::queue( std::vector<uint8_t>&& msg ) {
+  queue( BufferSlice( std::move( msg ) ) );
+}
+
+
+void IpcWriteStage::queue( const void* data, size_t len ) {
+  const uint8_t* ptr = (const uint8_t*)data;
+  queue( std::vector<uint8_t>( ptr, ptr + len ) );
+}
+
+
+int IpcWriteStage::flush() {
+  while ( !chunks.empty() ) {
+    struct iovec iov[ IOV_MAX ];
+    int iovcnt = 0;
+    size_t iovBytes = 0;
+
+    for ( auto it = chunks.begin(); ( it != chunks.end() ) && ( iovcnt < IOV_MAX ); it++ ) {
+      size_t offset = ( iovcnt == 0 ) ? frontOffset : 0;
+      iov[ iovcnt ].iov_base = it->data() + offset;
+      iov[ iovcnt ].iov_len = it->size() - offset;
+      iovBytes += iov[ iovcnt ].iov_len;
+      iovcnt++;
+    }
+
+    ssize_t n = pipe.writev( iov, iovcnt );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      if ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) ) {
+        return 0; // reader is behind, try again next time
+      }
+      perror( "IPC: write of staged output failed" );
+      return -1;
+    }
+
+    // Drop everything that went out, keeping track of a partially written chunk
+    size_t written = n;
+    stagedBytes -= written;
+    while ( written > 0 ) {
+      size_t left = chunks.front().size() - frontOffset;
+      if ( written < left ) {
+        frontOffset += written;
+        break;
+      }
+      written -= left;
+      chunks.pop_front();
+      frontOffset = 0;
+    }
+
+    if ( (size_t)n < iovBytes ) {
+      return 0; // pipe is full
+    }
+  }
+
+  return 0;
+}
@@ -42,6 +42,10 @@
  *      it.  That memory is freed the next time you call a decode function
  *      or call QMsgEncoderDeinit().
  *
+ *      If the caller keeps the raw buffer alive for as long as it uses the
+ *      decoded message, QMsgEncoderSetDecodeInPlace() can be called to have
+ *      opaque fields point into the raw buffer rather than being copied.
+ *
  *      Lastly, when you are finished using the library, call
  *      QMsgEncoderDeinit() in order to free allocated objects and memory.
  *
@@ -102,6 +106,8 @@ typedef struct
 // Function prototypes to initialize and deinitialize the library
 EXPORT int CALL QMsgEncoderInit(QMsgEncoderContext **context);
 EXPORT void CALL QMsgEncoderDeinit(QMsgEncoderContext *context);
+EXPORT void CALL QMsgEncoderSetDecodeInPlace(QMsgEncoderContext *context,
+                                             int in_place);
 
 // Function prototypes for UI<=>Sec message encoding and decoding
 EXPORT QMsgEncoderResult CALL QMsgUIEncodeMessage(QMsgEncoderContext *context,
@@ -849,6 +849,9 @@ std::size_t QMsgDeserializer::Deserialize(DataBuffer &data_buffer,
  *      buffer.
  *
  *      An exception may also be thrown if memory allocation fails.
+ *
+ *      When decoding in place, no memory is allocated and value.data
+ *      points into the data buffer.
  */
 std::size_t QMsgDeserializer::Deserialize(DataBuffer &data_buffer,
                                           QMsgOpaque_t &value)
@@ -856,6 +859,16 @@ std::size_t QMsgDeserializer::Deserialize(DataBuffer &data_buffer,
     std::size_t initial_read_position = data_buffer.GetReadLength();
 
     data_buffer.ReadValue(value.length);
+
+    if (decode_in_place)
+    {
+        // Reference the data where it is, after checking it is all there
+        std::size_t offset = data_buffer.GetReadLength();
+        data_buffer.AdvanceReadLength(value.length);
+        value.data = data_buffer.GetMutableBufferPointer(offset);
+        return data_buffer.GetReadLength() - initial_read_position;
+    }
+
     value.data = new std::uint8_t[value.length];
     allocations.push_back(value.data);
     data_buffer.ReadValue(value.data, value.length);
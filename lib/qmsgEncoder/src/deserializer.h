@@ -52,6 +52,9 @@ class QMsgDeserializer
             FreeAllocations();
         }
 
+        // Point opaque values into the data buffer rather than copying them
+        void SetDecodeInPlace(bool in_place) { decode_in_place = in_place; }
+
         std::size_t DeserializeMessageLength(DataBuffer &data_buffer,
                                              std::uint32_t &message_length);
 
@@ -107,6 +110,7 @@ class QMsgDeserializer
         void FreeAllocations();
 
         std::vector<std::uint8_t *> allocations;
+        bool decode_in_place = false;
 };
 
 } // namespace
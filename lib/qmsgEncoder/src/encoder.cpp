@@ -106,6 +106,41 @@ void CALL QMsgEncoderDeinit(QMsgEncoderContext *context)
     }
 }
 
+/*
+ *  QMsgEncoderSetDecodeInPlace
+ *
+ *  Description:
+ *      Select whether decoded opaque fields are copied out of the buffer
+ *      given to the decode functions or point into it.
+ *
+ *  Parameters:
+ *      context [in]
+ *          The encoder context to modify.
+ *
+ *      in_place [in]
+ *          Non-zero to point into the buffer, zero to copy (the default).
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ *  Comments:
+ *      When decoding in place, the decoded message is only valid for as
+ *      long as the buffer it was decoded from.  Device lists are always
+ *      copied, since they are converted from network byte order.
+ */
+void CALL QMsgEncoderSetDecodeInPlace(QMsgEncoderContext *context,
+                                      int in_place)
+{
+    // Just return if the context is a nullptr
+    if (!context || !context->opaque) return;
+
+    qmsg::QMsgEncoderContextInternal *internal_context =
+        reinterpret_cast<qmsg::QMsgEncoderContextInternal *>(
+            context->opaque);
+
+    internal_context->GetDeserializer().SetDecodeInPlace(in_place != 0);
+}
+
 /*
  *  QMsgUIEncodeMessage
  *
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+
+#include <slower.h>
+
+/**
+ * Delays acks so that many can be sent in one SlowerMsgAckBatch.
+ *
+ *     Acks are grouped by destination and by name with the msg_id left out, so a publisher
+ *     sending a run of messages on one channel gets them back as one range. A group is sent
+ *     once its oldest ack has waited delayMicros. A group holding a single msg_id is sent as a
+ *     plain SlowerMsgAck so publishers that do not understand batches still work.
+ */
+class AckBatcher {
+public:
+  AckBatcher( uint32_t delayMicros=5000 );
+
+  void add( const SlowerRemote& remote, const MsgShortName& name, uint64_t nowMicros );
+
+  /// Send the groups that are due, or all of them. Returns 0 or the last send error.
+  int service( SlowerConnection& slower, uint64_t nowMicros, bool all=false );
+
+  /// Milliseconds until service() has work to do, rounded up, or -1 if nothing is waiting
+  int nextTimeoutMs( uint64_t nowMicros ) const;
+
+  /// Ack messages sent so far, plain and batched
+  uint64_t messagesSent() const { return sent; }
+
+private:
+  struct Key {
+    SlowerRemote remote;
+    MsgShortName prefix;   ///< Name with msg_id zeroed
+    bool operator<( const Key& other ) const;
+  };
+  struct Group {
+    uint64_t firstMicros;
+    std::set<uint32_t> msgIDs;
+  };
+
+  int send( SlowerConnection& slower, const Key& key, const Group& group );
+
+  std::map<Key, Group> groups;
+  const uint32_t delayMicros;
+  uint64_t sent;
+};
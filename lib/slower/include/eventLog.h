@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <slower.h>
+
+/// Highest event level compiled in. Events above it are removed entirely by the EVENT_LOG macro.
+#ifndef SLOWER_EVENT_LOG_MAX_LEVEL
+#define SLOWER_EVENT_LOG_MAX_LEVEL 2
+#endif
+
+enum class EventLevel : uint8_t {
+  error = 0,
+  info = 1,
+  debug = 2
+};
+
+enum class EventType : uint8_t {
+  logStart = 1,     ///< value is the level the log was started with
+  dropped = 2,      ///< value is the number of events lost because the ring was full
+  pub = 3,          ///< value is the data length
+  pubDup = 4,       ///< value is the data length
+  pubLatency = 5,   ///< value is the publish to relay latency in ms
+  fwdRelay = 6,
+  fwdSub = 7,
+  sub = 8,          ///< value is the mask
+  unSub = 9,        ///< value is the mask
+  cacheSend = 10,
+  cacheMissing = 11,
+  subCookie = 12    ///< value is the mask, the subscriber was asked to echo a cookie
+};
+
+/**
+ * Fixed size binary event record. The log file is eventLogMagic followed by these, in host byte
+ *     order except for the address and port which are kept as they are on the wire.
+ */
+struct EventRecord {
+  uint64_t      timeUs;        ///< Wall clock time since epoch in microseconds
+  MsgShortName  name;
+  uint32_t      addr;          ///< Remote IPv4 address, network byte order
+  uint16_t      port;          ///< Remote port, network byte order
+  EventType     type;
+  EventLevel    level;
+  int32_t       value;         ///< Meaning depends on type
+  uint32_t      reserved;
+};
+
+static_assert( sizeof( EventRecord ) == 40, "EventRecord is a fixed size file format" );
+
+const char eventLogMagic[8] = { 'S', 'L', 'O', 'W', 'E', 'V', '0', '1' };
+
+const char* eventTypeName( EventType type );
+const char* eventLevelName( EventLevel level );
+
+/// Parse "error", "info", "debug" or a number. Returns false if str is not a level.
+bool eventLevelParse( const char* str, EventLevel& level );
+
+/**
+ * Binary event log for the hot path.
+ *
+ *     record() copies a fixed size record into a single producer single consumer ring and never
+ *     blocks or formats anything. A background thread drains the ring to the log file. If the
+ *     writer falls behind, events are dropped and counted, and the count is logged once there
+ *     is room again. Use slowLogDump to turn the file into text.
+ */
+class EventLog {
+public:
+  /// With no file the log is off and enabled() is always false
+  EventLog( const char* file, EventLevel level = EventLevel::info, size_t capacity = 1 << 16 );
+  ~EventLog();
+
+  EventLog( const EventLog& ) = delete;
+  EventLog& operator=( const EventLog& ) = delete;
+
+  bool enabled( EventLevel lvl ) const {
+    return (uint8_t)lvl < levelsOn.load( std::memory_order_relaxed );
+  }
+
+  /// Can be changed at any time, for example from a signal
+  void setLevel( EventLevel lvl );
+  EventLevel getLevel() const;
+
+  void record( EventLevel lvl, EventType type, const MsgShortName& name,
+               const SlowerRemote* remote = NULL, int32_t value = 0 );
+
+  uint64_t dropped() const { return droppedTotal; }
+
+private:
+  bool push( const EventRecord& rec );
+  size_t drain();
+  void run();
+
+  std::vector<EventRecord> ring;
+  const uint64_t ringMask;
+  alignas( 64 ) std::atomic<uint64_t> head;   ///< written by the producer
+  alignas( 64 ) std::atomic<uint64_t> tail;   ///< written by the writer thread
+
+  alignas( 64 ) std::atomic<uint8_t> levelsOn;   ///< levels below this are enabled, 0 when off
+  uint8_t configuredLevel;
+  uint64_t droppedPending;   ///< dropped since the last dropped record
+  uint64_t droppedTotal;
+
+  int fd;
+  std::atomic<bool> running;
+  std::thread writer;
+};
+
+#define EVENT_LOG( log, lvl, ... )                                                              \
+  do {                                                                                          \
+    if ( ( (int)( lvl ) <= SLOWER_EVENT_LOG_MAX_LEVEL ) && ( log ).enabled( lvl ) ) {           \
+      ( log ).record( ( lvl ), __VA_ARGS__ );                                                   \
+    }                                                                                           \
+  } while ( 0 )
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+
+#include <slower.h>
+
+/**
+ * Finds holes in the msg_id sequence of each stream a subscriber receives and asks the relay
+ *     to send them again.
+ *
+ *     A stream is a name with the msg_id left out, so one team, channel and device. The first
+ *     message of a stream only sets where it starts. After that any msg_id skipped over is
+ *     missing, and once it has been missing for reorderMs service() sends one SlowerMsgFetch per
+ *     stream covering all that are due. A fetch is tried again every retryMs and the id is given
+ *     up on after maxTries, after which it counts as received. Ids older than the start of a
+ *     stream arrive when the relay replays its cache and are accepted, with any between them
+ *     and the start also counted missing. A jump of more than maxGap ids either way is taken
+ *     as a restart: the stream starts over at the new id, so the ids jumped over are neither
+ *     fetched nor taken as received.
+ */
+class GapTracker {
+public:
+  GapTracker( uint32_t reorderMs=20, uint32_t retryMs=200, int maxTries=3, uint32_t maxGap=256 );
+
+  /// Note a received message. Returns false if it was already received, a duplicate.
+  bool received( const MsgShortName& name, uint64_t nowMs );
+
+  /// Fetch the missing ids that are due and give up on old ones. Returns 0 or the last send error.
+  int service( SlowerConnection& slower, uint64_t nowMs );
+
+  /// Milliseconds until service() has work to do, or -1 if nothing is missing
+  int nextTimeoutMs( uint64_t nowMs ) const;
+
+  size_t missing() const;
+  uint64_t repaired() const { return numRepaired; }   ///< missing ids that did arrive
+  uint64_t lost() const { return numLost; }           ///< missing ids given up on
+  uint64_t fetches() const { return numFetches; }     ///< fetch messages sent
+
+private:
+  struct Missing {
+    uint64_t dueMs;
+    int tries;
+  };
+  struct Stream {
+    uint32_t lowest;
+    uint32_t highest;
+    std::map<uint32_t, Missing> missing;
+  };
+
+  void addMissing( Stream& stream, uint32_t first, uint32_t last, uint64_t nowMs );
+  static void restart( Stream& stream, uint32_t id );
+  int fetch( SlowerConnection& slower, const MsgShortName& prefix, Stream& stream, uint64_t nowMs );
+
+  std::map<MsgShortName, Stream> streams;   ///< Keyed by name with msg_id zeroed
+  const uint32_t reorderMs;
+  const uint32_t retryMs;
+  const int maxTries;
+  const uint32_t maxGap;
+  uint64_t numRepaired;
+  uint64_t numLost;
+  uint64_t numFetches;
+};
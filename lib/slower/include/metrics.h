@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Monotonic counter. Updates are a relaxed atomic add, safe to read from another thread.
+ */
+class MetricCounter {
+public:
+  MetricCounter() : value( 0 ) {}
+  void inc( uint64_t n = 1 ) { value.fetch_add( n, std::memory_order_relaxed ); }
+  uint64_t get() const { return value.load( std::memory_order_relaxed ); }
+private:
+  std::atomic<uint64_t> value;
+};
+
+/**
+ * Value that can go up and down, such as a table size.
+ */
+class MetricGauge {
+public:
+  MetricGauge() : value( 0 ) {}
+  void set( int64_t v ) { value.store( v, std::memory_order_relaxed ); }
+  int64_t get() const { return value.load( std::memory_order_relaxed ); }
+private:
+  std::atomic<int64_t> value;
+};
+
+/**
+ * HDR style histogram of non negative integer values.
+ *
+ *     Values below 16 each get their own bucket and every power of two above that is split into
+ *     16 linear buckets, so any value is recorded to within 1/16 of itself over the whole 64 bit
+ *     range with a fixed array of counters. record() is a couple of relaxed atomic adds.
+ */
+class MetricHistogram {
+public:
+  static const int subBucketBits = 4;
+  static const int subBuckets = 1 << subBucketBits;
+  static const int numBuckets = subBuckets * ( 64 - subBucketBits + 1 );
+  static const int renderedBounds = 36;   ///< Prometheus buckets go up to le 2^36-1, then +Inf
+
+  MetricHistogram();
+
+  void record( uint64_t value );
+
+  uint64_t count() const { return total.load( std::memory_order_relaxed ); }
+  uint64_t sum() const { return valueSum.load( std::memory_order_relaxed ); }
+
+  /// Upper bound of the bucket holding the given percentile ( 0 to 100 ), 0 if empty
+  uint64_t valueAtPercentile( double percentile ) const;
+
+  uint64_t bucketCount( int index ) const { return buckets[ index ].load( std::memory_order_relaxed ); }
+  static int bucketIndex( uint64_t value );
+  static uint64_t bucketUpperBound( int index );   ///< largest value that lands in index
+
+private:
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> valueSum;
+};
+
+/**
+ * Set of named metrics rendered in the Prometheus text exposition format.
+ *
+ *     Metrics are registered at startup, before the server thread starts reading them, and the
+ *     returned references stay valid for the life of the registry. Metrics sharing a name with
+ *     different labels, such as type="pub" and type="sub", are rendered as one family.
+ */
+class MetricsRegistry {
+public:
+  MetricCounter& counter( const std::string& name, const std::string& help, const std::string& labels = "" );
+  MetricGauge& gauge( const std::string& name, const std::string& help, const std::string& labels = "" );
+  MetricHistogram& histogram( const std::string& name, const std::string& help, const std::string& labels = "" );
+
+  std::string render() const;
+
+private:
+  enum class Kind { counter, gauge, histogram };
+  struct Entry {
+    std::string name;
+    std::string help;
+    std::string labels;
+    Kind kind;
+    std::unique_ptr<MetricCounter> counter;
+    std::unique_ptr<MetricGauge> gauge;
+    std::unique_ptr<MetricHistogram> histogram;
+  };
+
+  Entry& add( const std::string& name, const std::string& help, const std::string& labels, Kind kind );
+
+  std::vector<std::unique_ptr<Entry>> entries;
+};
+
+/**
+ * Minimal HTTP server answering every request with the rendered registry, for Prometheus or
+ *     curl. Runs on its own thread so scrapes never touch the caller's loop.
+ */
+class MetricsServer {
+public:
+  MetricsServer( const MetricsRegistry& registry );
+  ~MetricsServer();
+
+  /// Listen on addr:port, returns 0 on success
+  int start( const char* addr, uint16_t port );
+
+private:
+  void run();
+  void serve( int clientFD );
+
+  const MetricsRegistry& registry;
+  int listenFD;
+  std::atomic<bool> running;
+  std::thread server;
+};
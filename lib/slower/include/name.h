@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <string>
+
 #include <slower.h>
 
 class Name {
@@ -12,13 +15,20 @@ public:
   Name(MsgShortName &n);
   Name(NamePath path, uint32_t org, uint32_t team,
        uint64_t fingerprint); // key package & welcome
-  //Name(NamePath path, uint32_t org, uint32_t team, uint32_t epoch,
-  //     uint32_t rand); // commit-all
-  //Name(NamePath path, uint32_t org, uint32_t team, uint32_t device,
-  //     uint32_t epoch, uint32_t rand); // commit-one
   Name(NamePath path, uint32_t org, uint32_t team, uint16_t channel,
        uint32_t device, uint32_t msgNum = 0); // msg data
 
+  // The commits take as many integers as the message data constructor so are made by name
+  static Name commitAll(uint32_t org, uint32_t team, uint32_t epoch, uint32_t rand);
+  static Name commitOne(uint32_t org, uint32_t team, uint32_t device, uint32_t epoch,
+                        uint32_t rand);
+
+  // Masks for the names of one team, path being set, and below that of one epoch of commitAll
+  // or one device of commitOne. Each set of names is one run in name order (see ShortName).
+  static const int teamMask = 50;
+  static const int epochMask = 26;
+  static const int deviceMask = 30;
+
   uint32_t orginID();
   uint8_t appID();
   NamePath path();
@@ -33,7 +43,34 @@ public:
 
   MsgShortName &shortName();
 
+private:
+  void setTeam(NamePath path, uint32_t org, uint32_t team);
+  void setTail(uint64_t tail);
+  uint64_t tail() const; ///< the 50 bits after team, laid out by path
+
+public:
+
   std::string shortString();
 
   std::string longString();
+
+  // Formatting into a buffer of the caller's, without allocating. Each writes a nul terminated
+  // string and returns buf, which must hold at least shortStringLen or longStringLen bytes.
+
+  static const size_t shortStringLen = 36;  ///< 4 words of 8 hex digits, 3 dashes and the nul
+  static const size_t longStringLen = 128;
+
+  const char* shortString( char* buf, size_t bufLen ) const;
+
+  const char* longString( char* buf, size_t bufLen ) const;
+
+  /**
+   * Parse a name and mask from either
+   *     qmsg://msg/org-<org>/team-<team>[/ch-<channel>[/dev-<device>[/[msg-]<msgNum>]]] with
+   *     decimal numbers, where the mask covers the fields left off, or
+   *     <hex>[:<mask>] with the name as up to 32 hex digits of the 128 bit number of
+   *     protocol.md (see ShortName) and a decimal mask, 0 if there is none.
+   *     Returns false, leaving name and mask alone, if str is neither or a field is too big.
+   */
+  static bool parse( const char* str, size_t len, MsgShortName& name, int& mask );
 };
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <slower.h>
+
+/**
+ * Outbound store-and-forward queue for publishes to the relay.
+ *
+ *     Every publish is kept until the relay acks its name, alone or in a batch. Up to window
+ *     publishes are in flight at once and any that are not acked in time are retransmitted with
+ *     exponential backoff. If a journal file is given, queued publishes are appended to it and
+ *     reloaded on restart so nothing is lost while the relay is unreachable.
+ */
+class PubQueue {
+public:
+  PubQueue( const char* journalFile=NULL, int window=32 );
+  ~PubQueue();
+
+  /// Queue a publish. A name already queued with the same data is left as it is, one queued
+  ///   with other data is an error and returns false, since the relay would drop either copy.
+  bool push( const MsgShortName& name, const uint8_t* data, int len );
+
+  /// Highest msg_id queued on the stream of name, whose own msg_id is ignored, 0 if none. After
+  ///   a restart new publishes on the stream must be numbered above it.
+  uint32_t highestMsgID( const MsgShortName& name ) const;
+
+  /// Remove name from the queue. Returns false if name was not queued.
+  bool ack( const MsgShortName& name );
+
+  /// Remove every queued name matching name apart from a msg_id in [ first, last ], as
+  ///   acknowledged by a SlowerMsgAckBatch range. Returns the number removed.
+  size_t ackRange( const MsgShortName& name, uint32_t firstMsgID, uint32_t lastMsgID );
+
+  /// Send new publishes that fit in the window and retransmit the ones that timed out.
+  int service( SlowerConnection& slower, uint64_t nowMs );
+
+  /// Milliseconds until service() has work to do, or -1 if nothing is queued.
+  int nextTimeoutMs( uint64_t nowMs ) const;
+
+  size_t size() const { return entries.size(); }
+  size_t inFlight() const { return numInFlight; }
+
+  static uint64_t nowMs();
+
+private:
+  struct Entry {
+    MsgShortName name;
+    std::vector<uint8_t> data;
+    int attempts;            ///< Number of times sent, 0 if not sent yet
+    uint64_t nextSendMs;     ///< Time of next retransmit
+    uint32_t rtoMs;          ///< Current retransmit timeout
+  };
+
+  void append( const MsgShortName& name, const uint8_t* data, int len );
+  void remove( std::list<Entry>::iterator it );
+  void acked();
+
+  void journalLoad();
+  void journalWrite( char type, const Entry& entry );
+  void journalCompact();
+
+  std::list<Entry> entries;
+  std::map<MsgShortName, std::list<Entry>::iterator> index;
+  size_t numInFlight;
+  const size_t window;
+
+  std::string journalFile;
+  int journalFD;
+  size_t journalBytes;
+  size_t queuedBytes;
+};
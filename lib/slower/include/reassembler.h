@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <slower.h>
+
+/**
+ * Rebuilds publishes that arrived as SlowerMsgPubFrag fragments.
+ *
+ *     Each object gets a buffer of its total length when its first fragment arrives. If no new
+ *     fragment shows up for fetchAfterMs, service() asks the relay the fragments came from for
+ *     the ones still missing, and an object that is not complete after timeoutMs is dropped.
+ *     Completed names are remembered for timeoutMs so late or replayed fragments of an object
+ *     already delivered do not start a new one. At most maxBytes of partial objects are held.
+ */
+class Reassembler {
+public:
+  Reassembler( uint32_t fetchAfterMs=200, uint32_t timeoutMs=10000, size_t maxBytes=8 << 20 );
+
+  /// Add a fragment. Returns true, with the whole object in object, when it was the last one missing.
+  bool add( const MsgShortName& name, const MsgFragHeader& frag, const SlowerRemote& remote,
+            const uint8_t* data, int len, uint64_t nowMs, std::vector<uint8_t>& object );
+
+  /// Fetch missing fragments of stalled objects and drop expired ones. Returns 0 or the last send error.
+  int service( SlowerConnection& slower, uint64_t nowMs );
+
+  /// Milliseconds until service() has work to do, or -1 if nothing is being reassembled
+  int nextTimeoutMs( uint64_t nowMs ) const;
+
+  size_t size() const { return objects.size(); }
+  uint64_t dropped() const { return numDropped; }
+
+private:
+  struct Object {
+    MsgFragHeader first;          ///< Header of the first fragment seen, the others must agree
+    std::vector<uint8_t> data;
+    std::vector<bool> have;
+    uint16_t numHave;
+    uint64_t startMs;
+    uint64_t nextFetchMs;
+    SlowerRemote remote;
+  };
+
+  std::map<MsgShortName, Object> objects;
+  std::map<MsgShortName, uint64_t> completed;   ///< Name to completion time
+  const uint32_t fetchAfterMs;
+  const uint32_t timeoutMs;
+  const size_t maxBytes;
+  size_t bytes;
+  uint64_t numDropped;
+};
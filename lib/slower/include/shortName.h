@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+
+#include <slower.h>
+
+/**
+ * A MsgShortName as the 128 bit number the protocol defines, the fields concatenated from
+ *     originID down to msg_id, held in two 64 bit words.
+ *
+ *     MsgShortName packs its fields into bytes with bitfields, so its bytes are not in field
+ *     order and a mask that does not fall on a field boundary picks the wrong bits. As a number
+ *     the low mask bits are the wildcard, whatever the mask, and names order by org, team,
+ *     channel and device then msg_id. Comparing, masking and reading fields take a few integer
+ *     instructions with no branches.
+ */
+class ShortName {
+public:
+  static const int originShift = 104;
+  static const int appShift = 96;
+  static const int pathShift = 88;
+  static const int orgShift = 70;
+  static const int teamShift = 50;
+  static const int channelShift = 40;
+  static const int deviceShift = 20;
+  static const int msgIDBits = 20;
+
+  constexpr ShortName() : hi( 0 ), lo( 0 ) {}
+  constexpr ShortName( uint64_t high, uint64_t low ) : hi( high ), lo( low ) {}
+
+  explicit ShortName( const MsgShortName& name )
+    : hi( ( (uint64_t)name.spec.origin_id << ( originShift - 64 ) ) | ( (uint64_t)name.spec.app_id << ( appShift - 64 ) )
+          | ( (uint64_t)name.spec.path << ( pathShift - 64 ) ) | ( (uint64_t)name.spec.org << ( orgShift - 64 ) )
+          | ( (uint64_t)name.spec.team >> ( 64 - teamShift ) ) ),
+      lo( ( (uint64_t)name.spec.team << teamShift ) | ( (uint64_t)name.spec.channel << channelShift )
+          | ( (uint64_t)name.spec.device << deviceShift ) | name.spec.msg_id ) {}
+
+  MsgShortName msgShortName() const {
+    MsgShortName name;
+    name.spec.origin_id = originID();
+    name.spec.app_id = appID();
+    name.spec.path = (uint8_t)path();
+    name.spec.org = org();
+    name.spec.team = team();
+    name.spec.channel = channel();
+    name.spec.device = device();
+    name.spec.msg_id = msgID();
+    return name;
+  }
+
+  constexpr uint64_t high() const { return hi; }
+  constexpr uint64_t low() const { return lo; }
+
+  constexpr uint32_t originID() const { return (uint32_t)( hi >> ( originShift - 64 ) ); }
+  constexpr uint8_t appID() const { return (uint8_t)( hi >> ( appShift - 64 ) ); }
+  constexpr NamePath path() const { return (NamePath)(uint8_t)( hi >> ( pathShift - 64 ) ); }
+  constexpr uint32_t org() const { return (uint32_t)( hi >> ( orgShift - 64 ) ) & 0x3ffff; }
+  constexpr uint32_t team() const { return (uint32_t)( ( hi << ( 64 - teamShift ) ) | ( lo >> teamShift ) ) & 0xfffff; }
+  constexpr uint16_t channel() const { return (uint16_t)( lo >> channelShift ) & 0x3ff; }
+  constexpr uint32_t device() const { return (uint32_t)( lo >> deviceShift ) & 0xfffff; }
+  constexpr uint32_t msgID() const { return (uint32_t)lo & 0xfffff; }
+
+  constexpr ShortName withMsgID( uint32_t msgID ) const {
+    return ShortName( hi, ( lo & ~(uint64_t)0xfffff ) | ( msgID & 0xfffff ) );
+  }
+
+  /// The name with its low mask bits cleared, mask from 0 to 128
+  constexpr ShortName masked( int mask ) const {
+    return ShortName( hi & keep( mask - 64 ), lo & keep( mask ) );
+  }
+
+  /// The name with its low mask bits set, the last name masked( mask ) covers
+  constexpr ShortName filled( int mask ) const {
+    return ShortName( hi | ~keep( mask - 64 ), lo | ~keep( mask ) );
+  }
+
+  /// True if name is the same as this one apart from the low mask bits
+  constexpr bool covers( const ShortName& name, int mask ) const {
+    return ( ( ( hi ^ name.hi ) & keep( mask - 64 ) ) | ( ( lo ^ name.lo ) & keep( mask ) ) ) == 0;
+  }
+
+  /// Negative, zero or positive as this name is before, the same as or after other
+  constexpr int compare( const ShortName& other ) const {
+    return 2 * ( ( hi > other.hi ) - ( hi < other.hi ) ) + ( ( lo > other.lo ) - ( lo < other.lo ) );
+  }
+
+  constexpr bool operator==( const ShortName& other ) const { return ( ( hi ^ other.hi ) | ( lo ^ other.lo ) ) == 0; }
+  constexpr bool operator!=( const ShortName& other ) const { return !( *this == other ); }
+  constexpr bool operator<( const ShortName& other ) const { return ( hi < other.hi ) || ( ( hi == other.hi ) && ( lo < other.lo ) ); }
+
+private:
+  /// Bits of a word to keep when its low bits are cleared, bits clamped to 0 to 64
+  static constexpr uint64_t keep( int bits ) {
+    return ( bits <= 0 ) ? ~(uint64_t)0 : ( ~(uint64_t)0 << ( bits & 63 ) ) & ( (uint64_t)0 - ( bits < 64 ) );
+  }
+
+  uint64_t hi;   ///< originID, app, path, org and the top of team
+  uint64_t lo;   ///< the rest of team, channel, device and msg_id
+};
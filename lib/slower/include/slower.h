@@ -13,15 +13,26 @@ float slowerVersion();
 
 const uint16_t slowerDefaultPort = 5004;
 const uint16_t slowerMTU = 1200;
+const uint16_t slowerFragSize = 1000;           ///< Data bytes per fragment of a large publish
+const uint32_t slowerMaxObjectLen = 1 << 20;   ///< Largest publish, split into fragments
+const uint32_t slowerSubRefreshMs = 20000;     ///< How often subscribers resend their subscribes to keep the relay lease
 
 typedef struct {
   socklen_t addrLen;
-  struct sockaddr_in addr;
+  union {
+    struct sockaddr_in addr;     ///< IPv4, the family of the socket slowerSetup makes
+    struct sockaddr_in6 addr6;   ///< IPv6, when addr.sin_family is AF_INET6
+  };
 } SlowerRemote;
 
+struct SlowerBundleState;
+
 typedef struct {
   int fd;  // UDP socket
   SlowerRemote relay;
+  int rxTimestamps;  // kernel receive timestamps enabled, see slowerEnableRxTimestamps
+  SlowerBundleState* bundle;  // frames waiting to be sent or read, see slowerBundleBegin
+  uint64_t subCookie;  // last cookie from the relay, sent with each subscribe, see SlowerMsgSubCookie
 } SlowerConnection;
 
 /**
@@ -67,8 +78,6 @@ enum class NamePath : uint8_t {
  } __attribute__ ((__packed__, __aligned__(1))) MsgShortName;
  
 
-// TODO: Add Key Package and Welcome ShortNames
-
 /**
  * Message types
  */
@@ -77,7 +86,14 @@ typedef enum {
     SlowerMsgPub=1,
     SlowerMsgSub=2,
     SlowerMsgUnSub=3,
-    SlowerMsgAck=4
+    SlowerMsgAck=4,
+    SlowerMsgBundle=5,
+    SlowerMsgAckBatch=6,
+    SlowerMsgPubFrag=7,
+    SlowerMsgFragFetch=8,
+    SlowerMsgFetch=9,
+    SlowerMsgSync=10,
+    SlowerMsgSubCookie=11
 } SlowerMsgType;
 
 /**
@@ -85,9 +101,21 @@ typedef enum {
  */
 struct MsgHeaderFlags {
     u_char        metrics : 1;                ///< Set to indicate if metrics are included in the header.
-    u_char        reserved: 7;                ///< Unused/remaining bits
+    u_char        priority: 2;                ///< Priority class as defined by enum SlowerPriority
+    u_char        reserved: 5;                ///< Unused/remaining bits
 };
 
+/**
+ * Priority classes carried in MsgHeaderFlags. Relays send queued control messages before any
+ *     normal ones, so MLS key packages, welcomes and commits are not stuck behind chat.
+ */
+typedef enum {
+    SlowerPriorityNormal=0,
+    SlowerPriorityControl=1
+} SlowerPriority;
+
+#define SLOWER_NUM_PRIORITIES 2
+
 /**
  * Defines the slow-relay message header. Every message header must start with this. Data follows
  *     the header.
@@ -99,13 +127,25 @@ struct MsgHeader {
 } __attribute__ ((__packed__, __aligned__(1)));
 
 /**
- * Message Header metrics
+ * One relay hop in the metrics trace
+ */
+struct MsgTraceHop {
+    uint32_t                      relay_id;             ///< Relay that handled the message, see SLOWR_RELAY_ID
+    uint64_t                      time_micros;          ///< Time the relay received it, since epoch in microseconds
+} __attribute__ ((__packed__, __aligned__(1)));
+
+#define SLOWER_MAX_TRACE_HOPS 8
+
+/**
+ * Message Header metrics. On the wire this is pub_millis and relay_millis, a one byte hop count
+ *     and then only the hops in use, so the header grows by 12 bytes per relay the message
+ *     passes through. Relays stop adding hops once SLOWER_MAX_TRACE_HOPS are recorded.
  */
 struct MsgHeaderMetrics {
     uint64_t                      pub_millis;           ///< Publisher/sender time since epoch in milliseconds
     uint64_t                      relay_millis;         ///< Sending Relay time since epoch in milliseconds
-
-    // TODO: Add variable array for tracing end-to-end hops
+    uint8_t                       num_hops;             ///< Hops recorded so far
+    MsgTraceHop                   hops[SLOWER_MAX_TRACE_HOPS];  ///< In the order the relays were traversed
 };
 
 /**
@@ -116,17 +156,120 @@ struct MsgPubHeader {
 } __attribute__ ((__packed__, __aligned__(1)));
 
 /**
- * Defines the slow-relay subscribe message header. This follows the slow-relay message header.
+ * Defines the slow-relay fragment header. A publish too large for one datagram is sent as count
+ *     SlowerMsgPubFrag messages with the same name, each with this header between the metrics
+ *     and the MsgPubHeader. Only the first fragment carries metrics.
+ */
+struct MsgFragHeader {
+    uint32_t                        totalLen;          ///< Length of the whole object
+    uint32_t                        offset;            ///< Where this fragment's data goes in the object
+    uint16_t                        index;             ///< Fragment number, from 0
+    uint16_t                        count;             ///< Number of fragments in the object
+} __attribute__ ((__packed__, __aligned__(1)));
+
+/**
+ * Defines the slow-relay fragment fetch header. This follows the slow-relay message header and
+ *     is followed by numIndexes uint16_t fragment numbers the sender is missing for the name.
+ */
+struct MsgFragFetchHeader {
+    uint8_t                         numIndexes;        ///< Number of fragment numbers to follow
+} __attribute__ ((__packed__, __aligned__(1)));
+
+#define SLOWER_MAX_FETCH_FRAGS 64
+
+/**
+ * Defines the slow-relay subscribe message header. This follows the slow-relay message header
+ *     of a subscribe or unsubscribe. A subscribe follows it with the uint64_t cookie the relay
+ *     last gave the subscriber, if it has one.
  */
 struct MsgSubHeader {
     int8_t                          mask;              ///< Subscriber mask
 } __attribute__ ((__packed__, __aligned__(1)));
 
+#define SLOWER_MAX_SUB_MASK 70      ///< Widest subscribe mask, every name of an org
+
+/**
+ * Defines the slow-relay subscribe cookie header. A relay answers a subscribe from an address it
+ *     has not yet validated with a SlowerMsgSubCookie, whose message header name and mask are
+ *     those of the subscribe, and the subscriber subscribes again with the cookie. Only an
+ *     address that receives what the relay sends can do that, so a subscribe with a spoofed
+ *     source address does not get a channel's cache replayed to someone else. The cookie is a
+ *     keyed hash of the address and the time, the relay keeps no state until it is echoed.
+ */
+struct MsgSubCookieHeader {
+    int8_t                          mask;              ///< Mask of the subscribe being answered
+    uint64_t                        cookie;            ///< To send back with the subscribe
+} __attribute__ ((__packed__, __aligned__(1)));
+
+/**
+ * Defines the slow-relay batched ack header. This follows the slow-relay message header, whose
+ *     name gives the team, channel and device with the msg_id ignored, and is followed by
+ *     numRanges MsgAckRange. Every msg_id in each range is acknowledged.
+ */
+struct MsgAckBatchHeader {
+    uint8_t                         numRanges;         ///< Number of ranges to follow
+} __attribute__ ((__packed__, __aligned__(1)));
+
+struct MsgAckRange {
+    uint32_t                        first;             ///< First msg_id acknowledged
+    uint32_t                        last;              ///< Last msg_id acknowledged, inclusive
+} __attribute__ ((__packed__, __aligned__(1)));
+
+#define SLOWER_MAX_ACK_RANGES 64
+
+/**
+ * Defines the slow-relay fetch header. A fetch asks the relay to send again the cached messages
+ *     named like the message header name with a msg_id in any of the ranges. It has the same
+ *     layout as a batched ack: this header followed by numRanges MsgAckRange. A point fetch of
+ *     a single name is one range with first equal to last.
+ */
+struct MsgFetchHeader {
+    uint8_t                         numRanges;         ///< Number of ranges to follow
+} __attribute__ ((__packed__, __aligned__(1)));
+
+#define SLOWER_MAX_FETCH_IDS 1024   ///< Most msg ids a relay sends for one fetch
+
+/**
+ * Defines the slow-relay sync header, sent between relays to find which cached names one has
+ *     and the other does not, for instance after a partition. It follows the slow-relay message
+ *     header, whose name is zeroed, and is followed by numRanges MsgSyncRange each followed by
+ *     its numNames MsgShortName.
+ *
+ *     Ranges are over names ordered as the 128 bit numbers of protocol.md, origin_id down to
+ *     msg_id (see ShortName), and run from lower up to but not including upper. The receiver
+ *     compares each range with the same range of its own cache. Where they differ it answers
+ *     with the range split smaller, or listing its names once there are at most
+ *     SLOWER_SYNC_MAX_NAMES, so only the names that differ end up being sent or fetched.
+ */
+struct MsgSyncHeader {
+    uint8_t                         numRanges;         ///< Number of ranges to follow
+} __attribute__ ((__packed__, __aligned__(1)));
+
+struct MsgSyncRange {
+    MsgShortName                    lower;             ///< First name in the range
+    MsgShortName                    upper;             ///< Names are before this, all bits set for no limit
+    uint32_t                        count;             ///< Names the sender has in the range
+    uint64_t                        fingerprint;       ///< XOR of a hash of each of those names
+    uint8_t                         numNames;          ///< count if the sender lists its names, otherwise 0
+} __attribute__ ((__packed__, __aligned__(1)));
+
+#define SLOWER_SYNC_MAX_NAMES 16
+
+/**
+ * Defines the slow-relay bundle frame header. A SlowerMsgBundle message header, with the name
+ *     zeroed, is followed by any number of frames up to slowerMTU. Each frame is this header
+ *     followed by one complete pub, ack, sub or unsub message. Bundles do not nest.
+ */
+struct MsgBundleFrameHeader {
+    uint16_t                        frameLen;          ///< Length of the message to follow
+} __attribute__ ((__packed__, __aligned__(1)));
+
 
 bool operator==(const MsgShortName& a, const MsgShortName& b );
 bool operator!=(const MsgShortName& a, const MsgShortName& b );
 bool operator<(const MsgShortName& a, const MsgShortName& b );
 
+bool operator==( const SlowerRemote& a, const SlowerRemote& b );
 bool operator!=( const SlowerRemote& a, const SlowerRemote& b );
 bool operator<( const SlowerRemote& a, const SlowerRemote& b );
 
@@ -138,21 +281,83 @@ int slowerRemote( SlowerRemote& remote, const char server[], const uint16_t port
 int slowerAddRelay( SlowerConnection& slower, const SlowerRemote& remote );
 int slowerClose( SlowerConnection& slower );
 
-int slowerWait( SlowerConnection& slower );
+int slowerWait( SlowerConnection& slower, int timeoutMs=50 );
 
 int slowerGetFD( SlowerConnection& slower);
 
+/**
+ * Ask the kernel to timestamp each datagram as it arrives ( SO_TIMESTAMPNS where available ).
+ *     The receive functions then return that time in rxMicros, so the time a packet spent queued
+ *     in the socket can be told apart from the time taken to process it. Without kernel support,
+ *     or if this is never called, rxMicros is the time recvmsg returned. Returns 0 on success.
+ */
+int slowerEnableRxTimestamps( SlowerConnection& slower );
+
+/**
+ * Coalesce sends into bundles.
+ *
+ *     Between slowerBundleBegin and slowerBundleFlush, slowerPub, slowerAck, slowerSub and
+ *     slowerUnSub queue their message per destination instead of sending it. A destination's
+ *     bundle is sent as soon as the next message would not fit in slowerMTU, and flush sends
+ *     the rest, so callers bound the added latency by how long they wait before flushing. A
+ *     bundle holding a single message is sent as that plain message. Send errors are reported
+ *     by flush. Received bundles are unpacked by slowerRecvMulti one message at a time.
+ */
+void slowerBundleBegin( SlowerConnection& slower );
+int slowerBundleFlush( SlowerConnection& slower );
+
+/// True if a message can be read without waiting, either on the socket or left from a bundle
+bool slowerPending( SlowerConnection& slower );
+
+/// Messages sent and the datagrams they went out in, since setup
+void slowerSendStats( SlowerConnection& slower, uint64_t* messages, uint64_t* datagrams );
+
+/// Priority class for a name, control for the MLS paths. slowerPub and slowerPubFragment set it in the header.
+SlowerPriority slowerNamePriority( const MsgShortName& name );
+
+/// Publish up to slowerMaxObjectLen bytes, as SlowerMsgPubFrag fragments if it needs more than one datagram
 int slowerPub(SlowerConnection& slower, const MsgShortName& name, char buf[], int bufLen,
               SlowerRemote* remote=NULL, MsgHeaderMetrics *metrics=NULL);
+/// True if frag and the len bytes it carries are laid out the way slowerPub splits an object
+bool slowerFragValid( const MsgFragHeader& frag, int len );
+/// Send a single fragment as is, for relays forwarding or replaying fragments
+int slowerPubFragment(SlowerConnection& slower, const MsgShortName& name, const MsgFragHeader& frag,
+                      char buf[], int bufLen, SlowerRemote* remote=NULL, MsgHeaderMetrics *metrics=NULL);
+int slowerFragFetch(SlowerConnection& slower, const MsgShortName& name, const uint16_t indexes[], int numIndexes,
+                    SlowerRemote* remote=NULL );
+int slowerFetch(SlowerConnection& slower, const MsgShortName& name, const MsgAckRange ranges[], int numRanges,
+                SlowerRemote* remote=NULL );
+/// Send sync ranges, names holds the numNames listed names of each range in turn. Must fit in one datagram.
+int slowerSync(SlowerConnection& slower, const MsgSyncRange ranges[], int numRanges, const MsgShortName names[],
+               SlowerRemote* remote=NULL );
 int slowerAck(SlowerConnection& slower, const MsgShortName& name, SlowerRemote* remote=NULL );
+int slowerAckBatch(SlowerConnection& slower, const MsgShortName& name, const MsgAckRange ranges[], int numRanges,
+                   SlowerRemote* remote=NULL );
+/// Subscribe, with the relay's cookie when sent to the relay and the connection has one
 int slowerSub(SlowerConnection& slower, const MsgShortName& name, int mask, SlowerRemote* remote=NULL );
+/// For relays, ask the sender of a subscribe to send it again with cookie
+int slowerSubCookie(SlowerConnection& slower, const MsgShortName& name, int mask, uint64_t cookie,
+                    SlowerRemote* remote );
 int slowerUnSub(SlowerConnection& slower, const MsgShortName& name, int mask, SlowerRemote* remote=NULL );
 
 int slowerRecvPub(SlowerConnection& slower, MsgHeader* msgHeader, char buf[], int bufSize, int* bufLen,
-                  MsgHeaderMetrics *metrics=NULL);
+                  MsgHeaderMetrics *metrics=NULL, uint64_t* rxMicros=NULL);
 int slowerRecvAck(SlowerConnection& slower, MsgShortName* name  );
+/**
+ * Receive one message. For SlowerMsgAckBatch and SlowerMsgFetch, buf is filled with the MsgAckRange array and
+ *     bufLen is its length in bytes, and for SlowerMsgFragFetch with the uint16_t fragment
+ *     numbers. A SlowerMsgPubFrag fills buf with the fragment data and frag with its header.
+ *     SlowerMsgSync fills buf with the ranges and names as they were sent, after the MsgSyncHeader.
+ *     SlowerMsgSub and SlowerMsgSubCookie fill buf with the uint64_t cookie, if there is one. A
+ *     SlowerMsgSubCookie from the relay is answered here, by keeping the cookie and subscribing
+ *     again with it.
+ */
 int slowerRecvMulti(SlowerConnection& slower, MsgHeader *msgHeader, SlowerRemote* remote,
-                    int* mask, char buf[], int bufSize, int* bufLen, MsgHeaderMetrics *metrics=NULL );
+                    int* mask, char buf[], int bufSize, int* bufLen, MsgHeaderMetrics *metrics=NULL,
+                    uint64_t* rxMicros=NULL, MsgFragHeader* frag=NULL );
 void getMaskedMsgShortName(const MsgShortName &src, MsgShortName &dst, const int mask);
 
+/// Add a hop to the trace, returns false if the trace is already full
+bool slowerTraceHop( MsgHeaderMetrics& metrics, uint32_t relayID, uint64_t timeMicros );
+
 #endif  // SLOWER_H
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <ackBatcher.h>
+
+
+AckBatcher::AckBatcher( uint32_t delayMicrosVal )
+  : delayMicros( delayMicrosVal ), sent( 0 ) {
+}
+
+
+bool AckBatcher::Key::operator<( const Key& other ) const {
+  if ( remote < other.remote ) return true;
+  if ( other.remote < remote ) return false;
+  return prefix < other.prefix;
+}
+
+
+void AckBatcher::add( const SlowerRemote& remote, const MsgShortName& name, uint64_t nowMicros ) {
+  Key key;
+  memset( &key, 0, sizeof( key ) );
+  key.remote = remote;
+  key.prefix = name;
+  key.prefix.spec.msg_id = 0;
+
+  auto it = groups.find( key );
+  if ( it == groups.end() ) {
+    it = groups.emplace( key, Group() ).first;
+    it->second.firstMicros = nowMicros;
+  }
+  it->second.msgIDs.insert( name.spec.msg_id );
+}
+
+
+int AckBatcher::send( SlowerConnection& slower, const Key& key, const Group& group ) {
+  SlowerRemote remote = key.remote;
+
+  if ( group.msgIDs.size() == 1 ) {
+    MsgShortName name = key.prefix;
+    name.spec.msg_id = *group.msgIDs.begin();
+    sent++;
+    return slowerAck( slower, name, &remote );
+  }
+
+  // collapse the sorted ids into runs, as many messages as it takes
+  int ret = 0;
+  MsgAckRange ranges[ SLOWER_MAX_ACK_RANGES ];
+  int numRanges = 0;
+  for ( uint32_t id : group.msgIDs ) {
+    if ( ( numRanges > 0 ) && ( id == ranges[ numRanges - 1 ].last + 1 ) ) {
+      ranges[ numRanges - 1 ].last = id;
+      continue;
+    }
+    if ( numRanges == SLOWER_MAX_ACK_RANGES ) {
+      int err = slowerAckBatch( slower, key.prefix, ranges, numRanges, &remote );
+      ret = err ? err : ret;
+      sent++;
+      numRanges = 0;
+    }
+    ranges[ numRanges ].first = id;
+    ranges[ numRanges ].last = id;
+    numRanges++;
+  }
+  int err = slowerAckBatch( slower, key.prefix, ranges, numRanges, &remote );
+  sent++;
+  return err ? err : ret;
+}
+
+
+int AckBatcher::service( SlowerConnection& slower, uint64_t nowMicros, bool all ) {
+  int ret = 0;
+  for ( auto it = groups.begin(); it != groups.end(); ) {
+    if ( !all && ( nowMicros < it->second.firstMicros + delayMicros ) ) {
+      ++it;
+      continue;
+    }
+    int err = send( slower, it->first, it->second );
+    if ( err != 0 ) {
+      ret = err;
+    }
+    it = groups.erase( it );
+  }
+  return ret;
+}
+
+
+int AckBatcher::nextTimeoutMs( uint64_t nowMicros ) const {
+  if ( groups.empty() ) {
+    return -1;
+  }
+  uint64_t next = UINT64_MAX;
+  for ( const auto& it : groups ) {
+    next = std::min( next, it.second.firstMicros + delayMicros );
+  }
+  return ( next <= nowMicros ) ? 0 : (int)( ( next - nowMicros + 999 ) / 1000 );
+}
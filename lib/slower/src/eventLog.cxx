@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <eventLog.h>
+
+static const uint8_t eventLogOff = 0;   // below any level, nothing is enabled
+
+
+const char* eventTypeName( EventType type ) {
+  switch ( type ) {
+  case EventType::logStart: return "START";
+  case EventType::dropped: return "DROPPED";
+  case EventType::pub: return "PUB";
+  case EventType::pubDup: return "PUB-DUP";
+  case EventType::pubLatency: return "PUB-LATENCY";
+  case EventType::fwdRelay: return "FWD-RELAY";
+  case EventType::fwdSub: return "FWD-SUB";
+  case EventType::sub: return "SUB";
+  case EventType::unSub: return "UNSUB";
+  case EventType::cacheSend: return "CACHE-SEND";
+  case EventType::cacheMissing: return "CACHE-MISSING";
+  case EventType::subCookie: return "SUB-COOKIE";
+  }
+  return "UNKNOWN";
+}
+
+
+const char* eventLevelName( EventLevel level ) {
+  switch ( level ) {
+  case EventLevel::error: return "error";
+  case EventLevel::info: return "info";
+  case EventLevel::debug: return "debug";
+  }
+  return "unknown";
+}
+
+
+bool eventLevelParse( const char* str, EventLevel& level ) {
+  if ( !str ) {
+    return false;
+  }
+  for ( uint8_t l = (uint8_t)EventLevel::error; l <= (uint8_t)EventLevel::debug; l++ ) {
+    if ( strcmp( str, eventLevelName( (EventLevel)l ) ) == 0 ) {
+      level = (EventLevel)l;
+      return true;
+    }
+  }
+  char* end;
+  long l = strtol( str, &end, 10 );
+  if ( ( *str == 0 ) || ( *end != 0 ) || ( l < 0 ) || ( l > (long)EventLevel::debug ) ) {
+    return false;
+  }
+  level = (EventLevel)l;
+  return true;
+}
+
+
+static uint64_t nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch() ).count();
+}
+
+
+static size_t roundUpPow2( size_t n ) {
+  size_t p = 64;
+  while ( p < n ) {
+    p <<= 1;
+  }
+  return p;
+}
+
+
+EventLog::EventLog( const char* file, EventLevel level, size_t capacity )
+  : ring( roundUpPow2( capacity ) ), ringMask( ring.size() - 1 ), head( 0 ), tail( 0 ),
+    levelsOn( eventLogOff ), configuredLevel( (uint8_t)level ), droppedPending( 0 ), droppedTotal( 0 ),
+    fd( -1 ), running( false ) {
+  if ( ( file == NULL ) || ( file[0] == 0 ) ) {
+    return;
+  }
+
+  // not through a symlink, which someone else could have left at the path
+  fd = open( file, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644 );
+  if ( fd < 0 ) {
+    perror( "Could not open event log" );
+    return;
+  }
+  if ( write( fd, eventLogMagic, sizeof( eventLogMagic ) ) != sizeof( eventLogMagic ) ) {
+    perror( "Could not write event log" );
+    close( fd );
+    fd = -1;
+    return;
+  }
+
+  running = true;
+  writer = std::thread( &EventLog::run, this );
+  levelsOn = configuredLevel + 1;
+
+  MsgShortName none;
+  memset( &none, 0, sizeof( none ) );
+  record( EventLevel::error, EventType::logStart, none, NULL, configuredLevel );
+}
+
+
+EventLog::~EventLog() {
+  if ( fd < 0 ) {
+    return;
+  }
+  levelsOn = eventLogOff;
+  running = false;
+  writer.join();
+  drain();
+  close( fd );
+}
+
+
+void EventLog::setLevel( EventLevel lvl ) {
+  configuredLevel = (uint8_t)lvl;
+  if ( fd >= 0 ) {
+    levelsOn = configuredLevel + 1;
+  }
+}
+
+
+EventLevel EventLog::getLevel() const {
+  return (EventLevel)configuredLevel;
+}
+
+
+void EventLog::record( EventLevel lvl, EventType type, const MsgShortName& name,
+                       const SlowerRemote* remote, int32_t value ) {
+  EventRecord rec;
+  rec.timeUs = nowUs();
+  rec.name = name;
+  rec.addr = remote ? remote->addr.sin_addr.s_addr : 0;
+  rec.port = remote ? remote->addr.sin_port : 0;
+  rec.type = type;
+  rec.level = lvl;
+  rec.value = value;
+  rec.reserved = 0;
+
+  if ( droppedPending > 0 ) {
+    EventRecord drop = rec;
+    memset( &drop.name, 0, sizeof( drop.name ) );
+    drop.addr = 0;
+    drop.port = 0;
+    drop.type = EventType::dropped;
+    drop.level = EventLevel::error;
+    drop.value = (int32_t)droppedPending;
+    if ( !push( drop ) ) {
+      droppedPending++;
+      droppedTotal++;
+      return;
+    }
+    droppedPending = 0;
+  }
+
+  if ( !push( rec ) ) {
+    droppedPending++;
+    droppedTotal++;
+  }
+}
+
+
+bool EventLog::push( const EventRecord& rec ) {
+  const uint64_t h = head.load( std::memory_order_relaxed );
+  if ( h - tail.load( std::memory_order_acquire ) >= ring.size() ) {
+    return false;
+  }
+  ring[ h & ringMask ] = rec;
+  head.store( h + 1, std::memory_order_release );
+  return true;
+}
+
+
+// Write everything in the ring to the file, returns the number of records written
+size_t EventLog::drain() {
+  size_t total = 0;
+  while ( true ) {
+    const uint64_t t = tail.load( std::memory_order_relaxed );
+    const uint64_t h = head.load( std::memory_order_acquire );
+    if ( h == t ) {
+      return total;
+    }
+
+    // contiguous run up to the end of the ring
+    size_t start = t & ringMask;
+    size_t count = std::min<uint64_t>( h - t, ring.size() - start );
+    const char* ptr = (const char*)&ring[ start ];
+    size_t len = count * sizeof( EventRecord );
+    while ( len > 0 ) {
+      ssize_t n = write( fd, ptr, len );
+      if ( n < 0 ) {
+        if ( errno == EINTR ) {
+          continue;
+        }
+        perror( "Event log write failed" );
+        break;
+      }
+      ptr += n;
+      len -= n;
+    }
+
+    tail.store( t + count, std::memory_order_release );
+    total += count;
+  }
+}
+
+
+void EventLog::run() {
+  while ( running.load() ) {
+    if ( drain() == 0 ) {
+      std::this_thread::sleep_for( std::chrono::milliseconds( 5 ) );
+    }
+  }
+}
@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <gapTracker.h>
+
+
+GapTracker::GapTracker( uint32_t reorderMsVal, uint32_t retryMsVal, int maxTriesVal, uint32_t maxGapVal )
+  : reorderMs( reorderMsVal ), retryMs( retryMsVal ), maxTries( maxTriesVal ), maxGap( maxGapVal ),
+    numRepaired( 0 ), numLost( 0 ), numFetches( 0 ) {
+}
+
+
+void GapTracker::addMissing( Stream& stream, uint32_t first, uint32_t last, uint64_t nowMs ) {
+  if ( first > last ) {
+    return;
+  }
+  for ( uint32_t id = first; id <= last; id++ ) {
+    Missing& m = stream.missing[ id ];
+    m.dueMs = nowMs + reorderMs;
+    m.tries = 0;
+  }
+}
+
+
+void GapTracker::restart( Stream& stream, uint32_t id ) {
+  stream.lowest = id;
+  stream.highest = id;
+  stream.missing.clear();
+}
+
+
+bool GapTracker::received( const MsgShortName& name, uint64_t nowMs ) {
+  MsgShortName prefix = name;
+  prefix.spec.msg_id = 0;
+  const uint32_t id = name.spec.msg_id;
+
+  auto it = streams.find( prefix );
+  if ( it == streams.end() ) {
+    restart( streams[ prefix ], id );
+    return true;
+  }
+  Stream& stream = it->second;
+
+  // everything from lowest to highest is either received or missing, so a jump too big to
+  // fetch the ids in between starts the stream over rather than leaving them in that span
+  if ( ( ( id > stream.highest ) && ( id - stream.highest > maxGap ) )
+       || ( ( id < stream.lowest ) && ( stream.lowest - id > maxGap ) ) ) {
+    restart( stream, id );
+    return true;
+  }
+  if ( id > stream.highest ) {
+    addMissing( stream, stream.highest + 1, id - 1, nowMs );
+    stream.highest = id;
+    return true;
+  }
+  if ( id < stream.lowest ) {
+    addMissing( stream, id + 1, stream.lowest - 1, nowMs );
+    stream.lowest = id;
+    return true;
+  }
+
+  auto m = stream.missing.find( id );
+  if ( m == stream.missing.end() ) {
+    return false;
+  }
+  stream.missing.erase( m );
+  numRepaired++;
+  return true;
+}
+
+
+int GapTracker::fetch( SlowerConnection& slower, const MsgShortName& prefix, Stream& stream, uint64_t nowMs ) {
+  int ret = 0;
+  MsgAckRange ranges[ SLOWER_MAX_ACK_RANGES ];
+  int numRanges = 0;
+
+  for ( auto it = stream.missing.begin(); it != stream.missing.end(); ) {
+    Missing& m = it->second;
+    if ( nowMs < m.dueMs ) {
+      ++it;
+      continue;
+    }
+    if ( m.tries >= maxTries ) {
+      numLost++;
+      it = stream.missing.erase( it );
+      continue;
+    }
+    m.tries++;
+    m.dueMs = nowMs + retryMs;
+
+    const uint32_t id = it->first;
+    if ( ( numRanges > 0 ) && ( id == ranges[ numRanges - 1 ].last + 1 ) ) {
+      ranges[ numRanges - 1 ].last = id;
+    } else {
+      if ( numRanges == SLOWER_MAX_ACK_RANGES ) {
+        int err = slowerFetch( slower, prefix, ranges, numRanges );
+        ret = err ? err : ret;
+        numFetches++;
+        numRanges = 0;
+      }
+      ranges[ numRanges ].first = id;
+      ranges[ numRanges ].last = id;
+      numRanges++;
+    }
+    ++it;
+  }
+
+  if ( numRanges > 0 ) {
+    int err = slowerFetch( slower, prefix, ranges, numRanges );
+    ret = err ? err : ret;
+    numFetches++;
+  }
+  return ret;
+}
+
+
+int GapTracker::service( SlowerConnection& slower, uint64_t nowMs ) {
+  int ret = 0;
+  for ( auto& it : streams ) {
+    if ( it.second.missing.empty() ) {
+      continue;
+    }
+    int err = fetch( slower, it.first, it.second, nowMs );
+    if ( err != 0 ) {
+      ret = err;
+    }
+  }
+  return ret;
+}
+
+
+int GapTracker::nextTimeoutMs( uint64_t nowMs ) const {
+  uint64_t next = UINT64_MAX;
+  for ( const auto& it : streams ) {
+    for ( const auto& m : it.second.missing ) {
+      next = std::min( next, m.second.dueMs );
+    }
+  }
+  if ( next == UINT64_MAX ) {
+    return -1;
+  }
+  return ( next <= nowMs ) ? 0 : (int)( next - nowMs );
+}
+
+
+size_t GapTracker::missing() const {
+  size_t n = 0;
+  for ( const auto& it : streams ) {
+    n += it.second.missing.size();
+  }
+  return n;
+}
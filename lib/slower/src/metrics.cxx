@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <metrics.h>
+
+
+MetricHistogram::MetricHistogram()
+  : buckets( new std::atomic<uint64_t>[ numBuckets ] ), total( 0 ), valueSum( 0 ) {
+  for ( int i = 0; i < numBuckets; i++ ) {
+    buckets[ i ] = 0;
+  }
+}
+
+
+int MetricHistogram::bucketIndex( uint64_t value ) {
+  if ( value < (uint64_t)subBuckets ) {
+    return (int)value;
+  }
+  int exponent = 63 - __builtin_clzll( value );   // value is in [ 2^exponent, 2^(exponent+1) )
+  int shift = exponent - subBucketBits;
+  int sub = (int)( value >> shift ) - subBuckets;
+  return subBuckets + shift * subBuckets + sub;
+}
+
+
+uint64_t MetricHistogram::bucketUpperBound( int index ) {
+  if ( index < subBuckets ) {
+    return index;
+  }
+  int shift = ( index - subBuckets ) / subBuckets;
+  uint64_t sub = ( index - subBuckets ) % subBuckets;
+  uint64_t lower = ( subBuckets + sub ) << shift;
+  return lower + ( ( uint64_t( 1 ) << shift ) - 1 );
+}
+
+
+void MetricHistogram::record( uint64_t value ) {
+  buckets[ bucketIndex( value ) ].fetch_add( 1, std::memory_order_relaxed );
+  total.fetch_add( 1, std::memory_order_relaxed );
+  valueSum.fetch_add( value, std::memory_order_relaxed );
+}
+
+
+uint64_t MetricHistogram::valueAtPercentile( double percentile ) const {
+  uint64_t n = count();
+  if ( n == 0 ) {
+    return 0;
+  }
+  uint64_t target = (uint64_t)( percentile / 100.0 * n + 0.5 );
+  if ( target < 1 ) {
+    target = 1;
+  }
+  uint64_t seen = 0;
+  for ( int i = 0; i < numBuckets; i++ ) {
+    seen += bucketCount( i );
+    if ( seen >= target ) {
+      return bucketUpperBound( i );
+    }
+  }
+  return bucketUpperBound( numBuckets - 1 );
+}
+
+
+MetricsRegistry::Entry& MetricsRegistry::add( const std::string& name, const std::string& help,
+                                              const std::string& labels, Kind kind ) {
+  std::unique_ptr<Entry> entry( new Entry );
+  entry->name = name;
+  entry->help = help;
+  entry->labels = labels;
+  entry->kind = kind;
+  entries.push_back( std::move( entry ) );
+  return *entries.back();
+}
+
+
+MetricCounter& MetricsRegistry::counter( const std::string& name, const std::string& help, const std::string& labels ) {
+  Entry& entry = add( name, help, labels, Kind::counter );
+  entry.counter.reset( new MetricCounter );
+  return *entry.counter;
+}
+
+
+MetricGauge& MetricsRegistry::gauge( const std::string& name, const std::string& help, const std::string& labels ) {
+  Entry& entry = add( name, help, labels, Kind::gauge );
+  entry.gauge.reset( new MetricGauge );
+  return *entry.gauge;
+}
+
+
+MetricHistogram& MetricsRegistry::histogram( const std::string& name, const std::string& help, const std::string& labels ) {
+  Entry& entry = add( name, help, labels, Kind::histogram );
+  entry.histogram.reset( new MetricHistogram );
+  return *entry.histogram;
+}
+
+
+// name{labels,extra} with the braces left out when there are no labels
+static std::string series( const std::string& name, const std::string& labels, const std::string& extra = "" ) {
+  std::string all = labels;
+  if ( !extra.empty() ) {
+    all += ( all.empty() ? "" : "," ) + extra;
+  }
+  return all.empty() ? name : name + "{" + all + "}";
+}
+
+
+std::string MetricsRegistry::render() const {
+  // group by name, keeping registration order within and across families
+  std::vector<std::string> order;
+  std::map<std::string, std::vector<const Entry*>> families;
+  for ( const auto& entry : entries ) {
+    auto& family = families[ entry->name ];
+    if ( family.empty() ) {
+      order.push_back( entry->name );
+    }
+    family.push_back( entry.get() );
+  }
+
+  std::ostringstream out;
+  for ( const auto& name : order ) {
+    const auto& family = families[ name ];
+    const Entry* first = family.front();
+    const char* type = ( first->kind == Kind::counter ) ? "counter"
+      : ( first->kind == Kind::gauge ) ? "gauge" : "histogram";
+    out << "# HELP " << name << " " << first->help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+
+    for ( const Entry* entry : family ) {
+      switch ( entry->kind ) {
+      case Kind::counter:
+        out << series( name, entry->labels ) << " " << entry->counter->get() << "\n";
+        break;
+      case Kind::gauge:
+        out << series( name, entry->labels ) << " " << entry->gauge->get() << "\n";
+        break;
+      case Kind::histogram: {
+        // The same bounds on every scrape, or rate() and histogram_quantile() across scrapes
+        // break. The buckets are coarsened to powers of two, which fall on bucket edges so
+        // each count is exact: le 0, 1, 3, 7 ... 2^renderedBounds-1, then +Inf.
+        const MetricHistogram& h = *entry->histogram;
+        uint64_t cumulative = 0;
+        int i = 0;
+        for ( int k = 0; k <= MetricHistogram::renderedBounds; k++ ) {
+          const uint64_t bound = ( uint64_t( 1 ) << k ) - 1;
+          for ( ; ( i < MetricHistogram::numBuckets ) && ( MetricHistogram::bucketUpperBound( i ) <= bound ); i++ ) {
+            cumulative += h.bucketCount( i );
+          }
+          out << series( name + "_bucket", entry->labels, "le=\"" + std::to_string( bound ) + "\"" )
+              << " " << cumulative << "\n";
+        }
+        // a record() in progress may have counted its bucket and not yet the total
+        for ( ; i < MetricHistogram::numBuckets; i++ ) {
+          cumulative += h.bucketCount( i );
+        }
+        const uint64_t count = std::max( cumulative, h.count() );
+        out << series( name + "_bucket", entry->labels, "le=\"+Inf\"" ) << " " << count << "\n";
+        out << series( name + "_sum", entry->labels ) << " " << h.sum() << "\n";
+        out << series( name + "_count", entry->labels ) << " " << count << "\n";
+      }
+        break;
+      }
+    }
+  }
+  return out.str();
+}
+
+
+MetricsServer::MetricsServer( const MetricsRegistry& registryVal )
+  : registry( registryVal ), listenFD( -1 ), running( false ) {
+}
+
+
+MetricsServer::~MetricsServer() {
+  if ( running ) {
+    running = false;
+    server.join();
+  }
+  if ( listenFD >= 0 ) {
+    close( listenFD );
+  }
+}
+
+
+int MetricsServer::start( const char* addr, uint16_t port ) {
+  assert( !running );
+
+  struct sockaddr_in sa;
+  memset( &sa, 0, sizeof( sa ) );
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons( port );
+  if ( inet_pton( AF_INET, addr, &sa.sin_addr ) != 1 ) {
+    fprintf( stderr, "Bad metrics address %s\n", addr );
+    return -1;
+  }
+
+  listenFD = socket( AF_INET, SOCK_STREAM, 0 );
+  if ( listenFD < 0 ) {
+    perror( "Could not create metrics socket" );
+    return -1;
+  }
+  int one = 1;
+  setsockopt( listenFD, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+  if ( ( bind( listenFD, (struct sockaddr*)&sa, sizeof( sa ) ) != 0 ) || ( listen( listenFD, 8 ) != 0 ) ) {
+    perror( "Could not listen for metrics" );
+    close( listenFD );
+    listenFD = -1;
+    return -1;
+  }
+
+  running = true;
+  server = std::thread( &MetricsServer::run, this );
+  return 0;
+}
+
+
+void MetricsServer::run() {
+  while ( running.load() ) {
+    struct pollfd pfd = { listenFD, POLLIN, 0 };
+    int n = poll( &pfd, 1, 200 );
+    if ( n <= 0 ) {
+      continue;
+    }
+    int clientFD = accept( listenFD, NULL, NULL );
+    if ( clientFD < 0 ) {
+      continue;
+    }
+    serve( clientFD );
+    close( clientFD );
+  }
+}
+
+
+void MetricsServer::serve( int clientFD ) {
+  // read the request header, the path does not matter
+  char req[2048];
+  size_t got = 0;
+  while ( got < sizeof( req ) - 1 ) {
+    struct pollfd pfd = { clientFD, POLLIN, 0 };
+    if ( poll( &pfd, 1, 1000 ) <= 0 ) {
+      return;
+    }
+    ssize_t n = read( clientFD, req + got, sizeof( req ) - 1 - got );
+    if ( n <= 0 ) {
+      return;
+    }
+    got += n;
+    req[ got ] = 0;
+    if ( strstr( req, "\r\n\r\n" ) || strstr( req, "\n\n" ) ) {
+      break;
+    }
+  }
+
+  std::string body = registry.render();
+  std::string resp = "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Content-Length: " + std::to_string( body.size() ) + "\r\n"
+    "Connection: close\r\n\r\n" + body;
+
+  const char* ptr = resp.data();
+  size_t len = resp.size();
+  while ( len > 0 ) {
+    ssize_t n = send( clientFD, ptr, len, MSG_NOSIGNAL );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      return;
+    }
+    ptr += n;
+    len -= n;
+  }
+}
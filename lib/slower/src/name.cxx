@@ -1,46 +1,82 @@
 
 #include <assert.h>
-#include <iomanip>
-#include <iostream>
-#include <sstream>
 #include <string.h>
 
 
 #include <name.h>
+#include <shortName.h>
 #include <slower.h>
 
 Name::Name(MsgShortName &n) : name(n){};
 
 Name::Name(NamePath path, uint32_t org, uint32_t team,
            uint64_t fingerprint) { // key package & welcome
+  assert((path == NamePath::keyPackage) || (path == NamePath::welcome));
+  assert(fingerprint <= 0xFFFFffffFFFFull); // 48 bits after 2 bits of zero pad
+
+  setTeam(path, org, team);
+  setTail(fingerprint);
+}
+
+Name Name::commitAll(uint32_t org, uint32_t team, uint32_t epoch, uint32_t rand) {
+  assert(epoch <= 0xFFffff);  // 24 bits
+  assert(rand <= 0x3FFffff);  // 26 bits
+
+  MsgShortName n = {};
+  Name name(n);
+  name.setTeam(NamePath::commitAll, org, team);
+  name.setTail(((uint64_t)epoch << 26) | rand);
+  return name;
 }
 
-//Name::Name(NamePath path, uint32_t org, uint32_t team, uint32_t epoch,
-//           uint32_t rand) { // commit-all
-//}
+Name Name::commitOne(uint32_t org, uint32_t team, uint32_t device, uint32_t epoch,
+                     uint32_t rand) {
+  assert(device <= 0xFffff); // 20 bits
+  assert(epoch <= 0xFFffff); // 24 bits
+  assert(rand <= 0x3F);      // 6 bits
 
-//Name::Name(NamePath path, uint32_t org, uint32_t team, uint32_t device,
-//           uint32_t epoch, uint32_t rand) { // commit-one
-//}
+  MsgShortName n = {};
+  Name name(n);
+  name.setTeam(NamePath::commitOne, org, team);
+  name.setTail(((uint64_t)device << 30) | ((uint64_t)epoch << 6) | rand);
+  return name;
+}
 
 Name::Name(NamePath path, uint32_t org, uint32_t team, uint16_t channel,
            uint32_t device, uint32_t msgNum) { // name for message data
 
   assert(path == NamePath::message);
-  assert(org <= 0x3ffff);    // 18 bits
-  assert(team <= 0xFffff);   // 20 bits
   assert(channel <= 0x3FF);  // 10 bits
   assert(device <= 0xFffff); // 20 bits
   assert(msgNum <= 0xFffff); // 20 bits
 
+  setTeam(path, org, team);
+  name.spec.channel = channel;
+  name.spec.device = device;
+  name.spec.msg_id = msgNum;
+}
+
+void Name::setTeam(NamePath path, uint32_t org, uint32_t team) {
+  assert(org <= 0x3ffff);    // 18 bits
+  assert(team <= 0xFffff);   // 20 bits
+
   name.spec.origin_id = itad;
   name.spec.app_id = qmsgAppID;
   name.spec.path = (uint8_t)path;
   name.spec.org = org;
   name.spec.team = team;
-  name.spec.channel = channel;
-  name.spec.device = device;
-  name.spec.msg_id = msgNum;
+}
+
+// The 50 bits after team are the channel, device and msg_id of message data, other paths lay
+// out their own fields across the same bits
+void Name::setTail(uint64_t tail) {
+  name.spec.channel = (uint16_t)(tail >> 40) & 0x3FF;
+  name.spec.device = (uint32_t)(tail >> 20) & 0xFffff;
+  name.spec.msg_id = (uint32_t)tail & 0xFffff;
+}
+
+uint64_t Name::tail() const {
+  return ((uint64_t)name.spec.channel << 40) | ((uint64_t)name.spec.device << 20) | name.spec.msg_id;
 }
 
 uint32_t Name::orginID() {
@@ -63,6 +99,9 @@ uint32_t Name::channel() {
 };
 
 uint32_t Name::device() {
+  if (path() == NamePath::commitOne) {
+    return (uint32_t)(tail() >> 30) & 0xFffff;
+  }
   return (uint32_t)(name.spec.device);
 };
 
@@ -70,43 +109,262 @@ uint32_t Name::msgNum() {
   return (uint32_t)(name.spec.msg_id);
 };
 
+uint64_t Name::fingerprint() {
+  if ((path() == NamePath::keyPackage) || (path() == NamePath::welcome)) {
+    return tail() & 0xFFFFffffFFFFull;
+  }
+  return 0;
+}
+
+uint32_t Name::epoch() {
+  switch (path()) {
+  case NamePath::commitAll:
+    return (uint32_t)(tail() >> 26) & 0xFFffff;
+  case NamePath::commitOne:
+    return (uint32_t)(tail() >> 6) & 0xFFffff;
+  default:
+    return 0;
+  }
+}
+
+uint32_t Name::rand() {
+  switch (path()) {
+  case NamePath::commitAll:
+    return (uint32_t)tail() & 0x3FFffff;
+  case NamePath::commitOne:
+    return (uint32_t)tail() & 0x3F;
+  default:
+    return 0;
+  }
+}
+
 MsgShortName &Name::shortName() { return name; }
 
-std::string Name::shortString() {
-  std::stringstream ss;
+namespace {
+
+const char hexDigits[] = "0123456789abcdef";
+
+char* put( char* p, const char* str ) {
+  const size_t len = strlen( str );
+  memcpy( p, str, len );
+  return p + len;
+}
+
+char* putDecimal( char* p, uint32_t value ) {
+  char digits[10];
+  int n = 0;
+  do {
+    digits[n++] = (char)( '0' + value % 10 );
+    value /= 10;
+  } while ( value );
+  while ( n > 0 ) {
+    *p++ = digits[--n];
+  }
+  return p;
+}
+
+char* putHex( char* p, uint64_t value, int digits = 8 ) {
+  for ( int shift = 4 * ( digits - 1 ); shift >= 0; shift -= 4 ) {
+    *p++ = hexDigits[ ( value >> shift ) & 0xf ];
+  }
+  return p;
+}
+
+// End of str if p starts with it, otherwise NULL
+const char* getPrefix( const char* p, const char* end, const char* str ) {
+  const size_t len = strlen( str );
+  if ( ( (size_t)( end - p ) < len ) || ( memcmp( p, str, len ) != 0 ) ) {
+    return NULL;
+  }
+  return p + len;
+}
 
-  uint32_t *data = (uint32_t *)&name.data;
+// End of the decimal number p starts with, or NULL if there is none or it is over max
+const char* getDecimal( const char* p, const char* end, uint32_t max, uint32_t& value ) {
+  if ( ( p == end ) || ( *p < '0' ) || ( *p > '9' ) ) {
+    return NULL;
+  }
+  uint64_t n = 0;
+  while ( ( p != end ) && ( *p >= '0' ) && ( *p <= '9' ) ) {
+    n = n * 10 + ( *p++ - '0' );
+    if ( n > max ) {
+      return NULL;
+    }
+  }
+  value = (uint32_t)n;
+  return p;
+}
+
+// Value of 8 hex digits, the first most significant, 8 at a time in one word rather than one by
+// one. Returns false if any of them is not a hex digit.
+bool getHex8( const char* str, uint32_t& value ) {
+  const uint64_t ones = 0x0101010101010101ull;
+  const uint64_t highs = 0x8080808080808080ull;
+  uint64_t w;
+  memcpy( &w, str, 8 ); // little endian, so the first digit is the low byte
+
+  // with no byte over 0x7f, adding up to 0x7f to each byte carries only into its own top bit
+  const uint64_t lower = w | ( 0x20 * ones );
+  const uint64_t digit = ( w + ( 0x80 - '0' ) * ones ) & ~( w + ( 0x80 - '9' - 1 ) * ones );
+  const uint64_t letter = ( lower + ( 0x80 - 'a' ) * ones ) & ~( lower + ( 0x80 - 'f' - 1 ) * ones );
+  if ( ( w & highs ) || ( ( ( digit | letter ) & highs ) != highs ) ) {
+    return false;
+  }
+
+  // letters have 0x40 set and their low nibble is 9 short of their value
+  uint64_t n = ( w & ( 0x0f * ones ) ) + 9 * ( ( w >> 6 ) & ones );
+  n = ( ( n << 4 ) | ( n >> 8 ) ) & 0x00ff00ff00ff00ffull;     // pairs of digits into bytes
+  n = ( ( n << 8 ) | ( n >> 16 ) ) & 0x0000ffff0000ffffull;    // and bytes into 16 bits
+  value = (uint32_t)( ( n << 16 ) | ( n >> 32 ) );
+  return true;
+}
+
+bool parseHex( const char* str, const char* end, MsgShortName& name, int& mask ) {
+  const char* colon = (const char*)memchr( str, ':', end - str );
+  const char* digitsEnd = colon ? colon : end;
+  const size_t numDigits = digitsEnd - str;
+  if ( ( numDigits == 0 ) || ( numDigits > 32 ) ) {
+    return false;
+  }
+
+  char digits[32];
+  memset( digits, '0', sizeof( digits ) - numDigits );
+  memcpy( digits + sizeof( digits ) - numDigits, str, numDigits );
+  uint32_t words[4];
+  for ( int i = 0; i < 4; i++ ) {
+    if ( !getHex8( digits + 8 * i, words[i] ) ) {
+      return false;
+    }
+  }
+
+  uint32_t bits = 0;
+  if ( colon && ( getDecimal( colon + 1, end, 128, bits ) != end ) ) {
+    return false;
+  }
+  name = ShortName( ( (uint64_t)words[0] << 32 ) | words[1], ( (uint64_t)words[2] << 32 ) | words[3] ).msgShortName();
+  mask = (int)bits;
+  return true;
+}
 
-  ss << std::hex << std::setfill('0') 
-     << std::setw( 8 ) << data[0] << "-"
-     << std::setw( 8 ) << data[1] << "-"
-     << std::setw( 8 ) << data[2] << "-"
-     << std::setw( 8 ) << data[3]
-     << std::dec;
+}
 
-  return ss.str();
+std::string Name::shortString() {
+  char buf[ shortStringLen ];
+  return shortString( buf, sizeof( buf ) );
 }
 
 std::string Name::longString() {
-  std::stringstream ss;
-  if ( ( orginID() != itad ) || ( appID() != qmsgAppID ) ) {
-    ss << "unknown-" << shortString() ;
-  } else {
-    switch ( path() ) {
-    case NamePath::message: {
-      ss << "origin_id: " << orginID()
-         << " qmsg://msg"
-         << "/org-" << org()
-         << "/team-" << team()
-         << "/ch-" << channel()
-         << "/dev-" << device() 
-         << "/msg-" << msgNum();
+  char buf[ longStringLen ];
+  return longString( buf, sizeof( buf ) );
+}
+
+const char* Name::shortString( char* buf, size_t bufLen ) const {
+  assert( bufLen >= shortStringLen );
+  uint32_t data[4];
+  memcpy( data, name.data, sizeof( data ) );
+
+  char* p = buf;
+  for ( int i = 0; i < 4; i++ ) {
+    if ( i > 0 ) {
+      *p++ = '-';
     }
-      break;
-    default:
-      break;
+    p = putHex( p, data[i] );
+  }
+  *p = '\0';
+  return buf;
+}
+
+const char* Name::longString( char* buf, size_t bufLen ) const {
+  assert( bufLen >= longStringLen );
+  char* p = buf;
+  if ( ( name.spec.origin_id != itad ) || ( name.spec.app_id != qmsgAppID ) ) {
+    p = put( p, "unknown-" );
+    shortString( p, bufLen - ( p - buf ) );
+    return buf;
+  }
+  const char* paths[] = { NULL, "msg", "key-package", "welcome", "commit-all", "commit-one" };
+  if ( ( name.spec.path == 0 ) || ( name.spec.path >= sizeof( paths ) / sizeof( paths[0] ) ) ) {
+    *p = '\0';
+    return buf;
+  }
+  p = put( p, "origin_id: " );
+  p = putDecimal( p, name.spec.origin_id );
+  p = put( p, " qmsg://" );
+  p = put( p, paths[ name.spec.path ] );
+  p = put( p, "/org-" );
+  p = putDecimal( p, name.spec.org );
+  p = put( p, "/team-" );
+  p = putDecimal( p, name.spec.team );
+
+  const uint64_t bits = tail();
+  switch ( (NamePath)name.spec.path ) {
+  case NamePath::message:
+    p = put( p, "/ch-" );
+    p = putDecimal( p, name.spec.channel );
+    p = put( p, "/dev-" );
+    p = putDecimal( p, name.spec.device );
+    p = put( p, "/msg-" );
+    p = putDecimal( p, name.spec.msg_id );
+    break;
+  case NamePath::keyPackage:
+    p = put( p, "/kp-" );
+    p = putHex( p, bits & 0xFFFFffffFFFFull, 12 );
+    break;
+  case NamePath::welcome:
+    p = put( p, "/fp-" );
+    p = putHex( p, bits & 0xFFFFffffFFFFull, 12 );
+    break;
+  case NamePath::commitAll:
+    p = put( p, "/epoch-" );
+    p = putDecimal( p, (uint32_t)( bits >> 26 ) & 0xFFffff );
+    p = put( p, "/rand-" );
+    p = putDecimal( p, (uint32_t)bits & 0x3FFffff );
+    break;
+  case NamePath::commitOne:
+    p = put( p, "/dev-" );
+    p = putDecimal( p, (uint32_t)( bits >> 30 ) & 0xFffff );
+    p = put( p, "/epoch-" );
+    p = putDecimal( p, (uint32_t)( bits >> 6 ) & 0xFFffff );
+    p = put( p, "/rand-" );
+    p = putDecimal( p, (uint32_t)bits & 0x3F );
+    break;
+  }
+  *p = '\0';
+  return buf;
+}
+
+bool Name::parse( const char* str, size_t len, MsgShortName& name, int& mask ) {
+  const char* end = str + len;
+  const char* p = getPrefix( str, end, "qmsg://msg/org-" );
+  if ( !p ) {
+    return parseHex( str, end, name, mask );
+  }
+
+  uint32_t org = 0;
+  uint32_t team = 0;
+  p = getDecimal( p, end, 0x3ffff, org );
+  p = p ? getPrefix( p, end, "/team-" ) : NULL;
+  p = p ? getDecimal( p, end, 0xfffff, team ) : NULL;
+
+  // the fields after team may be left off, each one given narrows the mask
+  uint32_t values[3] = { 0, 0, 0 }; // channel, device, msgNum
+  const char* prefixes[3] = { "/ch-", "/dev-", "/" };
+  const uint32_t maxes[3] = { 0x3ff, 0xfffff, 0xfffff };
+  const int masks[3] = { 40, 20, 0 };
+  int fieldMask = 50;
+  for ( int i = 0; p && ( p != end ) && ( i < 3 ); i++ ) {
+    p = getPrefix( p, end, prefixes[i] );
+    if ( p && ( i == 2 ) && getPrefix( p, end, "msg-" ) ) {
+      p += 4;
     }
+    p = p ? getDecimal( p, end, maxes[i], values[i] ) : NULL;
+    fieldMask = masks[i];
   }
-  
-  return ss.str();
-};
+  if ( p != end ) {
+    return false;
+  }
+
+  name = Name( NamePath::message, org, team, (uint16_t)values[0], values[1], values[2] ).shortName();
+  mask = fieldMask;
+  return true;
+}
@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pubQueue.h>
+#include <slower.h>
+
+static const uint32_t initialRtoMs = 250;
+static const uint32_t maxRtoMs = 8000;
+static const size_t compactMinBytes = 1024 * 1024;
+
+// Journal records are a type byte, the name, and for publishes a 16 bit length and the data.
+// Publishes too large for one datagram use journalLargePub with a 32 bit length.
+static const char journalPub = 'P';
+static const char journalLargePub = 'L';
+static const char journalAck = 'A';
+
+
+PubQueue::PubQueue( const char* journalFileVal, int windowVal )
+  : numInFlight( 0 ), window( windowVal > 0 ? windowVal : 1 ),
+    journalFD( -1 ), journalBytes( 0 ), queuedBytes( 0 ) {
+  if ( journalFileVal == NULL ) {
+    return;
+  }
+  journalFile = journalFileVal;
+
+  journalLoad();
+  journalCompact();
+
+  if ( entries.size() > 0 ) {
+    std::clog << "Reloaded " << entries.size() << " unacked publishes from " << journalFile << std::endl;
+  }
+}
+
+
+PubQueue::~PubQueue() {
+  if ( journalFD >= 0 ) {
+    close( journalFD );
+    journalFD = -1;
+  }
+}
+
+
+uint64_t PubQueue::nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+
+void PubQueue::append( const MsgShortName& name, const uint8_t* data, int len ) {
+  Entry entry;
+  entry.name = name;
+  entry.data.assign( data, data + len );
+  entry.attempts = 0;
+  entry.nextSendMs = 0;
+  entry.rtoMs = initialRtoMs;
+
+  entries.push_back( entry );
+  index[ name ] = std::prev( entries.end() );
+  queuedBytes += len;
+}
+
+
+bool PubQueue::push( const MsgShortName& name, const uint8_t* data, int len ) {
+  assert( data );
+  assert( len > 0 );
+  assert( (uint32_t)len <= slowerMaxObjectLen );
+
+  auto queued = index.find( name );
+  if ( queued != index.end() ) {
+    const std::vector<uint8_t>& prior = queued->second->data;
+    if ( ( prior.size() == (size_t)len ) && ( memcmp( prior.data(), data, len ) == 0 ) ) {
+      return true; // already queued
+    }
+    std::cerr << "PubQueue: name already queued with other data, not publishing it" << std::endl;
+    return false;
+  }
+
+  append( name, data, len );
+
+  // Only the publish needs to be durable, a lost ack record just causes a
+  // retransmit which the relay drops as a duplicate
+  journalWrite( journalPub, entries.back() );
+  if ( journalFD >= 0 ) {
+    fdatasync( journalFD );
+  }
+  return true;
+}
+
+
+uint32_t PubQueue::highestMsgID( const MsgShortName& name ) const {
+  MsgShortName prefix = name;
+  prefix.spec.msg_id = 0;
+
+  uint32_t highest = 0;
+  for ( const Entry& entry : entries ) {
+    MsgShortName entryPrefix = entry.name;
+    entryPrefix.spec.msg_id = 0;
+    if ( entryPrefix == prefix ) {
+      highest = std::max<uint32_t>( highest, entry.name.spec.msg_id );
+    }
+  }
+  return highest;
+}
+
+
+void PubQueue::remove( std::list<Entry>::iterator it ) {
+  if ( it->attempts > 0 ) {
+    assert( numInFlight > 0 );
+    numInFlight--;
+  }
+  journalWrite( journalAck, *it );
+  queuedBytes -= it->data.size();
+  index.erase( it->name );
+  entries.erase( it );
+}
+
+
+void PubQueue::acked() {
+  // The relay is reachable again so anything backed off can go right away
+  uint64_t now = nowMs();
+  for ( Entry& entry : entries ) {
+    if ( entry.attempts > 0 && entry.rtoMs > initialRtoMs ) {
+      entry.rtoMs = initialRtoMs;
+      entry.nextSendMs = now;
+    }
+  }
+
+  if ( entries.empty() || ( journalBytes > compactMinBytes && journalBytes > 4 * queuedBytes ) ) {
+    journalCompact();
+  }
+}
+
+
+bool PubQueue::ack( const MsgShortName& name ) {
+  auto mapPtr = index.find( name );
+  if ( mapPtr == index.end() ) {
+    return false;
+  }
+
+  remove( mapPtr->second );
+  acked();
+  return true;
+}
+
+
+size_t PubQueue::ackRange( const MsgShortName& name, uint32_t firstMsgID, uint32_t lastMsgID ) {
+  MsgShortName prefix = name;
+  prefix.spec.msg_id = 0;
+
+  size_t count = 0;
+  for ( auto it = entries.begin(); it != entries.end(); ) {
+    MsgShortName entryPrefix = it->name;
+    entryPrefix.spec.msg_id = 0;
+    uint32_t id = it->name.spec.msg_id;
+    auto next = std::next( it );
+    if ( ( entryPrefix == prefix ) && ( id >= firstMsgID ) && ( id <= lastMsgID ) ) {
+      remove( it );
+      count++;
+    }
+    it = next;
+  }
+
+  if ( count > 0 ) {
+    acked();
+  }
+  return count;
+}
+
+
+int PubQueue::service( SlowerConnection& slower, uint64_t now ) {
+  int ret = 0;
+
+  for ( Entry& entry : entries ) {
+    if ( entry.attempts == 0 ) {
+      if ( numInFlight >= window ) {
+        continue;
+      }
+      numInFlight++;
+    } else if ( entry.nextSendMs > now ) {
+      continue;
+    } else {
+      entry.rtoMs = std::min( entry.rtoMs * 2, maxRtoMs );
+    }
+
+    entry.attempts++;
+    entry.nextSendMs = now + entry.rtoMs;
+
+    int err = slowerPub( slower, entry.name, (char*)entry.data.data(), entry.data.size() );
+    if ( err != 0 ) {
+      ret = err; // keep going, it will be retried after the backoff
+    }
+  }
+
+  return ret;
+}
+
+
+int PubQueue::nextTimeoutMs( uint64_t now ) const {
+  if ( entries.empty() ) {
+    return -1;
+  }
+
+  uint64_t next = UINT64_MAX;
+  for ( const Entry& entry : entries ) {
+    if ( entry.attempts == 0 ) {
+      if ( numInFlight < window ) {
+        return 0;
+      }
+      continue;
+    }
+    next = std::min( next, entry.nextSendMs );
+  }
+
+  if ( next == UINT64_MAX ) {
+    return -1;
+  }
+  return ( next <= now ) ? 0 : (int)( next - now );
+}
+
+
+void PubQueue::journalWrite( char type, const Entry& entry ) {
+  if ( journalFD < 0 ) {
+    return;
+  }
+
+  if ( ( type == journalPub ) && ( entry.data.size() >= slowerMTU-20 ) ) {
+    type = journalLargePub;
+  }
+
+  std::vector<uint8_t> rec( 1 + sizeof( MsgShortName ) + sizeof( uint32_t ) + ( ( type == journalAck ) ? 0 : entry.data.size() ) );
+  size_t recLen = 0;
+
+  rec[ recLen ] = type; recLen += 1;
+  memcpy( rec.data() + recLen, entry.name.data, sizeof( MsgShortName ) ); recLen += sizeof( MsgShortName );
+
+  if ( type == journalPub ) {
+    uint16_t len = entry.data.size();
+    memcpy( rec.data() + recLen, &len, sizeof( len ) ); recLen += sizeof( len );
+    memcpy( rec.data() + recLen, entry.data.data(), len ); recLen += len;
+  } else if ( type == journalLargePub ) {
+    uint32_t len = entry.data.size();
+    memcpy( rec.data() + recLen, &len, sizeof( len ) ); recLen += sizeof( len );
+    memcpy( rec.data() + recLen, entry.data.data(), len ); recLen += len;
+  }
+
+  ssize_t n = write( journalFD, rec.data(), recLen );
+  if ( n != (ssize_t)recLen ) {
+    perror( "PubQueue journal write failed" );
+    return;
+  }
+  journalBytes += recLen;
+}
+
+
+void PubQueue::journalLoad() {
+  FILE* file = fopen( journalFile.c_str(), "rb" );
+  if ( file == NULL ) {
+    return;
+  }
+
+  while ( true ) {
+    char type;
+    MsgShortName name;
+    if ( fread( &type, 1, 1, file ) != 1 ) break;
+    if ( fread( name.data, sizeof( name ), 1, file ) != 1 ) break;
+
+    if ( ( type == journalPub ) || ( type == journalLargePub ) ) {
+      uint32_t len = 0;
+      if ( type == journalPub ) {
+        uint16_t shortLen;
+        if ( fread( &shortLen, sizeof( shortLen ), 1, file ) != 1 ) break;
+        len = shortLen;
+      } else {
+        if ( fread( &len, sizeof( len ), 1, file ) != 1 ) break;
+      }
+      if ( len == 0 || len > slowerMaxObjectLen ) break;
+      std::vector<uint8_t> data( len );
+      if ( fread( data.data(), len, 1, file ) != 1 ) break; // partial record from a crash
+
+      if ( index.find( name ) == index.end() ) {
+        append( name, data.data(), len );
+      }
+    } else if ( type == journalAck ) {
+      auto mapPtr = index.find( name );
+      if ( mapPtr != index.end() ) {
+        queuedBytes -= mapPtr->second->data.size();
+        entries.erase( mapPtr->second );
+        index.erase( mapPtr );
+      }
+    } else {
+      std::cerr << "PubQueue journal " << journalFile << " is corrupt" << std::endl;
+      break;
+    }
+  }
+
+  fclose( file );
+}
+
+
+void PubQueue::journalCompact() {
+  if ( journalFile.empty() ) {
+    return;
+  }
+
+  // Rewrite only what is still queued, then swap it in place of the old journal
+  std::string tmpFile = journalFile + ".tmp";
+  int fd = open( tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600 );
+  if ( fd < 0 ) {
+    perror( "PubQueue could not open journal" );
+    return;
+  }
+
+  if ( journalFD >= 0 ) {
+    close( journalFD );
+  }
+  journalFD = fd;
+  journalBytes = 0;
+
+  for ( const Entry& entry : entries ) {
+    journalWrite( journalPub, entry );
+  }
+  fdatasync( journalFD );
+
+  if ( rename( tmpFile.c_str(), journalFile.c_str() ) != 0 ) {
+    perror( "PubQueue could not replace journal" );
+  }
+}
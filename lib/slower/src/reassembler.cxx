@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+
+#include <reassembler.h>
+
+
+Reassembler::Reassembler( uint32_t fetchAfterMsVal, uint32_t timeoutMsVal, size_t maxBytesVal )
+  : fetchAfterMs( fetchAfterMsVal ), timeoutMs( timeoutMsVal ), maxBytes( maxBytesVal ),
+    bytes( 0 ), numDropped( 0 ) {
+}
+
+
+bool Reassembler::add( const MsgShortName& name, const MsgFragHeader& frag, const SlowerRemote& remote,
+                       const uint8_t* data, int len, uint64_t nowMs, std::vector<uint8_t>& object ) {
+  if ( !slowerFragValid( frag, len ) ) {
+    return false; // malformed
+  }
+  if ( completed.find( name ) != completed.end() ) {
+    return false; // already delivered
+  }
+
+  auto it = objects.find( name );
+  if ( it == objects.end() ) {
+    if ( bytes + frag.totalLen > maxBytes ) {
+      numDropped++;
+      return false;
+    }
+    Object& obj = objects[ name ];
+    obj.first = frag;
+    obj.data.resize( frag.totalLen );
+    obj.have.assign( frag.count, false );
+    obj.numHave = 0;
+    obj.startMs = nowMs;
+    obj.remote = remote;
+    bytes += frag.totalLen;
+    it = objects.find( name );
+  }
+
+  Object& obj = it->second;
+  if ( ( frag.count != obj.first.count ) || ( frag.totalLen != obj.first.totalLen ) ) {
+    return false; // does not belong to the object being rebuilt
+  }
+  obj.nextFetchMs = nowMs + fetchAfterMs;
+  if ( obj.have[ frag.index ] ) {
+    return false;
+  }
+  memcpy( obj.data.data() + frag.offset, data, len );
+  obj.have[ frag.index ] = true;
+  obj.numHave++;
+
+  if ( obj.numHave < obj.first.count ) {
+    return false;
+  }
+
+  object.swap( obj.data );
+  bytes -= obj.first.totalLen;
+  objects.erase( it );
+  completed[ name ] = nowMs;
+  return true;
+}
+
+
+int Reassembler::service( SlowerConnection& slower, uint64_t nowMs ) {
+  int ret = 0;
+
+  for ( auto it = completed.begin(); it != completed.end(); ) {
+    it = ( nowMs >= it->second + timeoutMs ) ? completed.erase( it ) : std::next( it );
+  }
+
+  for ( auto it = objects.begin(); it != objects.end(); ) {
+    Object& obj = it->second;
+    if ( nowMs >= obj.startMs + timeoutMs ) {
+      bytes -= obj.first.totalLen;
+      numDropped++;
+      it = objects.erase( it );
+      continue;
+    }
+
+    if ( nowMs >= obj.nextFetchMs ) {
+      uint16_t missing[ SLOWER_MAX_FETCH_FRAGS ];
+      int numMissing = 0;
+      for ( int i = 0; i < obj.first.count; i++ ) {
+        if ( obj.have[ i ] ) {
+          continue;
+        }
+        missing[ numMissing++ ] = i;
+        if ( numMissing == SLOWER_MAX_FETCH_FRAGS ) {
+          int err = slowerFragFetch( slower, it->first, missing, numMissing, &obj.remote );
+          ret = err ? err : ret;
+          numMissing = 0;
+        }
+      }
+      if ( numMissing > 0 ) {
+        int err = slowerFragFetch( slower, it->first, missing, numMissing, &obj.remote );
+        ret = err ? err : ret;
+      }
+      obj.nextFetchMs = nowMs + fetchAfterMs;
+    }
+    ++it;
+  }
+
+  return ret;
+}
+
+
+int Reassembler::nextTimeoutMs( uint64_t nowMs ) const {
+  uint64_t next = UINT64_MAX;
+  for ( const auto& it : objects ) {
+    next = std::min( next, std::min( it.second.nextFetchMs, it.second.startMs + timeoutMs ) );
+  }
+  for ( const auto& it : completed ) {
+    next = std::min( next, it.second + timeoutMs );
+  }
+  if ( next == UINT64_MAX ) {
+    return -1;
+  }
+  return ( next <= nowMs ) ? 0 : (int)( next - nowMs );
+}
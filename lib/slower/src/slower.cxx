@@ -1,12 +1,15 @@
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <chrono>
 #include <cstring>
 #include <ctime>
 #include <iostream>
+#include <map>
 #include <netdb.h>
 #include <stdio.h>
 #include <strings.h>
@@ -16,6 +19,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <poll.h>
+#include <vector>
 
 #ifdef __linux__
 #include <net/ethernet.h>
@@ -25,29 +29,60 @@
 #endif
 
 #include <slower.h>
-
-static int slowerRecv( SlowerConnection& slower, char buf[], int bufSize, int* bufLen, SlowerRemote* remote );
-static int slowerSend( SlowerConnection& slower, char buf[], int bufLen, SlowerRemote& remote );
+#include <shortName.h>
+
+// Frames queued per destination while bundling, and the rest of the last bundle received
+struct SlowerBundleState {
+  struct Out {
+    std::vector<char> frames;   // MsgBundleFrameHeader and message, repeated
+    int count = 0;
+  };
+
+  bool bundling = false;
+  std::map<SlowerRemote, Out> out;
+  uint64_t messagesSent = 0;
+  uint64_t datagramsSent = 0;
+
+  char rx[slowerMTU];
+  int rxLen = 0;
+  int rxLoc = 0;
+  SlowerRemote rxRemote;
+  uint64_t rxMicros = 0;
+};
+
+static int slowerRecv( SlowerConnection& slower, char buf[], int bufSize, int* bufLen, SlowerRemote* remote,
+                       uint64_t* rxMicros );
+static int slowerSend( SlowerConnection& slower, char buf[], int bufLen, SlowerRemote* remote );
+static int slowerSendTo( SlowerConnection& slower, const char buf[], int bufLen, const SlowerRemote& dest );
 
 float slowerVersion() {
   return 0.2;
 }
 
 
+// Orders by family, then port, then address. sin_port and sin6_port are at the same offset.
+static int slowerRemoteCompare( const SlowerRemote& a, const SlowerRemote& b ) {
+  if ( a.addr.sin_family != b.addr.sin_family ) return ( a.addr.sin_family < b.addr.sin_family ) ? -1 : 1;
+  if ( a.addr.sin_port != b.addr.sin_port ) return ( a.addr.sin_port < b.addr.sin_port ) ? -1 : 1;
+  if ( a.addr.sin_family == AF_INET6 ) {
+    int c = memcmp( &(a.addr6.sin6_addr), &(b.addr6.sin6_addr), sizeof( a.addr6.sin6_addr ) );
+    if ( c != 0 ) return c;
+    if ( a.addr6.sin6_scope_id != b.addr6.sin6_scope_id ) return ( a.addr6.sin6_scope_id < b.addr6.sin6_scope_id ) ? -1 : 1;
+    return 0;
+  }
+  return memcmp( &(a.addr.sin_addr), &(b.addr.sin_addr), sizeof( a.addr.sin_addr ) );
+}
+
+bool operator==( const SlowerRemote& a, const SlowerRemote& b ){
+  return slowerRemoteCompare( a, b ) == 0;
+}
+
 bool operator!=( const SlowerRemote& a, const SlowerRemote& b ){
-  if ( a.addr.sin_port != b.addr.sin_port ) return true;
-  if ( a.addrLen != b.addrLen ) return true;
-  if ( memcmp( &(a.addr.sin_addr), &(b.addr.sin_addr),4 ) != 0)  return true; // TODO broken for v6
-  return false;
+  return slowerRemoteCompare( a, b ) != 0;
 }
 
 bool operator<( const SlowerRemote& a, const SlowerRemote& b ){
-  if ( a.addr.sin_port > b.addr.sin_port ) return true;
-  if ( a.addr.sin_port < b.addr.sin_port ) return false;
-  if ( a.addrLen > b.addrLen ) return true;
-  if ( a.addrLen < b.addrLen ) return false;
-  if ( memcmp( &(a.addr.sin_addr), &(b.addr.sin_addr),4 ) > 0)  return true; // TODO broken for v6
-  return false;
+  return slowerRemoteCompare( a, b ) < 0;
 }
 
 
@@ -61,30 +96,20 @@ bool operator==(const MsgShortName& a, const MsgShortName& b ) {
 }
 
 bool operator!=(const MsgShortName& a, const MsgShortName& b ){
-  return (std::memcmp(&a.data, &b.data, sizeof(MsgShortName)) == 0 );
+  return (std::memcmp(&a.data, &b.data, sizeof(MsgShortName)) != 0 );
 }
 
 void getMaskedMsgShortName(const MsgShortName &src, MsgShortName &dst, const int mask) {
-
-  // Set the data len to the size of bytes to keep at 8 bit boundaries.  The last byte is a wildcard
-  //   that will be added back so that it can be masked.
-  u_char dst_len = mask >= 8 ? MSG_SHORT_NAME_LEN - (mask / 8) : 15;
-  u_char dst_bits = mask % 8;
-
-  bzero(&dst, MSG_SHORT_NAME_LEN);
-
-  std::memcpy(dst.data, src.data, dst_len);   // Copy all bytes to keep as-is on 8bit boundaries
-
-  // Handle the last byte, either mask it, zero it, or keep it as-is
-  if (dst_bits) {
-    dst.data[dst_len] = src.data[dst_len] >> dst_bits << dst_bits;
-  } else {
-    dst.data[dst_len] = mask == 0 ? src.data[dst_len] : 0;
-  }
+  // The mask is the low bits of the name as a number, msg_id first, which are not the low
+  //   bits of any byte of the packed struct
+  dst = ShortName( src ).masked( mask ).msgShortName();
 }
 
 int slowerSetup( SlowerConnection& slower, uint16_t port) {
   slower.fd=0;
+  slower.rxTimestamps=0;
+  slower.subCookie=0;
+  slower.bundle = new SlowerBundleState;
   bzero( &slower.relay, sizeof( slower.relay ) );
   
   int err;
@@ -152,8 +177,8 @@ int slowerRemote(  SlowerRemote& remote, const char* server, const uint16_t port
     memset(&remote.addr, 0, sizeof(remote.addr));
     assert(result->ai_addrlen <= sizeof(remote.addr));
 
-    remote.addrLen = results->ai_addrlen;
-    memcpy(&remote.addr, results->ai_addr, result->ai_addrlen);
+    remote.addrLen = result->ai_addrlen;
+    memcpy(&remote.addr, result->ai_addr, result->ai_addrlen);
 #if 0
     std::clog << "Got remote IP of " << inet_ntoa( remote.addr.sin_addr) << std::endl;
 #endif
@@ -169,23 +194,15 @@ int slowerRemote(  SlowerRemote& remote, const char* server, const uint16_t port
   return 0;
 }
 
-static int slowerSend( SlowerConnection& slower, char buf[], int bufLen, SlowerRemote* remote ) {
+static int slowerSendTo( SlowerConnection& slower, const char buf[], int bufLen, const SlowerRemote& dest ) {
   assert( bufLen <= 1200 );
   assert( slower.fd > 0 );
 
-  SlowerRemote dest;
-  if ( remote == NULL ) {
-    dest = slower.relay;
-  } else {
-    dest = *remote;
-  }
-
 #if 0
-  std::clog << "in slowerSend with"
+  std::clog << "in slowerSendTo with"
             << " bufLen=" << bufLen
             << " IP=" << inet_ntoa( dest.addr.sin_addr)
             << " port=" << ntohs( dest.addr.sin_port )
-            << " remote=" << ( (remote)?1:0 ) 
             << std::endl;
 #endif
     
@@ -198,23 +215,146 @@ static int slowerSend( SlowerConnection& slower, char buf[], int bufLen, SlowerR
     perror("UDP sendto failed");
     return -1;
   }
+  slower.bundle->datagramsSent++;
   
   return 0;
 }
 
+// Send whatever is queued for one destination, as a plain message if there is only one
+static int slowerBundleSend( SlowerConnection& slower, const SlowerRemote& dest, SlowerBundleState::Out& out ) {
+  int err = 0;
+  if ( out.count == 1 ) {
+    const int hdrLen = sizeof( MsgBundleFrameHeader );
+    err = slowerSendTo( slower, out.frames.data() + hdrLen, out.frames.size() - hdrLen, dest );
+  } else if ( out.count > 1 ) {
+    char msg[slowerMTU];
+    MsgHeader mhdr = {0};
+    mhdr.type = SlowerMsgBundle;
+    memcpy( msg, &mhdr, sizeof( mhdr ) );
+    assert( sizeof( mhdr ) + out.frames.size() <= sizeof( msg ) );
+    memcpy( msg + sizeof( mhdr ), out.frames.data(), out.frames.size() );
+    err = slowerSendTo( slower, msg, sizeof( mhdr ) + out.frames.size(), dest );
+  }
+  out.frames.clear();
+  out.count = 0;
+  return err;
+}
+
+static int slowerSend( SlowerConnection& slower, char buf[], int bufLen, SlowerRemote* remote ) {
+  SlowerRemote dest;
+  if ( remote == NULL ) {
+    dest = slower.relay;
+  } else {
+    dest = *remote;
+  }
+
+  SlowerBundleState& bundle = *slower.bundle;
+  bundle.messagesSent++;
+  if ( !bundle.bundling ) {
+    return slowerSendTo( slower, buf, bufLen, dest );
+  }
+
+  const int frameLen = sizeof( MsgBundleFrameHeader ) + bufLen;
+  const int room = slowerMTU - sizeof( MsgHeader );
+  SlowerBundleState::Out& out = bundle.out[ dest ];
+  int err = 0;
+  if ( (int)out.frames.size() + frameLen > room ) {
+    err = slowerBundleSend( slower, dest, out ); // keep the order messages were sent in
+  }
+  if ( frameLen > room ) {
+    int sendErr = slowerSendTo( slower, buf, bufLen, dest ); // too big to ever be bundled
+    return err ? err : sendErr;
+  }
+
+  MsgBundleFrameHeader fhdr;
+  fhdr.frameLen = bufLen;
+  out.frames.insert( out.frames.end(), (char*)&fhdr, (char*)&fhdr + sizeof( fhdr ) );
+  out.frames.insert( out.frames.end(), buf, buf + bufLen );
+  out.count++;
+  return err;
+}
+
+void slowerBundleBegin( SlowerConnection& slower ) {
+  slower.bundle->bundling = true;
+}
+
+int slowerBundleFlush( SlowerConnection& slower ) {
+  SlowerBundleState& bundle = *slower.bundle;
+  int ret = 0;
+  for ( auto& it : bundle.out ) {
+    int err = slowerBundleSend( slower, it.first, it.second );
+    if ( err != 0 ) {
+      ret = err;
+    }
+  }
+  bundle.bundling = false;
+  return ret;
+}
+
+void slowerSendStats( SlowerConnection& slower, uint64_t* messages, uint64_t* datagrams ) {
+  *messages = slower.bundle->messagesSent;
+  *datagrams = slower.bundle->datagramsSent;
+}
+
+// Next message left from a received bundle, false once there are none
+static bool slowerBundleNext( SlowerBundleState& bundle, SlowerRemote* remote, uint64_t* rxMicros,
+                              const char** msg, int* msgLen ) {
+  while ( bundle.rxLoc < bundle.rxLen ) {
+    MsgBundleFrameHeader fhdr;
+    if ( bundle.rxLen - bundle.rxLoc < (int)sizeof( fhdr ) ) {
+      break;
+    }
+    memcpy( &fhdr, bundle.rx + bundle.rxLoc, sizeof( fhdr ) );
+    bundle.rxLoc += sizeof( fhdr );
+    if ( ( fhdr.frameLen < sizeof( MsgHeader ) ) || ( fhdr.frameLen > bundle.rxLen - bundle.rxLoc ) ) {
+      break; // malformed, drop the rest
+    }
+
+    const char* frame = bundle.rx + bundle.rxLoc;
+    bundle.rxLoc += fhdr.frameLen;
+    if ( frame[0] == SlowerMsgBundle ) {
+      continue; // bundles do not nest
+    }
+
+    *msg = frame;
+    *msgLen = fhdr.frameLen;
+    *remote = bundle.rxRemote;
+    *rxMicros = bundle.rxMicros;
+    return true;
+  }
+
+  bundle.rxLoc = bundle.rxLen = 0;
+  return false;
+}
+
 int slowerGetFD( SlowerConnection& slower) {
   return slower.fd;
 }
 
-int slowerWait( SlowerConnection& slower ){
+bool slowerPending( SlowerConnection& slower ) {
+  if ( slower.bundle->rxLoc < slower.bundle->rxLen ) {
+    return true;
+  }
+  struct pollfd pfd = { slower.fd, POLLIN, 0 };
+  return poll( &pfd, 1, 0 ) > 0;
+}
+
+int slowerWait( SlowerConnection& slower, int timeoutMs ){
+  if ( slower.bundle->rxLoc < slower.bundle->rxLen ) {
+    return 0; // rest of a bundle to read
+  }
+
   pollfd pfd;
 
   pfd.fd = slower.fd;
   pfd.events = POLLIN | POLLPRI | POLLHUP | POLLERR;
   pfd.revents = 0;
 
-  int err = poll(&pfd, 1, 50);
+  int err = poll(&pfd, 1, timeoutMs);
 
+  if ( ( err < 0 ) && ( errno == EINTR ) ) {
+    return 0; // interrupted by a signal, the caller just goes round again
+  }
   if ( err < 0 ) {
     perror("Error on select");
     return -1;
@@ -223,21 +363,79 @@ int slowerWait( SlowerConnection& slower ){
   return 0;
 }
 
-static int slowerRecv( SlowerConnection& slower, char buf[], int bufSize, int* bufLen, SlowerRemote* remote ) {
+int slowerEnableRxTimestamps( SlowerConnection& slower ) {
   assert( slower.fd > 0 );
 
+  int on = 1;
+#ifdef SO_TIMESTAMPNS
+  int err = setsockopt( slower.fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof( on ) );
+#else
+  int err = setsockopt( slower.fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof( on ) );
+#endif
+  if ( err != 0 ) {
+    perror( "problem enabling receive timestamps" );
+    return -1;
+  }
+  slower.rxTimestamps = 1;
+  return 0;
+}
+
+static uint64_t slowerNowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch() ).count();
+}
+
+// Kernel arrival time from the control messages of a recvmsg, 0 if there was none
+static uint64_t slowerCmsgMicros( struct msghdr* mh ) {
+  for ( struct cmsghdr* cm = CMSG_FIRSTHDR( mh ); cm != NULL; cm = CMSG_NXTHDR( mh, cm ) ) {
+    if ( cm->cmsg_level != SOL_SOCKET ) {
+      continue;
+    }
+#ifdef SCM_TIMESTAMPNS
+    if ( cm->cmsg_type == SCM_TIMESTAMPNS ) {
+      struct timespec ts;
+      memcpy( &ts, CMSG_DATA( cm ), sizeof( ts ) );
+      return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+#endif
+    if ( cm->cmsg_type == SCM_TIMESTAMP ) {
+      struct timeval tv;
+      memcpy( &tv, CMSG_DATA( cm ), sizeof( tv ) );
+      return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+  }
+  return 0;
+}
+
+static int slowerRecv( SlowerConnection& slower, char buf[], int bufSize, int* bufLen, SlowerRemote* remote,
+                       uint64_t* rxMicros ) {
+  assert( slower.fd > 0 );
+  assert( rxMicros );
+
   bzero( buf, bufSize );
 
-  bzero( &(remote->addr) , sizeof(  remote->addr ) );
-  remote->addrLen = sizeof(  remote->addr );
+  bzero( &(remote->addr6) , sizeof(  remote->addr6 ) );
+  remote->addrLen = sizeof(  remote->addr6 );
   *bufLen = 0; 
+  *rxMicros = 0;
+
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = bufSize;
+
+  uint64_t control[ 64 / sizeof( uint64_t ) ]; // aligned room for one timestamp cmsg
+  struct msghdr mh;
+  memset( &mh, 0, sizeof( mh ) );
+  mh.msg_name = &(remote->addr6);
+  mh.msg_namelen = remote->addrLen;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if ( slower.rxTimestamps ) {
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof( control );
+  }
 
-
-  //ssize_t r = recv(slower.fd, (void*)buf, (size_t)bufSize, 0 /*flags*/) ;
-  ssize_t r = recvfrom(slower.fd, (void*)buf, (size_t)bufSize, 0 /*flags*/,
-                       (struct sockaddr *)&(remote->addr),
-                       &(remote->addrLen)
-                       );
+  ssize_t r = recvmsg( slower.fd, &mh, 0 /*flags*/ );
   if ( r == -1 ) {
     int e = errno ;
     if ( e == EAGAIN ) {
@@ -246,8 +444,16 @@ static int slowerRecv( SlowerConnection& slower, char buf[], int bufSize, int* b
     std::cerr << "revc udp packet got error: " << strerror(e) << std::endl;
      return -1;
    }
+   remote->addrLen = mh.msg_namelen;
    *bufLen = r ;
 
+   if ( slower.rxTimestamps ) {
+     *rxMicros = slowerCmsgMicros( &mh );
+   }
+   if ( *rxMicros == 0 ) {
+     *rxMicros = slowerNowMicros();
+   }
+
 #if 0
    std::clog << "in slowerRecv with bufLen=" << *bufLen << std::endl;
 #endif
@@ -261,10 +467,22 @@ int slowerAddRelay( SlowerConnection& slower, const SlowerRemote& remote ){
   return 0;
 }
 
+
+SlowerPriority slowerNamePriority( const MsgShortName& name ) {
+  switch ( (NamePath)name.spec.path ) {
+  case NamePath::keyPackage:
+  case NamePath::welcome:
+  case NamePath::commitAll:
+  case NamePath::commitOne:
+    return SlowerPriorityControl;
+  default:
+    return SlowerPriorityNormal;
+  }
+}
+
   
-int slowerPub(SlowerConnection& slower, const MsgShortName& name, char buf[], int bufLen,
-              SlowerRemote* remote, MsgHeaderMetrics *metrics) {
-  assert( bufLen < slowerMTU-20 ); 
+static int slowerPubEncode(SlowerConnection& slower, const MsgShortName& name, const MsgFragHeader* frag,
+                           const char buf[], int bufLen, SlowerRemote* remote, MsgHeaderMetrics *metrics) {
   assert( slower.fd > 0 );
   assert( bufLen > 0 );
   
@@ -272,17 +490,27 @@ int slowerPub(SlowerConnection& slower, const MsgShortName& name, char buf[], in
   int msgLen=0;
 
   MsgHeader mhdr = {0};
-  mhdr.type = SlowerMsgPub;
+  mhdr.type = frag ? SlowerMsgPubFrag : SlowerMsgPub;
   mhdr.flags.metrics = metrics == NULL ? 0 : 1;
+  mhdr.flags.priority = slowerNamePriority( name );
   mhdr.name = name;
 
   memcpy(msg+msgLen, &mhdr, sizeof(mhdr)); msgLen += sizeof(mhdr);
 
   if (mhdr.flags.metrics) {
-    memcpy(msg + msgLen, metrics, sizeof(MsgHeaderMetrics)); msgLen += sizeof(MsgHeaderMetrics);
+    assert( metrics->num_hops <= SLOWER_MAX_TRACE_HOPS );
+    memcpy(msg + msgLen, &metrics->pub_millis, sizeof(metrics->pub_millis)); msgLen += sizeof(metrics->pub_millis);
+    memcpy(msg + msgLen, &metrics->relay_millis, sizeof(metrics->relay_millis)); msgLen += sizeof(metrics->relay_millis);
+    msg[msgLen++] = metrics->num_hops;
+    memcpy(msg + msgLen, metrics->hops, metrics->num_hops * sizeof(MsgTraceHop));
+    msgLen += metrics->num_hops * sizeof(MsgTraceHop);
     assert( msgLen + bufLen < sizeof(msg) );
   }
 
+  if ( frag ) {
+    memcpy(msg+msgLen, frag, sizeof(*frag)); msgLen += sizeof(*frag);
+  }
+
   MsgPubHeader mpub_hdr;
   mpub_hdr.dataLen = bufLen;
   assert( sizeof(msg) - msgLen >= sizeof(mpub_hdr));
@@ -297,8 +525,85 @@ int slowerPub(SlowerConnection& slower, const MsgShortName& name, char buf[], in
 }
 
 
+int slowerPub(SlowerConnection& slower, const MsgShortName& name, char buf[], int bufLen,
+              SlowerRemote* remote, MsgHeaderMetrics *metrics) {
+  assert( bufLen > 0 );
+  assert( (uint32_t)bufLen <= slowerMaxObjectLen );
+
+  int metricsLen = 0;
+  if ( metrics ) {
+    metricsLen = sizeof(metrics->pub_millis) + sizeof(metrics->relay_millis) + 1
+      + metrics->num_hops * sizeof(MsgTraceHop);
+  }
+  if ( sizeof(MsgHeader) + metricsLen + sizeof(MsgPubHeader) + bufLen < slowerMTU ) {
+    return slowerPubEncode( slower, name, NULL, buf, bufLen, remote, metrics );
+  }
+
+  MsgFragHeader frag;
+  frag.totalLen = bufLen;
+  frag.count = ( bufLen + slowerFragSize - 1 ) / slowerFragSize;
+  int ret = 0;
+  for ( frag.index = 0; frag.index < frag.count; frag.index++ ) {
+    frag.offset = frag.index * slowerFragSize;
+    int len = std::min<int>( slowerFragSize, bufLen - frag.offset );
+    int err = slowerPubEncode( slower, name, &frag, buf + frag.offset, len, remote,
+                               ( frag.index == 0 ) ? metrics : NULL );
+    if ( err != 0 ) {
+      ret = err;
+    }
+  }
+  return ret;
+}
+
+
+bool slowerFragValid( const MsgFragHeader& frag, int len ) {
+  if ( ( frag.totalLen == 0 ) || ( frag.totalLen > slowerMaxObjectLen )
+       || ( frag.count != ( frag.totalLen + slowerFragSize - 1 ) / slowerFragSize ) || ( frag.index >= frag.count ) ) {
+    return false;
+  }
+  const uint32_t offset = (uint32_t)frag.index * slowerFragSize;
+  return ( frag.offset == offset ) && ( len > 0 )
+    && ( (uint32_t)len == std::min<uint32_t>( slowerFragSize, frag.totalLen - offset ) );
+}
+
+
+int slowerPubFragment(SlowerConnection& slower, const MsgShortName& name, const MsgFragHeader& frag,
+                      char buf[], int bufLen, SlowerRemote* remote, MsgHeaderMetrics *metrics) {
+  assert( bufLen <= slowerFragSize );
+  return slowerPubEncode( slower, name, &frag, buf, bufLen, remote, metrics );
+}
+
+
+int slowerFragFetch(SlowerConnection& slower, const MsgShortName& name, const uint16_t indexes[], int numIndexes,
+                    SlowerRemote* remote ){
+  assert( slower.fd > 0 );
+  assert( numIndexes > 0 );
+  assert( numIndexes <= SLOWER_MAX_FETCH_FRAGS );
+
+  char msg[slowerMTU];
+  int msgLen=0;
+
+  MsgHeader mhdr = {0};
+  mhdr.type = SlowerMsgFragFetch;
+  mhdr.name = name;
+
+  memcpy( msg+msgLen, &mhdr, sizeof(mhdr) ) ; msgLen += sizeof(mhdr);
+
+  MsgFragFetchHeader mfetch_hdr;
+  mfetch_hdr.numIndexes = numIndexes;
+  memcpy( msg+msgLen, &mfetch_hdr, sizeof(mfetch_hdr) ) ; msgLen += sizeof(mfetch_hdr);
+
+  assert( msgLen + numIndexes * sizeof(uint16_t) < sizeof( msg ) );
+  memcpy( msg+msgLen, indexes, numIndexes * sizeof(uint16_t) ) ; msgLen += numIndexes * sizeof(uint16_t);
+
+  int err = slowerSend( slower, msg, msgLen, remote );
+  return err;
+}
+
+
 int slowerRecvMulti(SlowerConnection& slower, MsgHeader *msgHeader, SlowerRemote* remote,
-                    int* mask, char buf[], int bufSize, int* bufLen, MsgHeaderMetrics *metrics ){
+                    int* mask, char buf[], int bufSize, int* bufLen, MsgHeaderMetrics *metrics,
+                    uint64_t* rxMicros, MsgFragHeader* frag ){
 
   assert (msgHeader);
   assert( remote );
@@ -312,26 +617,61 @@ int slowerRecvMulti(SlowerConnection& slower, MsgHeader *msgHeader, SlowerRemote
   *bufLen=0;
   bzero( msgHeader->name.data, sizeof( msgHeader->name.data ) );
 
-  char msg[slowerMTU];
+  char datagram[slowerMTU];
+  const char* msg = datagram;
   int msgLen=0; // total length of data received 
   int msgLoc=0; // position of current decode of messages
   
-  int err = slowerRecv( slower, msg, sizeof(msg), &msgLen, remote );
-  if ( err != 0 ) {
-    return err;
+  SlowerBundleState& bundle = *slower.bundle;
+  uint64_t arrival = 0;
+  if ( !slowerBundleNext( bundle, remote, &arrival, &msg, &msgLen ) ) {
+    int err = slowerRecv( slower, datagram, sizeof(datagram), &msgLen, remote, &arrival );
+    if ( rxMicros != NULL ) {
+      *rxMicros = arrival;
+    }
+    if ( err != 0 ) {
+      return err;
+    }
+    if ( msgLen < (int)sizeof(MsgHeader) ) {
+      return 0;
+    }
+
+    if ( datagram[0] == SlowerMsgBundle ) {
+      memcpy( bundle.rx, datagram, msgLen );
+      bundle.rxLen = msgLen;
+      bundle.rxLoc = sizeof(MsgHeader);
+      bundle.rxRemote = *remote;
+      bundle.rxMicros = arrival;
+      if ( !slowerBundleNext( bundle, remote, &arrival, &msg, &msgLen ) ) {
+        return 0; // empty or malformed bundle
+      }
+    }
   }
-  if ( msgLen == 0 ) {
-    return 0;
+  if ( rxMicros != NULL ) {
+    *rxMicros = arrival;
   }
 
   memcpy(msgHeader, msg, sizeof(MsgHeader));
   msgLoc += sizeof(MsgHeader);
 
   if (msgHeader->flags.metrics) {
-    if (metrics != NULL)
-      memcpy(metrics, msg+msgLoc, sizeof(MsgHeaderMetrics));
+    MsgHeaderMetrics recvMetrics;
+    const int fixedLen = sizeof(recvMetrics.pub_millis) + sizeof(recvMetrics.relay_millis) + 1;
+    if ( msgLen - msgLoc < fixedLen ) {
+      return -1;
+    }
+    memcpy(&recvMetrics.pub_millis, msg+msgLoc, sizeof(recvMetrics.pub_millis)); msgLoc += sizeof(recvMetrics.pub_millis);
+    memcpy(&recvMetrics.relay_millis, msg+msgLoc, sizeof(recvMetrics.relay_millis)); msgLoc += sizeof(recvMetrics.relay_millis);
+    recvMetrics.num_hops = msg[msgLoc++];
+
+    const int hopsLen = recvMetrics.num_hops * sizeof(MsgTraceHop);
+    if ( ( recvMetrics.num_hops > SLOWER_MAX_TRACE_HOPS ) || ( msgLen - msgLoc < hopsLen ) ) {
+      return -1;
+    }
+    memcpy(recvMetrics.hops, msg+msgLoc, hopsLen); msgLoc += hopsLen;
 
-    msgLoc += sizeof(MsgHeaderMetrics);
+    if (metrics != NULL)
+      *metrics = recvMetrics;
   }
 
   assert( msgHeader->type != SlowerMsgInvalid );
@@ -363,24 +703,144 @@ int slowerRecvMulti(SlowerConnection& slower, MsgHeader *msgHeader, SlowerRemote
     assert( msgLoc == msgLen );
     break;
 
-  case SlowerMsgSub:
-    MsgSubHeader msub_hdr;
+  case SlowerMsgPubFrag: {
+    MsgFragHeader frag_hdr;
+    MsgPubHeader mpub_hdr;
+    if ( msgLen - msgLoc < (int)( sizeof(frag_hdr) + sizeof(mpub_hdr) ) ) {
+      return -1;
+    }
+    memcpy(&frag_hdr, msg+msgLoc, sizeof(frag_hdr)); msgLoc += sizeof(frag_hdr);
+    memcpy(&mpub_hdr, msg+msgLoc, sizeof(mpub_hdr)); msgLoc += sizeof(mpub_hdr);
 
-    assert ( bufSize - msgLoc >= sizeof(msub_hdr));
-    memcpy(&msub_hdr, msg+msgLoc, sizeof(msub_hdr)); msgLoc += sizeof(msub_hdr);
+    if ( ( msgLen - msgLoc != mpub_hdr.dataLen ) || ( bufSize < mpub_hdr.dataLen ) ) {
+      return -1;
+    }
+    memcpy( buf, msg+msgLoc, mpub_hdr.dataLen ); msgLoc += mpub_hdr.dataLen;
+    *bufLen = mpub_hdr.dataLen;
+    if ( frag != NULL ) {
+      *frag = frag_hdr;
+    }
+  }
+    break;
 
+  case SlowerMsgFragFetch: {
+    MsgFragFetchHeader mfetch_hdr;
+    if ( msgLen - msgLoc < (int)sizeof(mfetch_hdr) ) {
+      return -1;
+    }
+    memcpy(&mfetch_hdr, msg+msgLoc, sizeof(mfetch_hdr)); msgLoc += sizeof(mfetch_hdr);
+
+    const int indexesLen = mfetch_hdr.numIndexes * sizeof(uint16_t);
+    if ( ( msgLen - msgLoc != indexesLen ) || ( bufSize < indexesLen ) ) {
+      return -1;
+    }
+    memcpy( buf, msg+msgLoc, indexesLen ); msgLoc += indexesLen;
+    *bufLen = indexesLen;
+  }
+    break;
+
+  case SlowerMsgSub: {
+    MsgSubHeader msub_hdr;
+    if ( msgLen - msgLoc < (int)sizeof(msub_hdr) ) {
+      return -1;
+    }
+    memcpy(&msub_hdr, msg+msgLoc, sizeof(msub_hdr)); msgLoc += sizeof(msub_hdr);
+    if ( ( msub_hdr.mask < 0 ) || ( msub_hdr.mask > SLOWER_MAX_SUB_MASK ) ) {
+      return -1;
+    }
     *mask = msub_hdr.mask;
-    assert( msgLoc == msgLen );
+
+    // then the cookie, if the subscriber has one
+    const int cookieLen = msgLen - msgLoc;
+    if ( ( ( cookieLen != 0 ) && ( cookieLen != (int)sizeof(uint64_t) ) ) || ( bufSize < cookieLen ) ) {
+      return -1;
+    }
+    memcpy( buf, msg+msgLoc, cookieLen ); msgLoc += cookieLen;
+    *bufLen = cookieLen;
+  }
     break;
 
-  case SlowerMsgUnSub:
-    assert( msgLoc == msgLen );
+  case SlowerMsgSubCookie: {
+    MsgSubCookieHeader mcookie_hdr;
+    if ( ( msgLen - msgLoc != (int)sizeof(mcookie_hdr) ) || ( bufSize < (int)sizeof(mcookie_hdr.cookie) ) ) {
+      return -1;
+    }
+    memcpy(&mcookie_hdr, msg+msgLoc, sizeof(mcookie_hdr)); msgLoc += sizeof(mcookie_hdr);
+    if ( ( mcookie_hdr.mask < 0 ) || ( mcookie_hdr.mask > SLOWER_MAX_SUB_MASK ) ) {
+      return -1;
+    }
+    *mask = mcookie_hdr.mask;
+    memcpy( buf, &mcookie_hdr.cookie, sizeof(mcookie_hdr.cookie) );
+    *bufLen = sizeof(mcookie_hdr.cookie);
+
+    // only the relay this connection subscribes through is answered, so a spoofed cookie
+    // cannot make it subscribe somewhere else
+    if ( *remote == slower.relay ) {
+      slower.subCookie = mcookie_hdr.cookie;
+      slowerSub( slower, msgHeader->name, mcookie_hdr.mask );
+    }
+  }
+    break;
+
+  case SlowerMsgUnSub: {
+    MsgSubHeader msub_hdr;
+    if ( msgLen - msgLoc != (int)sizeof(msub_hdr) ) {
+      return -1;
+    }
+    memcpy(&msub_hdr, msg+msgLoc, sizeof(msub_hdr)); msgLoc += sizeof(msub_hdr);
+    if ( ( msub_hdr.mask < 0 ) || ( msub_hdr.mask > SLOWER_MAX_SUB_MASK ) ) {
+      return -1;
+    }
+    *mask = msub_hdr.mask;
+  }
     break;
 
   case SlowerMsgAck:
     assert( msgLoc == msgLen );
     break;
 
+  case SlowerMsgAckBatch:
+  case SlowerMsgFetch: {
+    MsgAckBatchHeader mack_hdr;
+    if ( msgLen - msgLoc < (int)sizeof(mack_hdr) ) {
+      return -1;
+    }
+    memcpy(&mack_hdr, msg+msgLoc, sizeof(mack_hdr)); msgLoc += sizeof(mack_hdr);
+
+    const int rangesLen = mack_hdr.numRanges * sizeof(MsgAckRange);
+    if ( ( msgLen - msgLoc != rangesLen ) || ( bufSize < rangesLen ) ) {
+      return -1;
+    }
+    memcpy( buf, msg+msgLoc, rangesLen ); msgLoc += rangesLen;
+    *bufLen = rangesLen;
+  }
+    break;
+
+  case SlowerMsgSync: {
+    MsgSyncHeader msync_hdr;
+    if ( msgLen - msgLoc < (int)sizeof(msync_hdr) ) {
+      return -1;
+    }
+    memcpy(&msync_hdr, msg+msgLoc, sizeof(msync_hdr)); msgLoc += sizeof(msync_hdr);
+
+    // each range says how many names follow it
+    int bodyLen = 0;
+    for ( int r = 0; r < msync_hdr.numRanges; r++ ) {
+      MsgSyncRange range;
+      if ( msgLen - msgLoc - bodyLen < (int)sizeof(range) ) {
+        return -1;
+      }
+      memcpy(&range, msg+msgLoc+bodyLen, sizeof(range)); bodyLen += sizeof(range);
+      bodyLen += range.numNames * sizeof(MsgShortName);
+    }
+    if ( ( msgLen - msgLoc != bodyLen ) || ( bufSize < bodyLen ) ) {
+      return -1;
+    }
+    memcpy( buf, msg+msgLoc, bodyLen ); msgLoc += bodyLen;
+    *bufLen = bodyLen;
+  }
+    break;
+
   default:
     return -1;
   }
@@ -388,6 +848,17 @@ int slowerRecvMulti(SlowerConnection& slower, MsgHeader *msgHeader, SlowerRemote
   return 0;
 }
 
+bool slowerTraceHop( MsgHeaderMetrics& metrics, uint32_t relayID, uint64_t timeMicros ) {
+  if ( metrics.num_hops >= SLOWER_MAX_TRACE_HOPS ) {
+    return false;
+  }
+  metrics.hops[ metrics.num_hops ].relay_id = relayID;
+  metrics.hops[ metrics.num_hops ].time_micros = timeMicros;
+  metrics.num_hops++;
+  return true;
+}
+
+
 int slowerRecvAck(SlowerConnection& slower, MsgShortName* name ){
   assert( name );
 
@@ -415,7 +886,8 @@ int slowerRecvAck(SlowerConnection& slower, MsgShortName* name ){
 }
 
 
-int slowerRecvPub(SlowerConnection& slower, MsgHeader* msgHeader, char buf[], int bufSize, int* bufLen, MsgHeaderMetrics *metrics ){
+int slowerRecvPub(SlowerConnection& slower, MsgHeader* msgHeader, char buf[], int bufSize, int* bufLen, MsgHeaderMetrics *metrics,
+                  uint64_t* rxMicros ){
   assert( msgHeader );
   assert( bufLen );
   assert( bufSize > 0 );
@@ -423,7 +895,7 @@ int slowerRecvPub(SlowerConnection& slower, MsgHeader* msgHeader, char buf[], in
   SlowerRemote remote;
   int mask;
   
-  int err = slowerRecvMulti( slower,msgHeader, &remote, &mask, buf, bufSize, bufLen, metrics );
+  int err = slowerRecvMulti( slower,msgHeader, &remote, &mask, buf, bufSize, bufLen, metrics, rxMicros );
   if ( err != 0 ) {
     return err;
   }
@@ -455,10 +927,78 @@ int slowerAck(SlowerConnection& slower, const MsgShortName& name, SlowerRemote*
   return err;
 }
 
+// Batched acks and fetches are both a name and a list of msg id ranges
+static int slowerSendRanges(SlowerConnection& slower, int8_t type, const MsgShortName& name,
+                            const MsgAckRange ranges[], int numRanges, SlowerRemote* remote ){
+  assert( slower.fd > 0 );
+  assert( numRanges > 0 );
+  assert( numRanges <= SLOWER_MAX_ACK_RANGES );
+
+  char msg[slowerMTU];
+  int msgLen=0;
+
+  MsgHeader mhdr = {0};
+  mhdr.type = type;
+  mhdr.name = name;
+  mhdr.name.spec.msg_id = 0;
+
+  memcpy( msg+msgLen, &mhdr, sizeof(mhdr) ) ; msgLen += sizeof(mhdr);
+
+  MsgAckBatchHeader mack_hdr;
+  mack_hdr.numRanges = numRanges;
+  memcpy( msg+msgLen, &mack_hdr, sizeof(mack_hdr) ) ; msgLen += sizeof(mack_hdr);
+
+  assert( msgLen + numRanges * sizeof(MsgAckRange) < sizeof( msg ) );
+  memcpy( msg+msgLen, ranges, numRanges * sizeof(MsgAckRange) ) ; msgLen += numRanges * sizeof(MsgAckRange);
+
+  int err = slowerSend( slower, msg, msgLen, remote );
+  return err;
+}
+
+int slowerAckBatch(SlowerConnection& slower, const MsgShortName& name, const MsgAckRange ranges[], int numRanges,
+                   SlowerRemote* remote ){
+  return slowerSendRanges( slower, SlowerMsgAckBatch, name, ranges, numRanges, remote );
+}
+
+int slowerFetch(SlowerConnection& slower, const MsgShortName& name, const MsgAckRange ranges[], int numRanges,
+                SlowerRemote* remote ){
+  static_assert( sizeof( MsgFetchHeader ) == sizeof( MsgAckBatchHeader ), "fetch and batched ack share a layout" );
+  return slowerSendRanges( slower, SlowerMsgFetch, name, ranges, numRanges, remote );
+}
+
+
+int slowerSync(SlowerConnection& slower, const MsgSyncRange ranges[], int numRanges, const MsgShortName names[],
+               SlowerRemote* remote ){
+  assert( slower.fd > 0 );
+  assert( ( numRanges > 0 ) && ( numRanges <= 255 ) );
+
+  char msg[slowerMTU];
+  int msgLen=0;
+
+  MsgHeader mhdr = {0};
+  mhdr.type = SlowerMsgSync;
+  memcpy( msg+msgLen, &mhdr, sizeof(mhdr) ) ; msgLen += sizeof(mhdr);
+
+  MsgSyncHeader msync_hdr;
+  msync_hdr.numRanges = numRanges;
+  memcpy( msg+msgLen, &msync_hdr, sizeof(msync_hdr) ) ; msgLen += sizeof(msync_hdr);
+
+  for ( int r = 0; r < numRanges; r++ ) {
+    const int namesLen = ranges[r].numNames * sizeof(MsgShortName);
+    assert( msgLen + sizeof(MsgSyncRange) + namesLen <= sizeof( msg ) );
+    memcpy( msg+msgLen, &ranges[r], sizeof(MsgSyncRange) ) ; msgLen += sizeof(MsgSyncRange);
+    memcpy( msg+msgLen, names, namesLen ) ; msgLen += namesLen;
+    names += ranges[r].numNames;
+  }
+
+  int err = slowerSend( slower, msg, msgLen, remote );
+  return err;
+}
+
 int slowerSub(SlowerConnection& slower, const MsgShortName& name, int mask , SlowerRemote* remote ){
   assert( slower.fd > 0 );
   assert( mask >= 0 );
-  assert( mask < 128 ); 
+  assert( mask <= SLOWER_MAX_SUB_MASK ); 
   
   char msg[slowerMTU];
   int msgLen=0;
@@ -478,6 +1018,10 @@ int slowerSub(SlowerConnection& slower, const MsgShortName& name, int mask , Slo
 
   memcpy( msg+msgLen, &msub_hdr, sizeof(msub_hdr) ) ; msgLen += sizeof(msub_hdr);
 
+  if ( slower.subCookie && ( ( remote == NULL ) || ( *remote == slower.relay ) ) ) {
+    memcpy( msg+msgLen, &slower.subCookie, sizeof(slower.subCookie) ) ; msgLen += sizeof(slower.subCookie);
+  }
+
   assert( msgLen < sizeof( msg ) );
           
   int err = slowerSend( slower, msg, msgLen, remote );
@@ -485,10 +1029,33 @@ int slowerSub(SlowerConnection& slower, const MsgShortName& name, int mask , Slo
 }
 
 
+int slowerSubCookie(SlowerConnection& slower, const MsgShortName& name, int mask, uint64_t cookie,
+                    SlowerRemote* remote ){
+  assert( slower.fd > 0 );
+  assert( remote );
+
+  char msg[slowerMTU];
+  int msgLen=0;
+
+  MsgHeader mhdr = {0};
+  mhdr.type = SlowerMsgSubCookie;
+  mhdr.name = name;
+  memcpy( msg+msgLen, &mhdr, sizeof(mhdr) ) ; msgLen += sizeof(mhdr);
+
+  MsgSubCookieHeader mcookie_hdr;
+  mcookie_hdr.mask = mask;
+  mcookie_hdr.cookie = cookie;
+  memcpy( msg+msgLen, &mcookie_hdr, sizeof(mcookie_hdr) ) ; msgLen += sizeof(mcookie_hdr);
+
+  int err = slowerSend( slower, msg, msgLen, remote );
+  return err;
+}
+
+
 int slowerUnSub(SlowerConnection& slower, const MsgShortName& name, int mask , SlowerRemote* remote  ) {
   assert( slower.fd > 0 );
   assert( mask >= 0 );
-  assert( mask < 128 ); 
+  assert( mask <= SLOWER_MAX_SUB_MASK ); 
   
   char msg[slowerMTU];
   int msgLen=0;
@@ -504,7 +1071,7 @@ int slowerUnSub(SlowerConnection& slower, const MsgShortName& name, int mask , S
   MsgSubHeader msub_hdr;
   msub_hdr.mask = mask;
 
-  assert(sizeof(msg) < msgLen + sizeof(msub_hdr));
+  assert(msgLen + sizeof(msub_hdr) < sizeof (msg));
 
   memcpy( msg+msgLen, &msub_hdr, sizeof(msub_hdr) ) ; msgLen += sizeof(msub_hdr);
 
@@ -518,6 +1085,7 @@ int slowerUnSub(SlowerConnection& slower, const MsgShortName& name, int mask , S
 
 int slowerClose( SlowerConnection& slower ){
   close( slower.fd ); slower.fd=0;
+  delete slower.bundle; slower.bundle=NULL;
   bzero( & slower.relay, sizeof( slower.relay ) );
   
   return 0;
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include <ipcPipe.h>
+
+// Ping-pong round trip latency between two processes over a FIFO and over the shared memory
+// transport, with the same open/read/write pattern the endpoint processes use.
+
+static const char pingPath[] = "/tmp/ipcBench-ping";
+static const char pongPath[] = "/tmp/ipcBench-pong";
+
+static void readFull( IpcPipe& pipe, uint8_t* buf, size_t len ) {
+  size_t got = 0;
+  while ( got < len ) {
+    ssize_t n = pipe.read( buf + got, len - got );
+    assert( n > 0 );
+    got += n;
+  }
+}
+
+static void runPong( IpcTransport transport, int iterations, size_t msgSize ) {
+  IpcPipe ping;
+  IpcPipe pong;
+  int err = ping.openRead( pingPath, transport );
+  assert( err == 0 );
+  err = pong.openWrite( pongPath, transport );
+  assert( err == 0 );
+
+  std::vector<uint8_t> buf( msgSize );
+  for ( int i = 0; i < iterations; i++ ) {
+    readFull( ping, buf.data(), msgSize );
+    ssize_t n = pong.write( buf.data(), msgSize );
+    assert( n == (ssize_t)msgSize );
+  }
+}
+
+static void runPing( const char* label, IpcTransport transport, int warmup, int iterations, size_t msgSize ) {
+  if ( transport == IpcTransport::fifo ) {
+    unlink( pingPath );
+    unlink( pongPath );
+    int err = mkfifo( pingPath, 0600 );
+    assert( err == 0 );
+    err = mkfifo( pongPath, 0600 );
+    assert( err == 0 );
+  }
+
+  pid_t pid = fork();
+  assert( pid >= 0 );
+  if ( pid == 0 ) {
+    runPong( transport, warmup + iterations, msgSize );
+    exit( 0 );
+  }
+
+  IpcPipe ping;
+  IpcPipe pong;
+  int err = ping.openWrite( pingPath, transport );
+  assert( err == 0 );
+  err = pong.openRead( pongPath, transport );
+  assert( err == 0 );
+
+  std::vector<uint8_t> buf( msgSize, 0x55 );
+  std::vector<double> rttUs;
+  rttUs.reserve( iterations );
+
+  for ( int i = 0; i < warmup + iterations; i++ ) {
+    auto start = std::chrono::steady_clock::now();
+    ssize_t n = ping.write( buf.data(), msgSize );
+    assert( n == (ssize_t)msgSize );
+    readFull( pong, buf.data(), msgSize );
+    auto end = std::chrono::steady_clock::now();
+
+    if ( i >= warmup ) {
+      rttUs.push_back( std::chrono::duration<double, std::micro>( end - start ).count() );
+    }
+  }
+
+  waitpid( pid, NULL, 0 );
+  if ( transport == IpcTransport::fifo ) {
+    unlink( pingPath );
+    unlink( pongPath );
+  }
+
+  std::sort( rttUs.begin(), rttUs.end() );
+  double sum = 0;
+  for ( double t : rttUs ) {
+    sum += t;
+  }
+
+  std::cout << std::left << std::setw( 6 ) << label << std::right << std::fixed << std::setprecision( 2 )
+            << " rtt us: mean " << std::setw( 8 ) << sum / rttUs.size()
+            << "  p50 " << std::setw( 8 ) << rttUs[ rttUs.size() / 2 ]
+            << "  p99 " << std::setw( 8 ) << rttUs[ rttUs.size() * 99 / 100 ]
+            << "  max " << std::setw( 9 ) << rttUs.back()
+            << std::endl;
+}
+
+int main( int argc, char* argv[] ) {
+  int iterations = 100000;
+  size_t msgSize = 64;
+  if ( argc > 1 ) {
+    iterations = atoi( argv[1] );
+  }
+  if ( argc > 2 ) {
+    msgSize = atoi( argv[2] );
+  }
+  if ( ( iterations <= 0 ) || ( msgSize == 0 ) ) {
+    std::cerr << "Usage: ipcBench [iterations] [msgSize]" << std::endl;
+    exit( -1 );
+  }
+
+  std::cout << "ping-pong " << iterations << " round trips of " << msgSize << " bytes" << std::endl;
+
+  const int warmup = std::min( 1000, iterations );
+  runPing( "fifo", IpcTransport::fifo, warmup, iterations, msgSize );
+  runPing( "shm", IpcTransport::shm, warmup, iterations, msgSize );
+
+  return 0;
+}
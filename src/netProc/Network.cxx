@@ -3,15 +3,16 @@
 #include <string>
 #include <sstream>
 #include <iomanip>
-#include <thread>
+#include <chrono>
 
 #include "names.h"
 
 ///
 ///  Utility
 ///
+template<typename Bytes>
 static std::string
-to_hex(const quicr::bytes& data)
+to_hex(const Bytes& data)
 {
     std::stringstream hex(std::ios_base::out);
     hex.flags(std::ios::hex);
@@ -21,22 +22,97 @@ to_hex(const quicr::bytes& data)
     return hex.str();
 }
 
-Network::Network(const std::string& server_ip, const uint16_t port)
-  : qr_client(delegate, server_ip, port)
+Network::Network(const std::string& server_ip, const uint16_t port,
+                 const std::string& publish_journal)
+  : transport_start(std::chrono::steady_clock::now()),
+    publish_queue(publish_journal),
+    qr_client(delegate, server_ip, port)
 {
-    while(!qr_client.is_transport_ready()) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+bool Network::check_transport_ready()
+{
+    if (transport_ready) {
+        return true;
+    }
+    if (!qr_client.is_transport_ready()) {
+        return false;
     }
 
-    std::cout << "Transport is ready" << std::endl;
+    transport_ready = true;
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - transport_start);
+    std::cout << "[Network]: Transport is ready after " << elapsed.count() << " ms, flushing "
+              << pending_subscribes.size() << " subscribes and "
+              << publish_queue.size() << " publishes" << std::endl;
+
+    if (!pending_subscribes.empty()) {
+        subscribe(std::move(pending_subscribes));
+        pending_subscribes.clear();
+    }
+    service_publish_queue();
+
+    return true;
 }
 
 void Network::check_network_messages(std::vector<QuicrMessageInfo>& messages_out)
 {
-    return delegate.get_queued_messages(messages_out);
+    auto received = std::vector<QuicrMessageInfo>{};
+    delegate.get_queued_messages(received);
+    for (auto& message : received) {
+        if (!gap_tracker.received(message.name, message.object_id)) {
+            std::cout << "[Network]: Dropping duplicate " << message.name
+                      << " object " << message.object_id << std::endl;
+            continue;
+        }
+        messages_out.push_back(std::move(message));
+    }
 }
 
-void Network::publish(uint32_t team_id, uint32_t channel_id, uint16_t device_id, quicr::bytes&& data)
+void Network::repair_gaps()
+{
+    if (!transport_ready) {
+        return;
+    }
+
+    // The quicr client has no fetch by object id, so a name with missing objects is
+    // subscribed again and the relay replays what it has cached for it. The gap tracker
+    // drops the objects that were already received.
+    auto names = gap_tracker.due_repairs();
+    if (names.empty()) {
+        return;
+    }
+    std::cout << "[Network]: Repairing " << gap_tracker.missing() << " missing objects on "
+              << names.size() << " names" << std::endl;
+    qr_client.subscribe(names, true, true);
+}
+
+void Network::service_publish_queue()
+{
+    if (!transport_ready) {
+        // publishes wait in the queue until the transport is up
+        return;
+    }
+
+    auto published = std::vector<std::string>{};
+    delegate.get_published_names(published);
+    for (const auto& name : published) {
+        publish_queue.confirm(name);
+    }
+
+    publish_queue.service([this](const std::string& name, quicr::bytes&& data) {
+        if(!publisher_registration_status.count(name)) {
+            qr_client.register_names({name}, true);
+            publisher_registration_status[name] = true;
+        }
+
+        std::cout << "publishing :" << to_hex(data) << std::endl;
+        // the queue made these bytes for quicr when the message was pushed, hand them over
+        qr_client.publish_named_data(name, std::move(data), 1, 0);
+    });
+}
+
+void Network::publish(uint32_t team_id, uint32_t channel_id, uint16_t device_id, BufferSlice&& data)
 {
     auto qname = QuicrName::name_for_device(std::to_string(team_id),
                                          std::to_string(channel_id),
@@ -87,7 +163,7 @@ void Network::subscribe_for_keypackage(uint32_t team_id, quicr::bytes&& kp_hash)
 // event handlers
 
 
-void Network::handleKeyPackageEvent(EventSource source, const uint32_t team_id, quicr::bytes&& key_package,
+void Network::handleKeyPackageEvent(EventSource source, const uint32_t team_id, BufferSlice&& key_package,
                                     quicr::bytes&& key_package_hash)
 {
     if(source == EventSource::SecProc) {
@@ -103,7 +179,7 @@ void Network::handleKeyPackageEvent(EventSource source, const uint32_t team_id,
     }
 }
 
-void Network::handleMLSWelcomeEvent(EventSource source, const uint32_t team_id, quicr::bytes&& welcome)
+void Network::handleMLSWelcomeEvent(EventSource source, const uint32_t team_id, BufferSlice&& welcome)
 {
     if(source == EventSource::SecProc) {
         // publish the event
@@ -118,7 +194,7 @@ void Network::handleMLSWelcomeEvent(EventSource source, const uint32_t team_id,
     }
 }
 
-void Network::handleMLSCommitEvent(EventSource source, const uint32_t team_id, quicr::bytes&& commit)
+void Network::handleMLSCommitEvent(EventSource source, const uint32_t team_id, BufferSlice&& commit)
 {
     if(source == EventSource::SecProc) {
 
@@ -132,19 +208,19 @@ void Network::handleMLSCommitEvent(EventSource source, const uint32_t team_id, q
 /// Private API
 ///
 
-void Network::publish(std::string&& name, quicr::bytes&& data)
+void Network::publish(std::string&& name, BufferSlice&& data)
 {
-    if(!publisher_registration_status.count(name)) {
-        qr_client.register_names({name}, true);
-        publisher_registration_status[name] = true;
-    }
-
-    std::cout << "publishing :" << to_hex(data) << std::endl;
-    qr_client.publish_named_data(name, std::move(data), 1, 0);
+    // queue it until quicr reports it published, sending now if the window allows
+    publish_queue.push(name, std::move(data));
+    service_publish_queue();
 }
 
 void Network::subscribe(std::vector<std::string>&& names)
 {
+    if (!transport_ready) {
+        pending_subscribes.insert(pending_subscribes.end(), names.begin(), names.end());
+        return;
+    }
 
     // todo: apply set_intersection??
     auto qnames = std::move(names);
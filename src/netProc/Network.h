@@ -1,4 +1,5 @@
 #pragma once
+#include <chrono>
 #include <map>
 #include <queue>
 #include <set>
@@ -7,6 +8,8 @@
 
 #include <quicr/quicr_client.h>
 #include "message_loop.h"
+#include "publish_queue.h"
+#include "gap_tracker.h"
 
 struct QuicrMessageProcessor {
     virtual void on_quicr_message(const std::string& name, quicr::bytes&& message, std::uint64_t object_id) = 0;
@@ -39,6 +42,8 @@ struct QuicrDelegate: public quicr::QuicRClient::Delegate {
                                      uint64_t group_id,
                                      uint64_t object_id) override
     {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        published_queue.push(name);
     }
 
     virtual void log(quicr::LogLevel level, const std::string& message) override {
@@ -60,9 +65,20 @@ struct QuicrDelegate: public quicr::QuicRClient::Delegate {
         }
     }
 
+    void get_published_names(std::vector<std::string>& names_out)
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        while (!published_queue.empty())
+        {
+            names_out.push_back(std::move(published_queue.front()));
+            published_queue.pop();
+        }
+    }
+
 private:
   std::mutex queue_mutex;
   std::queue<QuicrMessageInfo> receive_queue;
+  std::queue<std::string> published_queue;
 };
 
 
@@ -70,31 +86,46 @@ private:
 // in the Qmsg Flow
 struct Network
 {
-  explicit Network(const std::string& server_ip, const uint16_t port);
+  explicit Network(const std::string& server_ip, const uint16_t port,
+                   const std::string& publish_journal = "");
   ~Network() = default;
 
   // public api
-  void publish(uint32_t team_id, uint32_t channel_id, uint16_t device_id, quicr::bytes&& data);
+  void publish(uint32_t team_id, uint32_t channel_id, uint16_t device_id, BufferSlice&& data);
   void subscribe_to_devices(uint32_t team_id, uint32_t channel_id, std::vector<uint16_t>&& devices);
 
   void unsubscribe_from_device(uint32_t team_id, uint32_t channel_id, uint16_t device_id);
   void subscribe_for_keypackage(uint32_t team_id, quicr::bytes&& kp_hash);
 
   // event handlers
-  void handleKeyPackageEvent(EventSource source, const uint32_t team_id, quicr::bytes&& key_package, quicr::bytes&& key_package_hash);
-  void handleMLSWelcomeEvent(EventSource source, const uint32_t team_id, quicr::bytes&& welcome);
-  void handleMLSCommitEvent(EventSource source, const uint32_t team_id, quicr::bytes&& commit);
+  void handleKeyPackageEvent(EventSource source, const uint32_t team_id, BufferSlice&& key_package, quicr::bytes&& key_package_hash);
+  void handleMLSWelcomeEvent(EventSource source, const uint32_t team_id, BufferSlice&& welcome);
+  void handleMLSCommitEvent(EventSource source, const uint32_t team_id, BufferSlice&& commit);
 
   // special function
+  // duplicates of objects already received are left out
   void check_network_messages(std::vector<QuicrMessageInfo>& messages_out);
+  void service_publish_queue();
+  // ask again for names with lost objects
+  void repair_gaps();
+
+  // transport comes up in the background, call from the loop until it returns true
+  bool check_transport_ready();
+  bool is_transport_ready() const { return transport_ready; }
 private:
 
-  void publish(std::string&& name, quicr::bytes&& data);
+  void publish(std::string&& name, BufferSlice&& data);
   void subscribe(std::vector<std::string>&& names);
 
   std::map<uint32_t, std::string> keypackage_hashes;
   std::map <std::string, bool> publisher_registration_status;
   std::set<std::string> subscribers;
+  // subscribes requested before the transport was ready
+  std::vector<std::string> pending_subscribes;
+  bool transport_ready = false;
+  std::chrono::steady_clock::time_point transport_start;
+  PublishQueue publish_queue;
+  GapTracker gap_tracker;
   QuicrDelegate delegate;
   quicr::QuicRClient qr_client;
 };
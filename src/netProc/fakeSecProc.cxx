@@ -21,22 +21,22 @@
 struct FakeSecProcess
 {
     QMsgEncoderContext *context;
-    int sec2netFD = -1;
-    int net2secFD = -1;
+    IpcPipe sec2net;
+    IpcPipe net2sec;
     bool is_leader = false;
 
     FakeSecProcess(const std::string& user)
     {
         std::string pipe_name = std::string("/tmp/pipe-s2n-") + user;
         fprintf(stderr, "Checkin for pipe to netProc : %s\n", pipe_name.c_str());
-        net2secFD = open( pipe_name.c_str(), O_WRONLY, O_NONBLOCK );
-        assert( net2secFD >= 0 );
+        int err = net2sec.openWrite(pipe_name);
+        assert( err == 0 );
         fprintf(stderr, "Got pipe to netProc : %s\n", pipe_name.c_str());
 
         pipe_name = std::string("/tmp/pipe-n2s-") + user;
         fprintf(stderr, "Checking for  pipe from Fake secProc %s\n", pipe_name.c_str());
-        sec2netFD = open( pipe_name.c_str(), O_RDONLY, O_NONBLOCK );
-        assert( sec2netFD >= 0 );
+        err = sec2net.openRead(pipe_name);
+        assert( err == 0 );
         fprintf(stderr, "Got pipe from Fake secProc %s\n", pipe_name.c_str());
 
         if (QMsgEncoderInit(&context))
@@ -70,7 +70,7 @@ struct FakeSecProcess
         assert(encode_result == QMsgEncoderSuccess);
         std::cerr << "Sending KP Hash message" << std::endl;
         // write to the pipe
-        write(net2secFD, data_buffer, encoded_length);
+        net2sec.write(data_buffer, encoded_length);
     }
 
     void send_key_package() {
@@ -107,7 +107,7 @@ struct FakeSecProcess
         assert(encode_result == QMsgEncoderSuccess);
         std::cerr << "Sending KP  message" << std::endl;
         // write to the pipe
-        write(net2secFD, data_buffer, encoded_length);
+        net2sec.write(data_buffer, encoded_length);
     }
 
     void send_watch(uint32_t team, uint32_t channel, uint16_t device) {
@@ -129,7 +129,7 @@ struct FakeSecProcess
                                            sizeof(data_buffer),
                                            &encoded_length);
 
-        write(net2secFD, data_buffer, encoded_length);
+        net2sec.write(data_buffer, encoded_length);
     }
 
 
@@ -159,10 +159,10 @@ struct FakeSecProcess
                                           &encoded_length);
         assert(result == QMsgEncoderSuccess);
         std::cout << "Encoded Text Message Length:" << encoded_length << std::endl;
-        write(net2secFD, data_buffer, encoded_length);
+        net2sec.write(data_buffer, encoded_length);
     }
 
-    bool process_net_message(QMsgNetMessage& message, EventSource source, quicr::bytes&& message_raw)
+    bool process_net_message(QMsgNetMessage& message, EventSource source, BufferSlice&& message_raw)
     {
         switch (message.type)
         {
@@ -248,7 +248,7 @@ int main( int argc, char* argv[]){
 
 
   auto message_loop = MessageLoop{};
-  message_loop.read_from_fd = secProc.sec2netFD;
+  message_loop.read_from = &secProc.sec2net;
   message_loop.keep_processing = true;
   message_loop.process_net_message_fn = std::bind(&FakeSecProcess::process_net_message,
                                                     &secProc,
@@ -0,0 +1,103 @@
+#include "gap_tracker.h"
+
+GapTracker::GapTracker(std::chrono::milliseconds reorder_delay_in,
+                       std::chrono::milliseconds retry_interval_in,
+                       int max_tries_in, uint64_t max_gap_in)
+  : reorder_delay(reorder_delay_in),
+    retry_interval(retry_interval_in),
+    max_tries(max_tries_in),
+    max_gap(max_gap_in)
+{
+}
+
+void GapTracker::add_missing(Stream& stream, uint64_t first, uint64_t last, clock::time_point now)
+{
+    if (first > last) {
+        return;
+    }
+    for (auto id = first; id <= last; id++) {
+        stream.missing[id] = Missing{now + reorder_delay, 0};
+    }
+}
+
+void GapTracker::restart(Stream& stream, uint64_t object_id)
+{
+    stream.lowest = object_id;
+    stream.highest = object_id;
+    stream.missing.clear();
+}
+
+bool GapTracker::received(const std::string& name, uint64_t object_id, clock::time_point now)
+{
+    auto it = streams.find(name);
+    if (it == streams.end()) {
+        restart(streams[name], object_id);
+        return true;
+    }
+    auto& stream = it->second;
+
+    // a big jump is a restart of the publisher rather than loss, and the ids jumped over
+    // must not be left between lowest and highest where they would look received
+    if ((object_id > stream.highest && object_id - stream.highest > max_gap) ||
+        (object_id < stream.lowest && stream.lowest - object_id > max_gap)) {
+        restart(stream, object_id);
+        return true;
+    }
+
+    if (object_id > stream.highest) {
+        add_missing(stream, stream.highest + 1, object_id - 1, now);
+        stream.highest = object_id;
+        return true;
+    }
+    if (object_id < stream.lowest) {
+        // older history replayed from the relay cache
+        add_missing(stream, object_id + 1, stream.lowest - 1, now);
+        stream.lowest = object_id;
+        return true;
+    }
+
+    auto missing = stream.missing.find(object_id);
+    if (missing == stream.missing.end()) {
+        return false;
+    }
+    stream.missing.erase(missing);
+    num_repaired++;
+    return true;
+}
+
+std::vector<std::string> GapTracker::due_repairs(clock::time_point now)
+{
+    auto names = std::vector<std::string>{};
+    for (auto& [name, stream] : streams) {
+        bool due = false;
+        for (auto it = stream.missing.begin(); it != stream.missing.end();) {
+            auto& missing = it->second;
+            if (now < missing.due) {
+                ++it;
+                continue;
+            }
+            if (missing.tries >= max_tries) {
+                num_lost++;
+                it = stream.missing.erase(it);
+                continue;
+            }
+            missing.tries++;
+            missing.due = now + retry_interval;
+            due = true;
+            ++it;
+        }
+        if (due) {
+            names.push_back(name);
+        }
+    }
+    return names;
+}
+
+size_t GapTracker::missing() const
+{
+    size_t n = 0;
+    for (const auto& [name, stream] : streams) {
+        n += stream.missing.size();
+    }
+    return n;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+///
+/// Tracks the object ids received on each subscribed name to find losses.
+///
+/// The first object on a name sets where it starts, after that any object id
+/// skipped over is missing. A jump of more than max_gap ids either way is a
+/// restart of the publisher, and the name starts over at the new id. Names
+/// with ids missing for longer than the reorder delay are handed out by
+/// due_repairs() so the caller can ask for them again in one batch, and again
+/// every retry interval until they arrive or max_tries is reached. Objects that were already received are reported
+/// as duplicates so repairs that race the original are not processed twice.
+///
+struct GapTracker
+{
+    using clock = std::chrono::steady_clock;
+
+    explicit GapTracker(std::chrono::milliseconds reorder_delay = std::chrono::milliseconds(20),
+                        std::chrono::milliseconds retry_interval = std::chrono::milliseconds(200),
+                        int max_tries = 3, uint64_t max_gap = 256);
+
+    // false if the object was already received
+    bool received(const std::string& name, uint64_t object_id, clock::time_point now = clock::now());
+
+    // names with missing objects due to be asked for again
+    std::vector<std::string> due_repairs(clock::time_point now = clock::now());
+
+    size_t missing() const;
+    uint64_t repaired() const { return num_repaired; }
+    uint64_t lost() const { return num_lost; }
+
+private:
+    struct Missing {
+        clock::time_point due;
+        int tries = 0;
+    };
+    struct Stream {
+        uint64_t lowest = 0;
+        uint64_t highest = 0;
+        std::map<uint64_t, Missing> missing;
+    };
+
+    void add_missing(Stream& stream, uint64_t first, uint64_t last, clock::time_point now);
+    static void restart(Stream& stream, uint64_t object_id);
+
+    std::map<std::string, Stream> streams;
+    const std::chrono::milliseconds reorder_delay;
+    const std::chrono::milliseconds retry_interval;
+    const int max_tries;
+    const uint64_t max_gap;
+    uint64_t num_repaired = 0;
+    uint64_t num_lost = 0;
+};
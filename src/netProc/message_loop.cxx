@@ -7,15 +7,17 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include <iostream>
+#include <memory>
 #include <vector>
 
 #include "message_loop.h"
 
 LoopProcessResult MessageLoop::process(uint16_t read_buffer_size_in)
 {
-    if (read_from_fd == -1) {
+    if (read_from == nullptr || read_from->getFD() == -1) {
         return  LoopProcessResult::INVALID_ARGS;
     }
+    const int read_from_fd = read_from->getFD();
 
     std::cout << "Running Message Loop\n";
 
@@ -24,7 +26,10 @@ LoopProcessResult MessageLoop::process(uint16_t read_buffer_size_in)
         buffer_size = read_buffer_size;
     }
 
-    uint8_t* read_buffer = (uint8_t *) malloc(buffer_size);
+    // Messages are handed on as slices of the read buffer, so it is only reused once nothing
+    // refers to it any more. Whatever keeps a slice past this iteration, like the publish
+    // queue, copies it out so the buffer is normally free again by the next read.
+    auto read_buffer = std::make_shared<std::vector<uint8_t>>(buffer_size);
 
     size_t fragment_size = 0;
     QMsgEncoderResult qmsg_enc_result;
@@ -38,6 +43,7 @@ LoopProcessResult MessageLoop::process(uint16_t read_buffer_size_in)
         // log an error and...
         return LoopProcessResult::ENCODER_ERROR;
     }
+    QMsgEncoderSetDecodeInPlace(context, 1);
 
     while(keep_processing)
     {
@@ -45,6 +51,10 @@ LoopProcessResult MessageLoop::process(uint16_t read_buffer_size_in)
         struct timeval timeout;
         timeout.tv_sec = 1;
         timeout.tv_usec = 0;
+        if (poll_soon_fn && poll_soon_fn()) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 10 * 1000;
+        }
         fd_set fdSet;
         int maxFD=0;
 
@@ -58,9 +68,8 @@ LoopProcessResult MessageLoop::process(uint16_t read_buffer_size_in)
         // process messages
         if ((read_from_fd > 0) && (FD_ISSET(read_from_fd, &fdSet)))
         {
-            ssize_t num = read(read_from_fd,
-                               read_buffer + fragment_size,
-                               buffer_size - fragment_size);
+            ssize_t num = read_from->read(read_buffer->data() + fragment_size,
+                                          buffer_size - fragment_size);
 
             std::cout << "[MessageLoop]: Read " << num << " bytes\n";
 
@@ -77,7 +86,8 @@ LoopProcessResult MessageLoop::process(uint16_t read_buffer_size_in)
             do
             {
                 consumed = 0;
-                auto message_ptr = read_buffer + total_consumed;
+                auto message_offset = total_consumed;
+                auto message_ptr = read_buffer->data() + message_offset;
                 qmsg_enc_result = QMsgNetDecodeMessage(context,
                                                        message_ptr,
                                                        num - total_consumed,
@@ -89,7 +99,7 @@ LoopProcessResult MessageLoop::process(uint16_t read_buffer_size_in)
                 if (qmsg_enc_result == QMsgEncoderSuccess)
                 {
                     if(process_net_message_fn != nullptr) {
-                        auto message_raw = quicr::bytes(message_ptr, message_ptr + consumed);
+                        auto message_raw = BufferSlice(read_buffer, message_offset, consumed);
                         std::cout << "Calling Process for net message:" << std::endl;
                         bool result = process_net_message_fn(message, EventSource::SecProc, std::move(message_raw));
                         // log the result
@@ -109,10 +119,21 @@ LoopProcessResult MessageLoop::process(uint16_t read_buffer_size_in)
             // and take note of the new fragment size
             if (total_consumed < num)
             {
-                memmove(read_buffer, read_buffer + total_consumed, num - total_consumed);
                 fragment_size = num - total_consumed;
             }
 
+            if (read_buffer.use_count() > 1)
+            {
+                // Messages still refer to this buffer, carry the fragment over to a fresh one
+                auto fresh_buffer = std::make_shared<std::vector<uint8_t>>(buffer_size);
+                memcpy(fresh_buffer->data(), read_buffer->data() + total_consumed, fragment_size);
+                read_buffer = std::move(fresh_buffer);
+            }
+            else if (fragment_size > 0)
+            {
+                memmove(read_buffer->data(), read_buffer->data() + total_consumed, fragment_size);
+            }
+
         }
 
         // carryout any loop related functions to carry out
@@ -3,6 +3,8 @@
 #include "qmsg/net_types.h"
 
 #include <functional>
+#include <bufferSlice.h>
+#include <ipcPipe.h>
 #include <quicr/quicr_client.h>
 
 enum struct LoopProcessResult {
@@ -23,12 +25,18 @@ struct MessageLoop {
     LoopProcessResult process(uint16_t read_buffer_size_in);
     QMsgEncoderResult decode();
 
-    std::function<bool (QMsgNetMessage&, EventSource, quicr::bytes&& )> process_net_message_fn = nullptr;
+    // the message is decoded in place and only valid for the call, the raw slice shares the read
+    // buffer and can be kept for as long as needed
+    std::function<bool (QMsgNetMessage&, EventSource, BufferSlice&& )> process_net_message_fn = nullptr;
     // generic loop fn to do other things than QMesg Parsing
     std::function<void ()> loop_fn = nullptr;
+    // work waiting on something other than the pipe, such as output the peer has not drained
+    // yet or the transport coming up, poll again soon instead of the idle timeout
+    std::function<bool ()> poll_soon_fn = nullptr;
 
 
     bool keep_processing = true;
-    int read_from_fd = -1;
+    // pipe from the peer process, FIFO or shared memory as opened by the caller
+    IpcPipe* read_from = nullptr;
     const uint16_t read_buffer_size = 8192;
 };
\ No newline at end of file
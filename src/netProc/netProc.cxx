@@ -7,39 +7,46 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <ipcWriteStage.h>
 #include "Network.h"
 #include "message_loop.h"
 
 // Handy abstraction to store pipes and so on
 struct NetworkProcess
 {
-    explicit NetworkProcess(const std::string& server, uint16_t port)
-    : network(server, port)
+    explicit NetworkProcess(const std::string& server, uint16_t port, const std::string& publish_journal)
+    : network(server, port, publish_journal)
     {
         if (QMsgEncoderInit(&context))
         {
             // log an error and...
             assert(0);
         }
+        // decoded messages point into the slice they came in, which outlives the decode
+        QMsgEncoderSetDecodeInPlace(context, 1);
     }
 
-    bool process_net_message(QMsgNetMessage& message, EventSource source, quicr::bytes&& message_raw);
+    bool process_net_message(QMsgNetMessage& message, EventSource source, BufferSlice&& message_raw);
     void perform_network_io();
-    void writeToSecProc(quicr::bytes&& message);
+    void writeToSecProc(BufferSlice&& message);
 
     Network network;
-    int sec2netFD = -1;
-    int net2secFD = -1;
+    IpcPipe* sec2net = nullptr;
+    IpcPipe* net2sec = nullptr;
+    // output to secProc is staged and written once per loop iteration
+    std::unique_ptr<IpcWriteStage> sec_output;
     QMsgEncoderContext *context;
 };
 
-void NetworkProcess::writeToSecProc(quicr::bytes&& message)
+void NetworkProcess::writeToSecProc(BufferSlice&& message)
 {
     std::cout << "Writing to secproc:" << message.size() << " bytes" << std::endl;
-    write( net2secFD, message.data(), message.size());
+    sec_output->queue(std::move(message));
 }
 
-bool NetworkProcess::process_net_message(QMsgNetMessage& message, EventSource source, quicr::bytes&& message_raw)
+bool NetworkProcess::process_net_message(QMsgNetMessage& message, EventSource source, BufferSlice&& message_raw)
 {
     switch (message.type)
     {
@@ -161,15 +168,22 @@ bool NetworkProcess::process_net_message(QMsgNetMessage& message, EventSource so
 
 void NetworkProcess::perform_network_io()
 {
+    if (!network.check_transport_ready()) {
+        // publishes and subscribes stay queued until then
+        return;
+    }
+    network.service_publish_queue();
+
     auto incoming_messages = std::vector<QuicrMessageInfo>{};
     network.check_network_messages(incoming_messages);
     // decode and process  - todo move this into the message_loop as well
     for(auto& message : incoming_messages) {
+        auto message_raw = BufferSlice(std::move(message.data));
         QMsgNetMessage qMsgNetMessage {};
         size_t consumed = 0;
         auto qmsg_enc_result = QMsgNetDecodeMessage(context,
-                                                    reinterpret_cast<uint8_t *>(message.data.data()),
-                                                    message.data.size(),
+                                                    message_raw.data(),
+                                                    message_raw.size(),
                                                     &qMsgNetMessage,
                                                     &consumed);
 
@@ -178,9 +192,22 @@ void NetworkProcess::perform_network_io()
             continue;
         }
 
-        process_net_message(qMsgNetMessage, EventSource::Network, std::move(message.data));
+        process_net_message(qMsgNetMessage, EventSource::Network, std::move(message_raw));
 
     }
+    network.repair_gaps();
+
+    if (sec_output->flush() != 0) {
+        std::cerr << "[NetworkIO]: Writing to secProc failed" << std::endl;
+    }
+}
+
+static void report_startup_phase(const char* phase, std::chrono::steady_clock::time_point& phase_start)
+{
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - phase_start);
+    std::cout << "[Startup]: " << phase << " took " << elapsed.count() << " ms" << std::endl;
+    phase_start = now;
 }
 
 int main( int argc, char* argv[]) {
@@ -200,22 +227,31 @@ int main( int argc, char* argv[]) {
     }
 
     fprintf(stderr, "NET: Starting netProc\n");
+    auto phase_start = std::chrono::steady_clock::now();
+
+    // start connecting now, the transport comes up while we wait for secProc
+    NetworkProcess network_process {"127.0.0.1", 7777, std::string("/tmp/netProc-publish-") + user};
+    report_startup_phase("network setup", phase_start);
+
     std::string pipe_name = std::string("/tmp/pipe-s2n-") + user;
     std::cout << "Checking for pipe from secProc %s" << pipe_name << std::endl;
-    int sec2netFD = open( pipe_name.c_str(), O_RDONLY, O_NONBLOCK );
-    assert( sec2netFD >= 0 );
+    IpcPipe sec2net;
+    int err = sec2net.openRead(pipe_name);
+    assert( err == 0 );
     std::cout << "NET: Got pipe from secProc %s" << pipe_name << std::endl;
 
     pipe_name = std::string("/tmp/pipe-n2s-") + user;
     std::cout << "Checking for pipe to netProc " << pipe_name << std::endl;
-    int net2secFD = open( pipe_name.c_str(), O_WRONLY, O_NONBLOCK );
-    assert( net2secFD >= 0 );
+    IpcPipe net2sec;
+    err = net2sec.openWrite(pipe_name);
+    assert( err == 0 );
     std::cout << "NET: Got pipe to netProc " << pipe_name << std::endl;
+    report_startup_phase("secProc pipes", phase_start);
 
   // set up connectors to the network process
-  NetworkProcess network_process {"127.0.0.1", 7777};
-  network_process.sec2netFD  = sec2netFD;
-  network_process.net2secFD = net2secFD;
+  network_process.sec2net = &sec2net;
+  network_process.net2sec = &net2sec;
+  network_process.sec_output = std::make_unique<IpcWriteStage>(net2sec);
 
   //network_process.network.start();
 
@@ -223,7 +259,7 @@ int main( int argc, char* argv[]) {
 
     // setup MessageLoop
   auto message_loop = MessageLoop{};
-  message_loop.read_from_fd = network_process.sec2netFD;
+  message_loop.read_from = network_process.sec2net;
   message_loop.keep_processing = true;
   message_loop.process_net_message_fn = std::bind(&NetworkProcess::process_net_message,
                                                   &network_process,
@@ -233,11 +269,14 @@ int main( int argc, char* argv[]) {
 
   message_loop.loop_fn = std::bind(&NetworkProcess::perform_network_io,
                                    &network_process);
+  message_loop.poll_soon_fn = [&network_process]() {
+      return network_process.sec_output->pending() || !network_process.network.is_transport_ready();
+  };
 
   // kick-off the message loop
-  auto err = message_loop.process(8192);
+  auto loop_err = message_loop.process(8192);
 
-  if (err != LoopProcessResult::SUCCESS) {
+  if (loop_err != LoopProcessResult::SUCCESS) {
       // log and fail
   }
 
@@ -0,0 +1,202 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+#include "publish_queue.h"
+
+static constexpr auto confirm_timeout = std::chrono::seconds(10);
+static constexpr size_t compact_min_bytes = 1024 * 1024;
+
+// journal records: type, name length, name and, for publishes, data length and data. A
+// publish is journaled until it is sent, the 'A' record marks the oldest on its name sent.
+static constexpr char journal_publish = 'P';
+static constexpr char journal_ack = 'A';
+
+PublishQueue::PublishQueue(const std::string& journal_file_in, size_t window_in)
+  : window(window_in > 0 ? window_in : 1),
+    journal_file(journal_file_in)
+{
+    if (journal_file.empty()) {
+        return;
+    }
+
+    journal_load();
+    journal_compact();
+
+    if (!entries.empty()) {
+        std::cout << "[PublishQueue]: Reloaded " << entries.size() << " pending publishes from "
+                  << journal_file << std::endl;
+    }
+}
+
+PublishQueue::~PublishQueue()
+{
+    if (journal_fd >= 0) {
+        close(journal_fd);
+    }
+}
+
+void PublishQueue::push(const std::string& name, const BufferSlice& data)
+{
+    entries.push_back(Entry{name, data.copy(), false, clock::time_point{}});
+    journal_write(journal_publish, name, &entries.back().data);
+    if (journal_fd >= 0) {
+        fdatasync(journal_fd);
+    }
+    queued_bytes += data.size();
+}
+
+bool PublishQueue::confirm(const std::string& name)
+{
+    auto it = std::find_if(entries.begin(), entries.end(), [&name](const Entry& entry) {
+        return entry.sent && entry.name == name;
+    });
+    if (it == entries.end()) {
+        return false;
+    }
+
+    complete(it);
+    return true;
+}
+
+void PublishQueue::service(const send_fn_t& send_fn, clock::time_point now)
+{
+    for (auto it = entries.begin(); it != entries.end();) {
+        auto& entry = *it;
+        if (entry.sent) {
+            if (now - entry.sent_at < confirm_timeout) {
+                ++it;
+                continue;
+            }
+            // a report that comes after this completes a later publish on the name, which
+            // has been sent too, so nothing is taken as sent before it is
+            std::cout << "[PublishQueue]: No report for " << entry.name << ", taking it as sent" << std::endl;
+            complete(it++);
+            continue;
+        }
+
+        if (num_in_flight < window) {
+            num_in_flight++;
+            entry.sent = true;
+            entry.sent_at = now;
+            journal_write(journal_ack, entry.name, nullptr);
+            queued_bytes -= entry.data.size();
+            send_fn(entry.name, std::move(entry.data));
+            entry.data = quicr::bytes{};
+        }
+        ++it;
+    }
+}
+
+void PublishQueue::complete(std::list<Entry>::iterator it)
+{
+    entries.erase(it);
+    num_in_flight--;
+
+    if (entries.empty() || (journal_bytes > compact_min_bytes && journal_bytes > 4 * queued_bytes)) {
+        journal_compact();
+    }
+}
+
+void PublishQueue::journal_write(char type, const std::string& name, const quicr::bytes* data)
+{
+    if (journal_fd < 0) {
+        return;
+    }
+
+    quicr::bytes record;
+    uint16_t name_len = name.size();
+    record.push_back(type);
+    record.insert(record.end(), reinterpret_cast<uint8_t*>(&name_len),
+                  reinterpret_cast<uint8_t*>(&name_len) + sizeof(name_len));
+    record.insert(record.end(), name.begin(), name.end());
+    if (data) {
+        uint32_t data_len = data->size();
+        record.insert(record.end(), reinterpret_cast<uint8_t*>(&data_len),
+                      reinterpret_cast<uint8_t*>(&data_len) + sizeof(data_len));
+        record.insert(record.end(), data->begin(), data->end());
+    }
+
+    if (write(journal_fd, record.data(), record.size()) != static_cast<ssize_t>(record.size())) {
+        perror("[PublishQueue]: journal write failed");
+        return;
+    }
+    journal_bytes += record.size();
+}
+
+void PublishQueue::journal_load()
+{
+    FILE* file = fopen(journal_file.c_str(), "rb");
+    if (!file) {
+        return;
+    }
+
+    while (true) {
+        char type;
+        uint16_t name_len;
+        if (fread(&type, 1, 1, file) != 1) break;
+        if (fread(&name_len, sizeof(name_len), 1, file) != 1) break;
+
+        std::string name(name_len, '\0');
+        if (fread(&name[0], 1, name_len, file) != name_len) break;
+
+        if (type == journal_publish) {
+            uint32_t data_len;
+            if (fread(&data_len, sizeof(data_len), 1, file) != 1) break;
+            quicr::bytes data(data_len);
+            if (fread(data.data(), 1, data_len, file) != data_len) break; // torn write on crash
+
+            queued_bytes += data.size();
+            entries.push_back(Entry{std::move(name), std::move(data), false, clock::time_point{}});
+        } else if (type == journal_ack) {
+            auto it = std::find_if(entries.begin(), entries.end(), [&name](const Entry& entry) {
+                return entry.name == name;
+            });
+            if (it != entries.end()) {
+                queued_bytes -= it->data.size();
+                entries.erase(it);
+            }
+        } else {
+            std::cerr << "[PublishQueue]: journal " << journal_file << " is corrupt" << std::endl;
+            break;
+        }
+    }
+
+    fclose(file);
+}
+
+void PublishQueue::journal_compact()
+{
+    if (journal_file.empty()) {
+        return;
+    }
+
+    // rewrite only the publishes not yet sent and swap the new journal in
+    auto tmp_file = journal_file + ".tmp";
+    int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd < 0) {
+        perror("[PublishQueue]: could not open journal");
+        return;
+    }
+
+    if (journal_fd >= 0) {
+        close(journal_fd);
+    }
+    journal_fd = fd;
+    journal_bytes = 0;
+
+    for (const auto& entry : entries) {
+        if (entry.sent) {
+            continue;
+        }
+        journal_write(journal_publish, entry.name, &entry.data);
+    }
+    fdatasync(journal_fd);
+
+    if (rename(tmp_file.c_str(), journal_file.c_str()) != 0) {
+        perror("[PublishQueue]: could not replace journal");
+    }
+}
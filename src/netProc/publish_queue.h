@@ -0,0 +1,68 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <list>
+#include <string>
+
+#include <bufferSlice.h>
+#include <quicr/quicr_client.h>
+
+///
+/// Outbound store-and-forward queue for publishes.
+///
+/// Publishes stay queued until quicr reports them as published, up to
+/// `window` are outstanding at once and the rest wait their turn. That report
+/// is quicr handing the object to its transport, not an ack from the relay,
+/// so the queue carries publishes over a transport that is not up yet and
+/// over a restart, not over loss on the network. Each publish is sent once:
+/// sending it again would make a second object with its own report. Names
+/// are per device rather than per message and quicr reports the objects of
+/// a name in order, so a report for a name completes the oldest outstanding
+/// publish on it. One not reported within confirm_timeout is taken as sent.
+/// With a journal file the queue is persisted and reloaded on restart. A
+/// publish's bytes are moved into quicr when it is sent, so it is journaled
+/// until then; one sent but not yet reported is not resent after a restart.
+///
+struct PublishQueue
+{
+    using clock = std::chrono::steady_clock;
+    using send_fn_t = std::function<void (const std::string& name, quicr::bytes&& data)>;
+
+    explicit PublishQueue(const std::string& journal_file = "", size_t window = 8);
+    ~PublishQueue();
+
+    // data is copied out of the buffer it shares once, into the bytes quicr is given
+    void push(const std::string& name, const BufferSlice& data);
+
+    // complete the oldest outstanding publish for name
+    bool confirm(const std::string& name);
+
+    // send what fits in the window and give up waiting on what timed out
+    void service(const send_fn_t& send_fn, clock::time_point now = clock::now());
+
+    size_t size() const { return entries.size(); }
+    size_t in_flight() const { return num_in_flight; }
+
+private:
+    struct Entry {
+        std::string name;
+        quicr::bytes data;       // empty once sent
+        bool sent = false;
+        clock::time_point sent_at;
+    };
+
+    void complete(std::list<Entry>::iterator it);
+
+    void journal_load();
+    void journal_write(char type, const std::string& name, const quicr::bytes* data);
+    void journal_compact();
+
+    std::list<Entry> entries;
+    size_t num_in_flight = 0;
+    const size_t window;
+
+    std::string journal_file;
+    int journal_fd = -1;
+    size_t journal_bytes = 0;
+    size_t queued_bytes = 0;
+};
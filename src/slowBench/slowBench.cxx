@@ -0,0 +1,498 @@
+#include <arpa/inet.h>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <vector>
+
+#include <name.h>
+#include <shortName.h>
+#include <slower.h>
+
+#include "cache.h"
+#include "dedupeFilter.h"
+#include "sendQueue.h"
+#include "sourceGuard.h"
+#include "subscription.h"
+
+// Heap allocations and time per publish on the relay's fan-out path, and per subscribe on its
+// cache replay path, done the way the relay used to with a list of results and the way it does
+// now with a visitor. Publishes are really sent, bundled, to ports on localhost nobody listens on.
+
+static uint64_t allocations = 0;
+
+void* operator new( size_t size ) {
+  allocations++;
+  void* p = malloc( size ? size : 1 );
+  if ( !p ) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete( void* p ) noexcept {
+  free( p );
+}
+
+void operator delete( void* p, size_t ) noexcept {
+  free( p );
+}
+
+static uint64_t nowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static const int batchPublishes = 64;   // publishes handled between sends, like one relay batch
+static const int devices = 4;
+static const int cachedPerDevice = 200;
+
+static MsgShortName channelName( int channel, int device, int msgID ) {
+  Name name( NamePath::message, 1, 1, channel, device, msgID );
+  return name.shortName();
+}
+
+static void report( const char* label, uint64_t ops, uint64_t allocs, uint64_t nanos ) {
+  std::cout << std::left << std::setw( 16 ) << label << std::right << std::fixed << std::setprecision( 2 )
+            << " allocs/op " << std::setw( 8 ) << (double)allocs / ops
+            << "  ns/op " << std::setw( 10 ) << (double)nanos / ops
+            << std::endl;
+}
+
+// Fill a dedupe filter to capacity in both generations, then time lookups of names it never saw
+// and count the ones it wrongly claims to have seen
+static void dedupe( size_t bytes ) {
+  DedupeFilter filter( bytes, 1000 );
+  const size_t names = filter.capacity();
+  for ( size_t i = 0; i < 2 * names; i++ ) {
+    filter.add( channelName( i % 500, 0, i / 500 ), 0 );   // rotates once, half way
+  }
+  assert( filter.size() == 2 * names );
+
+  const size_t lookups = 4000000;
+  std::vector<MsgShortName> unseen;
+  for ( size_t i = 0; i < lookups; i++ ) {
+    unseen.push_back( channelName( 500 + i % 500, 0, i / 500 ) );
+  }
+  size_t falsePositives = 0;
+  uint64_t startAllocs = allocations;
+  uint64_t start = nowNanos();
+  for ( const MsgShortName& name : unseen ) {
+    falsePositives += filter.contains( name );
+  }
+  uint64_t nanos = nowNanos() - start;
+  report( "  lookup", lookups, allocations - startAllocs, nanos );
+  std::cout << "  " << bytes / 1024 << " KiB, " << names << " names per generation, false positives "
+            << std::scientific << std::setprecision( 1 ) << (double)falsePositives / lookups
+            << std::defaultfloat << " (" << falsePositives << " of " << lookups << ")" << std::endl;
+}
+
+// Mask names byte by byte, the way getMaskedMsgShortName used to before it used ShortName
+static void bytesMasked( const MsgShortName& src, MsgShortName& dst, const int mask ) {
+  u_char dst_len = mask >= 8 ? MSG_SHORT_NAME_LEN - ( mask / 8 ) : 15;
+  u_char dst_bits = mask % 8;
+  std::memset( &dst, 0, MSG_SHORT_NAME_LEN );
+  std::memcpy( dst.data, src.data, dst_len );
+  if ( dst_bits ) {
+    dst.data[dst_len] = src.data[dst_len] >> dst_bits << dst_bits;
+  } else {
+    dst.data[dst_len] = mask == 0 ? src.data[dst_len] : 0;
+  }
+}
+
+// Time comparing names and finding the group of a publish in a map of masked names, with the
+// packed bytes and memcmp the relay's tables used to be keyed by and with ShortName
+static void names( int groups, const int mask ) {
+  std::map<MsgShortName, int> byBytes;
+  std::map<ShortName, int> byNumber;
+  for ( int g = 0; g < groups; g++ ) {
+    MsgShortName group = Name( NamePath::message, 1, 1 + g / 500, g % 500, 0, 0 ).shortName();
+    byBytes[ group ] = g;
+    byNumber[ ShortName( group ) ] = g;
+  }
+  const size_t lookups = 1000000;
+  std::vector<MsgShortName> published;
+  std::vector<ShortName> publishedNumbers;
+  for ( size_t i = 0; i < lookups; i++ ) {
+    size_t g = ( i * 7919 ) % groups;
+    published.push_back( Name( NamePath::message, 1, 1 + g / 500, g % 500, i % devices, i % 1000 ).shortName() );
+    publishedNumbers.push_back( ShortName( published.back() ) );
+  }
+
+  uint64_t found = 0;
+  uint64_t startAllocs = allocations;
+  uint64_t start = nowNanos();
+  for ( const MsgShortName& name : published ) {
+    MsgShortName group;
+    bytesMasked( name, group, mask );
+    found += ( byBytes.find( group ) != byBytes.end() );
+  }
+  report( "  bytes find", lookups, allocations - startAllocs, nowNanos() - start );
+  startAllocs = allocations;
+  start = nowNanos();
+  for ( const MsgShortName& name : published ) {
+    found += ( byNumber.find( ShortName( name ).masked( mask ) ) != byNumber.end() );
+  }
+  report( "  number find", lookups, allocations - startAllocs, nowNanos() - start );
+  if ( found != 2 * lookups ) {
+    std::cerr << "names missed groups" << std::endl;
+    exit( -1 );
+  }
+
+  uint64_t before = 0;
+  start = nowNanos();
+  for ( size_t i = 1; i < lookups; i++ ) {
+    before += ( published[ i ] < published[ i - 1 ] );
+  }
+  report( "  bytes compare", lookups - 1, 0, nowNanos() - start );
+  start = nowNanos();
+  for ( size_t i = 1; i < lookups; i++ ) {
+    before += ( publishedNumbers[ i ] < publishedNumbers[ i - 1 ] );
+  }
+  report( "  number compare", lookups - 1, 0, nowNanos() - start );
+  if ( before == 0 ) {
+    std::cout << "  no names out of order" << std::endl;   // keeps the compares from being dropped
+  }
+}
+
+// Format a name the way Name::longString used to, through a stringstream
+static std::string streamLongString( Name& name ) {
+  std::stringstream ss;
+  ss << "origin_id: " << name.orginID() << " qmsg://msg" << "/org-" << name.org() << "/team-" << name.team()
+     << "/ch-" << name.channel() << "/dev-" << name.device() << "/msg-" << name.msgNum();
+  return ss.str();
+}
+
+// Time formatting names the way the clients log them, into a std::string through a stringstream
+// as Name used to and into a buffer, and parsing them back from qmsg:// URIs and hex with a mask
+static void nameStrings() {
+  const size_t count = 200000;
+  std::vector<MsgShortName> shortNames;
+  for ( size_t i = 0; i < count; i++ ) {
+    shortNames.push_back( Name( NamePath::message, 1 + i % 7, i % 3000, i % 1000, i % 5000, i ).shortName() );
+  }
+
+  uint64_t chars = 0;
+  uint64_t startAllocs = allocations;
+  uint64_t start = nowNanos();
+  for ( MsgShortName& shortName : shortNames ) {
+    Name name( shortName );
+    chars += streamLongString( name ).size();
+  }
+  report( "  long stream", count, allocations - startAllocs, nowNanos() - start );
+
+  char buf[ Name::longStringLen ];
+  startAllocs = allocations;
+  start = nowNanos();
+  for ( MsgShortName& shortName : shortNames ) {
+    chars += strlen( Name( shortName ).longString( buf, sizeof( buf ) ) );
+  }
+  report( "  long buffer", count, allocations - startAllocs, nowNanos() - start );
+
+  startAllocs = allocations;
+  start = nowNanos();
+  for ( MsgShortName& shortName : shortNames ) {
+    chars += strlen( Name( shortName ).shortString( buf, sizeof( buf ) ) );
+  }
+  report( "  short buffer", count, allocations - startAllocs, nowNanos() - start );
+
+  std::vector<std::string> uris;
+  std::vector<std::string> hexes;
+  for ( MsgShortName& shortName : shortNames ) {
+    const ShortName number( shortName );
+    char hex[40];
+    snprintf( hex, sizeof( hex ), "%016llx%016llx:20", (unsigned long long)number.high(),
+              (unsigned long long)number.low() );
+    hexes.push_back( hex );
+    uris.push_back( strchr( Name( shortName ).longString( buf, sizeof( buf ) ), 'q' ) );
+  }
+
+  uint64_t parsed = 0;
+  startAllocs = allocations;
+  start = nowNanos();
+  for ( size_t i = 0; i < count; i++ ) {
+    MsgShortName name;
+    int mask;
+    parsed += Name::parse( uris[i].data(), uris[i].size(), name, mask ) && ( name == shortNames[i] );
+  }
+  report( "  parse qmsg://", count, allocations - startAllocs, nowNanos() - start );
+
+  startAllocs = allocations;
+  start = nowNanos();
+  for ( size_t i = 0; i < count; i++ ) {
+    MsgShortName name;
+    int mask;
+    parsed += Name::parse( hexes[i].data(), hexes[i].size(), name, mask ) && ( name == shortNames[i] );
+  }
+  report( "  parse hex:mask", count, allocations - startAllocs, nowNanos() - start );
+  if ( ( parsed != 2 * count ) || ( chars == 0 ) ) {
+    std::cerr << "names did not parse back" << std::endl;
+    exit( -1 );
+  }
+}
+
+// Time the per packet check of the source address, over more addresses than it has slots
+static void sourceGuard( int addresses ) {
+  SourceGuard::Limits limits = { 600 * 1000, 3, 2000, 4000 };
+  SourceGuard guard( limits );
+  std::vector<SlowerRemote> remotes( addresses );
+  for ( int i = 0; i < addresses; i++ ) {
+    int err = slowerRemote( remotes[ i ], "127.0.0.1", 1024 + i );
+    assert( err == 0 );
+    remotes[ i ].addr.sin_addr.s_addr = htonl( 0x0a000000 + i / 16 );
+  }
+
+  const int packets = 4000000;
+  size_t admitted = 0;
+  uint64_t startAllocs = allocations;
+  uint64_t start = nowNanos();
+  for ( int i = 0; i < packets; i++ ) {
+    admitted += guard.received( remotes[ i % addresses ], 100, i / 1000 ).admitted;
+  }
+  report( "  received", packets, allocations - startAllocs, nowNanos() - start );
+  if ( admitted == 0 ) {
+    std::cerr << "source guard admitted nothing" << std::endl;
+    exit( 1 );
+  }
+}
+
+
+// Cache a commit for each epoch of each team, next to the chat of the same teams, then time
+// finding the commits of one epoch with a mask lookup and with a scan of the whole org
+static void commits( int teams, int epochs ) {
+  Cache cache;
+  const std::vector<uint8_t> data( 100, 0x55 );
+  for ( int team = 0; team < teams; team++ ) {
+    for ( int epoch = 0; epoch < epochs; epoch++ ) {
+      cache.put( Name::commitAll( 1, team, epoch, 7 ).shortName(), data );
+      cache.put( channelName( 1, team % devices, team * epochs + epoch ), data );
+    }
+  }
+
+  const int lookups = 100000;
+  size_t found = 0;
+  uint64_t startAllocs = allocations;
+  uint64_t start = nowNanos();
+  for ( int i = 0; i < lookups; i++ ) {
+    MsgShortName name = Name::commitAll( 1, i % teams, ( i * 7 ) % epochs, 0 ).shortName();
+    cache.forEach( name, Name::epochMask, [&]( const MsgShortName&, const CacheData& ) { found++; } );
+  }
+  report( "  by epoch", lookups, allocations - startAllocs, nowNanos() - start );
+
+  const int scans = 100;
+  size_t scanned = 0;
+  startAllocs = allocations;
+  start = nowNanos();
+  for ( int i = 0; i < scans; i++ ) {
+    Name want = Name::commitAll( 1, i % teams, ( i * 7 ) % epochs, 0 );
+    cache.forEach( want.shortName(), 70, [&]( const MsgShortName& hit, const CacheData& ) {
+      MsgShortName hitName = hit;
+      Name name( hitName );
+      scanned += ( name.path() == NamePath::commitAll ) && ( name.team() == want.team() )
+                 && ( name.epoch() == want.epoch() );
+    } );
+  }
+  report( "  org scan", scans, allocations - startAllocs, nowNanos() - start );
+  if ( ( found != (size_t)lookups ) || ( scanned != (size_t)scans ) ) {
+    std::cerr << "commit lookups found " << found << " and " << scanned << std::endl;
+    exit( 1 );
+  }
+}
+
+
+// Do what the relay does with each publish: copy it out of the packet, cache it, look up its
+// subscribers, queue the copy for each and send them in batches
+template <typename Lookup>
+static void publish( const char* label, SlowerConnection& slower, SendQueue& queue, int channels, int publishes,
+                     Lookup lookup ) {
+  const std::vector<uint8_t> packet( 100, 0x55 );
+  uint64_t allocs = 0;
+  uint64_t nanos = 0;
+  uint64_t sent = 0;
+  for ( int round = 0; round < 2; round++ ) {   // the first round grows the queue and bundles
+    Cache cache;                                 // of its own each round, the names repeat
+    allocs = 0;
+    nanos = 0;
+    for ( int i = 0; i < publishes; i++ ) {
+      MsgShortName name = channelName( i % channels, i % devices, 1000 + i );
+
+      uint64_t startAllocs = allocations;
+      uint64_t start = nowNanos();
+      std::vector<uint8_t> data( packet.begin(), packet.end() );
+      if ( !cache.exists( name ) ) {
+        cache.put( name, data );
+      }
+      // one buffer for each publish, shared between the destinations
+      auto shared = std::make_shared<const std::vector<uint8_t>>( std::move( data ) );
+      lookup( name, [&]( RemoteID dest ) {
+        queue.push( SlowerPriorityNormal, dest, name, shared, 0 );
+      } );
+      if ( ( i % batchPublishes == batchPublishes - 1 ) || ( i == publishes - 1 ) ) {
+        slowerBundleBegin( slower );
+        while ( !queue.empty() ) {
+          queue.drain( slower, [&]( SlowerPriority, uint64_t ) { sent++; } );
+        }
+        slowerBundleFlush( slower );
+      }
+      nanos += nowNanos() - start;
+      allocs += allocations - startAllocs;
+    }
+  }
+  report( label, publishes, allocs, nanos );
+}
+
+// Visit the cached messages a new subscriber to each channel is sent
+template <typename Lookup>
+static void replay( const char* label, int channels, Lookup lookup ) {
+  uint64_t bytes = 0;
+  uint64_t startAllocs = allocations;
+  uint64_t start = nowNanos();
+  for ( int channel = 0; channel < channels; channel++ ) {
+    lookup( channelName( channel, 0, 0 ), [&]( const CacheData& data ) { bytes += data.size(); } );
+  }
+  uint64_t nanos = nowNanos() - start;
+  report( label, channels, allocations - startAllocs, nanos );
+  if ( bytes != (uint64_t)channels * devices * cachedPerDevice * 100 ) {   // checked, so not optimized away
+    std::cerr << "replay missed messages" << std::endl;
+    exit( -1 );
+  }
+}
+
+// The whole replay the relay does for a subscribe: each cached message is copied into a buffer
+// of its own, since the cache may change before the queue drains, queued and sent
+static void replaySend( const char* label, SlowerConnection& slower, SendQueue& queue, Cache& cache,
+                        RemoteID dest, int channels, int mask ) {
+  uint64_t allocs = 0;
+  uint64_t nanos = 0;
+  uint64_t sent = 0;
+  for ( int round = 0; round < 2; round++ ) {   // the first round grows the queue and bundles
+    allocs = 0;
+    nanos = 0;
+    sent = 0;
+    for ( int channel = 0; channel < channels; channel++ ) {
+      uint64_t startAllocs = allocations;
+      uint64_t start = nowNanos();
+      cache.forEach( channelName( channel, 0, 0 ), mask, [&]( const MsgShortName& n, const CacheData& hit ) {
+        queue.push( SlowerPriorityNormal, dest, n,
+                    std::make_shared<const std::vector<uint8_t>>( hit.data(), hit.data() + hit.size() ), 0 );
+      } );
+      slowerBundleBegin( slower );
+      while ( !queue.empty() ) {
+        queue.drain( slower, [&]( SlowerPriority, uint64_t ) { sent++; } );
+      }
+      slowerBundleFlush( slower );
+      nanos += nowNanos() - start;
+      allocs += allocations - startAllocs;
+    }
+  }
+  report( label, channels, allocs, nanos );
+  if ( sent != (uint64_t)channels * devices * cachedPerDevice ) {
+    std::cerr << "replay sent " << sent << " messages" << std::endl;
+    exit( -1 );
+  }
+}
+
+int main( int argc, char* argv[] ) {
+  int channels = 100;
+  int subscribers = 20;
+  int publishes = 100000;
+  if ( argc > 1 ) {
+    channels = atoi( argv[1] );
+  }
+  if ( argc > 2 ) {
+    subscribers = atoi( argv[2] );
+  }
+  if ( argc > 3 ) {
+    publishes = atoi( argv[3] );
+  }
+  if ( ( channels <= 0 ) || ( subscribers <= 0 ) || ( publishes <= 0 ) || ( channels * subscribers > 40000 ) ) {
+    std::cerr << "Usage: slowBench [channels] [subscribersPerChannel] [publishes]" << std::endl;
+    exit( -1 );
+  }
+
+  SlowerConnection slower;
+  int err = slowerSetup( slower, 0 );
+  assert( err == 0 );
+
+  // everyone subscribes to a whole channel
+  RemoteTable remotes;
+  Subscriptions subs( remotes );
+  const int channelMask = 40;
+  for ( int channel = 0; channel < channels; channel++ ) {
+    for ( int s = 0; s < subscribers; s++ ) {
+      SlowerRemote remote;
+      err = slowerRemote( remote, "127.0.0.1", 20000 + channel * subscribers + s );
+      assert( err == 0 );
+      subs.add( channelName( channel, 0, 0 ), channelMask, remote );
+    }
+  }
+
+  Cache cache;
+  const std::vector<uint8_t> data( 100, 0x55 );
+  for ( int channel = 0; channel < channels; channel++ ) {
+    for ( int device = 0; device < devices; device++ ) {
+      for ( int msgID = 1; msgID <= cachedPerDevice; msgID++ ) {
+        cache.put( channelName( channel, device, msgID ), data );
+      }
+    }
+  }
+
+  std::cout << channels << " channels, " << subscribers << " subscribers each, "
+            << devices * cachedPerDevice << " messages cached each" << std::endl;
+
+  SendQueue queue( remotes );
+  std::cout << "publish fan-out, " << publishes << " publishes" << std::endl;
+  publish( "  list", slower, queue, channels, publishes,
+           [&]( const MsgShortName& name, auto onRemote ) {
+             std::list<SlowerRemote> list = subs.find( name );
+             for ( const SlowerRemote& dest : list ) {
+               onRemote( remotes.find( dest ) );
+             }
+           } );
+  publish( "  visitor", slower, queue, channels, publishes,
+           [&]( const MsgShortName& name, auto onRemote ) {
+             subs.forEach( name, onRemote );
+           } );
+
+  std::cout << "subscribe replay, " << channels << " subscribes" << std::endl;
+  replay( "  list", channels, [&]( const MsgShortName& name, auto onData ) {
+      std::vector<Cache::Hit> hits = cache.find( name, channelMask );
+      for ( const Cache::Hit& hit : hits ) {
+        onData( *hit.data );
+      }
+    } );
+  replay( "  visitor", channels, [&]( const MsgShortName& name, auto onData ) {
+      cache.forEach( name, channelMask, [&]( const MsgShortName&, const CacheData& hit ) { onData( hit ); } );
+    } );
+  SlowerRemote subscriber;
+  err = slowerRemote( subscriber, "127.0.0.1", 19999 );
+  assert( err == 0 );
+  RemoteID subscriberID = remotes.acquire( subscriber );
+  replaySend( "  queued", slower, queue, cache, subscriberID, channels, channelMask );
+
+  std::cout << "names, " << channels * subscribers << " groups of mask " << channelMask << std::endl;
+  names( channels * subscribers, channelMask );
+
+  std::cout << "name strings" << std::endl;
+  nameStrings();
+
+  std::cout << "commits, 1000 teams of 100 epochs" << std::endl;
+  commits( 1000, 100 );
+
+  std::cout << "source guard, 200000 addresses" << std::endl;
+  sourceGuard( 200000 );
+
+  std::cout << "dedupe filter, both generations full" << std::endl;
+  dedupe( 8192 * 1024 );
+
+  return 0;
+}
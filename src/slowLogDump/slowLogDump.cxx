@@ -0,0 +1,135 @@
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <unistd.h>
+
+#include <slower.h>
+#include <name.h>
+#include <eventLog.h>
+
+// Print a binary event log written by slowRelay as text, one event per line
+
+static void usage() {
+  std::cerr << "Usage: slowLogDump [-l level] [-f] logFile" << std::endl;
+  std::cerr << "  -l  only show events up to level (error, info, debug)" << std::endl;
+  std::cerr << "  -f  keep reading as the log grows" << std::endl;
+  exit( -1 );
+}
+
+static void printRecord( const EventRecord& rec ) {
+  char timeBuf[32];
+  time_t secs = rec.timeUs / 1000000;
+  struct tm tmVal;
+  localtime_r( &secs, &tmVal );
+  strftime( timeBuf, sizeof( timeBuf ), "%Y-%m-%d %H:%M:%S", &tmVal );
+
+  std::cout << timeBuf << "." << std::setfill( '0' ) << std::setw( 6 ) << rec.timeUs % 1000000
+            << std::setfill( ' ' ) << " " << std::left << std::setw( 5 ) << eventLevelName( rec.level )
+            << " " << std::setw( 13 ) << eventTypeName( rec.type ) << std::right;
+
+  switch ( rec.type ) {
+  case EventType::logStart:
+    std::cout << " level=" << eventLevelName( (EventLevel)rec.value );
+    break;
+  case EventType::dropped:
+    std::cout << " count=" << rec.value;
+    break;
+  default: {
+    MsgShortName shortName = rec.name;
+    char nameBuf[ Name::longStringLen ];
+    std::cout << " " << Name( shortName ).longString( nameBuf, sizeof( nameBuf ) );
+  }
+  }
+
+  if ( rec.port != 0 ) {
+    struct in_addr addr;
+    addr.s_addr = rec.addr;
+    std::cout << ( ( rec.type == EventType::fwdRelay ) || ( rec.type == EventType::fwdSub ) ||
+                   ( rec.type == EventType::cacheSend ) || ( rec.type == EventType::subCookie ) ? " to " : " from " )
+              << inet_ntoa( addr ) << ":" << ntohs( rec.port );
+  }
+
+  switch ( rec.type ) {
+  case EventType::pub:
+  case EventType::pubDup:
+    std::cout << " len=" << rec.value;
+    break;
+  case EventType::pubLatency:
+    std::cout << " latencyMs=" << rec.value;
+    break;
+  case EventType::sub:
+  case EventType::unSub:
+  case EventType::subCookie:
+    std::cout << " mask=" << rec.value;
+    break;
+  default:
+    break;
+  }
+
+  std::cout << std::endl;
+}
+
+int main( int argc, char* argv[] ) {
+  EventLevel maxLevel = EventLevel::debug;
+  bool follow = false;
+
+  int opt;
+  while ( ( opt = getopt( argc, argv, "l:f" ) ) != -1 ) {
+    switch ( opt ) {
+    case 'l':
+      if ( !eventLevelParse( optarg, maxLevel ) ) {
+        usage();
+      }
+      break;
+    case 'f':
+      follow = true;
+      break;
+    default:
+      usage();
+    }
+  }
+  if ( optind >= argc ) {
+    usage();
+  }
+  const char* logFile = argv[optind];
+
+  FILE* file = fopen( logFile, "rb" );
+  if ( !file ) {
+    perror( logFile );
+    return -1;
+  }
+
+  char magic[ sizeof( eventLogMagic ) ];
+  if ( ( fread( magic, sizeof( magic ), 1, file ) != 1 ) ||
+       ( memcmp( magic, eventLogMagic, sizeof( magic ) ) != 0 ) ) {
+    std::cerr << logFile << " is not a slowRelay event log" << std::endl;
+    return -1;
+  }
+
+  EventRecord rec;
+  size_t got = 0;
+  while ( true ) {
+    got += fread( (char*)&rec + got, 1, sizeof( rec ) - got, file );
+    if ( got < sizeof( rec ) ) {
+      if ( !follow ) {
+        break;
+      }
+      clearerr( file );
+      usleep( 100 * 1000 );
+      continue;
+    }
+    got = 0;
+
+    if ( (uint8_t)rec.level <= (uint8_t)maxLevel ) {
+      printRecord( rec );
+    }
+  }
+
+  fclose( file );
+  return 0;
+}
@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <vector>
 
 #include "qmsg/encoder.h"
 
@@ -21,24 +22,30 @@ void SecApi::send(const QMsgNetMessage &message) {
                              sizeof(encodeBuffer), &encodeLen);
   assert(err == QMsgEncoderSuccess);
 
+  // stage length and body together so they go out in the same write
   uint32_t sendLen = encodeLen;
-  ssize_t n = write(net2secFD, &sendLen, sizeof(sendLen));
-  assert(n == sizeof(sendLen));
-  n = write(net2secFD, encodeBuffer, sendLen);
-  assert(n == sendLen);
+  std::vector<uint8_t> msg(sizeof(sendLen) + encodeLen);
+  memcpy(msg.data(), &sendLen, sizeof(sendLen));
+  memcpy(msg.data() + sizeof(sendLen), encodeBuffer, encodeLen);
+  net2secStage.queue(std::move(msg));
 }
 
-int SecApi::getReadFD() { return sec2netFD; }
+void SecApi::flush() {
+  int err = net2secStage.flush();
+  assert(err == 0);
+}
+
+int SecApi::getReadFD() { return sec2net.getFD(); }
 
-SecApi::SecApi() {
+SecApi::SecApi() : net2secStage(net2sec) {
   QMsgEncoderInit(&context);
 
-  sec2netFD = open("/tmp/pipe-s2n", O_RDONLY, O_NONBLOCK);
-  assert(sec2netFD >= 0);
+  int err = sec2net.openRead("/tmp/pipe-s2n");
+  assert(err == 0);
   std::clog << "SEC: Got pipe from uiProc" << std::endl;
 
-  net2secFD = open("/tmp/pipe-n2s", O_WRONLY, O_NONBLOCK);
-  assert(net2secFD >= 0);
+  err = net2sec.openWrite("/tmp/pipe-n2s");
+  assert(err == 0);
   std::clog << "SEC: Got pipe to uiProc" << std::endl;
 }
 
@@ -55,14 +62,14 @@ void SecApi::readMsg(QMsgNetMessage *message) {
   uint8_t uiBuf[bufSize];
 
   uint32_t msgLen = 0;
-  ssize_t num = read(sec2netFD, &msgLen, sizeof(msgLen));
+  ssize_t num = sec2net.read(&msgLen, sizeof(msgLen));
   if ( num == 0 ) {
     message->type = QMsgNetInvalid;
     return;
   }
   assert(num == sizeof(msgLen));
   assert(msgLen <= bufSize);
-  num = read(sec2netFD, uiBuf, msgLen);
+  num = sec2net.read(uiBuf, msgLen);
   assert(num == msgLen);
 
   QMsgEncoderResult err;
@@ -3,12 +3,15 @@
 #include <unistd.h>
 
 #include "qmsg/encoder.h"
+#include <ipcPipe.h>
+#include <ipcWriteStage.h>
 
 class SecApi {
 private:
   QMsgEncoderContext *context;
-  int sec2netFD;
-  int net2secFD;
+  IpcPipe sec2net;
+  IpcPipe net2sec;
+  IpcWriteStage net2secStage;
 
   void send(const QMsgNetMessage &message);
 
@@ -17,6 +20,10 @@ public:
   ~SecApi();
   int getReadFD();
 
+  // write out everything staged since the last call
+  void flush();
+  bool pendingOutput() const { return net2secStage.pending(); }
+
   void readMsg(QMsgNetMessage *message);
   void recvAsciiMsg(int team, int dev, int ch, uint8_t *msg, int msgLen);
 };
@@ -1,6 +1,8 @@
 
 #include <assert.h>
 #include <iostream>
+#include <map>
+#include <string>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -11,6 +13,9 @@
 
 #include <slower.h>
 #include <name.h>
+#include <pubQueue.h>
+#include <reassembler.h>
+#include <gapTracker.h>
 
 
 #include "secApi.h"
@@ -19,8 +24,20 @@ class Relay {
 private:
   SlowerConnection slower;
   SecApi& secApi;
+  PubQueue pubQueue;
+  Reassembler reassembler;
+  GapTracker gaps;
+  std::vector<std::pair<MsgShortName,int>> subscriptions;   ///< resent to keep the relay lease
+  std::map<MsgShortName,uint32_t> nextMsgIDs;                ///< by stream, name with msg_id 0
+  uint64_t nextSubRefreshMs = 0;
+
+  // earliest of two timeouts where -1 means none
+  static int earliest( int a, int b ) {
+    return ( a < 0 || ( b >= 0 && b < a ) ) ? b : a;
+  }
 public:
-  Relay(  SecApi& secApiVal, const char* relayName=NULL ) : secApi( secApiVal ) {
+  Relay(  SecApi& secApiVal, const char* relayName=NULL, const char* queueFile=NULL )
+    : secApi( secApiVal ), pubQueue( queueFile ) {
     const char defaultRelayName[] = "relay.us-east-2.qmsg.ctgpoc.com";
     const int port = 5004;
     const int mask=16;
@@ -46,29 +63,133 @@ public:
   }
 
   int getFD() { return slowerGetFD( slower ); }
+
+  // more to read, either on the socket or left from a bundle the socket no longer shows
+  bool pending() { return slowerPending( slower ); }
   
   void pub(const MsgShortName& name, const uint8_t* data, const int len ) {
-    int err = slowerPub( slower,  name,  (char*) data , len  );
-    assert( err == 0 );
+    if ( !pubQueue.push( name, data, len ) ) {
+      std::cerr << "NET: could not queue publish" << std::endl;
+      return;
+    }
+    service();
+  }
+
+  // msg_id for the next publish on the stream of name, numbered above the publishes reloaded
+  // from the journal so a new message never reuses the name of one still queued
+  uint32_t nextMsgID( const MsgShortName& name ) {
+    MsgShortName prefix = name;
+    prefix.spec.msg_id = 0;
+    auto it = nextMsgIDs.find( prefix );
+    if ( it == nextMsgIDs.end() ) {
+      it = nextMsgIDs.insert( std::make_pair( prefix, pubQueue.highestMsgID( prefix ) + 1 ) ).first;
+    }
+    return it->second++;
+  }
+
+  // send queued publishes and retransmit any that have not been acked, fetch missing
+  // fragments of large messages being received and fetch messages lost from a stream
+  void service() {
+    pubQueue.service( slower, PubQueue::nowMs() );
+    reassembler.service( slower, PubQueue::nowMs() );
+    gaps.service( slower, PubQueue::nowMs() );
+
+    if ( PubQueue::nowMs() >= nextSubRefreshMs ) {
+      for ( const auto& sub : subscriptions ) {
+        slowerSub( slower, sub.first, sub.second );
+      }
+      nextSubRefreshMs = PubQueue::nowMs() + slowerSubRefreshMs;
+    }
+  }
+
+  // everything sent between begin and flush goes to the relay in as few datagrams as possible
+  void bundleBegin() { slowerBundleBegin( slower ); }
+
+  void flush() {
+    int err = slowerBundleFlush( slower );
+    if ( err ) {
+      std::clog << "NET: relay unreachable, " << pubQueue.size() << " publishes queued" << std::endl;
+    }
+  }
+
+  int nextTimeoutMs() {
+    const uint64_t now = PubQueue::nowMs();
+    int refreshMs = subscriptions.empty() ? -1 : (int)( nextSubRefreshMs > now ? nextSubRefreshMs - now : 0 );
+    return earliest( earliest( pubQueue.nextTimeoutMs( now ), reassembler.nextTimeoutMs( now ) ),
+                     earliest( gaps.nextTimeoutMs( now ), refreshMs ) );
   }
 
   void sub(const MsgShortName& name, const int mask ) {
     int err = slowerSub( slower,  name, mask  );
     assert( err == 0 );
+    subscriptions.push_back( std::make_pair( name, mask ) );
+    if ( nextSubRefreshMs == 0 ) {
+      nextSubRefreshMs = PubQueue::nowMs() + slowerSubRefreshMs;
+    }
+  }
+
+  // handle everything already waiting on the socket, up to a limit so secProc is not starved
+  void recvAll() {
+    const int maxBurst = 64;
+    for ( int i = 0; i < maxBurst; i++ ) {
+      recv();
+
+      if ( !pending() ) {
+        break;
+      }
+    }
   }
 
   void recv( ) {
     MsgHeader mhdr = {0};
-    char buf[1024];
+    SlowerRemote remote;
+    int mask;
+    char buf[slowerMTU];
     int bufSize=sizeof(buf);
     int bufLen=0;
-    int err = slowerRecvPub( slower, &mhdr, buf, bufSize, &bufLen );
+    MsgFragHeader frag;
+    int err = slowerRecvMulti( slower, &mhdr, &remote, &mask, buf, bufSize, &bufLen, NULL, NULL, &frag );
     assert( err == 0 );
     Name name( mhdr.name );
+    char nameBuf[ Name::longStringLen ];
+
+    if ( mhdr.type == SlowerMsgAck ) {
+      pubQueue.ack( mhdr.name );
+      return;
+    }
+
+    if ( mhdr.type == SlowerMsgAckBatch ) {
+      const MsgAckRange* ranges = (const MsgAckRange*)buf;
+      for ( int i = 0; i < bufLen / (int)sizeof( MsgAckRange ); i++ ) {
+        pubQueue.ackRange( mhdr.name, ranges[i].first, ranges[i].last );
+      }
+      return;
+    }
 
-    if ( bufLen > 0 ) {
+    if ( ( mhdr.type == SlowerMsgPubFrag ) && ( bufLen > 0 ) ) {
+      std::vector<uint8_t> object;
+      if ( reassembler.add( mhdr.name, frag, remote, (uint8_t*)buf, bufLen, PubQueue::nowMs(), object ) ) {
+        if ( !gaps.received( mhdr.name, PubQueue::nowMs() ) ) {
+          return; // already delivered, a repair raced the original
+        }
+        std::clog << "NET: Recv PUB "
+                  << name.longString( nameBuf, sizeof( nameBuf ) )
+                  << " len=" << object.size()
+                  << " in " << frag.count << " fragments"
+                  << std::endl;
+
+        secApi.recvAsciiMsg( mhdr.name.spec.team, mhdr.name.spec.device, mhdr.name.spec.channel,
+                             object.data(), object.size() );
+      }
+      return;
+    }
+
+    if ( ( mhdr.type == SlowerMsgPub ) && ( bufLen > 0 ) ) {
+      if ( !gaps.received( mhdr.name, PubQueue::nowMs() ) ) {
+        return; // already delivered, a repair raced the original
+      }
       std::clog << "NET: Recv PUB "
-                << name.longString() 
+                << name.longString( nameBuf, sizeof( nameBuf ) )
                 << " len=" << bufLen 
                 << std::endl;
       
@@ -83,19 +204,32 @@ int main( int argc, char* argv[]){
   std::clog <<   "NET: Starting netProc" << std::endl;
   SecApi secApi;
 
-  Relay relay( secApi, getenv("SLOWR_RELAY") );
+  // the default journal is per user so two users on one host do not replay each other's publishes
+  const char* queueFile = getenv("SLOWR_QUEUE");
+  const std::string defaultQueueFile = "/tmp/slowNet-pubQueue-" + std::to_string( getuid() );
+  Relay relay( secApi, getenv("SLOWR_RELAY"), queueFile ? queueFile : defaultQueueFile.c_str() );
 
   const QMsgOrgID org=1; // TODO load from config 
   
   //  const int mask = 16;
-  int msgNum=1; // TODO - make msgnum per team/device/ch
   
   
   while( true ) {
     //waitForInput
+    int waitMs = relay.nextTimeoutMs();
+    if ( ( waitMs < 0 ) || ( waitMs > 1000 ) ) {
+      waitMs = 1000;
+    }
+    if ( secApi.pendingOutput() && ( waitMs > 10 ) ) {
+      waitMs = 10; // secProc is behind, retry the staged output soon
+    }
+    const bool relayPending = relay.pending();
+    if ( relayPending ) {
+      waitMs = 0; // rest of a bundle, or more than the last burst read
+    }
     struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+    timeout.tv_sec = waitMs / 1000;
+    timeout.tv_usec = ( waitMs % 1000 ) * 1000;
     fd_set fdSet;
     int maxFD=0;
     FD_ZERO(&fdSet);
@@ -109,11 +243,13 @@ int main( int argc, char* argv[]){
     }
     int numSelectFD = select( maxFD+1 , &fdSet , NULL, NULL, &timeout );
     assert( numSelectFD >= 0 );
+    relay.bundleBegin();
 
     // process relay
-    if ( (numSelectFD > 0) && ( FD_ISSET( relay.getFD(), &fdSet) ) ) {
-      relay.recv();
+    if ( relayPending || ( (numSelectFD > 0) && ( FD_ISSET( relay.getFD(), &fdSet) ) ) ) {
+      relay.recvAll();
     }
+    relay.service();
     
     // processs secProc
     if ( (numSelectFD > 0) && ( FD_ISSET( secApi.getReadFD(), &fdSet) ) ) {
@@ -170,11 +306,15 @@ int main( int argc, char* argv[]){
 
 #if 1
         assert( message.u.watch_devices.channel_id <= 0xFFFF );
+        Name stream(  NamePath::message, org,
+                      message.u.send_ascii_message.team_id,
+                      (uint16_t)message.u.send_ascii_message.channel_id,
+                      message.u.send_ascii_message.device_id );
         Name name(  NamePath::message, org,
                     message.u.send_ascii_message.team_id,
                     (uint16_t)message.u.send_ascii_message.channel_id,
                     message.u.send_ascii_message.device_id,
-                    msgNum++ // TODO - persiste msg nums 
+                    relay.nextMsgID( stream.shortName() ) // TODO - persist msg nums once all are acked
                    );
         
           std::clog << "Pub to " << name.longString() << std::endl;
@@ -197,6 +337,9 @@ int main( int argc, char* argv[]){
         assert(0);
       }
     }
+
+    relay.flush();
+    secApi.flush();
   }
   
   return 0;
@@ -1,82 +1,539 @@
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <cstring>
 
 #include "cache.h"
 
+// Expiry given to names evicted for their class budget, already past whatever the time
+static const uint64_t evictedMs = 1;
+
+
+int Cache::open( const char* dir, uint64_t nowMs ) {
+  assert( !log );
+  log.reset( new CacheLog( dir ) );
+  return log->load( nowMs, [this]( const CacheLog::Record& rec ) {
+    CacheData data( rec );
+    if ( rec.fragment ) {
+      if ( !putFragmentData( rec.name, rec.frag, std::move( data ) ) ) {
+        log->release( rec.segment, rec.len );
+      }
+    }
+    else if ( !exists( rec.name ) ) {
+      putData( rec.name, std::move( data ) );
+    }
+    else {
+      log->release( rec.segment, rec.len );
+    }
+  } );
+}
+
+
+Cache::Retention Cache::retention( NamePath path ) {
+  switch ( path ) {
+    case NamePath::keyPackage:
+      return Retention::keyPackages;
+    case NamePath::welcome:
+      return Retention::welcomes;
+    case NamePath::commitAll:
+    case NamePath::commitOne:
+      return Retention::commits;
+    default:
+      return Retention::messages;
+  }
+}
+
+
+const char* Cache::retentionName( Retention r ) {
+  static const char* names[ numRetentions ] = { "message", "key_package", "welcome", "commit" };
+  return names[ (int)r ];
+}
+
+
+void Cache::setRetention( Retention r, const RetentionPolicy& policy ) {
+  retained[ (int)r ].policy = policy;
+  if ( !policy.maxBytes ) {
+    retained[ (int)r ].arrivals.clear();
+  }
+}
+
+
+uint64_t Cache::expiryMs( const MsgShortName& name, uint64_t nowMs ) const {
+  const uint64_t ttlMs = retained[ (int)retention( (NamePath)name.spec.path ) ].policy.ttlMs;
+  return ttlMs ? nowMs + ttlMs : 0;
+}
+
+
+// Entry in a vector sorted by msgID, end() if there is none
+template <typename V>
+auto Cache::findID( V& vec, uint32_t msgID ) -> decltype( vec.begin() ) {
+  auto it = std::lower_bound( vec.begin(), vec.end(), msgID,
+                              []( const typename V::value_type& e, uint32_t id ) { return e.msgID < id; } );
+  return ( ( it != vec.end() ) && ( it->msgID == msgID ) ) ? it : vec.end();
+}
+
+
+// Insert keeping vec sorted by msgID, almost always at the end as msg_ids only go up
+template <typename V>
+static typename V::iterator insertID( V& vec, typename V::value_type&& e ) {
+  if ( vec.empty() || ( vec.back().msgID < e.msgID ) ) {
+    vec.push_back( std::move( e ) );
+    return vec.end() - 1;
+  }
+  auto it = std::lower_bound( vec.begin(), vec.end(), e.msgID,
+                              []( const typename V::value_type& x, uint32_t id ) { return x.msgID < id; } );
+  return vec.insert( it, std::move( e ) );
+}
+
+
+const Cache::Entry* Cache::findEntry( const MsgShortName& name ) const {
+  auto s = streams.find( streamKey( name ) );
+  if ( s == streams.end() ) {
+    return NULL;
+  }
+  auto it = findID( s->second.entries, name.spec.msg_id );
+  return ( it == s->second.entries.end() ) ? NULL : &*it;
+}
 
-void Cache::put(const MsgShortName& name, const std::vector<uint8_t>& data ) {
-  assert( data.size() > 0 );
 
-  std::vector<uint8_t>* vec = new std::vector<uint8_t>( data );
+const Cache::FragEntry* Cache::findFragEntry( const MsgShortName& name ) const {
+  auto s = streams.find( streamKey( name ) );
+  if ( s == streams.end() ) {
+    return NULL;
+  }
+  auto it = findID( s->second.fragmented, name.spec.msg_id );
+  return ( it == s->second.fragmented.end() ) ? NULL : &*it;
+}
 
-  std::pair<MsgShortName, std::vector<uint8_t>* > pair;
-  pair = make_pair( name, vec );
 
-  dataCache.insert( pair );
+// The bytes go in the log if there is one, otherwise they are copied
+CacheData Cache::store( const MsgShortName& name, const MsgFragHeader* frag, const std::vector<uint8_t>& data,
+                        uint64_t expiryMs ) {
+  if ( log ) {
+    CacheLog::Record rec = CacheLog::Record();
+    rec.name = name;
+    rec.expiryMs = expiryMs;
+    rec.fragment = ( frag != NULL );
+    if ( frag ) {
+      rec.frag = *frag;
+    }
+    rec.len = data.size();
+    if ( log->append( rec, data.data() ) ) {
+      return CacheData( rec );
+    }
+  }
+  return CacheData( data, expiryMs );
 }
 
 
-const std::vector<uint8_t>* Cache::get( const MsgShortName& name ) const {
-  auto mapPtr = dataCache.find( name );
-  if ( mapPtr == dataCache.end() ) {
-    return &emptyVec;
+void Cache::release( const CacheData& data ) {
+  if ( log && data.segment ) {
+    log->release( data.segment, data.len );
   }
+}
 
-  const std::vector<uint8_t>* vecP =  mapPtr->second;
-  assert( vecP );
-  assert( vecP->size() > 0 );
 
-  return  vecP;
+uint64_t Cache::syncHash( const MsgShortName& name ) {
+  // splitmix64 finalizer over each half, so fingerprints of similar names do not cancel out
+  auto mix = []( uint64_t x ) {
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebull;
+    return x ^ ( x >> 31 );
+  };
+  uint64_t half[2];
+  std::memcpy( half, name.data, sizeof( half ) );
+  return mix( half[0] ^ mix( half[1] + 0x9e3779b97f4a7c15ull ) );
+}
+
+
+bool Cache::syncBefore( const MsgShortName& a, const MsgShortName& b ) {
+  return ShortName( a ) < ShortName( b );
+}
+
+
+void Cache::added( Stream& stream, const MsgShortName& name ) {
+  stream.count++;
+  stream.fingerprint ^= syncHash( name );
+}
+
+
+void Cache::putData( const MsgShortName& name, CacheData&& data ) {
+  if ( data.expiryMs ) {
+    expiries.insert( std::make_pair( data.expiryMs, streamKey( name ) ) );
+  }
+  Retained& r = retainedFor( name );
+  r.bytes += data.size();
+  if ( r.policy.maxBytes ) {
+    r.arrivals.push_back( ShortName( name ) );
+  }
+  Entry entry = { name.spec.msg_id, std::move( data ) };
+  Stream& stream = streams[ streamKey( name ) ];
+  insertID( stream.entries, std::move( entry ) );
+  added( stream, name );
+  numData++;
+}
+
+
+void Cache::put(const MsgShortName& name, const std::vector<uint8_t>& data, uint64_t expiryMs ) {
+  assert( data.size() > 0 );
+  if ( exists( name ) ) {
+    return;
+  }
+  putData( name, store( name, NULL, data, expiryMs ) );
+}
+
+
+const CacheData* Cache::get( const MsgShortName& name ) const {
+  const Entry* entry = findEntry( name );
+  if ( !entry ) {
+    return &emptyData;
+  }
+
+  const CacheData* dataP = &entry->data;
+  assert( dataP->size() > 0 );
+
+  return dataP;
 }
 
 
 bool Cache::exists(  const MsgShortName& name ) const {
-  auto mapPtr = dataCache.find( name );
-  if ( mapPtr == dataCache.end() ) {
+  return findEntry( name ) != NULL;
+}
+
+
+std::vector<Cache::Hit> Cache::find(const MsgShortName& name, const int mask ) const {
+  std::vector<Hit> ret;
+  forEach( name, mask, [&]( const MsgShortName& hitName, const CacheData& data ) {
+    Hit hit = { hitName, &data };
+    ret.push_back( hit );
+  } );
+  return ret;
+}
+
+
+bool Cache::putFragment( const MsgShortName& name, const MsgFragHeader& frag, const std::vector<uint8_t>& data,
+                         uint64_t expiryMs ) {
+  if ( !slowerFragValid( frag, (int)data.size() ) ) {
     return false;
   }
-  return true; 
+
+  // check before storing so duplicates do not go in the log
+  const FragEntry* entry = findFragEntry( name );
+  if ( entry ) {
+    const Fragments& frags = entry->frags;
+    if ( ( frag.count != frags.first.count ) || ( frag.totalLen != frags.first.totalLen )
+         || !frags.data[ frag.index ].empty() ) {
+      return false;
+    }
+  }
+  return putFragmentData( name, frag, store( name, &frag, data, expiryMs ) );
 }
 
 
-std::list<MsgShortName> Cache::find(const MsgShortName& name, const int mask ) const {
+bool Cache::putFragmentData( const MsgShortName& name, const MsgFragHeader& frag, CacheData&& data ) {
+  if ( !slowerFragValid( frag, (int)data.size() ) ) {
+    return false;
+  }
+
+  Stream& stream = streams[ streamKey( name ) ];
+  auto it = findID( stream.fragmented, name.spec.msg_id );
+  if ( it == stream.fragmented.end() ) {
+    FragEntry entry;
+    entry.msgID = name.spec.msg_id;
+    entry.frags.first = frag;
+    entry.frags.data.resize( frag.count );
+    entry.frags.offsets.resize( frag.count );
+    entry.frags.numHave = 0;
+    entry.frags.expiryMs = data.expiryMs;
+    it = insertID( stream.fragmented, std::move( entry ) );
+    added( stream, name );
+    numFragmented++;
+    if ( data.expiryMs ) {
+      expiries.insert( std::make_pair( data.expiryMs, streamKey( name ) ) ); // all fragments expire with the first
+    }
+    if ( retainedFor( name ).policy.maxBytes ) {
+      retainedFor( name ).arrivals.push_back( ShortName( name ) );
+    }
+  }
+
+  Fragments& frags = it->frags;
+  if ( ( frag.count != frags.first.count ) || ( frag.totalLen != frags.first.totalLen ) ) {
+    return false;
+  }
+  if ( !frags.data[ frag.index ].empty() ) {
+    return false;
+  }
+  retainedFor( name ).bytes += data.size();
+  frags.data[ frag.index ] = std::move( data );
+  frags.offsets[ frag.index ] = frag.offset;
+  frags.numHave++;
+  return true;
+}
+
+
+const CacheData* Cache::getFragment( const MsgShortName& name, uint16_t index, MsgFragHeader& frag ) const {
+  const FragEntry* entry = findFragEntry( name );
+  if ( !entry || ( index >= entry->frags.first.count ) || entry->frags.data[ index ].empty() ) {
+    return NULL;
+  }
+  frag = entry->frags.first;
+  frag.index = index;
+  frag.offset = entry->frags.offsets[ index ];
+  return &entry->frags.data[ index ];
+}
+
+
+uint16_t Cache::fragmentCount( const MsgShortName& name ) const {
+  const FragEntry* entry = findFragEntry( name );
+  return entry ? entry->frags.first.count : 0;
+}
+
+
+bool Cache::fragmentsComplete( const MsgShortName& name ) const {
+  const FragEntry* entry = findFragEntry( name );
+  return entry && ( entry->frags.numHave == entry->frags.first.count );
+}
+
+
+std::list<MsgShortName> Cache::findFragmented( const MsgShortName& name, const int mask ) const {
   std::list<MsgShortName> ret;
-  assert( mask <= 70 ); // TODO
+  forEachFragment( name, mask, [&]( const MsgShortName& fragName, const MsgFragHeader&, const CacheData& ) {
+    if ( ret.empty() || ( std::memcmp( ret.back().data, fragName.data, MSG_SHORT_NAME_LEN ) != 0 ) ) {
+      ret.push_back( fragName );
+    }
+  } );
+  return ret;
+}
 
-  MsgShortName startName = name;
-  getMaskedMsgShortName(name, startName, mask);
 
-  //std::clog << "  Cache::find lower = " << std::hex << startName.part[1] << "-" <<  startName.part[0] << std::dec << std::endl;
-  //std::clog << "  Cache::find upper = " << std::hex << endName.part[1] << "-" <<  endName.part[0] << std::dec << std::endl;
-  MsgShortName endName =  startName;
-  std::memset(endName.data + MSG_SHORT_NAME_LEN - (mask / 8), 0xff, (mask / 8));
+Cache::Summary Cache::summarize( const MsgShortName& lower, const MsgShortName& upper ) const {
+  Summary sum = { 0, 0 };
+  forSyncStreams( lower, upper, [&]( const ShortName& key, const Stream& stream, uint32_t firstID, uint32_t endID ) {
+    if ( ( firstID == 0 ) && ( endID == msgIDLimit ) ) {
+      sum.count += stream.count;
+      sum.fingerprint ^= stream.fingerprint;
+      return;
+    }
+    // only the streams at the ends of the range are walked
+    forStreamNames( key, stream, firstID, endID, [&]( const MsgShortName& name ) {
+      sum.count++;
+      sum.fingerprint ^= syncHash( name );
+    } );
+  } );
+  return sum;
+}
 
-  auto start = dataCache.lower_bound( startName );
 
-  auto end = dataCache.upper_bound( endName );
-  
-  for ( auto it = start; it != end; it++ ) {
-    MsgShortName dataName = it->first;
+std::vector<MsgShortName> Cache::split( const MsgShortName& lower, const MsgShortName& upper, int parts ) const {
+  std::vector<MsgShortName> ret;
+  assert( parts >= 2 );
 
-    //std::cerr << "   Cache::find adding " << std::hex << dataName.part[1] << "-" <<  dataName.part[0] << std::dec << " to results" << std::endl;
+  // count the names of each stream in the range
+  std::vector<std::pair<ShortName, uint32_t>> counts;
+  uint32_t total = 0;
+  forSyncStreams( lower, upper, [&]( const ShortName& key, const Stream& stream, uint32_t firstID, uint32_t endID ) {
+    uint32_t n = 0;
+    if ( ( firstID == 0 ) && ( endID == msgIDLimit ) ) {
+      n = stream.count;
+    } else {
+      forStreamNames( key, stream, firstID, endID, [&]( const MsgShortName& ) { n++; } );
+    }
+    if ( n > 0 ) {
+      counts.push_back( std::make_pair( key, n ) );
+      total += n;
+    }
+  } );
+  if ( counts.empty() ) {
+    return ret;
+  }
+  const uint32_t target = ( total + parts - 1 ) / parts;
 
-    assert( it->second );
-    assert( it->second->size() > 0 );
-    
-    ret.push_back( dataName );
+  if ( counts.size() > 1 ) {
+    // split between streams, giving any stream bigger than a part a range of its own so the
+    // next split can cut it by msg_id
+    uint32_t sum = counts[0].second;
+    for ( size_t i = 1; ( i < counts.size() ) && ( (int)ret.size() < parts - 1 ); i++ ) {
+      if ( ( sum >= target * ( ret.size() + 1 ) ) || ( counts[i].second > target )
+           || ( counts[i - 1].second > target ) ) {
+        ret.push_back( counts[i].first.msgShortName() );   // msg_id 0, the start of the stream
+      }
+      sum += counts[i].second;
+    }
+    return ret;
+  }
+
+  // one stream, split by msg_id
+  std::vector<uint32_t> ids;
+  ids.reserve( total );
+  forEachName( lower, upper, [&]( const MsgShortName& name ) { ids.push_back( name.spec.msg_id ); } );
+  MsgShortName bound = counts[0].first.msgShortName();
+  for ( int p = 1; p < parts; p++ ) {
+    size_t index = (size_t)p * ids.size() / parts;
+    if ( ( index == 0 ) || ( ids[ index ] == ids[ index - 1 ] ) ) {
+      continue;
+    }
+    bound.spec.msg_id = ids[ index ];
+    if ( ret.empty() || ( ret.back() != bound ) ) {
+      ret.push_back( bound );
+    }
   }
-  
   return ret;
 }
 
 
-Cache::~Cache(){
-  for( auto it =  dataCache.begin(); it != dataCache.end(); it++ ) {
-    assert( it->second );
-    delete it->second;
-    dataCache.erase( it );
+// Data a log record is for, NULL if the cache no longer has it
+CacheData* Cache::logged( const CacheLog::Record& rec ) {
+  if ( rec.fragment ) {
+    const FragEntry* entry = findFragEntry( rec.name );
+    if ( !entry || ( rec.frag.index >= entry->frags.data.size() ) ) {
+      return NULL;
+    }
+    return const_cast<CacheData*>( &entry->frags.data[ rec.frag.index ] );
+  }
+  const Entry* entry = findEntry( rec.name );
+  return entry ? const_cast<CacheData*>( &entry->data ) : NULL;
+}
+
+
+size_t Cache::expire( uint64_t nowMs, const std::function<void( const MsgShortName& )>& onDropped ) {
+  // Collect the streams first then sweep each once, rather than closing the gap left by every
+  // name taken out of the middle of a vector
+  std::set<ShortName> touched;
+  while ( !expiries.empty() && ( expiries.begin()->first <= nowMs ) ) {
+    touched.insert( expiries.begin()->second );
+    expiries.erase( expiries.begin() );
+  }
+  size_t dropped = sweep( touched, nowMs, onDropped );
+
+  // then make room in the classes still over budget
+  touched.clear();
+  evict( touched );
+  dropped += sweep( touched, nowMs, onDropped );
+
+  if ( !log ) {
+    return dropped;
+  }
+
+  // records still in use are the ones the streams point at
+  numCompacted += log->compact(
+    [&]( const CacheLog::Record& rec ) {
+      CacheData* data = logged( rec );
+      return data && ( data->data() == rec.data );
+    },
+    [&]( const CacheLog::Record& rec ) {
+      CacheData* data = logged( rec );
+      assert( data );
+      *data = CacheData( rec );
+    } );
+  return dropped;
+}
+
+
+bool Cache::droppedThrough( const MsgShortName& name ) const {
+  auto it = droppedIDs.find( streamKey( name ) );
+  return ( it != droppedIDs.end() ) && ( name.spec.msg_id <= it->second );
+}
+
+
+// Drop the names in the touched streams that expired by nowMs
+size_t Cache::sweep( const std::set<ShortName>& touched, uint64_t nowMs,
+                     const std::function<void( const MsgShortName& )>& onDropped ) {
+  size_t dropped = 0;
+  for ( const ShortName& key : touched ) {
+    auto s = streams.find( key );
+    if ( s == streams.end() ) {
+      continue;
+    }
+    Stream& stream = s->second;
+    Retained& retain = retained[ (int)retention( key.path() ) ];
+    auto removed = [&]( uint32_t msgID ) {
+      const MsgShortName name = key.withMsgID( msgID ).msgShortName();
+      auto high = droppedIDs.emplace( key, msgID ).first;
+      high->second = std::max( high->second, msgID );
+      stream.count--;
+      stream.fingerprint ^= syncHash( name );
+      if ( onDropped ) {
+        onDropped( name );
+      }
+    };
+
+    auto end = std::remove_if( stream.entries.begin(), stream.entries.end(), [&]( const Entry& entry ) {
+      if ( !entry.data.expiryMs || ( entry.data.expiryMs > nowMs ) ) {
+        return false;
+      }
+      retain.bytes -= entry.data.size();
+      release( entry.data );
+      removed( entry.msgID );
+      return true;
+    } );
+    dropped += stream.entries.end() - end;
+    numData -= stream.entries.end() - end;
+    stream.entries.erase( end, stream.entries.end() );
+
+    // fragments expire with the first one that arrived
+    auto fragEnd = std::remove_if( stream.fragmented.begin(), stream.fragmented.end(), [&]( const FragEntry& entry ) {
+      if ( !entry.frags.expiryMs || ( entry.frags.expiryMs > nowMs ) ) {
+        return false;
+      }
+      for ( const CacheData& data : entry.frags.data ) {
+        retain.bytes -= data.size();
+        release( data );
+      }
+      removed( entry.msgID );
+      return true;
+    } );
+    dropped += stream.fragmented.end() - fragEnd;
+    numFragmented -= stream.fragmented.end() - fragEnd;
+    stream.fragmented.erase( fragEnd, stream.fragmented.end() );
+
+    if ( stream.entries.empty() && stream.fragmented.empty() ) {
+      streams.erase( s );
+    }
+  }
+  return dropped;
+}
+
+
+// Mark the oldest names of each class over its budget as expired, adding their streams to
+// touched for the sweep that drops them
+void Cache::evict( std::set<ShortName>& touched ) {
+  for ( Retained& retain : retained ) {
+    if ( !retain.policy.maxBytes ) {
+      continue;
+    }
+    uint64_t over = ( retain.bytes > retain.policy.maxBytes ) ? retain.bytes - retain.policy.maxBytes : 0;
+    while ( !retain.arrivals.empty() ) {
+      const ShortName name = retain.arrivals.front();
+      const ShortName key = name.withMsgID( 0 );
+
+      // find what is still cached under the name, skipping names already gone
+      uint64_t* expiry = NULL;
+      uint64_t size = 0;
+      auto s = streams.find( key );
+      if ( s != streams.end() ) {
+        auto entry = findID( s->second.entries, name.msgID() );
+        auto frag = findID( s->second.fragmented, name.msgID() );
+        if ( entry != s->second.entries.end() ) {
+          expiry = &entry->data.expiryMs;
+          size = entry->data.size();
+        } else if ( frag != s->second.fragmented.end() ) {
+          expiry = &frag->frags.expiryMs;
+          for ( const CacheData& data : frag->frags.data ) {
+            size += data.size();
+          }
+        }
+      }
+      if ( expiry && ( *expiry != evictedMs ) ) {
+        if ( over == 0 ) {
+          break;
+        }
+        *expiry = evictedMs;
+        retain.evicted++;
+        over -= std::min( over, size );
+        touched.insert( key );
+      }
+      retain.arrivals.pop_front();
+    }
   }
-  dataCache.clear();
 }
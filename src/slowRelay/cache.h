@@ -1,27 +1,371 @@
+#pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <functional>
 #include <list>
+#include <memory>
+#include <deque>
 #include <set>
 #include <map>
 #include <vector>
 
 #include <slower.h>
+#include <shortName.h>
 
+#include "cacheLog.h"
 
+
+/**
+ * Bytes of a cached message, either owned or where they are mapped in the cache log
+ */
+class CacheData {
+public:
+  CacheData() : ptr( NULL ), len( 0 ), segment( 0 ), expiryMs( 0 ) {}
+  CacheData( const std::vector<uint8_t>& bytes, uint64_t expiryMsVal )
+    : owned( bytes ), ptr( owned.data() ), len( owned.size() ), segment( 0 ), expiryMs( expiryMsVal ) {}
+  CacheData( const CacheLog::Record& rec )
+    : ptr( rec.data ), len( rec.len ), segment( rec.segment ), expiryMs( rec.expiryMs ) {}
+
+  // moving the vector keeps its buffer, so ptr stays good
+  CacheData( CacheData&& ) = default;
+  CacheData& operator=( CacheData&& ) = default;
+  CacheData( const CacheData& ) = delete;
+  CacheData& operator=( const CacheData& ) = delete;
+
+  const uint8_t* data() const { return ptr; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+
+private:
+  friend class Cache;
+  std::vector<uint8_t> owned;   ///< Empty when the bytes are in the log
+  const uint8_t* ptr;
+  uint32_t len;
+  uint64_t segment;             ///< Log segment holding the bytes, 0 if owned
+  uint64_t expiryMs;            ///< Wall clock time since epoch it expires, 0 for never
+};
+
+
+/**
+ * Cached messages, grouped into one stream per org, team, channel and device.
+ *
+ *     Each stream keeps its messages in a vector ordered by msg_id, so the messages of a stream
+ *     sit together in memory, in the order they were published. Streams are keyed by ShortName,
+ *     so the names matching a subscribe mask are one run of streams. Finding a name is a lookup
+ *     of its stream then a binary search. Replaying a channel walks the streams of the channel
+ *     in order and scans each one straight through. Pointers to cached data stay valid until
+ *     the cache is next changed.
+ *
+ *     Each NamePath has a retention class with its own TTL and byte budget. When a class goes
+ *     over its budget its oldest names are evicted on the next expire(), so a burst of large
+ *     welcomes only pushes out older welcomes, never chat history. Eviction is not written to
+ *     the log, whose record keeps the name's own expiry. A name evicted before a restart is
+ *     loaded again, until it expires or compaction drops its segment, and is only evicted
+ *     again if its class is still over budget.
+ */
 class Cache {
 public:
+  enum class Retention : uint8_t { messages, keyPackages, welcomes, commits };
+  static const int numRetentions = 4;
+
+  struct RetentionPolicy {
+    uint64_t ttlMs;      ///< 0 keeps names until they are evicted
+    uint64_t maxBytes;   ///< 0 for no budget
+  };
+
+  /// Class of names on path, names with a path the relay does not know are messages
+  static Retention retention( NamePath path );
+  static const char* retentionName( Retention r );
+
+  /// Set before open() so names loaded from the log count against the budget
+  void setRetention( Retention r, const RetentionPolicy& policy );
+  const RetentionPolicy& retentionPolicy( Retention r ) const { return retained[ (int)r ].policy; }
+
+  /// Expiry for name put at nowMs under its class TTL, 0 for none
+  uint64_t expiryMs( const MsgShortName& name, uint64_t nowMs ) const;
+
+  /// Data bytes cached in class r
+  uint64_t bytes( Retention r ) const { return retained[ (int)r ].bytes; }
+  /// Names of class r evicted to keep it within its budget
+  uint64_t evicted( Retention r ) const { return retained[ (int)r ].evicted; }
+
+  /// A cached whole message found by find()
+  struct Hit {
+    MsgShortName name;
+    const CacheData* data;
+  };
+
   Cache() {};
 
-  void put(const MsgShortName& name, const std::vector<uint8_t>& data );
+  /// Keep the cache in a CacheLog in dir, loading what it already holds. Returns 0 on success.
+  int open( const char* dir, uint64_t nowMs );
 
-  const std::vector<uint8_t>* get( const MsgShortName& name ) const;
+  /// expiryMs is wall clock time since epoch, 0 to keep it until the relay restarts without a log
+  void put(const MsgShortName& name, const std::vector<uint8_t>& data, uint64_t expiryMs=0 );
+
+  const CacheData* get( const MsgShortName& name ) const;
 
   bool exists(  const MsgShortName& name ) const;
 
-  std::list<MsgShortName> find(const MsgShortName& name, const int mask ) const;
+  /// Call onHit( name, data ) for each whole message matching name apart from the low mask
+  /// bits, highest stream and msg_id first. Nothing is allocated and the cache must not change
+  /// until it returns.
+  template <typename F>
+  void forEach( const MsgShortName& name, const int mask, F onHit ) const;
+
+  /// Whole messages forEach would visit, in the same order
+  std::vector<Hit> find(const MsgShortName& name, const int mask ) const;
+
+  // Fragments of large publishes are kept as they arrived, never reassembled
+
+  /// Returns false if the fragment is malformed, a duplicate or does not match the ones already cached
+  bool putFragment( const MsgShortName& name, const MsgFragHeader& frag, const std::vector<uint8_t>& data,
+                    uint64_t expiryMs=0 );
+
+  /// NULL if that fragment is not cached, otherwise its data with its header in frag
+  const CacheData* getFragment( const MsgShortName& name, uint16_t index, MsgFragHeader& frag ) const;
+
+  /// Number of fragments name was split into, 0 if none are cached
+  uint16_t fragmentCount( const MsgShortName& name ) const;
+
+  /// True once every fragment of name has arrived
+  bool fragmentsComplete( const MsgShortName& name ) const;
+
+  /// Call onFragment( name, frag, data ) for each cached fragment of the fragmented names
+  /// matching name apart from the low mask bits, in the same order as forEach
+  template <typename F>
+  void forEachFragment( const MsgShortName& name, const int mask, F onFragment ) const;
+
+  std::list<MsgShortName> findFragmented( const MsgShortName& name, const int mask ) const;
+
+  // Ranges of names for relays syncing their caches, in the order described with MsgSyncRange
+
+  struct Summary {
+    uint32_t count;
+    uint64_t fingerprint;   ///< XOR of syncHash of each name
+  };
+
+  /// Names cached, whole or fragmented, from lower up to but not including upper
+  Summary summarize( const MsgShortName& lower, const MsgShortName& upper ) const;
+
+  /// Call onName( name ) for each name summarize would count, in order
+  template <typename F>
+  void forEachName( const MsgShortName& lower, const MsgShortName& upper, F onName ) const;
+
+  /// Up to parts - 1 names, in order, that split the range into parts holding about as many names each
+  std::vector<MsgShortName> split( const MsgShortName& lower, const MsgShortName& upper, int parts ) const;
+
+  static uint64_t syncHash( const MsgShortName& name );
+  static bool syncBefore( const MsgShortName& a, const MsgShortName& b );
+
+  /// Drop what expired by nowMs and the oldest names of classes over budget, then compact the
+  /// log, calling onDropped( name ) for each name dropped. Returns the number of names dropped.
+  size_t expire( uint64_t nowMs, const std::function<void( const MsgShortName& )>& onDropped = nullptr );
+
+  /// True if expire() has dropped a name of name's stream with a msg_id at or above name's, so
+  /// name may be one that was dropped. Names above that are new whatever a filter of dropped
+  /// names says.
+  bool droppedThrough( const MsgShortName& name ) const;
+
+  size_t size() const { return numData + numFragmented; }
+  size_t streamCount() const { return streams.size(); }
+  size_t logSegments() const { return log ? log->segments() : 0; }
+  uint64_t compactedBytes() const { return numCompacted; }
 
-  ~Cache();
-  
 private:
-  std::map< MsgShortName, std::vector<uint8_t>* > dataCache;
-  const std::vector<uint8_t> emptyVec;
+  struct Fragments {
+    MsgFragHeader first;                       ///< count and totalLen every fragment must match
+    std::vector<CacheData> data;               ///< Indexed by fragment, empty until it arrives
+    std::vector<uint32_t> offsets;
+    uint16_t numHave;
+    uint64_t expiryMs;                         ///< Of the first fragment to arrive
+  };
+  struct Entry {
+    uint32_t msgID;
+    CacheData data;
+  };
+  struct FragEntry {
+    uint32_t msgID;
+    Fragments frags;
+  };
+  struct Stream {
+    std::vector<Entry> entries;                ///< Sorted by msgID
+    std::vector<FragEntry> fragmented;         ///< Sorted by msgID
+    uint32_t count = 0;                        ///< Of entries and fragmented together
+    uint64_t fingerprint = 0;                  ///< XOR of syncHash of their names
+  };
+  struct Retained {
+    RetentionPolicy policy = { 0, 0 };
+    uint64_t bytes = 0;
+    uint64_t evicted = 0;
+    std::deque<ShortName> arrivals;            ///< Oldest first, only with a budget; may hold names since dropped
+  };
+  static const uint32_t msgIDLimit = 1 << 20;
+
+  template <typename F>
+  void forSyncStreams( const MsgShortName& lower, const MsgShortName& upper, F onStream ) const;
+  template <typename F>
+  static void forStreamNames( const ShortName& key, const Stream& stream, uint32_t firstID, uint32_t endID,
+                              F onName );
+  void added( Stream& stream, const MsgShortName& name );
+  Retained& retainedFor( const MsgShortName& name ) { return retained[ (int)retention( (NamePath)name.spec.path ) ]; }
+  size_t sweep( const std::set<ShortName>& touched, uint64_t nowMs,
+                const std::function<void( const MsgShortName& )>& onDropped );
+  void evict( std::set<ShortName>& touched );
+
+  static ShortName streamKey( const MsgShortName& name ) { return ShortName( name ).withMsgID( 0 ); }
+  template <typename F>
+  void forStreams( const MsgShortName& name, const int mask, F onStream ) const;
+  template <typename V>
+  static auto findIDs( V& vec, uint32_t firstID, uint32_t endID ) -> std::pair<decltype( vec.begin() ),
+                                                                               decltype( vec.begin() )>;
+  template <typename V>
+  static auto findID( V& vec, uint32_t msgID ) -> decltype( vec.begin() );
+
+  const Entry* findEntry( const MsgShortName& name ) const;
+  const FragEntry* findFragEntry( const MsgShortName& name ) const;
+  CacheData* logged( const CacheLog::Record& rec );
+
+  CacheData store( const MsgShortName& name, const MsgFragHeader* frag, const std::vector<uint8_t>& data,
+                   uint64_t expiryMs );
+  void release( const CacheData& data );
+  void putData( const MsgShortName& name, CacheData&& data );
+  bool putFragmentData( const MsgShortName& name, const MsgFragHeader& frag, CacheData&& data );
+
+  std::map< ShortName, Stream > streams;                      ///< Keyed by name with msg_id zeroed
+  std::set< std::pair<uint64_t, ShortName> > expiries;        ///< By expiry time, streams of names that have one
+  std::map< ShortName, uint32_t > droppedIDs;                 ///< Highest msg_id expire() dropped, by stream
+  std::unique_ptr<CacheLog> log;
+  Retained retained[ numRetentions ];
+  size_t numData = 0;
+  size_t numFragmented = 0;
+  uint64_t numCompacted = 0;
+  const CacheData emptyData;
 };
+
+
+// Call onStream( key, stream, firstID, endID ) for each stream with names matching name apart from
+// the low mask bits, last first, where firstID and endID bound the msg_ids that match. As numbers
+// the matching names are the run from name masked to name with the mask bits set, so their
+// streams are one run of the map and every msg_id between the bounds matches.
+template <typename F>
+void Cache::forStreams( const MsgShortName& name, const int mask, F onStream ) const {
+  assert( mask <= 70 ); // TODO
+  const ShortName shortName( name );
+  const ShortName first = shortName.masked( mask );
+  const ShortName last = shortName.filled( mask );
+  const ShortName firstKey = first.withMsgID( 0 );
+  const ShortName lastKey = last.withMsgID( 0 );
+
+  auto begin = streams.lower_bound( firstKey );
+  for ( auto it = streams.upper_bound( lastKey ); it != begin; ) {
+    it--;
+    uint32_t firstID = ( it->first == firstKey ) ? first.msgID() : 0;
+    uint32_t endID = ( it->first == lastKey ) ? last.msgID() + 1 : msgIDLimit;
+    onStream( it->first, it->second, firstID, endID );
+  }
+}
+
+
+// The run of vec, sorted by msgID, with firstID <= msgID < endID
+template <typename V>
+auto Cache::findIDs( V& vec, uint32_t firstID, uint32_t endID ) -> std::pair<decltype( vec.begin() ),
+                                                                            decltype( vec.begin() )> {
+  auto byID = []( uint32_t id ) {
+    return [id]( const auto& e ) { return e.msgID < id; };
+  };
+  if ( ( firstID == 0 ) && ( endID == msgIDLimit ) ) {
+    return std::make_pair( vec.begin(), vec.end() );
+  }
+  auto begin = std::partition_point( vec.begin(), vec.end(), byID( firstID ) );
+  return std::make_pair( begin, std::partition_point( begin, vec.end(), byID( endID ) ) );
+}
+
+
+template <typename F>
+void Cache::forEach( const MsgShortName& name, const int mask, F onHit ) const {
+  forStreams( name, mask, [&]( const ShortName& key, const Stream& stream, uint32_t firstID, uint32_t endID ) {
+    auto run = findIDs( stream.entries, firstID, endID );
+    MsgShortName hitName = key.msgShortName();
+    for ( auto entry = run.second; entry != run.first; ) {
+      entry--;
+      hitName.spec.msg_id = entry->msgID;
+      onHit( (const MsgShortName&)hitName, entry->data );
+    }
+  } );
+}
+
+
+template <typename F>
+void Cache::forEachFragment( const MsgShortName& name, const int mask, F onFragment ) const {
+  forStreams( name, mask, [&]( const ShortName& key, const Stream& stream, uint32_t firstID, uint32_t endID ) {
+    auto run = findIDs( stream.fragmented, firstID, endID );
+    MsgShortName fragName = key.msgShortName();
+    for ( auto entry = run.second; entry != run.first; ) {
+      entry--;
+      fragName.spec.msg_id = entry->msgID;
+      const Fragments& frags = entry->frags;
+      MsgFragHeader frag = frags.first;
+      for ( uint16_t i = 0; i < frags.first.count; i++ ) {
+        if ( !frags.data[ i ].empty() ) {
+          frag.index = i;
+          frag.offset = frags.offsets[ i ];
+          onFragment( (const MsgShortName&)fragName, (const MsgFragHeader&)frag, frags.data[ i ] );
+        }
+      }
+    }
+  } );
+}
+
+
+// Call onStream( key, stream, firstID, endID ) for each stream with names in the sync range,
+// where firstID and endID bound the msg_ids in the range
+template <typename F>
+void Cache::forSyncStreams( const MsgShortName& lower, const MsgShortName& upper, F onStream ) const {
+  const ShortName lowerName( lower );
+  const ShortName upperName( upper );
+  const ShortName lowerKey = lowerName.withMsgID( 0 );
+  const ShortName upperKey = upperName.withMsgID( 0 );
+  for ( auto it = streams.lower_bound( lowerKey ); it != streams.end(); it++ ) {
+    if ( upperKey < it->first ) {
+      break;
+    }
+    uint32_t firstID = ( it->first == lowerKey ) ? lowerName.msgID() : 0;
+    uint32_t endID = ( it->first == upperKey ) ? upperName.msgID() : msgIDLimit;
+    if ( firstID < endID ) {
+      onStream( it->first, it->second, firstID, endID );
+    }
+  }
+}
+
+
+// Call onName( name ) for the names in stream with firstID <= msg_id < endID, in msg_id order
+template <typename F>
+void Cache::forStreamNames( const ShortName& key, const Stream& stream, uint32_t firstID, uint32_t endID,
+                            F onName ) {
+  auto entries = findIDs( stream.entries, firstID, endID );
+  auto frags = findIDs( stream.fragmented, firstID, endID );
+  auto entry = entries.first;
+  auto frag = frags.first;
+
+  // merge the two, a name is only ever in one of them
+  MsgShortName name = key.msgShortName();
+  while ( ( entry != entries.second ) || ( frag != frags.second ) ) {
+    if ( ( frag == frags.second ) || ( ( entry != entries.second ) && ( entry->msgID < frag->msgID ) ) ) {
+      name.spec.msg_id = ( entry++ )->msgID;
+    } else {
+      name.spec.msg_id = ( frag++ )->msgID;
+    }
+    onName( (const MsgShortName&)name );
+  }
+}
+
+
+template <typename F>
+void Cache::forEachName( const MsgShortName& lower, const MsgShortName& upper, F onName ) const {
+  forSyncStreams( lower, upper, [&]( const ShortName& key, const Stream& stream, uint32_t firstID, uint32_t endID ) {
+    forStreamNames( key, stream, firstID, endID, onName );
+  } );
+}
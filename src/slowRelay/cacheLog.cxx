@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cacheLog.h"
+
+
+static size_t align8( size_t n ) {
+  return ( n + 7 ) & ~(size_t)7;
+}
+
+
+static uint32_t recordCheck( const MsgShortName& name, const uint8_t* data, uint32_t len ) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for ( int i = 0; i < MSG_SHORT_NAME_LEN; i++ ) {
+    hash = ( hash ^ name.data[i] ) * 16777619u;
+  }
+  for ( uint32_t i = 0; i < len; i++ ) {
+    hash = ( hash ^ data[i] ) * 16777619u;
+  }
+  return hash;
+}
+
+
+CacheLog::CacheLog( const std::string& dirVal, size_t segmentBytesVal )
+  : dir( dirVal ), segmentBytes( segmentBytesVal ), nextSeq( 1 ) {
+}
+
+
+CacheLog::~CacheLog() {
+  for ( Segment& seg : segs ) {
+    unmap( seg );
+  }
+}
+
+
+std::string CacheLog::path( uint64_t seq ) const {
+  char file[32];
+  snprintf( file, sizeof( file ), "cache-%08llx.seg", (unsigned long long)seq );
+  return dir + "/" + file;
+}
+
+
+void CacheLog::unmap( Segment& seg ) {
+  if ( seg.base ) {
+    munmap( seg.base, seg.mapLen );
+    seg.base = NULL;
+  }
+  if ( seg.fd >= 0 ) {
+    close( seg.fd );
+    seg.fd = -1;
+  }
+}
+
+
+int CacheLog::load( uint64_t nowMs, const std::function<void( const Record& )>& onRecord ) {
+  assert( segs.empty() );
+  mkdir( dir.c_str(), 0755 );
+
+  DIR* d = opendir( dir.c_str() );
+  if ( !d ) {
+    perror( "Could not open cache directory" );
+    return -1;
+  }
+  std::vector<uint64_t> seqs;
+  while ( struct dirent* ent = readdir( d ) ) {
+    unsigned long long seq;
+    char tail;
+    if ( sscanf( ent->d_name, "cache-%llx.se%c", &seq, &tail ) == 2 ) {
+      seqs.push_back( seq );
+    }
+  }
+  closedir( d );
+  std::sort( seqs.begin(), seqs.end() );
+
+  for ( uint64_t seq : seqs ) {
+    nextSeq = seq + 1;
+    Segment seg = Segment();
+    seg.seq = seq;
+    seg.fd = -1;
+    if ( !loadSegment( seg, nowMs, onRecord ) ) {
+      std::cerr << "Skipping bad cache segment " << path( seq ) << std::endl;
+      unmap( seg );
+      continue;
+    }
+    segs.push_back( std::move( seg ) );
+  }
+
+  // only the last segment is written to, any other left unsealed by a crash is sealed now
+  for ( size_t i = 0; i + 1 < segs.size(); i++ ) {
+    if ( !segs[i].sealed && !seal( segs[i] ) ) {
+      return -1;
+    }
+  }
+  if ( segs.empty() || segs.back().sealed ) {
+    return openActive() ? 0 : -1;
+  }
+  return 0;
+}
+
+
+bool CacheLog::loadSegment( Segment& seg, uint64_t nowMs, const std::function<void( const Record& )>& onRecord ) {
+  seg.fd = open( path( seg.seq ).c_str(), O_RDWR );
+  if ( seg.fd < 0 ) {
+    return false;
+  }
+  struct stat st;
+  if ( ( fstat( seg.fd, &st ) != 0 ) || ( (size_t)st.st_size < sizeof( CacheLogSegmentHeader ) ) ) {
+    return false;
+  }
+
+  // a sealed segment ends with a footer that covers its index exactly
+  CacheLogFooter footer;
+  bool sealed = false;
+  if ( (size_t)st.st_size >= sizeof( CacheLogSegmentHeader ) + sizeof( footer ) ) {
+    if ( pread( seg.fd, &footer, sizeof( footer ), st.st_size - sizeof( footer ) ) != sizeof( footer ) ) {
+      return false;
+    }
+    sealed = ( footer.magic == cacheLogFooterMagic )
+      && ( footer.indexOffset + (uint64_t)footer.count * sizeof( CacheLogIndexEntry ) + sizeof( footer ) == (uint64_t)st.st_size );
+  }
+  if ( !sealed && ( (size_t)st.st_size < segmentBytes ) && ( ftruncate( seg.fd, segmentBytes ) != 0 ) ) {
+    return false;
+  }
+
+  seg.mapLen = sealed ? st.st_size : std::max<size_t>( st.st_size, segmentBytes );
+  void* base = mmap( NULL, seg.mapLen, sealed ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0 );
+  if ( base == MAP_FAILED ) {
+    perror( "Could not map cache segment" );
+    return false;
+  }
+  seg.base = (uint8_t*)base;
+  if ( memcmp( seg.base, cacheLogMagic, sizeof( cacheLogMagic ) ) != 0 ) {
+    return false;
+  }
+
+  Record rec;
+  rec.segment = seg.seq;
+  seg.sealed = sealed;
+  if ( sealed ) {
+    seg.used = footer.indexOffset;
+    seg.index = (const CacheLogIndexEntry*)( seg.base + footer.indexOffset );
+    seg.count = footer.count;
+    for ( uint32_t i = 0; i < seg.count; i++ ) {
+      const CacheLogIndexEntry& entry = seg.index[i];
+      if ( ( entry.offset + (uint64_t)entry.len > footer.indexOffset ) ) {
+        return false;
+      }
+      if ( entry.expiryMs && ( entry.expiryMs <= nowMs ) ) {
+        continue;
+      }
+      rec.name = entry.name;
+      rec.expiryMs = entry.expiryMs;
+      rec.fragment = entry.fragment;
+      rec.frag = entry.frag;
+      rec.data = seg.base + entry.offset;
+      rec.len = entry.len;
+      seg.liveBytes += entry.len;
+      onRecord( rec );
+    }
+    return true;
+  }
+
+  // the active segment, keep every complete record
+  size_t offset = sizeof( CacheLogSegmentHeader );
+  while ( offset + sizeof( CacheLogRecord ) <= seg.mapLen ) {
+    CacheLogRecord hdr;
+    memcpy( &hdr, seg.base + offset, sizeof( hdr ) );
+    const size_t dataOffset = offset + sizeof( hdr );
+    if ( ( hdr.magic != cacheLogRecordMagic ) || ( dataOffset + hdr.len > seg.mapLen )
+         || ( hdr.check != recordCheck( hdr.name, seg.base + dataOffset, hdr.len ) ) ) {
+      break;
+    }
+
+    CacheLogIndexEntry entry = CacheLogIndexEntry();
+    entry.name = hdr.name;
+    entry.expiryMs = hdr.expiryMs;
+    entry.frag = hdr.frag;
+    entry.offset = dataOffset;
+    entry.len = hdr.len;
+    entry.fragment = hdr.fragment;
+    seg.pending.push_back( entry );
+    offset = align8( dataOffset + hdr.len );
+
+    if ( hdr.expiryMs && ( hdr.expiryMs <= nowMs ) ) {
+      continue;
+    }
+    rec.name = hdr.name;
+    rec.expiryMs = hdr.expiryMs;
+    rec.fragment = hdr.fragment;
+    rec.frag = hdr.frag;
+    rec.data = seg.base + dataOffset;
+    rec.len = hdr.len;
+    seg.liveBytes += hdr.len;
+    onRecord( rec );
+  }
+  seg.used = offset;
+
+  // Cut any partial record. A record is only written after the one before it, so one whose
+  // header was never written has nothing after it, but after a damaged one there may be
+  // records that would be read back once the next record is appended over it.
+  uint32_t magic = 0;
+  if ( offset + sizeof( magic ) <= seg.mapLen ) {
+    memcpy( &magic, seg.base + offset, sizeof( magic ) );
+  }
+  memset( seg.base + offset, 0,
+          ( magic == cacheLogRecordMagic ) ? seg.mapLen - offset : std::min( seg.mapLen - offset, sizeof( CacheLogRecord ) ) );
+  return true;
+}
+
+
+bool CacheLog::openActive() {
+  Segment seg = Segment();
+  seg.seq = nextSeq++;
+  seg.fd = open( path( seg.seq ).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if ( seg.fd < 0 ) {
+    perror( "Could not create cache segment" );
+    return false;
+  }
+  if ( ftruncate( seg.fd, segmentBytes ) != 0 ) {
+    perror( "Could not size cache segment" );
+    close( seg.fd );
+    return false;
+  }
+  void* base = mmap( NULL, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0 );
+  if ( base == MAP_FAILED ) {
+    perror( "Could not map cache segment" );
+    close( seg.fd );
+    return false;
+  }
+  seg.base = (uint8_t*)base;
+  seg.mapLen = segmentBytes;
+
+  CacheLogSegmentHeader hdr;
+  memcpy( hdr.magic, cacheLogMagic, sizeof( hdr.magic ) );
+  hdr.seq = seg.seq;
+  memcpy( seg.base, &hdr, sizeof( hdr ) );
+  seg.used = sizeof( hdr );
+  segs.push_back( std::move( seg ) );
+  return true;
+}
+
+
+// Write the index and footer after the records and cut the file to length. The mapping stays
+// where it is, as the cache points into it, and nothing past the new end is ever read.
+bool CacheLog::seal( Segment& seg ) {
+  assert( !seg.sealed );
+  const size_t indexOffset = align8( seg.used );
+  const size_t indexLen = seg.pending.size() * sizeof( CacheLogIndexEntry );
+  CacheLogFooter footer;
+  footer.magic = cacheLogFooterMagic;
+  footer.count = seg.pending.size();
+  footer.indexOffset = indexOffset;
+  const size_t fileLen = indexOffset + indexLen + sizeof( footer );
+  assert( fileLen <= seg.mapLen );
+
+  memcpy( seg.base + indexOffset, seg.pending.data(), indexLen );
+  memcpy( seg.base + indexOffset + indexLen, &footer, sizeof( footer ) );
+  if ( msync( seg.base, fileLen, MS_SYNC ) != 0 ) {
+    perror( "Could not sync cache segment" );
+  }
+  if ( ftruncate( seg.fd, fileLen ) != 0 ) {
+    perror( "Could not truncate cache segment" );
+    return false;
+  }
+  mprotect( seg.base, seg.mapLen, PROT_READ );
+  seg.used = indexOffset;
+  seg.index = (const CacheLogIndexEntry*)( seg.base + indexOffset );
+  seg.count = footer.count;
+  seg.sealed = true;
+  std::vector<CacheLogIndexEntry>().swap( seg.pending );
+  return true;
+}
+
+
+bool CacheLog::append( Record& record, const uint8_t* data ) {
+  assert( !segs.empty() );
+  const size_t recordLen = align8( sizeof( CacheLogRecord ) + record.len );
+  if ( sizeof( CacheLogSegmentHeader ) + recordLen + sizeof( CacheLogIndexEntry ) + sizeof( CacheLogFooter ) > segmentBytes ) {
+    return false; // would never fit
+  }
+
+  Segment* seg = &segs.back();
+  if ( seg->sealed ) {
+    // the last one filled up but the next could not be made, try again
+    if ( !openActive() ) {
+      return false;
+    }
+    seg = &segs.back();
+  }
+  const size_t indexLen = ( seg->pending.size() + 1 ) * sizeof( CacheLogIndexEntry );
+  if ( align8( seg->used + recordLen ) + indexLen + sizeof( CacheLogFooter ) > seg->mapLen ) {
+    if ( !seal( *seg ) || !openActive() ) {
+      return false;
+    }
+    seg = &segs.back();
+  }
+
+  CacheLogRecord hdr = CacheLogRecord();
+  hdr.magic = cacheLogRecordMagic;
+  hdr.len = record.len;
+  hdr.check = recordCheck( record.name, data, record.len );
+  hdr.fragment = record.fragment ? 1 : 0;
+  hdr.expiryMs = record.expiryMs;
+  hdr.name = record.name;
+  if ( record.fragment ) {
+    hdr.frag = record.frag;
+  }
+
+  // data first and the header last, so a crash part way leaves no valid record behind
+  const size_t dataOffset = seg->used + sizeof( hdr );
+  memcpy( seg->base + dataOffset, data, record.len );
+  memcpy( seg->base + seg->used, &hdr, sizeof( hdr ) );
+
+  CacheLogIndexEntry entry = CacheLogIndexEntry();
+  entry.name = hdr.name;
+  entry.expiryMs = hdr.expiryMs;
+  entry.frag = hdr.frag;
+  entry.offset = dataOffset;
+  entry.len = hdr.len;
+  entry.fragment = hdr.fragment;
+  seg->pending.push_back( entry );
+
+  seg->used += recordLen;
+  seg->liveBytes += record.len;
+  record.data = seg->base + dataOffset;
+  record.segment = seg->seq;
+  return true;
+}
+
+
+void CacheLog::release( uint64_t segment, uint32_t len ) {
+  for ( Segment& seg : segs ) {
+    if ( seg.seq == segment ) {
+      assert( seg.liveBytes >= len );
+      seg.liveBytes -= len;
+      return;
+    }
+  }
+}
+
+
+size_t CacheLog::compact( const std::function<bool( const Record& )>& isLive,
+                          const std::function<void( const Record& )>& moved ) {
+  // the sealed segment with the most unused space, if at least half of it is
+  size_t victim = segs.size();
+  size_t mostDead = 0;
+  for ( size_t i = 0; i < segs.size(); i++ ) {
+    const Segment& seg = segs[i];
+    const size_t dataLen = seg.used - sizeof( CacheLogSegmentHeader );
+    const size_t dead = dataLen - std::min( dataLen, seg.liveBytes );
+    if ( seg.sealed && ( dead * 2 >= dataLen ) && ( dead >= mostDead ) ) {
+      victim = i;
+      mostDead = dead;
+    }
+  }
+  if ( victim == segs.size() ) {
+    return 0;
+  }
+
+  const uint64_t seq = segs[ victim ].seq;
+  const size_t reclaimed = segs[ victim ].mapLen;
+  for ( uint32_t i = 0; i < segs[ victim ].count; i++ ) {
+    // appending can open a segment and grow segs, so the victim is looked up by index each time
+    const CacheLogIndexEntry& entry = segs[ victim ].index[i];
+    Record rec;
+    rec.name = entry.name;
+    rec.expiryMs = entry.expiryMs;
+    rec.fragment = entry.fragment;
+    rec.frag = entry.frag;
+    rec.data = segs[ victim ].base + entry.offset;
+    rec.len = entry.len;
+    rec.segment = seq;
+    if ( !isLive( rec ) ) {
+      continue;
+    }
+    Record copy = rec;
+    if ( !append( copy, rec.data ) ) {
+      return 0; // out of space, leave the rest where it is
+    }
+    moved( copy );
+  }
+
+  unmap( segs[ victim ] );
+  if ( unlink( path( seq ).c_str() ) != 0 ) {
+    perror( "Could not remove cache segment" );
+  }
+  segs.erase( segs.begin() + victim );
+  return reclaimed;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <slower.h>
+
+/**
+ * Append only log of cached messages in memory mapped segment files, so a relay can restart
+ *     with its cache.
+ *
+ *     Each segment is a fixed size file, cache-<seq>.seg in the log directory, holding a
+ *     CacheLogSegmentHeader and then records of a CacheLogRecord header followed by the data.
+ *     When a segment is full an index of its records is written after them, then a
+ *     CacheLogFooter, and the file is cut to that length. Loading reads only the footers and
+ *     indexes of these sealed segments and hands out pointers to the data where it is mapped,
+ *     so start up does not depend on how much data is cached. The one segment still being
+ *     written is scanned record by record, stopping at the first that is incomplete.
+ *
+ *     Segments are never changed once sealed. Space is reclaimed by compact(), which copies the
+ *     records still in use out of segments that are mostly unused and deletes the files.
+ */
+
+const char cacheLogMagic[8] = { 'S', 'L', 'O', 'W', 'S', 'E', 'G', '1' };
+const uint32_t cacheLogRecordMagic = 0x43524c53;   // "SLRC"
+const uint32_t cacheLogFooterMagic = 0x54464c53;   // "SLFT"
+
+struct CacheLogSegmentHeader {
+  char         magic[8];     ///< cacheLogMagic
+  uint64_t     seq;          ///< Matches the file name, segments are loaded in this order
+} __attribute__ ((__packed__, __aligned__(1)));
+
+struct CacheLogRecord {
+  uint32_t      magic;        ///< cacheLogRecordMagic
+  uint32_t      len;          ///< Data bytes that follow, records are padded to 8 bytes
+  uint32_t      check;        ///< FNV-1a of the name and data, to spot a record cut short by a crash
+  uint8_t       fragment;     ///< 1 if frag is valid and the data is one fragment of name
+  uint8_t       reserved[3];
+  uint64_t      expiryMs;     ///< Wall clock time since epoch the record expires, 0 for never
+  MsgShortName  name;
+  MsgFragHeader frag;
+} __attribute__ ((__packed__, __aligned__(1)));
+
+struct CacheLogIndexEntry {
+  MsgShortName  name;
+  uint64_t      expiryMs;
+  MsgFragHeader frag;
+  uint32_t      offset;       ///< Of the data from the start of the segment
+  uint32_t      len;
+  uint8_t       fragment;
+  uint8_t       reserved[3];
+} __attribute__ ((__packed__, __aligned__(1)));
+
+struct CacheLogFooter {
+  uint32_t     magic;         ///< cacheLogFooterMagic
+  uint32_t     count;         ///< Index entries
+  uint64_t     indexOffset;   ///< Index entries start here and end at this footer
+} __attribute__ ((__packed__, __aligned__(1)));
+
+
+class CacheLog {
+public:
+  /// Where a record is, data points into the mapped segment
+  struct Record {
+    MsgShortName name;
+    uint64_t expiryMs;
+    bool fragment;
+    MsgFragHeader frag;
+    const uint8_t* data;
+    uint32_t len;
+    uint64_t segment;
+  };
+
+  CacheLog( const std::string& dir, size_t segmentBytes = 64 << 20 );
+  ~CacheLog();
+
+  CacheLog( const CacheLog& ) = delete;
+  CacheLog& operator=( const CacheLog& ) = delete;
+
+  /// Map the segments in the directory and call onRecord for each record not expired by nowMs.
+  /// Returns 0 on success.
+  int load( uint64_t nowMs, const std::function<void( const Record& )>& onRecord );
+
+  /// Returns false, with the record left as it was, if the data could not be written
+  bool append( Record& record, const uint8_t* data );
+
+  /// Note that a record is no longer used
+  void release( uint64_t segment, uint32_t len );
+
+  /// Copy the records that isLive still wants out of the sealed segment with the most unused
+  /// space, if at least half of it is unused, calling moved with the new location of each.
+  /// Then delete the segment. Returns the bytes reclaimed.
+  size_t compact( const std::function<bool( const Record& )>& isLive,
+                  const std::function<void( const Record& )>& moved );
+
+  size_t segments() const { return segs.size(); }
+
+private:
+  struct Segment {
+    uint64_t seq;
+    int fd;
+    uint8_t* base;
+    size_t mapLen;
+    size_t used;                          ///< Write offset, or start of the index once sealed
+    size_t liveBytes;
+    bool sealed;
+    const CacheLogIndexEntry* index;      ///< In the mapping once sealed
+    uint32_t count;
+    std::vector<CacheLogIndexEntry> pending;   ///< Index of the active segment
+  };
+
+  std::string path( uint64_t seq ) const;
+  bool openActive();
+  bool seal( Segment& seg );
+  bool loadSegment( Segment& seg, uint64_t nowMs, const std::function<void( const Record& )>& onRecord );
+  void unmap( Segment& seg );
+
+  const std::string dir;
+  const size_t segmentBytes;
+  std::vector<Segment> segs;             ///< In seq order, the last is the active one
+  uint64_t nextSeq;
+};
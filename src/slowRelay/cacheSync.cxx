@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "cacheSync.h"
+
+
+CacheSync::CacheSync( const Cache& cacheVal, int partsVal )
+  : cache( cacheVal ), parts( partsVal ) {
+  assert( ( parts >= 2 ) && ( parts <= 255 ) );
+}
+
+
+CacheSync::Range CacheSync::whole() const {
+  MsgShortName lower;
+  MsgShortName upper;
+  std::memset( lower.data, 0, MSG_SHORT_NAME_LEN );
+  std::memset( upper.data, 0xff, MSG_SHORT_NAME_LEN );
+  return summarize( lower, upper );
+}
+
+
+// Summary of this cache's side of a range, listing the names if there are few enough
+CacheSync::Range CacheSync::summarize( const MsgShortName& lower, const MsgShortName& upper ) const {
+  Range range;
+  Cache::Summary sum = cache.summarize( lower, upper );
+  range.summary.lower = lower;
+  range.summary.upper = upper;
+  range.summary.count = sum.count;
+  range.summary.fingerprint = sum.fingerprint;
+  range.summary.numNames = 0;
+  if ( sum.count <= SLOWER_SYNC_MAX_NAMES ) {
+    cache.forEachName( lower, upper, [&]( const MsgShortName& name ) { range.names.push_back( name ); } );
+    assert( range.names.size() == sum.count );
+    range.summary.numNames = sum.count;
+  }
+  return range;
+}
+
+
+bool CacheSync::handle( const char buf[], int bufLen, Result& result ) const {
+  int loc = 0;
+  while ( loc < bufLen ) {
+    MsgSyncRange theirs;
+    if ( bufLen - loc < (int)sizeof( theirs ) ) {
+      return false;
+    }
+    std::memcpy( &theirs, buf + loc, sizeof( theirs ) ); loc += sizeof( theirs );
+    const int namesLen = theirs.numNames * sizeof( MsgShortName );
+    if ( ( bufLen - loc < namesLen ) || !Cache::syncBefore( theirs.lower, theirs.upper ) ) {
+      return false;
+    }
+    std::vector<MsgShortName> theirNames( theirs.numNames );
+    std::memcpy( theirNames.data(), buf + loc, namesLen ); loc += namesLen;
+
+    // they listed everything they have in the range, compare name by name
+    if ( theirs.numNames == theirs.count ) {
+      std::vector<MsgShortName> ours;
+      cache.forEachName( theirs.lower, theirs.upper, [&]( const MsgShortName& name ) { ours.push_back( name ); } );
+      std::sort( theirNames.begin(), theirNames.end(), Cache::syncBefore );
+      auto outside = [&]( const MsgShortName& name ) {
+        return Cache::syncBefore( name, theirs.lower ) || !Cache::syncBefore( name, theirs.upper );
+      };
+      theirNames.erase( std::remove_if( theirNames.begin(), theirNames.end(), outside ), theirNames.end() );
+
+      size_t pushed = result.push.size();
+      size_t fetched = result.fetch.size();
+      std::set_difference( ours.begin(), ours.end(), theirNames.begin(), theirNames.end(),
+                           std::back_inserter( result.push ), Cache::syncBefore );
+      std::set_difference( theirNames.begin(), theirNames.end(), ours.begin(), ours.end(),
+                           std::back_inserter( result.fetch ), Cache::syncBefore );
+      ( ( pushed == result.push.size() ) && ( fetched == result.fetch.size() ) ? result.matched : result.differed )++;
+      continue;
+    }
+
+    Range mine = summarize( theirs.lower, theirs.upper );
+    if ( ( mine.summary.count == theirs.count ) && ( mine.summary.fingerprint == theirs.fingerprint ) ) {
+      result.matched++;
+      continue;
+    }
+    result.differed++;
+    if ( mine.summary.numNames == mine.summary.count ) {
+      result.replies.push_back( std::move( mine ) );
+      continue;
+    }
+
+    std::vector<MsgShortName> bounds = cache.split( theirs.lower, theirs.upper, parts );
+    bounds.push_back( theirs.upper );
+    MsgShortName lower = theirs.lower;
+    for ( const MsgShortName& upper : bounds ) {
+      result.replies.push_back( summarize( lower, upper ) );
+      lower = upper;
+    }
+  }
+  return true;
+}
+
+
+int CacheSync::send( SlowerConnection& slower, const SlowerRemote& peer, const std::vector<Range>& ranges ) {
+  const int room = slowerMTU - sizeof( MsgHeader ) - sizeof( MsgSyncHeader );
+  std::vector<MsgSyncRange> summaries;
+  std::vector<MsgShortName> names;
+  int used = 0;
+  int ret = 0;
+
+  SlowerRemote dest = peer;
+  auto flush = [&]() {
+    if ( !summaries.empty() ) {
+      int err = slowerSync( slower, summaries.data(), summaries.size(), names.data(), &dest );
+      ret = err ? err : ret;
+    }
+    summaries.clear();
+    names.clear();
+    used = 0;
+  };
+
+  for ( const Range& range : ranges ) {
+    const int len = sizeof( MsgSyncRange ) + range.names.size() * sizeof( MsgShortName );
+    assert( len <= room );
+    if ( ( used + len > room ) || ( summaries.size() == 255 ) ) {
+      flush();
+    }
+    summaries.push_back( range.summary );
+    names.insert( names.end(), range.names.begin(), range.names.end() );
+    used += len;
+  }
+  flush();
+  return ret;
+}
+
+
+int CacheSync::fetch( SlowerConnection& slower, const SlowerRemote& peer, std::vector<MsgShortName> names ) {
+  std::sort( names.begin(), names.end(), Cache::syncBefore );
+  SlowerRemote dest = peer;
+  int ret = 0;
+
+  // runs of msg_ids in one stream become ranges of one fetch
+  size_t i = 0;
+  while ( i < names.size() ) {
+    MsgShortName stream = names[i];
+    stream.spec.msg_id = 0;
+    std::vector<MsgAckRange> ranges;
+    for ( ; i < names.size(); i++ ) {
+      MsgShortName key = names[i];
+      key.spec.msg_id = 0;
+      if ( ( key != stream ) || ( ranges.size() == SLOWER_MAX_ACK_RANGES ) ) {
+        break;
+      }
+      const uint32_t id = names[i].spec.msg_id;
+      if ( !ranges.empty() && ( ranges.back().last + 1 == id ) ) {
+        ranges.back().last = id;
+      } else {
+        MsgAckRange range = { id, id };
+        ranges.push_back( range );
+      }
+    }
+    int err = slowerFetch( slower, stream, ranges.data(), ranges.size(), &dest );
+    ret = err ? err : ret;
+  }
+  return ret;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <slower.h>
+
+#include "cache.h"
+
+/**
+ * Reconciles the cache with a peer relay's, so relays that were cut off from each other catch
+ *     up on what they missed once they can talk again.
+ *
+ *     A round starts with one range covering the whole cache. The peer answers each range it
+ *     gets: nothing if its own count and fingerprint for the range match, the names it has if
+ *     there are at most SLOWER_SYNC_MAX_NAMES, otherwise the range split into parts with its
+ *     summary of each. Ranges bounce back and forth getting smaller until one side can list
+ *     its names, and the other then sends what the list lacks and fetches what it lacks
+ *     itself. Ranges that match are never looked at again, so the work and traffic grow with
+ *     the number of names that differ, not with the size of the cache.
+ */
+class CacheSync {
+public:
+  struct Range {
+    MsgSyncRange summary;
+    std::vector<MsgShortName> names;   ///< Listed names, numNames of them
+  };
+
+  /// What to do about the ranges a peer sent
+  struct Result {
+    std::vector<Range> replies;        ///< To send back to the peer
+    std::vector<MsgShortName> push;    ///< Cached here and missing at the peer
+    std::vector<MsgShortName> fetch;   ///< At the peer and missing here
+    size_t matched = 0;                ///< Ranges the same on both sides
+    size_t differed = 0;
+  };
+
+  CacheSync( const Cache& cache, int parts=16 );
+
+  /// One range over the whole cache, to start a round
+  Range whole() const;
+
+  /// Answer the ranges from a SlowerMsgSync, returns false if they are malformed
+  bool handle( const char buf[], int bufLen, Result& result ) const;
+
+  /// Send ranges, as many to a message as fit
+  static int send( SlowerConnection& slower, const SlowerRemote& peer, const std::vector<Range>& ranges );
+
+  /// Ask peer for names, one SlowerMsgFetch per stream
+  static int fetch( SlowerConnection& slower, const SlowerRemote& peer, std::vector<MsgShortName> names );
+
+private:
+  Range summarize( const MsgShortName& lower, const MsgShortName& upper ) const;
+
+  const Cache& cache;
+  const int parts;
+};
@@ -0,0 +1,91 @@
+#include <cstring>
+
+#include "cache.h"
+#include "dedupeFilter.h"
+
+// odd multipliers that pick the bit in each word from the same 32 bit hash
+static const uint32_t salts[ DedupeFilter::blockWords ] = {
+  0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du, 0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+  0x3c6ef373u, 0xa54ff53bu, 0x510e527fu, 0x9b05688du, 0x1f83d9abu, 0x5be0cd19u, 0xcbbb9d5du, 0x629a292bu };
+
+static const size_t lineWords = 64 / sizeof( uint32_t );
+
+
+DedupeFilter::DedupeFilter( size_t bytes, uint64_t windowMsVal, uint64_t nowMs )
+  : numBlocks( bytes / 2 / ( blockWords * sizeof( uint32_t ) ) ), current( 0 ),
+    windowMs( windowMsVal ), startMs( nowMs ), numRotations( 0 ) {
+  static_assert( blockWords * sizeof( uint32_t ) == 64, "a block is one cache line" );
+  count[ 0 ] = 0;
+  count[ 1 ] = 0;
+
+  // room to start each generation on a cache line boundary
+  storage.resize( 2 * numBlocks * blockWords + lineWords );
+  uintptr_t start = reinterpret_cast<uintptr_t>( storage.data() );
+  size_t skip = ( ( 64 - start % 64 ) % 64 ) / sizeof( uint32_t );
+  words[ 0 ] = storage.data() + skip;
+  words[ 1 ] = words[ 0 ] + numBlocks * blockWords;
+}
+
+
+DedupeFilter::Probe DedupeFilter::probe( const MsgShortName& name ) const {
+  const uint64_t hash = Cache::syncHash( name );
+  Probe p;
+  p.block = (size_t)( ( ( hash >> 32 ) * numBlocks ) >> 32 );   // high half picks the block
+  p.hash = (uint32_t)hash;
+  return p;
+}
+
+
+bool DedupeFilter::test( int gen, const Probe& p ) const {
+  const uint32_t* block = words[ gen ] + p.block * blockWords;
+  uint32_t missing = 0;
+  for ( int w = 0; w < blockWords; w++ ) {
+    missing |= ~block[ w ] & ( 1u << ( ( p.hash * salts[ w ] ) >> 27 ) );
+  }
+  return missing == 0;
+}
+
+
+void DedupeFilter::add( const MsgShortName& name, uint64_t nowMs ) {
+  if ( numBlocks == 0 ) {
+    return;
+  }
+  if ( count[ current ] >= capacity() ) {
+    rotate( nowMs );
+  }
+  const Probe p = probe( name );
+  uint32_t* block = words[ current ] + p.block * blockWords;
+  for ( int w = 0; w < blockWords; w++ ) {
+    block[ w ] |= 1u << ( ( p.hash * salts[ w ] ) >> 27 );
+  }
+  count[ current ]++;
+}
+
+
+bool DedupeFilter::contains( const MsgShortName& name ) const {
+  if ( size() == 0 ) {
+    return false;
+  }
+  const Probe p = probe( name );
+  return ( count[ current ] && test( current, p ) ) || ( count[ 1 - current ] && test( 1 - current, p ) );
+}
+
+
+bool DedupeFilter::expire( uint64_t nowMs ) {
+  if ( ( size() == 0 ) || ( nowMs < startMs + windowMs ) ) {
+    return false;
+  }
+  rotate( nowMs );
+  return true;
+}
+
+
+void DedupeFilter::rotate( uint64_t nowMs ) {
+  current = 1 - current;
+  if ( count[ current ] ) {
+    std::memset( words[ current ], 0, numBlocks * blockWords * sizeof( uint32_t ) );
+    count[ current ] = 0;
+  }
+  startMs = nowMs;
+  numRotations++;
+}
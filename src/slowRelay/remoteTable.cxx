@@ -0,0 +1,131 @@
+#include <cstring>
+
+#include "remoteTable.h"
+
+const RemoteID RemoteTable::none;
+
+
+RemoteTable::RemoteTable() : slots( 64, none ), count( 0 ) {
+}
+
+
+uint32_t RemoteTable::hash( const SlowerRemote& remote ) {
+  uint64_t a = 0;
+  uint64_t b = 0;
+  if ( remote.addr.sin_family == AF_INET6 ) {
+    std::memcpy( &a, &remote.addr6.sin6_addr, 8 );
+    std::memcpy( &b, (const uint8_t*)&remote.addr6.sin6_addr + 8, 8 );
+    b ^= remote.addr6.sin6_scope_id;
+  } else {
+    a = remote.addr.sin_addr.s_addr;
+  }
+  a ^= ( (uint64_t)remote.addr.sin_port << 32 ) ^ ( (uint64_t)remote.addr.sin_family << 48 );
+
+  // splitmix64 finalizer
+  auto mix = []( uint64_t x ) {
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebull;
+    return x ^ ( x >> 31 );
+  };
+  return (uint32_t)( mix( a ^ mix( b + 0x9e3779b97f4a7c15ull ) ) >> 32 );
+}
+
+
+size_t RemoteTable::slotOf( const SlowerRemote& remote, uint32_t h ) const {
+  const size_t mask = slots.size() - 1;
+  size_t slot = h & mask;
+  while ( slots[ slot ] != none ) {
+    const Entry& entry = entries[ slots[ slot ] ];
+    if ( ( entry.hash == h ) && ( entry.remote == remote ) ) {
+      break;
+    }
+    slot = ( slot + 1 ) & mask;
+  }
+  return slot;
+}
+
+
+RemoteID RemoteTable::find( const SlowerRemote& remote ) const {
+  return slots[ slotOf( remote, hash( remote ) ) ];
+}
+
+
+RemoteID RemoteTable::acquire( const SlowerRemote& remote ) {
+  const uint32_t h = hash( remote );
+  size_t slot = slotOf( remote, h );
+  if ( slots[ slot ] != none ) {
+    entries[ slots[ slot ] ].refs++;
+    return slots[ slot ];
+  }
+
+  if ( 2 * ( count + 1 ) > slots.size() ) {
+    grow();
+    slot = slotOf( remote, h );
+  }
+  RemoteID id;
+  if ( freeIDs.empty() ) {
+    id = (RemoteID)entries.size();
+    assert( id != none );
+    entries.emplace_back();
+  } else {
+    id = freeIDs.back();
+    freeIDs.pop_back();
+  }
+  Entry& entry = entries[ id ];
+  entry.remote = remote;
+  entry.hash = h;
+  entry.refs = 1;
+  slots[ slot ] = id;
+  count++;
+  return id;
+}
+
+
+void RemoteTable::release( RemoteID id ) {
+  Entry& entry = entries[ id ];
+  assert( entry.refs > 0 );
+  if ( --entry.refs > 0 ) {
+    return;
+  }
+  unslot( slotOf( entry.remote, entry.hash ) );
+  freeIDs.push_back( id );
+  count--;
+}
+
+
+void RemoteTable::unslot( size_t slot ) {
+  // Close the gap by moving back later entries of the same probe run, so lookups never need
+  // to step over deleted slots. An entry can fill the gap unless its home slot lies after the
+  // gap, between it and where the entry sits.
+  const size_t mask = slots.size() - 1;
+  size_t next = slot;
+  for ( ;; ) {
+    next = ( next + 1 ) & mask;
+    if ( slots[ next ] == none ) {
+      break;
+    }
+    const size_t home = entries[ slots[ next ] ].hash & mask;
+    if ( ( ( next - home ) & mask ) >= ( ( next - slot ) & mask ) ) {
+      slots[ slot ] = slots[ next ];
+      slot = next;
+    }
+  }
+  slots[ slot ] = none;
+}
+
+
+void RemoteTable::grow() {
+  std::vector<RemoteID> old( 2 * slots.size(), none );
+  old.swap( slots );
+  const size_t mask = slots.size() - 1;
+  for ( RemoteID id : old ) {
+    if ( id == none ) {
+      continue;
+    }
+    size_t slot = entries[ id ].hash & mask;
+    while ( slots[ slot ] != none ) {
+      slot = ( slot + 1 ) & mask;
+    }
+    slots[ slot ] = id;
+  }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <slower.h>
+
+typedef uint32_t RemoteID;
+
+/**
+ * Remotes interned as small ids, so the relay's tables hold 4 byte ids instead of addresses.
+ *
+ *     Ids index a flat array of remotes, and an open addressing hash of IPv4 or IPv6 address and
+ *     port finds the id of a remote. Each id is reference counted. acquire() adds a reference,
+ *     looking the remote up or adding it, and release() drops one. An id with no references
+ *     left is freed and may be handed to another remote, so anything that keeps an id must hold
+ *     a reference to it.
+ */
+class RemoteTable {
+public:
+  static const RemoteID none = UINT32_MAX;
+
+  RemoteTable();
+
+  RemoteTable( const RemoteTable& ) = delete;
+  RemoteTable& operator=( const RemoteTable& ) = delete;
+
+  RemoteID acquire( const SlowerRemote& remote );
+  void acquire( RemoteID id ) { assert( entries[ id ].refs > 0 ); entries[ id ].refs++; }
+  void release( RemoteID id );
+
+  /// The id of remote, or none if it has none
+  RemoteID find( const SlowerRemote& remote ) const;
+
+  const SlowerRemote& operator[]( RemoteID id ) const { return entries[ id ].remote; }
+
+  size_t size() const { return count; }
+
+  static uint32_t hash( const SlowerRemote& remote );
+
+private:
+  struct Entry {
+    SlowerRemote remote;
+    uint32_t hash;
+    uint32_t refs;   ///< 0 for a free id
+  };
+
+  size_t slotOf( const SlowerRemote& remote, uint32_t hash ) const;   ///< where it is, or the empty slot it would go in
+  void unslot( size_t slot );
+  void grow();
+
+  std::vector<Entry> entries;      ///< indexed by id
+  std::vector<RemoteID> freeIDs;
+  std::vector<RemoteID> slots;     ///< power of two, at most half full, none when empty
+  size_t count;
+};
@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "sendQueue.h"
+
+
+SendQueue::SendQueue( RemoteTable& remoteTable, size_t normalBudgetVal )
+  : remotes( remoteTable ), normalBudget( normalBudgetVal ) {
+}
+
+
+void SendQueue::push( SlowerPriority priority, RemoteID dest, const MsgShortName& name,
+                      const std::shared_ptr<const std::vector<uint8_t>>& data, uint64_t startMicros,
+                      const MsgFragHeader* frag, const MsgHeaderMetrics* metrics ) {
+  assert( priority < SLOWER_NUM_PRIORITIES );
+  assert( data && !data->empty() );
+
+  remotes.acquire( dest );
+  Item& item = queues[ priority ].pushBack();
+  item.dest = dest;
+  item.name = name;
+  item.data = data;
+  item.startMicros = startMicros;
+  item.fragment = ( frag != NULL );
+  if ( frag ) {
+    item.frag = *frag;
+  }
+  item.hasMetrics = ( metrics != NULL );
+  if ( metrics ) {
+    item.metrics = *metrics;
+  }
+}
+
+
+int SendQueue::send( SlowerConnection& slower, Item& item ) {
+  char* data = (char*)item.data->data();
+  MsgHeaderMetrics* metrics = item.hasMetrics ? &item.metrics : NULL;
+  SlowerRemote dest = remotes[ item.dest ];
+  if ( item.fragment ) {
+    return slowerPubFragment( slower, item.name, item.frag, data, item.data->size(), &dest, metrics );
+  }
+  return slowerPub( slower, item.name, data, item.data->size(), &dest, metrics );
+}
+
+
+SendQueue::Item& SendQueue::Ring::pushBack() {
+  if ( count == items.size() ) {
+    // unroll into a bigger ring, oldest first
+    std::vector<Item> bigger( std::max<size_t>( 64, 2 * items.size() ) );
+    for ( size_t i = 0; i < count; i++ ) {
+      bigger[ i ] = std::move( items[ ( head + i ) % items.size() ] );
+    }
+    items.swap( bigger );
+    head = 0;
+  }
+  return items[ ( head + count++ ) % items.size() ];
+}
+
+
+void SendQueue::Ring::popFront() {
+  assert( count > 0 );
+  items[ head ].data.reset();   // let go of the bytes now rather than when the slot is reused
+  head = ( head + 1 ) % items.size();
+  count--;
+}
+
+
+bool SendQueue::empty() const {
+  for ( const auto& queue : queues ) {
+    if ( queue.count > 0 ) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <slower.h>
+
+#include "remoteTable.h"
+
+/**
+ * Publishes waiting to be sent by the relay, one FIFO per priority class.
+ *
+ *     drain() sends every queued control message and then at most normalBudget normal ones, so
+ *     a large cache replay is spread over several passes of the relay loop and a commit that
+ *     arrives in the middle of it goes out on the next pass instead of behind the whole replay.
+ *     Data is shared between the copies of a publish going to several destinations. Each FIFO
+ *     is a ring that only grows, so once warmed up queueing a publish allocates nothing.
+ *     Destinations are ids in remotes, held from push until sent.
+ */
+class SendQueue {
+public:
+  SendQueue( RemoteTable& remotes, size_t normalBudget=256 );
+
+  /// Queue a publish or, with frag, one fragment. startMicros is when the relay got it, since epoch.
+  void push( SlowerPriority priority, RemoteID dest, const MsgShortName& name,
+             const std::shared_ptr<const std::vector<uint8_t>>& data, uint64_t startMicros,
+             const MsgFragHeader* frag=NULL, const MsgHeaderMetrics* metrics=NULL );
+
+  /// Send what this pass allows, calling onSent( priority, startMicros ) for each. Returns 0 or the last send error.
+  template<typename F>
+  int drain( SlowerConnection& slower, F onSent ) {
+    int ret = 0;
+    for ( int p = SLOWER_NUM_PRIORITIES - 1; p >= 0; p-- ) {
+      size_t budget = ( p == SlowerPriorityNormal ) ? normalBudget : SIZE_MAX;
+      Ring& queue = queues[ p ];
+      while ( ( queue.count > 0 ) && ( budget-- > 0 ) ) {
+        Item& item = queue.items[ queue.head ];
+        int err = send( slower, item );
+        ret = err ? err : ret;
+        onSent( (SlowerPriority)p, item.startMicros );
+        remotes.release( item.dest );
+        queue.popFront();
+      }
+    }
+    return ret;
+  }
+
+  bool empty() const;
+  size_t size( SlowerPriority priority ) const { return queues[ priority ].count; }
+
+private:
+  struct Item {
+    RemoteID dest;
+    MsgShortName name;
+    std::shared_ptr<const std::vector<uint8_t>> data;
+    uint64_t startMicros;
+    bool fragment;
+    MsgFragHeader frag;
+    bool hasMetrics;
+    MsgHeaderMetrics metrics;
+  };
+
+  struct Ring {
+    std::vector<Item> items;
+    size_t head = 0;
+    size_t count = 0;
+
+    Item& pushBack();
+    void popFront();
+  };
+
+  int send( SlowerConnection& slower, Item& item );
+
+  Ring queues[ SLOWER_NUM_PRIORITIES ];
+  RemoteTable& remotes;
+  const size_t normalBudget;
+};
@@ -1,4 +1,5 @@
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
 #include <chrono>
@@ -8,7 +9,10 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <netdb.h>
+#include <signal.h>
 #include <sstream>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -16,11 +20,168 @@
 
 #include <slower.h>
 #include <name.h>
+#include <eventLog.h>
+#include <metrics.h>
+#include <ackBatcher.h>
 
 #include "subscription.h"
 #include "cache.h"
+#include "sendQueue.h"
+#include "cacheSync.h"
+#include "dedupeFilter.h"
+#include "remoteTable.h"
+#include "sourceGuard.h"
 
 
+// Everything the relay exports on its metrics endpoint
+struct RelayMetrics {
+  explicit RelayMetrics( MetricsRegistry& r )
+    : rxPub( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"pub\"" ) ),
+      rxPubDup( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"pub_dup\"" ) ),
+      rxSub( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"sub\"" ) ),
+      rxUnSub( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"unsub\"" ) ),
+      rxFrag( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"pub_frag\"" ) ),
+      rxFragDup( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"pub_frag_dup\"" ) ),
+      rxFetch( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"frag_fetch\"" ) ),
+      rxRepair( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"fetch\"" ) ),
+      rxSync( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"sync\"" ) ),
+      rxInvalid( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"invalid\"" ) ),
+      rxOther( r.counter( "slowr_rx_packets_total", "Packets received by type", "type=\"other\"" ) ),
+      rxLimited( r.counter( "slowr_rx_rate_limited_total", "Packets dropped because their source went over SLOWR_RATE_PPS" ) ),
+      rxBytes( r.counter( "slowr_rx_pub_bytes_total", "Publish data bytes received" ) ),
+      txRelay( r.counter( "slowr_tx_packets_total", "Packets sent by destination", "dest=\"relay\"" ) ),
+      txSub( r.counter( "slowr_tx_packets_total", "Packets sent by destination", "dest=\"subscriber\"" ) ),
+      txReplay( r.counter( "slowr_tx_packets_total", "Packets sent by destination", "dest=\"replay\"" ) ),
+      txAck( r.counter( "slowr_tx_packets_total", "Packets sent by destination", "dest=\"ack\"" ) ),
+      txFetch( r.counter( "slowr_tx_packets_total", "Packets sent by destination", "dest=\"fetch\"" ) ),
+      txRepair( r.counter( "slowr_tx_packets_total", "Packets sent by destination", "dest=\"repair\"" ) ),
+      txSync( r.counter( "slowr_tx_packets_total", "Packets sent by destination", "dest=\"sync\"" ) ),
+      txBytes( r.counter( "slowr_tx_pub_bytes_total", "Publish data bytes sent" ) ),
+      txErrors( r.counter( "slowr_tx_errors_total", "Passes of the send queue or bundles where a send failed" ) ),
+      txDatagrams( r.counter( "slowr_tx_datagrams_total", "UDP datagrams sent, several packets can share one bundle" ) ),
+      cacheHits( r.counter( "slowr_cache_lookups_total", "Subscribe cache lookups by result", "result=\"hit\"" ) ),
+      cacheMisses( r.counter( "slowr_cache_lookups_total", "Subscribe cache lookups by result", "result=\"miss\"" ) ),
+      repairHits( r.counter( "slowr_repair_lookups_total", "Msg ids asked for by fetches by result", "result=\"hit\"" ) ),
+      repairMisses( r.counter( "slowr_repair_lookups_total", "Msg ids asked for by fetches by result", "result=\"miss\"" ) ),
+      cacheMissingData( r.counter( "slowr_cache_missing_data_total", "Cached names found with no data" ) ),
+      cacheEntries( r.gauge( "slowr_cache_entries", "Messages in the cache" ) ),
+      cacheExpired( r.counter( "slowr_cache_expired_total", "Cached names dropped after the TTL of their retention class" ) ),
+      cacheSegments( r.gauge( "slowr_cache_log_segments", "Segment files of the cache log" ) ),
+      cacheCompacted( r.counter( "slowr_cache_compacted_bytes_total", "Cache log bytes reclaimed by compaction" ) ),
+      dedupeHits( r.counter( "slowr_dedupe_hits_total", "Publishes dropped because their name recently expired from the cache" ) ),
+      dedupeNames( r.gauge( "slowr_dedupe_names", "Names expired from the cache held by the dedupe filter" ) ),
+      syncRounds( r.counter( "slowr_sync_rounds_total", "Cache sync rounds started with peer relays" ) ),
+      syncMatched( r.counter( "slowr_sync_ranges_total", "Sync ranges from peer relays by result", "result=\"match\"" ) ),
+      syncDiffered( r.counter( "slowr_sync_ranges_total", "Sync ranges from peer relays by result", "result=\"differ\"" ) ),
+      syncFetched( r.counter( "slowr_sync_fetched_total", "Names fetched from peer relays because sync found them missing" ) ),
+      subExpired( r.counter( "slowr_sub_expired_total", "Subscriptions dropped because their lease was not renewed" ) ),
+      cookiesSent( r.counter( "slowr_sub_cookies_total", "Subscribe cookies sent to unvalidated addresses and echoed back by result", "result=\"sent\"" ) ),
+      cookiesValid( r.counter( "slowr_sub_cookies_total", "Subscribe cookies sent to unvalidated addresses and echoed back by result", "result=\"valid\"" ) ),
+      cookiesInvalid( r.counter( "slowr_sub_cookies_total", "Subscribe cookies sent to unvalidated addresses and echoed back by result", "result=\"invalid\"" ) ),
+      replayCapped( r.counter( "slowr_replay_capped_total", "Packets not sent to unvalidated addresses because they were out of replay credit" ) ),
+      subscriptions( r.gauge( "slowr_subscriptions", "Subscriptions with a running lease" ) ),
+      logDropped( r.gauge( "slowr_event_log_dropped", "Events dropped because the event log writer fell behind" ) ),
+      fanout( r.histogram( "slowr_pub_fanout", "Destinations each new publish was sent to" ) ),
+      replay( r.histogram( "slowr_sub_replay_messages", "Cached messages replayed for each subscribe" ) ),
+      pubLatency( r.histogram( "slowr_pub_latency_ms", "Publisher to relay latency in ms, for publishes with metrics" ) ),
+      batchSize( r.histogram( "slowr_batch_packets", "Packets handled per batch, whose output is sent together in bundles" ) ),
+      latencyNormal( r.histogram( "slowr_relay_latency_us", "Time from kernel arrival to send by priority class in us", "class=\"normal\"" ) ),
+      latencyControl( r.histogram( "slowr_relay_latency_us", "Time from kernel arrival to send by priority class in us", "class=\"control\"" ) ),
+      queuedNormal( r.gauge( "slowr_send_queue_packets", "Packets waiting in the send queue by priority class", "class=\"normal\"" ) ),
+      queuedControl( r.gauge( "slowr_send_queue_packets", "Packets waiting in the send queue by priority class", "class=\"control\"" ) ),
+      queueTime( r.histogram( "slowr_socket_queue_time_us", "Time from kernel arrival to the relay reading a packet in us" ) ),
+      processTime( r.histogram( "slowr_process_time_us", "Time to handle one received packet in us" ) ) {
+    for ( int i = 0; i < Cache::numRetentions; i++ ) {
+      const std::string label = std::string( "class=\"" ) + Cache::retentionName( (Cache::Retention)i ) + "\"";
+      cacheBytes[ i ] = &r.gauge( "slowr_cache_bytes", "Data bytes cached by retention class", label );
+      cacheEvicted[ i ] = &r.counter( "slowr_cache_evicted_total",
+                                      "Cached names evicted to keep a retention class within its budget", label );
+    }
+  }
+
+  MetricCounter& rxPub;
+  MetricCounter& rxPubDup;
+  MetricCounter& rxSub;
+  MetricCounter& rxUnSub;
+  MetricCounter& rxFrag;
+  MetricCounter& rxFragDup;
+  MetricCounter& rxFetch;
+  MetricCounter& rxRepair;
+  MetricCounter& rxSync;
+  MetricCounter& rxInvalid;
+  MetricCounter& rxOther;
+  MetricCounter& rxLimited;
+  MetricCounter& rxBytes;
+  MetricCounter& txRelay;
+  MetricCounter& txSub;
+  MetricCounter& txReplay;
+  MetricCounter& txAck;
+  MetricCounter& txFetch;
+  MetricCounter& txRepair;
+  MetricCounter& txSync;
+  MetricCounter& txBytes;
+  MetricCounter& txErrors;
+  MetricCounter& txDatagrams;
+  MetricCounter& cacheHits;
+  MetricCounter& cacheMisses;
+  MetricCounter& repairHits;
+  MetricCounter& repairMisses;
+  MetricCounter& cacheMissingData;
+  MetricGauge& cacheEntries;
+  MetricCounter& cacheExpired;
+  MetricGauge* cacheBytes[ Cache::numRetentions ];
+  MetricCounter* cacheEvicted[ Cache::numRetentions ];
+  MetricGauge& cacheSegments;
+  MetricCounter& cacheCompacted;
+  MetricCounter& dedupeHits;
+  MetricGauge& dedupeNames;
+  MetricCounter& syncRounds;
+  MetricCounter& syncMatched;
+  MetricCounter& syncDiffered;
+  MetricCounter& syncFetched;
+  MetricCounter& subExpired;
+  MetricCounter& cookiesSent;
+  MetricCounter& cookiesValid;
+  MetricCounter& cookiesInvalid;
+  MetricCounter& replayCapped;
+  MetricGauge& subscriptions;
+  MetricGauge& logDropped;
+  MetricHistogram& fanout;
+  MetricHistogram& replay;
+  MetricHistogram& pubLatency;
+  MetricHistogram& batchSize;
+  MetricHistogram& latencyNormal;
+  MetricHistogram& latencyControl;
+  MetricGauge& queuedNormal;
+  MetricGauge& queuedControl;
+  MetricHistogram& queueTime;
+  MetricHistogram& processTime;
+};
+
+// Identifies this relay in hop traces, SLOWR_RELAY_ID or a hash of the host name and port
+static uint32_t relayIdentity( int port ) {
+  char* idVar = getenv( "SLOWR_RELAY_ID" );
+  if ( idVar ) {
+    return strtoul( idVar, NULL, 0 );
+  }
+
+  char host[256] = { 0 };
+  gethostname( host, sizeof( host ) - 1 );
+  std::string key = std::string( host ) + ":" + std::to_string( port );
+
+  uint32_t hash = 2166136261u; // FNV-1a
+  for ( char c : key ) {
+    hash = ( hash ^ (uint8_t)c ) * 16777619u;
+  }
+  return hash;
+}
+
+static volatile sig_atomic_t logLevelChange = 0;
+
+static void logLevelSignal( int sig ) {
+  logLevelChange += ( sig == SIGUSR1 ) ? 1 : -1;
+}
+
 int main(int argc, char* argv[]) {
   std::clog << "Starting slowerReal (slower version " << slowerVersion() << ")" << std::endl;
   SlowerConnection slower;
@@ -33,9 +194,17 @@ int main(int argc, char* argv[]) {
 
   int err = slowerSetup( slower, port );
   assert( err == 0 );
+  if ( slowerEnableRxTimestamps( slower ) != 0 ) {
+    std::cerr << "No kernel receive timestamps, queueing time will read as zero" << std::endl;
+  }
+
+  const uint32_t relayID = relayIdentity( port );
+  std::clog << "Relay ID 0x" << std::hex << relayID << std::dec << std::endl;
 
   // ========  Setup up upstream and relay mesh =========
-  std::list<SlowerRemote>  relays;
+  // Everyone the relay sends to is interned in remotes, its tables and queues hold ids
+  RemoteTable remotes;
+  std::vector<RemoteID> relays;
   for ( int i=1; i< argc; i++ ) {
      SlowerRemote relay;
      err = slowerRemote( relay , argv[i] );
@@ -43,7 +212,7 @@ int main(int argc, char* argv[]) {
        std::cerr << "Could not lookup IP address for relay: " << argv[i]  << std::endl;
      } else {
        std::clog << "Using relay at " << inet_ntoa( relay.addr.sin_addr)  << ":" <<  ntohs(relay.addr.sin_port) << std::endl;
-       relays.push_back( relay );
+       relays.push_back( remotes.acquire( relay ) );
      }
   }
   // get relays from ENV var
@@ -65,21 +234,323 @@ int main(int argc, char* argv[]) {
         std::cerr << "Could not lookup IP address for relay: " << r  << std::endl;
       } else {
         std::clog << "Using relay at " << inet_ntoa( relay.addr.sin_addr)  << ":" <<  ntohs(relay.addr.sin_port) << std::endl;
-        relays.push_back( relay );
+        relays.push_back( remotes.acquire( relay ) );
       }
     }
   }
   
 
+  // ========== Event log ==============
+  // Per message events go to a binary log in SLOWR_LOG, read it with slowLogDump. There is no
+  // log unless it is set. SIGUSR1 and SIGUSR2 raise and lower the level while running.
+  EventLevel logLevel = EventLevel::info;
+  const char* logLevelVar = getenv( "SLOWR_LOG_LEVEL" );
+  if ( logLevelVar && !eventLevelParse( logLevelVar, logLevel ) ) {
+    std::cerr << "Unknown SLOWR_LOG_LEVEL " << logLevelVar << std::endl;
+  }
+  const char* logFile = getenv( "SLOWR_LOG" );
+  EventLog eventLog( logFile, logLevel );
+  if ( eventLog.enabled( EventLevel::error ) ) {
+    std::clog << "Event log " << logFile << " level " << eventLevelName( logLevel ) << std::endl;
+  }
+  signal( SIGUSR1, logLevelSignal );
+  signal( SIGUSR2, logLevelSignal );
+
+  // ========== Metrics ==============
+  // Prometheus text format over HTTP, SLOWR_METRICS_PORT=0 turns it off
+  MetricsRegistry registry;
+  RelayMetrics stats( registry );
+  MetricsServer metricsServer( registry );
+  int metricsPort = 9464;
+  char* metricsPortVar = getenv( "SLOWR_METRICS_PORT" );
+  if ( metricsPortVar ) {
+    metricsPort = atoi( metricsPortVar );
+  }
+  const char* metricsAddr = getenv( "SLOWR_METRICS_ADDR" );
+  if ( !metricsAddr ) {
+    metricsAddr = "127.0.0.1";
+  }
+  if ( metricsPort > 0 ) {
+    if ( metricsServer.start( metricsAddr, metricsPort ) == 0 ) {
+      std::clog << "Metrics on http://" << metricsAddr << ":" << metricsPort << "/metrics" << std::endl;
+    }
+  }
+
   // ========== MAIN Loop ==============
-  Subscriptions subscribeList;
+  // Subscriptions expire unless renewed within SLOWR_SUB_LEASE_S seconds, clients resend them
+  // every slowerSubRefreshMs. 0 keeps them until unsubscribed.
+  int subLeaseSec = 3 * slowerSubRefreshMs / 1000;
+  char* subLeaseVar = getenv( "SLOWR_SUB_LEASE_S" );
+  if ( subLeaseVar ) {
+    subLeaseSec = atoi( subLeaseVar );
+  }
+  auto steadyMs = []() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+  };
+  Subscriptions subscribeList( remotes, subLeaseSec * 1000, steadyMs() );
+
+  // With SLOWR_CACHE_DIR the cache is kept on disk and survives a restart. Each retention
+  // class has a TTL in seconds, 0 keeps names, and a budget in MiB, 0 for none. Over budget
+  // its oldest names are evicted, so one class never pushes out another.
+  auto wallMs = []() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch() ).count();
+  };
+  auto envU64 = []( const char* var, uint64_t value ) {
+    const char* str = getenv( var );
+    return str ? strtoull( str, NULL, 10 ) : value;
+  };
+  const uint64_t cacheTTLS = envU64( "SLOWR_CACHE_TTL_S", 0 );
+  const Cache::RetentionPolicy policies[ Cache::numRetentions ] = {
+    { cacheTTLS * 1000, envU64( "SLOWR_CACHE_MB", 0 ) << 20 },
+    { envU64( "SLOWR_KP_TTL_S", 7 * 24 * 3600 ) * 1000, envU64( "SLOWR_KP_MB", 16 ) << 20 },
+    { envU64( "SLOWR_WELCOME_TTL_S", 3600 ) * 1000, envU64( "SLOWR_WELCOME_MB", 64 ) << 20 },
+    { envU64( "SLOWR_COMMIT_TTL_S", cacheTTLS ) * 1000, envU64( "SLOWR_COMMIT_MB", 64 ) << 20 }
+  };
   Cache cache;
+  bool cacheDrops = false;
+  for ( int i = 0; i < Cache::numRetentions; i++ ) {
+    cache.setRetention( (Cache::Retention)i, policies[ i ] );
+    cacheDrops = cacheDrops || policies[ i ].ttlMs || policies[ i ].maxBytes;
+  }
+  char* cacheDir = getenv( "SLOWR_CACHE_DIR" );
+  if ( cacheDir ) {
+    auto loadStart = std::chrono::steady_clock::now();
+    err = cache.open( cacheDir, wallMs() );
+    if ( err ) {
+      std::cerr << "Could not open cache in " << cacheDir << std::endl;
+      exit( 1 );
+    }
+    std::clog << "Loaded " << cache.size() << " cached messages from " << cache.logSegments()
+              << " segments in " << cacheDir << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - loadStart ).count()
+              << " ms" << std::endl;
+  }
+  stats.cacheEntries.set( cache.size() );
+  stats.cacheSegments.set( cache.logSegments() );
+  uint64_t nextCacheExpireMs = 0;
+
+  // Names that expire from the cache go in a filter of SLOWR_DEDUPE_KB KiB for at least
+  // SLOWR_DEDUPE_WINDOW_S seconds, so a late copy of one is not forwarded again as new
+  size_t dedupeBytes = 8192 * 1024;
+  char* dedupeKBVar = getenv( "SLOWR_DEDUPE_KB" );
+  if ( dedupeKBVar ) {
+    dedupeBytes = strtoull( dedupeKBVar, NULL, 10 ) * 1024;
+  }
+  uint64_t dedupeWindowMs = 600 * 1000;
+  char* dedupeWindowVar = getenv( "SLOWR_DEDUPE_WINDOW_S" );
+  if ( dedupeWindowVar ) {
+    dedupeWindowMs = strtoull( dedupeWindowVar, NULL, 10 ) * 1000;
+  }
+  DedupeFilter dedupe( cacheDrops ? dedupeBytes : 0, dedupeWindowMs, steadyMs() );
 
+  // Every SLOWR_SYNC_S seconds the cache is reconciled with each peer relay, so relays catch
+  // up on what was published on the other side of a partition. 0 turns it off. A round the
+  // peer starts puts off ours, so the two do not both send what differs.
+  uint64_t syncMs = 30 * 1000;
+  char* syncVar = getenv( "SLOWR_SYNC_S" );
+  if ( syncVar ) {
+    syncMs = strtoull( syncVar, NULL, 10 ) * 1000;
+  }
+  CacheSync cacheSync( cache );
+  std::map<RemoteID, uint64_t> nextSyncMs;
+  for ( RemoteID peer : relays ) {
+    nextSyncMs[ peer ] = steadyMs() + syncMs + relayID % ( syncMs / 2 + 1 ); // relays started together still take turns
+  }
+
+  // Acks wait briefly so a burst of publishes gets one batched ack, SLOWR_ACK_DELAY_MS=0 sends
+  // them with the batch that received the publish
+  int ackDelayMs = 5;
+  char* ackDelayVar = getenv( "SLOWR_ACK_DELAY_MS" );
+  if ( ackDelayVar ) {
+    ackDelayMs = atoi( ackDelayVar );
+  }
+  AckBatcher acks( ackDelayMs * 1000 );
+
+  // Addresses are validated by echoing a subscribe cookie, and stay so for SLOWR_VALID_S
+  // seconds. Until then they are sent at most SLOWR_REPLAY_FACTOR times the bytes received
+  // from them. Each may send SLOWR_RATE_PPS packets a second, 0 for no limit, in bursts of up
+  // to SLOWR_RATE_BURST. Peer relays are trusted.
+  SourceGuard::Limits guardLimits;
+  guardLimits.validMs = envU64( "SLOWR_VALID_S", 600 ) * 1000;
+  guardLimits.replayFactor = (uint32_t)envU64( "SLOWR_REPLAY_FACTOR", 3 );
+  guardLimits.ratePps = (uint32_t)envU64( "SLOWR_RATE_PPS", 2000 );
+  guardLimits.burst = (uint32_t)envU64( "SLOWR_RATE_BURST", 4000 );
+  SourceGuard guard( guardLimits );
+  for ( RemoteID peer : relays ) {
+    guard.trust( remotes[ peer ] );
+  }
+  uint64_t sentAcks = 0;
+  auto steadyMicros = []() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+  };
+
+  // Everything sent while handling a batch of received packets goes out in bundles when the
+  // batch ends: once the socket is empty, after batchMaxPackets or after batchMaxMicros.
+  const int batchMaxPackets = 64;
+  const auto batchMaxMicros = std::chrono::microseconds( 1000 );
+  bool batchOpen = false;
+  int batchPackets = 0;
+  auto batchStart = std::chrono::steady_clock::now();
+  uint64_t sentDatagrams = 0;
+
+  // Publishes are queued by priority class and sent when the batch ends, control first
+  SendQueue sendQueue( remotes );
+
+  // Bytes that may still be sent back to the source of the packet being handled, fits() is
+  // false once the next packet would be more than an unvalidated source has credit for
+  uint64_t replayCredit = UINT64_MAX;
+  auto pubBytes = []( size_t len, bool fragment ) {
+    return sizeof( MsgHeader ) + ( fragment ? sizeof( MsgFragHeader ) : 0 ) + sizeof( MsgPubHeader ) + len;
+  };
+  auto fits = [&]( size_t bytes ) {
+    if ( bytes > replayCredit ) {
+      stats.replayCapped.inc();
+      return false;
+    }
+    replayCredit -= bytes;
+    return true;
+  };
+  // cached data is only good until the cache next changes, so what is queued from it is copied
+  auto queueCopy = [&]( SlowerPriority priority, RemoteID dest, const MsgShortName& n,
+                        const CacheData& bytes, uint64_t startMicros, const MsgFragHeader* f ) {
+    sendQueue.push( priority, dest, n, std::make_shared<const std::vector<uint8_t>>( bytes.data(), bytes.data() + bytes.size() ),
+                    startMicros, f );
+  };
+
+  // Queue what is cached under n for dest, the whole message or every fragment of it. Returns
+  // the packets queued, 0 if nothing is cached.
+  auto queueCached = [&]( RemoteID dest, const MsgShortName& n, uint64_t startMicros ) {
+    const CacheData* priorData = cache.get( n );
+    if ( priorData->size() != 0 ) {
+      if ( !fits( pubBytes( priorData->size(), false ) ) ) {
+        return 0;
+      }
+      queueCopy( slowerNamePriority( n ), dest, n, *priorData, startMicros, NULL );
+      stats.txBytes.inc( priorData->size() );
+      return 1;
+    }
+    int packets = 0;
+    MsgFragHeader priorFrag;
+    const uint16_t count = cache.fragmentCount( n );
+    for ( uint16_t i = 0; i < count; i++ ) {
+      const CacheData* fragData = cache.getFragment( n, i, priorFrag );
+      if ( fragData && fits( pubBytes( fragData->size(), true ) ) ) {
+        queueCopy( slowerNamePriority( n ), dest, n, *fragData, startMicros, &priorFrag );
+        stats.txBytes.inc( fragData->size() );
+        packets++;
+      }
+    }
+    return packets;
+  };
+
+  RemoteID source = RemoteTable::none;   // who sent the packet being handled
   while (true ) {
-    //std::cerr << "Waiting ... ";
-    err=slowerWait( slower );
-    assert( err == 0 );
-    //std::cerr << "done" << std::endl;
+    if ( batchOpen && ( ( batchPackets >= batchMaxPackets ) || !slowerPending( slower )
+                        || ( std::chrono::steady_clock::now() - batchStart >= batchMaxMicros ) ) ) {
+      acks.service( slower, steadyMicros() );
+      stats.txAck.inc( acks.messagesSent() - sentAcks );
+      sentAcks = acks.messagesSent();
+
+      const uint64_t sentMicros = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+      err = sendQueue.drain( slower, [&]( SlowerPriority priority, uint64_t startMicros ) {
+        ( ( priority == SlowerPriorityControl ) ? stats.latencyControl : stats.latencyNormal )
+          .record( sentMicros > startMicros ? sentMicros - startMicros : 0 );
+      } );
+      if ( err ) {
+        stats.txErrors.inc(); // such as a peer relay on the other side of a partition
+      }
+      stats.queuedNormal.set( sendQueue.size( SlowerPriorityNormal ) );
+      stats.queuedControl.set( sendQueue.size( SlowerPriorityControl ) );
+
+      err = slowerBundleFlush( slower );
+      if ( err ) {
+        stats.txErrors.inc();
+      }
+      batchOpen = false;
+      if ( batchPackets > 0 ) {
+        stats.batchSize.record( batchPackets );
+      }
+
+      uint64_t messages, datagrams;
+      slowerSendStats( slower, &messages, &datagrams );
+      stats.txDatagrams.inc( datagrams - sentDatagrams );
+      sentDatagrams = datagrams;
+    }
+
+    if ( logLevelChange != 0 ) {
+      int level = (int)eventLog.getLevel() + logLevelChange;
+      logLevelChange = 0;
+      level = std::max( (int)EventLevel::error, std::min( (int)EventLevel::debug, level ) );
+      eventLog.setLevel( (EventLevel)level );
+      std::clog << "Event log level " << eventLevelName( (EventLevel)level ) << std::endl;
+    }
+
+    if ( !batchOpen && ( wallMs() >= nextCacheExpireMs ) ) {
+      const uint64_t compacted = cache.compactedBytes();
+      uint64_t evicted[ Cache::numRetentions ];
+      for ( int i = 0; i < Cache::numRetentions; i++ ) {
+        evicted[ i ] = cache.evicted( (Cache::Retention)i );
+      }
+      size_t expired = cache.expire( wallMs(), [&]( const MsgShortName& name ) {
+        dedupe.add( name, steadyMs() );
+      } );
+      for ( int i = 0; i < Cache::numRetentions; i++ ) {
+        const uint64_t n = cache.evicted( (Cache::Retention)i ) - evicted[ i ];
+        stats.cacheEvicted[ i ]->inc( n );
+        stats.cacheBytes[ i ]->set( cache.bytes( (Cache::Retention)i ) );
+        expired -= n;
+      }
+      stats.cacheExpired.inc( expired );
+      dedupe.expire( steadyMs() );
+      stats.dedupeNames.set( dedupe.size() );
+      stats.cacheCompacted.inc( cache.compactedBytes() - compacted );
+      stats.cacheEntries.set( cache.size() );
+      stats.cacheSegments.set( cache.logSegments() );
+      nextCacheExpireMs = wallMs() + 1000;
+    }
+
+    if ( !batchOpen && syncMs ) {
+      for ( auto& peer : nextSyncMs ) {
+        if ( steadyMs() >= peer.second ) {
+          CacheSync::send( slower, remotes[ peer.first ], std::vector<CacheSync::Range>( 1, cacheSync.whole() ) );
+          stats.syncRounds.inc();
+          peer.second = steadyMs() + syncMs;
+        }
+      }
+    }
+
+    size_t expired = subscribeList.expire( steadyMs() );
+    if ( expired > 0 ) {
+      stats.subExpired.inc( expired );
+      stats.subscriptions.set( subscribeList.size() );
+    }
+
+    if ( !batchOpen ) {
+      int waitMs = acks.nextTimeoutMs( steadyMicros() );
+      int leaseMs = subscribeList.nextTimeoutMs( steadyMs() );
+      if ( ( waitMs < 0 ) || ( ( leaseMs >= 0 ) && ( leaseMs < waitMs ) ) ) {
+        waitMs = leaseMs;
+      }
+      if ( !sendQueue.empty() ) {
+        waitMs = 0; // more of a long replay to send
+      }
+      //std::cerr << "Waiting ... ";
+      err=slowerWait( slower, ( ( waitMs < 0 ) || ( waitMs > 50 ) ) ? 50 : waitMs );
+      assert( err == 0 );
+      //std::cerr << "done" << std::endl;
+
+      slowerBundleBegin( slower );
+      batchOpen = true;
+      batchPackets = 0;
+      batchStart = std::chrono::steady_clock::now();
+      if ( !slowerPending( slower ) ) {
+        continue; // timed out, go round to send the acks that are due
+      }
+    }
   
     char buf[slowerMTU];
     int bufLen=0;
@@ -87,95 +558,287 @@ int main(int argc, char* argv[]) {
     MsgHeader mhdr = {0};
     MsgHeaderMetrics metrics = {0};
     int mask;
+    uint64_t rxMicros = 0;
+    MsgFragHeader frag = {0};
     
-    err=slowerRecvMulti(  slower, &mhdr, &remote, &mask,  buf, sizeof(buf), &bufLen, &metrics );
-    assert( err == 0 );
+    err=slowerRecvMulti(  slower, &mhdr, &remote, &mask,  buf, sizeof(buf), &bufLen, &metrics, &rxMicros, &frag );
+    if ( err != 0 ) {
+      stats.rxInvalid.inc(); // malformed, drop it
+      continue;
+    }
+
+    if ( mhdr.type == SlowerMsgInvalid ) {
+      continue; // nothing received
+    }
+    if ( ( mhdr.type == SlowerMsgPubFrag ) && !slowerFragValid( frag, bufLen ) ) {
+      stats.rxInvalid.inc(); // a header that does not match its data would size what is kept by it
+      continue;
+    }
+
+    // a source over its rate is dropped before anything is done for it, the size counted is
+    // about that of the message
+    const SourceGuard::Source from = guard.received( remote, sizeof( MsgHeader ) + bufLen, steadyMs() );
+    if ( !from.admitted ) {
+      stats.rxLimited.inc();
+      continue;
+    }
+    bool validated = from.validated;
+    replayCredit = from.credit;
+    batchPackets++;
+
+    // the sender is held until the next packet, whatever is queued for it holds its own reference
+    if ( source != RemoteTable::none ) {
+      remotes.release( source );
+    }
+    source = remotes.acquire( remote );
+    auto processStart = std::chrono::steady_clock::now();
+    uint64_t readMicros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    stats.queueTime.record( readMicros > rxMicros ? readMicros - rxMicros : 0 );
 
     // =========  PUBLISH ===================
-    if ( ( mhdr.type == SlowerMsgPub ) && ( bufLen > 0 ) ) {
-      bool duplicate = cache.exists( mhdr.name );
+    // Fragments of large publishes are cached and forwarded one by one as they arrive, the
+    // publish is acked once all of them are here
+    const bool fragment = ( mhdr.type == SlowerMsgPubFrag );
+    // the class comes from the name like on replay, not from the header a publisher sets
+    const SlowerPriority priority = slowerNamePriority( mhdr.name );
+    if ( ( ( mhdr.type == SlowerMsgPub ) || fragment ) && ( bufLen > 0 ) ) {
+      std::vector<uint8_t> data(buf, buf + bufLen);
+      const uint64_t expiryMs = cache.expiryMs( mhdr.name, wallMs() );
+      // only a name at or below what its stream has dropped can be a late copy, so a false
+      // positive of the filter never drops a new publish
+      const bool expired = cache.droppedThrough( mhdr.name ) && dedupe.contains( mhdr.name );
+      bool duplicate = expired;
+      if ( expired ) {
+        stats.dedupeHits.inc();
+      } else {
+        duplicate = fragment ? !cache.putFragment( mhdr.name, frag, data, expiryMs ) : cache.exists( mhdr.name );
+      }
       
-      std::clog << "Got "
-                << ( duplicate ? "dup " : "" )
-                << "PUB " << Name(mhdr.name).longString()
-                << " from " << inet_ntoa( remote.addr.sin_addr)
-                << ":" << ntohs( remote.addr.sin_port )
-                << std::endl;
-
-      err = slowerAck( slower, mhdr.name, &remote );
-      assert( err == 0 );
+      EVENT_LOG( eventLog, EventLevel::info, duplicate ? EventType::pubDup : EventType::pub,
+                 mhdr.name, &remote, bufLen );
+      if ( fragment ) {
+        ( duplicate ? stats.rxFragDup : stats.rxFrag ).inc();
+      } else {
+        ( duplicate ? stats.rxPubDup : stats.rxPub ).inc();
+      }
+      stats.rxBytes.inc( bufLen );
+
+      // a late copy of an expired object is acked so the publisher stops resending it
+      if ( !fragment || expired || cache.fragmentsComplete( mhdr.name ) ) {
+        acks.add( remote, mhdr.name, steadyMicros() );
+      }
         
       if ( !duplicate ) {
         // add to local cache 
-        std::vector<uint8_t> data(buf, buf + bufLen);
-        cache.put(mhdr.name, data);
+        if ( !fragment ) {
+          cache.put(mhdr.name, data, expiryMs);
+        }
+        stats.cacheEntries.set( cache.size() );
 
-        // report metrics for QMsg
+        // report metrics for QMsg, timed from when the packet reached this host so time spent
+        // queued in the socket is counted as part of the hop
         if (mhdr.flags.metrics) {
-          Name qmsgName(mhdr.name);
-          metrics.relay_millis = std::chrono::duration_cast<std::chrono::milliseconds>(
-              std::chrono::system_clock::now().time_since_epoch()).count();
+          metrics.relay_millis = rxMicros / 1000;
+          slowerTraceHop( metrics, relayID, rxMicros );
 
-          std::clog << "    " << qmsgName.longString() << " pub latency: " << (metrics.relay_millis - metrics.pub_millis)
-                    << std::endl;
+          EVENT_LOG( eventLog, EventLevel::info, EventType::pubLatency, mhdr.name, &remote,
+                     (int32_t)( metrics.relay_millis - metrics.pub_millis ) );
+          if ( metrics.relay_millis >= metrics.pub_millis ) {
+            stats.pubLatency.record( metrics.relay_millis - metrics.pub_millis );
+          }
         }
 
+        auto shared = std::make_shared<const std::vector<uint8_t>>( std::move( data ) );
+        auto forward = [&]( RemoteID dest ) {
+          sendQueue.push( priority, dest, mhdr.name, shared, rxMicros, fragment ? &frag : NULL,
+                          mhdr.flags.metrics ? &metrics : NULL );
+        };
+
         // send to other relays
-        for (SlowerRemote dest: relays) {
-          if (dest != remote) {
-            std::clog << "  Sent to relay " << inet_ntoa(dest.addr.sin_addr) << ":" << ntohs(dest.addr.sin_port)
-                      << std::endl;
-            err = slowerPub(slower, mhdr.name, buf, bufLen, &dest, mhdr.flags.metrics ? &metrics : NULL);
-            assert(err == 0);
+        uint64_t fanout = 0;
+        for (RemoteID dest: relays) {
+          if (dest != source) {
+            EVENT_LOG( eventLog, EventLevel::debug, EventType::fwdRelay, mhdr.name, &remotes[ dest ] );
+            forward( dest );
+            stats.txRelay.inc();
+            stats.txBytes.inc( bufLen );
+            fanout++;
           }
         }
 
         // send to anyone subscribed
-        std::list<SlowerRemote> list = subscribeList.find(mhdr.name);
-        for (SlowerRemote dest: list) {
-          if (dest != remote) {
-            std::clog << "  Sent to subscriber " << inet_ntoa(dest.addr.sin_addr) << ":" << ntohs(dest.addr.sin_port)
-                      << std::endl;
-            err = slowerPub(slower, mhdr.name, buf, bufLen, &dest, mhdr.flags.metrics ? &metrics : NULL);
-            assert(err == 0);
+        subscribeList.forEach( mhdr.name, [&]( RemoteID dest ) {
+          if (dest != source) {
+            EVENT_LOG( eventLog, EventLevel::debug, EventType::fwdSub, mhdr.name, &remotes[ dest ] );
+            forward( dest );
+            stats.txSub.inc();
+            stats.txBytes.inc( bufLen );
+            fanout++;
           }
-        }
+        } );
+        stats.fanout.record( fanout );
       }
     }
 
     // ============ SUBSCRIBE ==================
+    // A renewal of a lease gets nothing replayed, the subscriber already has the cache. An
+    // unvalidated address is asked to echo a cookie and is only subscribed, and sent the
+    // cache, once it does, so the replay is not split across the two and sent partly twice.
+    bool replaySub = false;
     if ( mhdr.type == SlowerMsgSub  ) {
-      std::clog << "Got SUB" 
-                << " for " << Name(mhdr.name).longString() << "*" << mask
-                << " from " << inet_ntoa( remote.addr.sin_addr) << ":" <<  ntohs( remote.addr.sin_port )
-                << std::endl;
-      subscribeList.add( mhdr.name, mask, remote );
-      
-      std::list<MsgShortName> names = cache.find(mhdr.name, mask );
-      names.reverse(); // send the highest (and likely most recent) first 
+      EVENT_LOG( eventLog, EventLevel::info, EventType::sub, mhdr.name, &remote, mask );
+      stats.rxSub.inc();
+      uint64_t cookie = 0;
+      if ( !validated && ( bufLen == (int)sizeof( cookie ) ) ) {
+        memcpy( &cookie, buf, sizeof( cookie ) );
+        validated = guard.checkCookie( remote, cookie, steadyMs() );
+        ( validated ? stats.cookiesValid : stats.cookiesInvalid ).inc();
+        if ( validated ) {
+          replayCredit = UINT64_MAX;
+        }
+      }
+      if ( validated ) {
+        replaySub = subscribeList.add( mhdr.name, mask, remote, steadyMs() );
+        stats.subscriptions.set( subscribeList.size() );
+      } else if ( fits( sizeof( MsgHeader ) + sizeof( MsgSubCookieHeader ) ) ) {
+        EVENT_LOG( eventLog, EventLevel::info, EventType::subCookie, mhdr.name, &remote, mask );
+        slowerSubCookie( slower, mhdr.name, mask, guard.cookie( remote, steadyMs() ), &remote );
+        stats.cookiesSent.inc();
+      }
+    }
+    if ( replaySub ) {
+      // highest (and likely most recent) first
+      uint64_t replayed = 0;
+      cache.forEach( mhdr.name, mask, [&]( const MsgShortName& n, const CacheData& priorData ) {
+        if ( !fits( pubBytes( priorData.size(), false ) ) ) {
+          return;
+        }
+        EVENT_LOG( eventLog, EventLevel::debug, EventType::cacheSend, n, &remote );
+        queueCopy( slowerNamePriority( n ), source, n, priorData, rxMicros, NULL );
+        stats.txReplay.inc();
+        stats.txBytes.inc( priorData.size() );
+        replayed++;
+      } );
+
+      // whatever fragments are here, the subscriber fetches the rest once they arrive
+      cache.forEachFragment( mhdr.name, mask, [&]( const MsgShortName& n, const MsgFragHeader& priorFrag,
+                                                   const CacheData& priorData ) {
+        if ( !fits( pubBytes( priorData.size(), true ) ) ) {
+          return;
+        }
+        EVENT_LOG( eventLog, EventLevel::debug, EventType::cacheSend, n, &remote );
+        queueCopy( slowerNamePriority( n ), source, n, priorData, rxMicros, &priorFrag );
+        stats.txReplay.inc();
+        stats.txBytes.inc( priorData.size() );
+        replayed++;
+      } );
+
+      ( replayed ? stats.cacheHits : stats.cacheMisses ).inc();
+      stats.replay.record( replayed );
+    }
 
-      for ( auto n : names ) {
-        std::clog << "  Sent cache " << Name(n).longString() << std::dec << std::endl;
-        const std::vector<uint8_t>* priorData = cache.get( n );
+    // ============ FRAGMENT FETCH ==================
+    if ( mhdr.type == SlowerMsgFragFetch ) {
+      stats.rxFetch.inc();
+      for ( int i = 0; i < bufLen / (int)sizeof( uint16_t ); i++ ) {
+        uint16_t index;
+        memcpy( &index, buf + i * sizeof( index ), sizeof( index ) );
 
-        if ( priorData->size() != 0 ) {
-          err = slowerPub( slower, n, (char*)(priorData->data()), priorData->size(), &remote );
-          assert( err == 0 );
-        } else {
-             std::clog << "    PROBLEM with missing priorData" << std::endl;
-        } 
+        MsgFragHeader priorFrag;
+        const CacheData* priorData = cache.getFragment( mhdr.name, index, priorFrag );
+        if ( !priorData ) {
+          EVENT_LOG( eventLog, EventLevel::info, EventType::cacheMissing, mhdr.name, &remote, index );
+          stats.cacheMissingData.inc();
+          continue;
+        }
+        if ( !fits( pubBytes( priorData->size(), true ) ) ) {
+          continue;
+        }
+        EVENT_LOG( eventLog, EventLevel::debug, EventType::cacheSend, mhdr.name, &remote, index );
+        queueCopy( slowerNamePriority( mhdr.name ), source, mhdr.name, *priorData, rxMicros, &priorFrag );
+        stats.txFetch.inc();
+        stats.txBytes.inc( priorData->size() );
+      }
+    }
+
+    // ============ FETCH ==================
+    // A subscriber that saw a gap in a stream asks for the msg ids it is missing, and so does a
+    // peer relay that sync found behind. Each id is looked up on its own, up to SLOWER_MAX_FETCH_IDS.
+    if ( mhdr.type == SlowerMsgFetch ) {
+      stats.rxRepair.inc();
+      int numIDs = 0;
+      for ( int r = 0; r < bufLen / (int)sizeof( MsgAckRange ); r++ ) {
+        MsgAckRange range;
+        memcpy( &range, buf + r * sizeof( range ), sizeof( range ) );
+
+        for ( uint32_t id = range.first; ( id <= range.last ) && ( numIDs < SLOWER_MAX_FETCH_IDS ); id++, numIDs++ ) {
+          MsgShortName n = mhdr.name;
+          n.spec.msg_id = id;
+
+          int packets = queueCached( source, n, rxMicros );
+          if ( packets ) {
+            EVENT_LOG( eventLog, EventLevel::debug, EventType::cacheSend, n, &remote );
+          } else {
+            EVENT_LOG( eventLog, EventLevel::info, EventType::cacheMissing, n, &remote );
+          }
+          ( packets ? stats.repairHits : stats.repairMisses ).inc();
+          stats.txRepair.inc( packets );
+        }
+      }
+    }
+
+    // ============ SYNC ==================
+    // Only peer relays are answered. Names the peer lacks are sent to it as publishes, which it
+    // caches and forwards like any other, and names this relay lacks are fetched from it.
+    if ( mhdr.type == SlowerMsgSync ) {
+      stats.rxSync.inc();
+      CacheSync::Result result;
+      auto peer = nextSyncMs.find( source );
+      if ( ( peer != nextSyncMs.end() ) && cacheSync.handle( buf, bufLen, result ) ) {
+        peer->second = steadyMs() + syncMs;
+        stats.syncMatched.inc( result.matched );
+        stats.syncDiffered.inc( result.differed );
+        CacheSync::send( slower, remote, result.replies );
+        for ( const MsgShortName& n : result.push ) {
+          stats.txSync.inc( queueCached( source, n, rxMicros ) );
+        }
+        // what this relay let expire is not fetched back
+        result.fetch.erase( std::remove_if( result.fetch.begin(), result.fetch.end(), [&]( const MsgShortName& n ) {
+          return cache.droppedThrough( n ) && dedupe.contains( n );
+        } ), result.fetch.end() );
+        if ( !result.fetch.empty() ) {
+          CacheSync::fetch( slower, remote, result.fetch );
+          stats.syncFetched.inc( result.fetch.size() );
+        }
+      } else {
+        stats.rxInvalid.inc();
       }
-  
     }
 
     // ============== Un SUBSCRIBE ===========
+    // only from a validated address, so a spoofed one cannot drop someone else's subscription
     if ( mhdr.type == SlowerMsgUnSub  ) {
-       std::clog << "Got UnSUB" 
-                 << " for " <<  Name(mhdr.name).longString() << "*" << mask
-                 << " from " << inet_ntoa( remote.addr.sin_addr) << ":" <<  ntohs( remote.addr.sin_port )
-                 << std::endl;
-       subscribeList.remove( mhdr.name, mask, remote );
+       EVENT_LOG( eventLog, EventLevel::info, EventType::unSub, mhdr.name, &remote, mask );
+       stats.rxUnSub.inc();
+       if ( validated ) {
+         subscribeList.remove( mhdr.name, mask, remote );
+         stats.subscriptions.set( subscribeList.size() );
+       }
     }  
+
+    if ( !validated && ( replayCredit < from.credit ) ) {
+      guard.spend( remote, from.credit - replayCredit );
+    }
+
+    if ( ( mhdr.type != SlowerMsgPub ) && ( mhdr.type != SlowerMsgSub ) && ( mhdr.type != SlowerMsgUnSub )
+         && ( mhdr.type != SlowerMsgPubFrag ) && ( mhdr.type != SlowerMsgFragFetch ) && ( mhdr.type != SlowerMsgFetch )
+         && ( mhdr.type != SlowerMsgSync ) ) {
+      stats.rxOther.inc();
+    }
+    stats.logDropped.set( eventLog.dropped() );
+    stats.processTime.record( std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - processStart ).count() );
   }
 
   slowerClose( slower );
@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#include "sourceGuard.h"
+
+
+SourceGuard::SourceGuard( const Limits& limitsVal, size_t numSlots ) : limits( limitsVal ) {
+  size_t size = 1;
+  while ( size < numSlots ) {
+    size *= 2;
+  }
+  slots.resize( size, Slot() );
+
+  std::random_device sysRand;
+  for ( uint64_t& word : key ) {
+    word = ( (uint64_t)sysRand() << 32 ) | sysRand();
+  }
+}
+
+
+// SipHash-2-4 of the address, port and extra, so cookies cannot be forged and the slot an
+// address lands in cannot be picked without the key
+uint64_t SourceGuard::hash( const SlowerRemote& remote, uint64_t extra ) const {
+  uint64_t words[ 4 ] = { 0, 0, 0, extra };
+  words[ 0 ] = (uint64_t)remote.addr.sin_family | ( (uint64_t)remote.addr.sin_port << 16 );
+  if ( remote.addr.sin_family == AF_INET6 ) {
+    std::memcpy( &words[ 1 ], &remote.addr6.sin6_addr, 16 );
+    words[ 0 ] |= (uint64_t)remote.addr6.sin6_scope_id << 32;
+  } else {
+    words[ 0 ] |= (uint64_t)remote.addr.sin_addr.s_addr << 32;
+  }
+
+  uint64_t v0 = key[ 0 ] ^ 0x736f6d6570736575ull;
+  uint64_t v1 = key[ 1 ] ^ 0x646f72616e646f6dull;
+  uint64_t v2 = key[ 0 ] ^ 0x6c7967656e657261ull;
+  uint64_t v3 = key[ 1 ] ^ 0x7465646279746573ull;
+  auto rotl = []( uint64_t x, int b ) { return ( x << b ) | ( x >> ( 64 - b ) ); };
+  auto round = [&]() {
+    v0 += v1; v1 = rotl( v1, 13 ); v1 ^= v0; v0 = rotl( v0, 32 );
+    v2 += v3; v3 = rotl( v3, 16 ); v3 ^= v2;
+    v0 += v3; v3 = rotl( v3, 21 ); v3 ^= v0;
+    v2 += v1; v1 = rotl( v1, 17 ); v1 ^= v2; v2 = rotl( v2, 32 );
+  };
+  auto compress = [&]( uint64_t m ) {
+    v3 ^= m;
+    round();
+    round();
+    v0 ^= m;
+  };
+  for ( uint64_t word : words ) {
+    compress( word );
+  }
+  compress( (uint64_t)sizeof( words ) << 56 );   // the final block holds just the length
+  v2 ^= 0xff;
+  round();
+  round();
+  round();
+  round();
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+// The slot holding remote's state. A slot held by another address is taken over if claim is
+// set or it is not validated, otherwise there is none for remote and this returns NULL.
+SourceGuard::Slot* SourceGuard::slotOf( const SlowerRemote& remote, uint64_t nowMs, bool claim ) {
+  const uint64_t h = hash( remote, 0 );
+  Slot& slot = slots[ h & ( slots.size() - 1 ) ];
+  const uint32_t tag = tagOf( h );
+  if ( slot.tag == tag ) {
+    return &slot;
+  }
+  if ( ( slot.validUntilMs > nowMs ) && ( !claim || ( slot.validUntilMs == trustedMs ) ) ) {
+    return NULL;
+  }
+  slot = Slot();
+  slot.tag = tag;
+  slot.tokens = (uint64_t)limits.burst * 1000;
+  slot.refillMs = nowMs;
+  return &slot;
+}
+
+
+void SourceGuard::trust( const SlowerRemote& remote ) {
+  Slot* slot = slotOf( remote, 0, true );
+  if ( slot ) {
+    slot->validUntilMs = trustedMs;
+  }
+}
+
+
+SourceGuard::Source SourceGuard::received( const SlowerRemote& remote, uint32_t bytes, uint64_t nowMs ) {
+  Source source = { true, false, 0 };
+  Slot* slot = slotOf( remote, nowMs, false );
+  if ( !slot ) {
+    return source;
+  }
+  if ( slot->validUntilMs == trustedMs ) {
+    source.validated = true;
+    source.credit = UINT64_MAX;
+    return source;
+  }
+
+  if ( limits.ratePps ) {
+    const uint64_t full = (uint64_t)limits.burst * 1000;
+    if ( nowMs > slot->refillMs ) {
+      slot->tokens = std::min( full, slot->tokens + ( nowMs - slot->refillMs ) * limits.ratePps );
+      slot->refillMs = nowMs;
+    }
+    if ( slot->tokens < 1000 ) {
+      source.admitted = false;
+      return source;
+    }
+    slot->tokens -= 1000;
+  }
+
+  if ( slot->validUntilMs > nowMs ) {
+    source.validated = true;
+    source.credit = UINT64_MAX;
+    return source;
+  }
+  slot->bytesIn = ( bytes > UINT32_MAX - slot->bytesIn ) ? UINT32_MAX : slot->bytesIn + bytes;
+  const uint64_t allowed = (uint64_t)limits.replayFactor * slot->bytesIn;
+  source.credit = ( allowed > slot->bytesOut ) ? allowed - slot->bytesOut : 0;
+  return source;
+}
+
+
+void SourceGuard::spend( const SlowerRemote& remote, uint64_t bytes ) {
+  const uint64_t h = hash( remote, 0 );
+  Slot& slot = slots[ h & ( slots.size() - 1 ) ];
+  if ( slot.tag == tagOf( h ) ) {
+    slot.bytesOut += bytes;
+  }
+}
+
+
+uint64_t SourceGuard::cookie( const SlowerRemote& remote, uint64_t nowMs ) const {
+  return hash( remote, nowMs / cookiePeriodMs + 1 ) | 1;   // never 0, which means none
+}
+
+
+bool SourceGuard::checkCookie( const SlowerRemote& remote, uint64_t value, uint64_t nowMs ) {
+  if ( ( value != cookie( remote, nowMs ) ) && ( ( nowMs < cookiePeriodMs )
+                                                 || ( value != cookie( remote, nowMs - cookiePeriodMs ) ) ) ) {
+    return false;
+  }
+  Slot* slot = slotOf( remote, nowMs, true );
+  if ( slot && ( slot->validUntilMs != trustedMs ) ) {
+    slot->validUntilMs = nowMs + limits.validMs;
+    slot->bytesIn = 0;
+    slot->bytesOut = 0;
+  }
+  return true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <slower.h>
+
+/**
+ * What the relay will do for a source address before it has shown that it receives what is
+ *     sent to it.
+ *
+ *     A subscribe from an address that is not validated is answered with a cookie, a SipHash of
+ *     the address and the time under a key made at startup (see MsgSubCookieHeader). Checking
+ *     a cookie needs no state, only the addresses that echoed one are kept, for validMs. Until
+ *     then a subscribe from the address replays nothing, and the relay sends it at most
+ *     replayFactor times the bytes it received from it, so a few spoofed bytes cannot make it
+ *     send a channel's cache to someone else.
+ *
+ *     Every address also has a token bucket of ratePps packets a second, up to burst at once.
+ *     The state sits in a fixed table indexed by a keyed hash of the address, so spoofing many
+ *     addresses costs no memory and cannot pick whose slot it lands on. Only an address that
+ *     validates can take over the slot of a validated one. Until then it is admitted with no
+ *     bucket and no credit.
+ */
+class SourceGuard {
+public:
+  struct Limits {
+    uint64_t validMs;        ///< How long an address stays validated after echoing a cookie
+    uint32_t replayFactor;   ///< Bytes sent to an unvalidated address per byte received from it
+    uint32_t ratePps;        ///< Packets a second each address may send, 0 for no limit
+    uint32_t burst;          ///< Packets an address may send at once
+  };
+
+  /// How a packet from an address is to be handled, see received()
+  struct Source {
+    bool admitted;           ///< False if its bucket was empty and it should be dropped
+    bool validated;
+    uint64_t credit;         ///< Bytes that may be sent to it, UINT64_MAX once validated
+  };
+
+  static const uint64_t cookiePeriodMs = 60 * 1000;   ///< A cookie is good for one to two periods
+
+  /// slots is rounded up to a power of two
+  SourceGuard( const Limits& limits, size_t slots = 1 << 16 );
+
+  SourceGuard( const SourceGuard& ) = delete;
+  SourceGuard& operator=( const SourceGuard& ) = delete;
+
+  /// Always validate remote and never limit it, for peer relays
+  void trust( const SlowerRemote& remote );
+
+  /// Count a packet of about bytes from remote, taking a token from its bucket
+  Source received( const SlowerRemote& remote, uint32_t bytes, uint64_t nowMs );
+
+  /// Record bytes sent to remote out of the credit received() gave
+  void spend( const SlowerRemote& remote, uint64_t bytes );
+
+  uint64_t cookie( const SlowerRemote& remote, uint64_t nowMs ) const;
+
+  /// Validate remote if cookie is one it was given in this period or the last. Returns false if not.
+  bool checkCookie( const SlowerRemote& remote, uint64_t cookie, uint64_t nowMs );
+
+private:
+  struct Slot {
+    uint32_t tag;            ///< High half of the address hash, odd, 0 for an unused slot
+    uint32_t bytesIn;        ///< Received while not validated, saturating
+    uint64_t bytesOut;       ///< Sent while not validated
+    uint64_t tokens;         ///< Thousandths of a packet
+    uint64_t refillMs;
+    uint64_t validUntilMs;   ///< trustedMs for peer relays
+  };
+  static const uint64_t trustedMs = UINT64_MAX;
+
+  uint64_t hash( const SlowerRemote& remote, uint64_t extra ) const;
+  static uint32_t tagOf( uint64_t hash ) { return (uint32_t)( hash >> 32 ) | 1; }
+  Slot* slotOf( const SlowerRemote& remote, uint64_t nowMs, bool claim );
+
+  Limits limits;
+  uint64_t key[ 2 ];
+  std::vector<Slot> slots;
+};
@@ -1,78 +1,86 @@
 
-
 #include <cassert>
 #include <iostream>
+#include <tuple>
 
 #include <slower.h>
 
 #include "subscription.h"
 
 
-Subscriptions::Subscriptions() {
+Subscriptions::Subscriptions( RemoteTable& remoteTable, uint32_t leaseMsVal, uint64_t nowMs )
+  : remotes( remoteTable ), wheel( 100, nowMs ), leaseMs( leaseMsVal ), count( 0 ) {
   subscriptions.resize(128);
 }
 
-void Subscriptions::add(const MsgShortName& name, const int mask, const SlowerRemote& remote ) {
+bool Subscriptions::add(const MsgShortName& name, const int mask, const SlowerRemote& remote, uint64_t nowMs ) {
   assert( mask <= 70 ); // Mask to org
 
-  MsgShortName group;
-  getMaskedMsgShortName(name, group, mask);
+  const ShortName group = ShortName( name ).masked( mask );
 
   //std::clog << "subscribe.cxx: add "
   //          << std::hex << group.part[1] << "-" <<  group.part[0] << std::dec
   //          << " port=" <<  ntohs( remote.addr.sin_port )
   //          << std::endl;
   
-  auto mapPtr =  subscriptions[mask].find( group );
-  if ( mapPtr == subscriptions[mask].end() ) {
-    std::set<SlowerRemote> list;
-    list.insert( remote );
-    std::pair<MsgShortName,std::set<SlowerRemote>> pair;
-    pair = make_pair( group , list );
-    subscriptions[mask].insert( pair );
+  const RemoteID id = remotes.acquire( remote );
+  Remotes& leases = subscriptions[mask][ group ];
+  auto it = leases.find( id );
+  const bool added = ( it == leases.end() );
+  if ( added ) {
+    it = leases.emplace( std::piecewise_construct, std::forward_as_tuple( id ), std::forward_as_tuple() ).first;
+    it->second.mask = mask;
+    it->second.group = group;
+    it->second.remote = id;
+    count++;
+  } else {
+    remotes.release( id ); // the lease already holds one
   }
-  else {
-    std::set<SlowerRemote>& list = mapPtr->second;
-    if ( list.find( remote ) == list.end() ) {
-      list.insert( remote ); // TODO - rethink if list is right thing here 
-    }
+  if ( leaseMs > 0 ) {
+    wheel.schedule( it->second, nowMs + leaseMs );
+  }
+  return added;
+}
+
+void Subscriptions::erase( int mask, std::map<ShortName,Remotes>::iterator group, Remotes::iterator lease ) {
+  remotes.release( lease->first );
+  group->second.erase( lease ); // the lease takes itself off the wheel
+  count--;
+  if ( group->second.empty() ) {
+    subscriptions[mask].erase( group );
   }
 }
   
 void Subscriptions::remove(const MsgShortName& name, const int mask, const SlowerRemote& remote ) {
-  assert( mask <= 64 );
-  MsgShortName group;
-  getMaskedMsgShortName(name, group, mask);
-
-  auto mapPtr = subscriptions[mask].find( group );
+  assert( mask <= 70 );
+  const RemoteID id = remotes.find( remote );
+  if ( id == RemoteTable::none ) {
+    return;
+  }
+  auto mapPtr = subscriptions[mask].find( ShortName( name ).masked( mask ) );
   if ( mapPtr != subscriptions[mask].end() ) {
-    std::set<SlowerRemote>& list = mapPtr->second;
-    if ( list.find( remote ) == list.end() ) {
-      list.erase( remote ); 
+    auto lease = mapPtr->second.find( id );
+    if ( lease != mapPtr->second.end() ) {
+      erase( mask, mapPtr, lease );
     }
   }
 }
   
 std::list<SlowerRemote> Subscriptions::find(  const MsgShortName& name  ) {
   std::list<SlowerRemote> ret;
-  //std::clog << "subscribe.cxx: find " << std::hex << group.part[1] << "-" <<  group.part[0] << std::dec << std::endl;
-  MsgShortName group;
-
-  // TODO: Fix this to not have to iterate for each mask bit
-  for ( int mask=0; mask <=70 ; mask ++ ) {
-    getMaskedMsgShortName(name, group, mask);
-
-    auto mapPtr = subscriptions[mask].find( group );
-    if ( mapPtr != subscriptions[mask].end() ) {
-      std::set<SlowerRemote>& list = mapPtr->second;
-      for( const SlowerRemote& remote : list ) {
-        SlowerRemote dest = remote;
-        ret.push_back( dest );
-        //std::clog << "subscribe.cxx:     found port=" <<  ntohs( remote.addr.sin_port )<< std::endl;
-      }
-    }
-  }
+  forEach( name, [&]( RemoteID id ) {
+    ret.push_back( remotes[ id ] );
+  } );
   return ret;
 }
 
-
+size_t Subscriptions::expire( uint64_t nowMs ) {
+  return wheel.advance( nowMs, [this]( TimerWheel::Timer& timer ) {
+    Lease& lease = static_cast<Lease&>( timer );
+    auto group = subscriptions[ lease.mask ].find( lease.group );
+    assert( group != subscriptions[ lease.mask ].end() );
+    auto it = group->second.find( lease.remote );
+    assert( it != group->second.end() );
+    erase( lease.mask, group, it );
+  } );
+}
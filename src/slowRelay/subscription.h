@@ -1,27 +1,81 @@
-
-
 #include <list>
 #include <set>
 #include <map>
 #include <vector>
 
 #include <slower.h>
+#include <shortName.h>
+
+#include "remoteTable.h"
+#include "timerWheel.h"
 
 
+/**
+ * Subscriptions are leases. Each add() starts or renews a lease of leaseMs and expire() drops
+ *     the ones that were not renewed in time, so clients must resend their subscribes at least
+ *     every slowerSubRefreshMs. A leaseMs of 0 keeps subscriptions until they are removed.
+ *
+ *     Subscribers are kept as ids in remotes, each lease holding a reference to its id. Groups
+ *     are keyed by the ShortName with the low mask bits cleared.
+ */
 class Subscriptions {
 public:
 
-  Subscriptions();
+  Subscriptions( RemoteTable& remotes, uint32_t leaseMs=0, uint64_t nowMs=0 );
   
-  void add(const MsgShortName& name, const int mask, const SlowerRemote& remote );
+  /// Returns true for a new subscription, false if it renewed an existing one
+  bool add(const MsgShortName& name, const int mask, const SlowerRemote& remote, uint64_t nowMs=0 );
   
   void remove(const MsgShortName& name, const int mask, const SlowerRemote& remote );
   
+  /// Call onRemote( id ) for each subscriber to name, without allocating
+  template <typename F>
+  void forEach( const MsgShortName& name, F onRemote ) const;
+
   std::list<SlowerRemote> find(  const MsgShortName& name  ) ;
+
+  /// Drop the leases that ran out by nowMs, returns how many
+  size_t expire( uint64_t nowMs );
+
+  /// Milliseconds until expire() next has work to do, or -1 if no leases are running
+  int nextTimeoutMs( uint64_t nowMs ) const { return wheel.nextTimeoutMs( nowMs ); }
+
+  size_t size() const { return count; }
     
  private:
-  std::vector< std::map<MsgShortName,std::set<SlowerRemote>> > subscriptions;
+  struct Lease : public TimerWheel::Timer {
+    int mask;
+    ShortName group;
+    RemoteID remote;
+  };
+  typedef std::map<RemoteID,Lease> Remotes;
+
+  void erase( int mask, std::map<ShortName,Remotes>::iterator group, Remotes::iterator lease );
 
+  std::vector< std::map<ShortName,Remotes> > subscriptions;
+  RemoteTable& remotes;
+  TimerWheel wheel;
+  const uint32_t leaseMs;
+  size_t count;
 };
 
 
+template <typename F>
+void Subscriptions::forEach( const MsgShortName& name, F onRemote ) const {
+  const ShortName shortName( name );
+
+  // TODO: Fix this to not have to iterate for each mask bit
+  for ( int mask=0; mask <=70 ; mask ++ ) {
+    const std::map<ShortName,Remotes>& groups = subscriptions[mask];
+    if ( groups.empty() ) {
+      continue;
+    }
+
+    auto mapPtr = groups.find( shortName.masked( mask ) );
+    if ( mapPtr != groups.end() ) {
+      for( const auto& lease : mapPtr->second ) {
+        onRemote( lease.first );
+      }
+    }
+  }
+}
@@ -0,0 +1,115 @@
+#include <cassert>
+
+#include "timerWheel.h"
+
+
+void TimerWheel::Timer::detach() {
+  next->prev = prev;
+  prev->next = next;
+  next = NULL;
+  prev = NULL;
+}
+
+
+void TimerWheel::Timer::unlink() {
+  if ( !next ) {
+    return;
+  }
+  detach();
+  if ( wheel ) {
+    wheel->count--;
+    wheel = NULL;
+  }
+}
+
+
+TimerWheel::TimerWheel( uint32_t tickMsVal, uint64_t nowMs )
+  : tickMs( tickMsVal ), currentTick( nowMs / tickMsVal ), count( 0 ) {
+  assert( tickMs > 0 );
+  for ( int level = 0; level < numLevels; level++ ) {
+    for ( int slot = 0; slot < numSlots; slot++ ) {
+      Timer& head = slots[ level ][ slot ];
+      head.next = &head;
+      head.prev = &head;
+    }
+  }
+}
+
+
+TimerWheel::~TimerWheel() {
+  // leave the timers unscheduled rather than pointing at freed heads, then let the heads
+  // go without unlinking themselves from each other
+  for ( int level = 0; level < numLevels; level++ ) {
+    for ( int slot = 0; slot < numSlots; slot++ ) {
+      Timer& head = slots[ level ][ slot ];
+      while ( head.next != &head ) {
+        head.next->unlink();
+      }
+      head.next = NULL;
+      head.prev = NULL;
+    }
+  }
+}
+
+
+void TimerWheel::schedule( Timer& timer, uint64_t expireMs ) {
+  timer.unlink();
+  timer.expireTick = ( expireMs + tickMs - 1 ) / tickMs; // never early
+  if ( timer.expireTick <= currentTick ) {
+    timer.expireTick = currentTick + 1; // overdue, the current tick has already run
+  }
+  insert( timer );
+  timer.wheel = this;
+  count++;
+}
+
+
+// Put timer in the lowest level that reaches its expiry. While cascading, timers due on the
+// current tick go in the level 0 slot that is about to run.
+void TimerWheel::insert( Timer& timer ) {
+  uint64_t expire = timer.expireTick;
+  assert( expire >= currentTick );
+  const uint64_t delta = expire - currentTick;
+
+  int level = 0;
+  while ( ( level < numLevels - 1 ) && ( delta >= ( uint64_t( 1 ) << ( slotBits * ( level + 1 ) ) ) ) ) {
+    level++;
+  }
+  const uint64_t maxDelta = ( uint64_t( 1 ) << ( slotBits * numLevels ) ) - 1;
+  if ( delta > maxDelta ) {
+    expire = currentTick + maxDelta;
+  }
+
+  Timer& head = slots[ level ][ ( expire >> ( slotBits * level ) ) & ( numSlots - 1 ) ];
+  timer.next = &head;
+  timer.prev = head.prev;
+  head.prev->next = &timer;
+  head.prev = &timer;
+}
+
+
+// When the lower levels wrap, spread the next slot of each level above back down. Higher
+// levels go first so their timers can land in the slots being spread.
+void TimerWheel::cascade() {
+  int top = 0;
+  while ( ( top < numLevels - 1 ) && ( ( currentTick >> ( slotBits * ( top + 1 ) ) << ( slotBits * ( top + 1 ) ) ) == currentTick ) ) {
+    top++;
+  }
+  for ( int level = top; level > 0; level-- ) {
+    Timer& head = slots[ level ][ ( currentTick >> ( slotBits * level ) ) & ( numSlots - 1 ) ];
+    while ( head.next != &head ) {
+      Timer& timer = *head.next;
+      timer.detach();
+      insert( timer );
+    }
+  }
+}
+
+
+int TimerWheel::nextTimeoutMs( uint64_t nowMs ) const {
+  if ( count == 0 ) {
+    return -1;
+  }
+  const uint64_t nextMs = ( currentTick + 1 ) * tickMs;
+  return ( nextMs <= nowMs ) ? 0 : (int)( nextMs - nowMs );
+}
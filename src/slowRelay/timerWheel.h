@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Hierarchical timer wheel.
+ *
+ *     Time moves in ticks of tickMs. There are numLevels wheels of numSlots slots each, and a
+ *     timer goes in the lowest wheel that can hold its expiry: level 0 slots are single ticks,
+ *     level 1 slots are numSlots ticks and so on. Each tick expires the timers of one level 0
+ *     slot, and every numSlots ticks one slot of the level above is spread back down. Scheduling,
+ *     rescheduling and cancelling are O(1) and each timer is moved at most numLevels times, so
+ *     the work per tick does not depend on how many timers are waiting. Expiries further out
+ *     than the wheels reach are clamped to the furthest slot.
+ *
+ *     Timers are intrusive list nodes owned by the caller, usually as a base class of whatever
+ *     is timed. A timer unlinks itself when destroyed and must not move while it is scheduled.
+ */
+class TimerWheel {
+public:
+  static const int slotBits = 6;
+  static const int numSlots = 1 << slotBits;
+  static const int numLevels = 4;
+
+  class Timer {
+  public:
+    Timer() : next( NULL ), prev( NULL ), wheel( NULL ), expireTick( 0 ) {}
+    ~Timer() { unlink(); }
+    Timer( const Timer& ) = delete;
+    Timer& operator=( const Timer& ) = delete;
+
+    bool scheduled() const { return next != NULL; }
+
+  private:
+    friend class TimerWheel;
+    void unlink();   ///< take off the wheel
+    void detach();   ///< take out of its slot list only
+
+    Timer* next;
+    Timer* prev;
+    TimerWheel* wheel;
+    uint64_t expireTick;
+  };
+
+  TimerWheel( uint32_t tickMs=100, uint64_t nowMs=0 );
+  ~TimerWheel();
+
+  TimerWheel( const TimerWheel& ) = delete;
+  TimerWheel& operator=( const TimerWheel& ) = delete;
+
+  /// Schedule, or move if already scheduled, timer to fire at expireMs
+  void schedule( Timer& timer, uint64_t expireMs );
+
+  void cancel( Timer& timer ) { timer.unlink(); }
+
+  /// Run the ticks up to nowMs, calling onExpire( Timer& ) for every timer that fires. The
+  /// timer is unscheduled before the call, so onExpire may destroy or reschedule it. Returns
+  /// the number fired.
+  template<typename F>
+  size_t advance( uint64_t nowMs, F onExpire ) {
+    const uint64_t target = nowMs / tickMs;
+    size_t fired = 0;
+    while ( currentTick < target ) {
+      if ( count == 0 ) {
+        currentTick = target; // nothing to do for the ticks in between
+        break;
+      }
+      currentTick++;
+      cascade();
+      Timer& head = slots[ 0 ][ currentTick & ( numSlots - 1 ) ];
+      while ( head.next != &head ) {
+        Timer& timer = *head.next;
+        timer.unlink();
+        fired++;
+        onExpire( timer );
+      }
+    }
+    return fired;
+  }
+
+  /// Milliseconds until the next tick, or -1 if no timers are scheduled
+  int nextTimeoutMs( uint64_t nowMs ) const;
+
+  size_t size() const { return count; }
+
+private:
+  void insert( Timer& timer );
+  void cascade();
+
+  Timer slots[ numLevels ][ numSlots ];   ///< List heads, each slot is a circular list
+  const uint32_t tickMs;
+  uint64_t currentTick;
+  size_t count;
+};
@@ -22,23 +22,23 @@ void NetApi::send(const QMsgNetMessage &message) {
   assert(err == QMsgEncoderSuccess);
 
   QMsgLength sendLen = encodeLen;
-  ssize_t n = write(sec2netFD, &sendLen, sizeof(sendLen));
+  ssize_t n = sec2net.write(&sendLen, sizeof(sendLen));
   assert(n == sizeof(sendLen));
-  n = write(sec2netFD, encodeBuffer, sendLen);
+  n = sec2net.write(encodeBuffer, sendLen);
   assert(n == sendLen);
 }
 
-int NetApi::getReadFD() { return net2secFD; }
+int NetApi::getReadFD() { return net2sec.getFD(); }
 
 NetApi::NetApi() {
   QMsgEncoderInit(&context);
 
-  sec2netFD = open("/tmp/pipe-s2n", O_WRONLY, O_NONBLOCK);
-  assert(sec2netFD >= 0);
+  int err = sec2net.openWrite("/tmp/pipe-s2n");
+  assert(err == 0);
   std::clog << "SEC: Got pipe to netProc" << std::endl;
 
-  net2secFD = open("/tmp/pipe-n2s", O_RDONLY, O_NONBLOCK);
-  assert(net2secFD >= 0);
+  err = net2sec.openRead("/tmp/pipe-n2s");
+  assert(err == 0);
   std::clog << "SEC: Got pipe from netProc" << std::endl;
 }
 
@@ -86,7 +86,7 @@ void NetApi::readMsg(QMsgNetMessage *message) {
   uint8_t uiBuf[bufSize];
 
   QMsgLength msgLen = 0;
-  ssize_t num = read(net2secFD, &msgLen, sizeof(msgLen));
+  ssize_t num = net2sec.readAll(&msgLen, sizeof(msgLen));
   if ( num == 0 ) {
     message->type = QMsgNetInvalid;
     return;
@@ -94,7 +94,7 @@ void NetApi::readMsg(QMsgNetMessage *message) {
   assert(num == sizeof(msgLen));
   if ( msgLen >= bufSize ) { std::cerr << "msgLen=" << msgLen << std::endl; }
   assert(msgLen <= bufSize);
-  num = read(net2secFD, uiBuf, msgLen);
+  num = net2sec.readAll(uiBuf, msgLen);
   assert(num == msgLen);
 
   QMsgEncoderResult err;
@@ -8,12 +8,13 @@
 #include <vector>
 
 #include "qmsg/encoder.h"
+#include <ipcPipe.h>
 
 class NetApi {
 private:
   QMsgEncoderContext *context;
-  int sec2netFD;
-  int net2secFD;
+  IpcPipe sec2net;
+  IpcPipe net2sec;
 
   void send(const QMsgNetMessage &message);
 
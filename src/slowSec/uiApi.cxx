@@ -23,23 +23,23 @@ void UiApi::send(const QMsgUIMessage &message) {
   assert(err == QMsgEncoderSuccess);
 
   uint32_t sendLen = encodeLen;
-  ssize_t n = write(sec2uiFD, &sendLen, sizeof(sendLen));
+  ssize_t n = sec2ui.write(&sendLen, sizeof(sendLen));
   assert(n == sizeof(sendLen));
-  n = write(sec2uiFD, encodeBuffer, sendLen);
+  n = sec2ui.write(encodeBuffer, sendLen);
   assert(n == sendLen);
 }
 
-int UiApi::getReadFD() { return ui2secFD; }
+int UiApi::getReadFD() { return ui2sec.getFD(); }
 
 UiApi::UiApi() {
   QMsgEncoderInit(&context);
 
-  sec2uiFD = open("/tmp/pipe-s2u", O_WRONLY, O_NONBLOCK);
-  assert(sec2uiFD >= 0);
+  int err = sec2ui.openWrite("/tmp/pipe-s2u");
+  assert(err == 0);
   std::clog << "SEC: Got pipe from uiProc" << std::endl;
 
-  ui2secFD = open("/tmp/pipe-u2s", O_RDONLY, O_NONBLOCK);
-  assert(ui2secFD >= 0);
+  err = ui2sec.openRead("/tmp/pipe-u2s");
+  assert(err == 0);
   std::clog << "SEC: Got pipe to uiProc" << std::endl;
 }
 
@@ -56,14 +56,14 @@ void UiApi::readMsg(QMsgUIMessage *message) {
   uint8_t uiBuf[bufSize];
 
   uint32_t msgLen = 0;
-  ssize_t num = read(ui2secFD, &msgLen, sizeof(msgLen));
+  ssize_t num = ui2sec.read(&msgLen, sizeof(msgLen));
    if ( num == 0 ) {
     message->type = QMsgUIInvalid;
     return;
   }
   assert(num == sizeof(msgLen));
   assert(msgLen <= bufSize);
-  num = read(ui2secFD, uiBuf, msgLen);
+  num = ui2sec.read(uiBuf, msgLen);
   assert(num == msgLen);
 
   QMsgEncoderResult err;
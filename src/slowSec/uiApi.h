@@ -3,12 +3,13 @@
 #include <unistd.h>
 
 #include "qmsg/encoder.h"
+#include <ipcPipe.h>
 
 class UiApi {
 private:
   QMsgEncoderContext *context;
-  int sec2uiFD;
-  int ui2secFD;
+  IpcPipe sec2ui;
+  IpcPipe ui2sec;
 
   void send(const QMsgUIMessage &message);
 
@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
+#include <cctype>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -13,24 +14,32 @@
 #include <unistd.h>
 #include <vector>
 #include <iomanip>
+#include <set>
 
 #include <chrono>
 
+#include <fstream>
+#include <iterator>
+#include <map>
+
 #include <slower.h>
 #include <name.h>
+#include <reassembler.h>
 
 
 int main(int argc, char* argv[]) {
-  if ( ( argc != 2 ) && (  argc != 3 ) ) {
+  if ( ( argc < 2 ) || (  argc > 4 ) ) {
     float slowVer = slowerVersion();
     std::cerr << "Relay address and port set in SLOWR_RELAY and SLOWR_PORT env variables as well as SLOWR_ORG" << std::endl; 
-    std::cerr << "Usage PUB: slowTest <team>/<channel>/<device/<message> pubData" << std::endl; 
+    std::cerr << "Usage PUB: slowTest <team>/<channel>/<device/<message> pubData [count]" << std::endl; 
+    std::cerr << "Usage PUB: slowTest <team>/<channel>/<device/<message> @file [count]" << std::endl; 
     std::cerr << "Usage SUB: slowTest <team>/<channel>/<device/<message>" << std::endl; 
     std::cerr << "Usage SUB: slowTest <team>/<channel>/<device>" << std::endl;
     std::cerr << "Usage SUB: slowTest <team>/<channel>" << std::endl;
     std::cerr <<  std::endl; 
     std::cerr << "Usage PUB: slowTest FF0001 pubData" << std::endl; 
     std::cerr << "Usage SUB: slowTest FF0000:16" << std::endl;
+    std::cerr << "Usage SUB: slowTest qmsg://msg/org-1/team-2/ch-3[/dev-4[/msg-5]]" << std::endl;
     std::cerr << "slowTest lib version " << slowVer << std::endl;
     exit(-1);
   }
@@ -53,61 +62,41 @@ int main(int argc, char* argv[]) {
     port = atoi( portVar );
   }
 
-  std::string nameString( argv[1] );
+  const char* nameString = argv[1];
   MsgShortName shortName;
   int mask=16;
-  try {
-    if ( nameString.find('/') != std::string::npos ) {
-      uint32_t team=1;
-      uint32_t channel=1;
-      uint32_t device=0;
-      uint32_t msgID=0;
-
-      team    = std::stoul( nameString.substr(0,  nameString.find('/') ), nullptr, 16);
-      nameString.erase( 0, nameString.find('/') );
-
-      channel = std::stoul( nameString.substr(1,  nameString.find('/',1) ), nullptr, 16);
-      nameString.erase( 0, nameString.find('/',1) );
-      mask=40;
-
-      if ( nameString.length() > 0 ) {
-        device  = std::stoul( nameString.substr(1,  nameString.find('/',1) ), nullptr, 16);
-        nameString.erase( 0, nameString.find('/',1) );
-        mask = 20;
-        
-        if ( nameString.length() > 0 ) {
-          msgID   = std::stoul( nameString.substr(1,  nameString.length() ), nullptr, 16);
-          nameString.erase( 0, nameString.length() );
-          mask = 0; 
-        }
+  if ( !Name::parse( nameString, strlen( nameString ), shortName, mask ) ) {
+    // <team>/<channel>[/<device>[/<message>]] in hex, in the org from SLOWR_ORG
+    uint32_t fields[4] = { 1, 1, 0, 0 }; // team, channel, device, msgID
+    const uint32_t maxes[4] = { 0xFffff, 0x3FF, 0xFffff, 0xFffff };
+    const int masks[4] = { 0, 40, 20, 0 };
+    int numFields = 0;
+    bool valid = false;
+    const char* p = nameString;
+    while ( ( numFields < 4 ) && isxdigit( (unsigned char)*p ) ) {
+      char* end;
+      unsigned long value = strtoul( p, &end, 16 );
+      if ( value > maxes[ numFields ] ) {
+        break;
       }
-      
-      Name nameObj( NamePath::message, org, team, channel, device , msgID );
-      shortName = nameObj.shortName();
-    }
-
-    /* --- Add support for hex names if that's going to be used.
-    else {
-      if ( nameString.find(':') != std::string::npos ) {
-        mask = std::stoul( nameString.substr( nameString.find(':')+1, std::string::npos ), nullptr, 10);
-        nameString.erase( nameString.find(':'), std::string::npos );
+      fields[ numFields++ ] = (uint32_t)value;
+      p = end;
+      if ( *p == '\0' ) {
+        valid = ( numFields >= 2 );
+        break;
       }
-      std::string low;
-      std::string high;
-      if ( nameString.length() <= 16 ) {
-        low = nameString;
-        shortName.part[0] = std::stoul(low,nullptr,16);
-        shortName.part[1] = 0;
-      } else {
-        low =  nameString.substr( nameString.length()-16 , std::string::npos );
-        high = nameString.substr( 0 , nameString.length()-16 );
-        shortName.part[0] = std::stoul(low,nullptr,16);
-        shortName.part[1] = std::stoul(high,nullptr,16);
+      if ( *p++ != '/' ) {
+        break;
       }
-    } */
-  } catch ( ... ) {
-    std::clog << "invalid input name: " << nameString <<  std::endl;
-    exit (1);
+    }
+    if ( !valid ) {
+      std::clog << "invalid input name: " << nameString <<  std::endl;
+      exit (1);
+    }
+    mask = masks[ numFields - 1 ];
+
+    Name nameObj( NamePath::message, org, fields[0], (uint16_t)fields[1], fields[2], fields[3] );
+    shortName = nameObj.shortName();
   }
  
   std::cerr << "Name=" << Name( shortName ).shortString()
@@ -115,7 +104,23 @@ int main(int argc, char* argv[]) {
   
     
   std::vector<uint8_t> data;
-  if ( argc == 3 ) {
+  int count = 1;
+  if ( argc == 4 ) {
+    count = atoi( argv[3] );
+  }
+  if ( ( argc >= 3 ) && ( argv[2][0] == '@' ) ) {
+    // publish a file, anything over one datagram is sent in fragments
+    std::ifstream file( argv[2] + 1, std::ios::binary );
+    if ( !file ) {
+      std::cerr << "Could not read " << argv[2] + 1 << std::endl;
+      exit(1);
+    }
+    data.assign( std::istreambuf_iterator<char>( file ), std::istreambuf_iterator<char>() );
+    if ( data.size() > slowerMaxObjectLen ) {
+      std::cerr << argv[2] + 1 << " is over " << slowerMaxObjectLen << " bytes" << std::endl;
+      exit(1);
+    }
+  } else if ( argc >= 3 ) {
     data.insert( data.end(), (uint8_t*)(argv[2]) , ((uint8_t*)(argv[2])) + strlen( argv[2] ) );
   }
 
@@ -123,6 +128,7 @@ int main(int argc, char* argv[]) {
   SlowerConnection slower;
   int err = slowerSetup( slower  );
   assert( err == 0 );
+  slowerEnableRxTimestamps( slower ); // falls back to user space time if unsupported
   
   SlowerRemote relay;
   err = slowerRemote( relay , relayName, port );
@@ -144,26 +150,69 @@ int main(int argc, char* argv[]) {
               << " aka "
               << Name( shortName ).longString()
               << std::endl;
-    MsgHeaderMetrics metrics = {0};
+    // count publishes to consecutive msg ids, all in flight at once, then take the acks as
+    // they come in whether one at a time or batched
+    MsgShortName prefix = shortName;
+    prefix.spec.msg_id = 0;
+    std::set<uint32_t> outstanding;
 
-    metrics.pub_millis = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::system_clock::now().time_since_epoch() ).count();
+    slowerBundleBegin( slower );
+    for ( int i = 0; i < count; i++ ) {
+      MsgShortName name = shortName;
+      name.spec.msg_id += i;
+      outstanding.insert( name.spec.msg_id );
 
+      MsgHeaderMetrics metrics = {0};
+      metrics.pub_millis = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::system_clock::now().time_since_epoch() ).count();
 
-    err = slowerPub( slower,  shortName,  (char*)data.data() , data.size(), NULL, &metrics);
+      err = slowerPub( slower,  name,  (char*)data.data() , data.size(), NULL, &metrics);
+      assert( err == 0 );
+    }
+    err = slowerBundleFlush( slower );
     assert( err == 0 );
+    auto pubTime = std::chrono::steady_clock::now();
 
-     while ( true ) {
+    int ackPackets = 0;
+    while ( !outstanding.empty() ) {
       err=slowerWait( slower );
       assert( err == 0 );
 
-      MsgShortName recvName;
-      err = slowerRecvAck( slower, &recvName );
+      MsgHeader mhdr;
+      SlowerRemote remote;
+      int subMask;
+      char buf[slowerMTU];
+      int bufLen=0;
+      err = slowerRecvMulti( slower, &mhdr, &remote, &subMask, buf, sizeof(buf), &bufLen );
       assert( err == 0 );
-      if ( recvName == shortName ) {
-        std::clog << "   Got ACK for " << Name( recvName ).longString() << std::endl;
-        break;
+
+      MsgShortName recvPrefix = mhdr.name;
+      recvPrefix.spec.msg_id = 0;
+      if ( recvPrefix != prefix ) {
+        continue;
       }
-     }
+
+      if ( mhdr.type == SlowerMsgAck ) {
+        if ( count == 1 ) {
+          char nameBuf[ Name::longStringLen ];
+          std::clog << "   Got ACK for " << Name( mhdr.name ).longString( nameBuf, sizeof( nameBuf ) ) << std::endl;
+        }
+        outstanding.erase( mhdr.name.spec.msg_id );
+        ackPackets++;
+      }
+      if ( mhdr.type == SlowerMsgAckBatch ) {
+        const MsgAckRange* ranges = (const MsgAckRange*)buf;
+        for ( int r = 0; r < bufLen / (int)sizeof( MsgAckRange ); r++ ) {
+          outstanding.erase( outstanding.lower_bound( ranges[r].first ), outstanding.upper_bound( ranges[r].last ) );
+        }
+        ackPackets++;
+      }
+    }
+
+    if ( count > 1 ) {
+      std::clog << "   Got ACKs for " << count << " publishes in " << ackPackets << " packets after "
+                << std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - pubTime ).count()
+                << " ms" << std::endl;
+    }
   }
   else {
     // do subscribe 
@@ -178,35 +227,99 @@ int main(int argc, char* argv[]) {
     err = slowerSub( slower,  shortName, mask  );
     assert( err == 0 );
 
+    // large publishes arrive in fragments, only the first of which carries the metrics
+    Reassembler reassembler;
+    std::map<MsgShortName, MsgHeaderMetrics> fragMetrics;
+    auto steadyMs = []() {
+      return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+    };
+
+    // the relay drops subscriptions that are not renewed
+    uint64_t nextSubRefreshMs = steadyMs() + slowerSubRefreshMs;
+
     while ( true ) {
       err=slowerWait( slower );
       assert( err == 0 );
+      reassembler.service( slower, steadyMs() );
+
+      if ( steadyMs() >= nextSubRefreshMs ) {
+        err = slowerSub( slower,  shortName, mask  );
+        assert( err == 0 );
+        nextSubRefreshMs += slowerSubRefreshMs;
+      }
 
       char buf[slowerMTU];
       int bufLen=0;
       MsgHeader mhdr;
       MsgHeaderMetrics metrics = {0};
+      uint64_t rxMicros = 0;
+      MsgFragHeader frag;
+      SlowerRemote remote;
+      int subMask;
       
-      err = slowerRecvPub( slower, &mhdr, buf, sizeof(buf), &bufLen, &metrics);
-      uint64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::system_clock::now().time_since_epoch() ).count();
+      err = slowerRecvMulti( slower, &mhdr, &remote, &subMask, buf, sizeof(buf), &bufLen, &metrics, &rxMicros, &frag );
+      uint64_t nowMicros = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::system_clock::now().time_since_epoch() ).count();
+      uint64_t rxMs = rxMicros / 1000; // latencies are to when the packet reached this host
 
       assert( err == 0 );
 
-      if (bufLen > 0) {
+      std::vector<uint8_t> object;
+      if ( mhdr.type == SlowerMsgPub ) {
+        object.assign( buf, buf + bufLen );
+      }
+      if ( ( mhdr.type == SlowerMsgPubFrag ) && ( bufLen > 0 ) ) {
+        if ( mhdr.flags.metrics ) {
+          fragMetrics[ mhdr.name ] = metrics;
+        }
+        if ( !reassembler.add( mhdr.name, frag, remote, (uint8_t*)buf, bufLen, steadyMs(), object ) ) {
+          continue;
+        }
+        auto m = fragMetrics.find( mhdr.name );
+        if ( m != fragMetrics.end() ) {
+          metrics = m->second;
+          fragMetrics.erase( m );
+        }
+        std::clog << "Reassembled " << frag.count << " fragments, " << object.size() << " bytes" << std::endl;
+      }
+
+      if ( !object.empty() ) {
+        char nameBuf[ Name::longStringLen ];
         std::clog << "Got data for "
-                  << Name( mhdr.name ).longString() << " ";
+                  << Name( mhdr.name ).longString( nameBuf, sizeof( nameBuf ) ) << " ";
           //<< " len=" << bufLen
 
         if (metrics.pub_millis and metrics.relay_millis) {
           std::clog << std::endl
-                    << "  pub age ms       : " << (nowMs - metrics.pub_millis) << std::endl
-                    << "  relay latency ms : " << (nowMs - metrics.relay_millis) << std::endl;
+                    << "  pub age ms       : " << (rxMs - metrics.pub_millis) << std::endl
+                    << "  relay latency ms : " << (rxMs - metrics.relay_millis) << std::endl
+                    << "  socket queue us  : " << (nowMicros - rxMicros) << std::endl;
+        }
+
+        if (metrics.pub_millis and metrics.num_hops > 0) {
+          // per hop breakdown, each step is the time since the previous hop was received. Hops
+          // on different hosts are only as accurate as their clocks are in sync.
+          std::clog << "  hop trace ms     : (targets 100 in region, 250 between regions)" << std::endl;
+          double prevMs = metrics.pub_millis;
+          for ( int h = 0; h < metrics.num_hops; h++ ) {
+            double hopMs = metrics.hops[h].time_micros / 1000.0;
+            std::clog << "    relay 0x" << std::hex << std::setw( 8 ) << std::setfill( '0' )
+                      << metrics.hops[h].relay_id << std::dec << std::setfill( ' ' )
+                      << std::fixed << std::setprecision( 3 )
+                      << " +" << std::setw( 9 ) << ( hopMs - prevMs )
+                      << "  at " << std::setw( 9 ) << ( hopMs - metrics.pub_millis ) << std::endl;
+            prevMs = hopMs;
+          }
+          double hereMs = rxMicros / 1000.0;
+          std::clog << "    subscriber      +" << std::setw( 9 ) << ( hereMs - prevMs )
+                    << "  at " << std::setw( 9 ) << ( hereMs - metrics.pub_millis ) << std::endl;
+          std::clog << std::defaultfloat;
         }
 
         std::clog << "  data --> " ;
 
-        for ( int i=0; i< bufLen; i++ ) {
-          char c = buf[i];
+        const size_t maxShow = 200;
+        for ( size_t i=0; i< std::min( object.size(), maxShow ); i++ ) {
+          char c = object[i];
           if (( c >= 32 ) && ( c <= 0x7e ) ) {
             std::clog << c;
           }
@@ -214,6 +327,9 @@ int main(int argc, char* argv[]) {
              std::clog << '~';
           }
         }
+        if ( object.size() > maxShow ) {
+          std::clog << "... (" << object.size() << " bytes)";
+        }
 
         std::clog  << std::endl;
         // break;
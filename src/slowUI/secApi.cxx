@@ -22,23 +22,23 @@ void SecApi::send(const QMsgUIMessage &message) {
   assert(err == QMsgEncoderSuccess);
 
   uint32_t sendLen = encodeLen;
-  ssize_t n = write(ui2secFD, &sendLen, sizeof(sendLen));
+  ssize_t n = ui2sec.write(&sendLen, sizeof(sendLen));
   assert(n == sizeof(sendLen));
-  n = write(ui2secFD, encodeBuffer, sendLen);
+  n = ui2sec.write(encodeBuffer, sendLen);
   assert(n == sendLen);
 }
 
-int SecApi::getReadFD() { return sec2uiFD; }
+int SecApi::getReadFD() { return sec2ui.getFD(); }
 
 SecApi::SecApi() {
   QMsgEncoderInit(&context);
 
-  sec2uiFD = open("/tmp/pipe-s2u", O_RDONLY, O_NONBLOCK);
-  assert(sec2uiFD >= 0);
+  int err = sec2ui.openRead("/tmp/pipe-s2u");
+  assert(err == 0);
   fprintf(stderr, "UI: Got pipe from secProc\n");
 
-  ui2secFD = open("/tmp/pipe-u2s", O_WRONLY, O_NONBLOCK);
-  assert(ui2secFD >= 0);
+  err = ui2sec.openWrite("/tmp/pipe-u2s");
+  assert(err == 0);
   fprintf(stderr, "UI: Got pipe to secProc\n");
 }
 
@@ -79,14 +79,14 @@ void SecApi::readMsg(QMsgUIMessage *message) {
   uint8_t uiBuf[bufSize];
 
   uint32_t msgLen = 0;
-  ssize_t num = read(sec2uiFD, &msgLen, sizeof(msgLen));
+  ssize_t num = sec2ui.read(&msgLen, sizeof(msgLen));
   if ( num == 0 ) {
     message->type = QMsgUIInvalid;
     return;
   }
   assert(num == sizeof(msgLen));
   assert(msgLen <= bufSize);
-  num = read(sec2uiFD, uiBuf, msgLen);
+  num = sec2ui.read(uiBuf, msgLen);
   assert(num == msgLen);
 
   QMsgEncoderResult err;
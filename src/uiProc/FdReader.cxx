@@ -4,7 +4,13 @@
 #include <string.h>
 
 FdReader::FdReader(int fd, unsigned long buffer_size) :
-    fd(fd), buffer_size(buffer_size), buffer_length(0)
+    fd(fd), pipe(nullptr), buffer_size(buffer_size), buffer_length(0)
+{
+    buffer_data = new char[buffer_size];
+}
+
+FdReader::FdReader(IpcPipe* pipe, unsigned long buffer_size) :
+    fd(pipe->getFD()), pipe(pipe), buffer_size(buffer_size), buffer_length(0)
 {
     buffer_data = new char[buffer_size];
 }
@@ -21,9 +27,16 @@ bool FdReader::HasMessage(const int selected_fd, fd_set &fdSet)
 
 char* FdReader::Read(unsigned long offset)
 {
-    buffer_length = read(fd,
-                         buffer_data + offset,
-                         buffer_size - offset);
+    if (pipe)
+    {
+        buffer_length = pipe->read(buffer_data + offset, buffer_size - offset);
+    }
+    else
+    {
+        buffer_length = read(fd,
+                             buffer_data + offset,
+                             buffer_size - offset);
+    }
 
     buffer_length += offset;
     buffer_data[strcspn(buffer_data, "\n")] = 0;
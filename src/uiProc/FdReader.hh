@@ -5,11 +5,15 @@
 #include <unistd.h>
 #include <sys/select.h>
 
+#include <ipcPipe.h>
+
 // Read and parse input from keybaord or similar user entry system
 class FdReader
 {
 public:
     FdReader(int fd, unsigned long buffer_size);
+    // Read from a pipe to the peer process, FIFO or shared memory as opened by the caller
+    FdReader(IpcPipe* pipe, unsigned long buffer_size);
     ~FdReader();
 
     bool HasMessage(const int selected_fd, fd_set &fdSet);
@@ -22,6 +26,7 @@ public:
     void Flush();
 private:
     int fd;
+    IpcPipe* pipe;
     unsigned long buffer_size;
     unsigned long buffer_length;
     char* buffer_data;
@@ -2,7 +2,7 @@
 #include <stdint.h>
 #include <cstring>
 
-Sender::Sender(int ui_to_sec_fd) : ui_to_sec_fd(ui_to_sec_fd)
+Sender::Sender(IpcPipe* ui_to_sec) : ui_to_sec(ui_to_sec)
 {
     if (QMsgEncoderInit(&context)) throw "Failed to create sender context";
 }
@@ -53,7 +53,7 @@ void Sender::SendEncoded(QMsgUIMessage msg)
         return;
     }
 
-    // Write the buffer to the fd
-    write(ui_to_sec_fd, send_buffer, encoded_length);
+    // Write the buffer to the pipe
+    ui_to_sec->write(send_buffer, encoded_length);
     fprintf(stderr, "\n");
 }
@@ -4,11 +4,12 @@
 #include <unistd.h>
 
 #include "qmsg/encoder.h"
+#include <ipcPipe.h>
 
 class Sender
 {
 public:
-    Sender(int ui_to_sec_fd);
+    Sender(IpcPipe* ui_to_sec);
     ~Sender();
 
     bool HasMessage(int selected_fd);
@@ -20,6 +21,6 @@ public:
 private:
     void SendEncoded(QMsgUIMessage msg);
 
-    int ui_to_sec_fd;
+    IpcPipe* ui_to_sec;
     QMsgEncoderContext *context;
 };
@@ -5,16 +5,16 @@
 #include <iostream>
 
 UserInterface::UserInterface(const int keyboard_fd,
-                             const int sec_to_ui_fd,
-                             const int ui_to_sec_id,
+                             IpcPipe* sec_to_ui,
+                             IpcPipe* ui_to_sec,
                              const unsigned int buffer_size) :
     selected_fd(0),
     is_running(false),
     update_draw(false)
 {
     keyboard = new FdReader(keyboard_fd, buffer_size);
-    receiver = new FdReader(sec_to_ui_fd, buffer_size);
-    sender = new Sender(ui_to_sec_id);
+    receiver = new FdReader(sec_to_ui, buffer_size);
+    sender = new Sender(ui_to_sec);
     parser = new Parser();
 
     // HACK the defaults should be stored on the device
@@ -33,8 +33,8 @@ class UserInterface
 {
 public:
     UserInterface(const int keyboard_fd,
-                  const int sec_to_ui_fd,
-                  const int ui_to_sec_id,
+                  IpcPipe* sec_to_ui,
+                  IpcPipe* ui_to_sec,
                   const unsigned int buffer_size);
 
     ~UserInterface();
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <ipcPipe.h>
 #include "UserInterface.hh"
 
 constexpr int Buffer_Size = 1024;
@@ -19,13 +20,16 @@ int main(int argc, char *argv[])
     int keyboard_fd = 0;
 
     // Setup the security to ui file descriptor
-    int sec_to_ui_fd = open("/tmp/pipe-s2u", O_RDONLY, O_NONBLOCK);
-    assert(sec_to_ui_fd >= 0);
+    IpcPipe sec_to_ui;
+    int err = sec_to_ui.openRead("/tmp/pipe-s2u");
+    assert(err == 0);
+    const int sec_to_ui_fd = sec_to_ui.getFD();
     fprintf(stderr, "UI: Got pipe from secProc\n");
 
     // Setup the ui to security file descriptor
-    int ui_to_sec_fd = open("/tmp/pipe-u2s", O_WRONLY, O_NONBLOCK);
-    assert(ui_to_sec_fd >= 0);
+    IpcPipe ui_to_sec;
+    err = ui_to_sec.openWrite("/tmp/pipe-u2s");
+    assert(err == 0);
     fprintf(stderr, "UI: Got pipe to secProc\n");
 
     /*
@@ -51,7 +55,7 @@ int main(int argc, char *argv[])
     int selected_fd = 0;
 
     UserInterface user_interface(
-        keyboard_fd, sec_to_ui_fd, ui_to_sec_fd, Buffer_Size);
+        keyboard_fd, &sec_to_ui, &ui_to_sec, Buffer_Size);
     user_interface.Start();
     while (user_interface.Running())
     {
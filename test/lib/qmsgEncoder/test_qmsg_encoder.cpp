@@ -291,6 +291,68 @@ namespace {
     };
 
 
+    TEST_F(QMsgEncoderTest, Deserialize_NetSendASCIIMessageInPlace)
+    {
+        std::uint8_t buffer[] =
+        {
+            // Message length
+            0x00, 0x00, 0x00, 0x29,
+
+            // Message type
+            0x00, 0x00, 0x00, 0x01,
+
+            // Org ID
+            0x11, 0x12, 0x13, 0x14,
+
+            // Team ID
+            0x01, 0x02, 0x03, 0x04,
+
+            // Channel ID
+            0x05, 0x06, 0x07, 0x08,
+
+            // Device ID
+            0x21, 0x22, 0x23, 0x24,
+
+            // Message ID
+            0xa1, 0xa2, 0xa3, 0xa4,
+
+            // Opaque data length
+            0x00, 0x00, 0x00, 0x0d,
+
+            // Hello, World!
+            0x48, 0x65, 0x6c, 0x6c, 0x6f, 0x2c, 0x20, 0x57,
+            0x6f, 0x72, 0x6c, 0x64, 0x21
+        };
+
+        QMsgNetMessage message{};
+        char text[] = "Hello, World!";
+        std::size_t octets_consumed{};
+
+        QMsgEncoderSetDecodeInPlace(context, 1);
+
+        ASSERT_EQ(QMsgEncoderSuccess,
+                  QMsgNetDecodeMessage(context,
+                                       buffer,
+                                       sizeof(buffer),
+                                       &message,
+                                       &octets_consumed));
+
+        ASSERT_EQ(sizeof(buffer), octets_consumed);
+        ASSERT_EQ(strlen(text), message.u.send_ascii_message.message.length);
+
+        // The opaque data should reference the buffer rather than a copy
+        ASSERT_EQ(buffer + 32, message.u.send_ascii_message.message.data);
+
+        // An opaque length running past the message is still rejected
+        buffer[31] = 0x0e;
+        ASSERT_EQ(QMsgEncoderCorruptMessage,
+                  QMsgNetDecodeMessage(context,
+                                       buffer,
+                                       sizeof(buffer),
+                                       &message,
+                                       &octets_consumed));
+    };
+
     TEST_F(QMsgEncoderTest, Serialize_NetWatchDevices)
     {
         std::uint8_t expected[] =
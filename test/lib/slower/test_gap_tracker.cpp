@@ -0,0 +1,132 @@
+/*
+ *  test_gap_tracker.cpp
+ *
+ *  Copyright (C) 2022
+ *  Cisco Systems, Inc.
+ *  All Rights Reserved
+ *
+ *  Description:
+ *      This module will test how the slower GapTracker counts the msg_ids
+ *      of a stream missing, and how a jump of more than maxGap ids starts
+ *      the stream over.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#include <cstring>
+#include "gapTracker.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+    const uint32_t max_gap = 256;
+
+    MsgShortName MakeName(uint32_t device, uint32_t msg_id)
+    {
+        MsgShortName name;
+        std::memset(&name, 0, sizeof(name));
+        name.spec.team = 3;
+        name.spec.channel = 1;
+        name.spec.device = device;
+        name.spec.msg_id = msg_id;
+        return name;
+    }
+
+    // The fixture feeds one tracker the msg_ids of a few devices
+    class GapTrackerTest : public ::testing::Test
+    {
+        protected:
+            GapTrackerTest() : tracker(20, 200, 3, max_gap)
+            {
+            }
+
+            bool Received(uint32_t msg_id, uint32_t device = 1)
+            {
+                return tracker.received(MakeName(device, msg_id), now_ms);
+            }
+
+            GapTracker tracker;
+            uint64_t now_ms = 1000;
+    };
+
+    // Ids skipped over are missing until they arrive, and arrive only once
+    TEST_F(GapTrackerTest, Gap)
+    {
+        ASSERT_TRUE(Received(10));
+        ASSERT_TRUE(Received(15));
+        ASSERT_EQ(tracker.missing(), 4u);
+        ASSERT_TRUE(Received(12));
+        ASSERT_EQ(tracker.missing(), 3u);
+        ASSERT_EQ(tracker.repaired(), 1u);
+        ASSERT_FALSE(Received(12));
+        ASSERT_FALSE(Received(15));
+        ASSERT_EQ(tracker.nextTimeoutMs(now_ms), 20);
+    }
+
+    // A jump of exactly maxGap is still a gap, the ids in between are missing
+    TEST_F(GapTrackerTest, JumpOfMaxGap)
+    {
+        ASSERT_TRUE(Received(10));
+        ASSERT_TRUE(Received(10 + max_gap));
+        ASSERT_EQ(tracker.missing(), max_gap - 1);
+        ASSERT_TRUE(Received(100));
+        ASSERT_FALSE(Received(100));
+    }
+
+    // A larger jump forward starts the stream over at the new id
+    TEST_F(GapTrackerTest, RestartForward)
+    {
+        ASSERT_TRUE(Received(10));
+        ASSERT_TRUE(Received(13));
+        ASSERT_EQ(tracker.missing(), 2u);
+
+        ASSERT_TRUE(Received(1000));
+        ASSERT_EQ(tracker.missing(), 0u);   // neither fetched nor taken as received
+        ASSERT_EQ(tracker.lost(), 0u);
+        ASSERT_EQ(tracker.nextTimeoutMs(now_ms), -1);
+
+        // ids near the new start count as usual, and are not duplicates of the old stream
+        ASSERT_TRUE(Received(1002));
+        ASSERT_EQ(tracker.missing(), 1u);
+        ASSERT_TRUE(Received(1001));
+        ASSERT_FALSE(Received(1001));
+        ASSERT_FALSE(Received(1000));
+
+        // an id between the old and new streams, once taken as a duplicate, starts it over too
+        ASSERT_TRUE(Received(500));
+        ASSERT_EQ(tracker.missing(), 0u);
+        ASSERT_TRUE(Received(501));
+    }
+
+    // A larger jump back, a publisher that restarted its ids, starts the stream over as well
+    TEST_F(GapTrackerTest, RestartBackward)
+    {
+        ASSERT_TRUE(Received(5000));
+        ASSERT_TRUE(Received(5003));
+        ASSERT_TRUE(Received(1));
+        ASSERT_EQ(tracker.missing(), 0u);
+        ASSERT_TRUE(Received(2));
+        ASSERT_FALSE(Received(1));
+
+        // ids older than the start within maxGap are a cache replay, not a restart
+        ASSERT_TRUE(Received(500, 3));
+        ASSERT_TRUE(Received(400, 3));
+        ASSERT_EQ(tracker.missing(), 99u);
+        ASSERT_TRUE(Received(100, 3));
+        ASSERT_EQ(tracker.missing(), 0u);
+    }
+
+    // A restart of one device's stream leaves the others alone
+    TEST_F(GapTrackerTest, StreamsApart)
+    {
+        ASSERT_TRUE(Received(10, 1));
+        ASSERT_TRUE(Received(10, 2));
+        ASSERT_TRUE(Received(12, 2));
+        ASSERT_TRUE(Received(5000, 1));
+        ASSERT_EQ(tracker.missing(), 1u);
+        ASSERT_TRUE(Received(11, 2));
+        ASSERT_FALSE(Received(11, 2));
+    }
+
+} // namespace
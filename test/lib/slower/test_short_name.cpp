@@ -0,0 +1,194 @@
+/*
+ *  test_short_name.cpp
+ *
+ *  Copyright (C) 2022
+ *  Cisco Systems, Inc.
+ *  All Rights Reserved
+ *
+ *  Description:
+ *      This module will test ShortName, the 128 bit number a MsgShortName
+ *      stands for, against the same number built field by field in an
+ *      unsigned __int128.
+ *
+ *  Portability Issues:
+ *      Needs a compiler with unsigned __int128.
+ */
+
+#include <cstring>
+#include <random>
+#include "shortName.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+    typedef unsigned __int128 u128;
+
+    const int masks[] = {0, 20, 40, 50, 64, 70, 128};
+
+    // The fields concatenated from origin_id down to msg_id
+    u128 Number(const MsgShortName& name)
+    {
+        u128 n = name.spec.origin_id;
+        n = (n << 8) | name.spec.app_id;
+        n = (n << 8) | name.spec.path;
+        n = (n << 18) | name.spec.org;
+        n = (n << 20) | name.spec.team;
+        n = (n << 10) | name.spec.channel;
+        n = (n << 20) | name.spec.device;
+        n = (n << 20) | name.spec.msg_id;
+        return n;
+    }
+
+    u128 Number(const ShortName& name)
+    {
+        return ((u128)name.high() << 64) | name.low();
+    }
+
+    // Bits of the number kept when the low mask bits are cleared
+    u128 Keep(int mask)
+    {
+        return (mask >= 128) ? 0 : ~(u128)0 << mask;
+    }
+
+    // The fixture makes names with every field random, to its full width
+    class ShortNameTest : public ::testing::Test
+    {
+        protected:
+            ShortNameTest() : rng(20231006)
+            {
+            }
+
+            MsgShortName RandomName()
+            {
+                MsgShortName name;
+                std::memset(&name, 0, sizeof(name));
+                name.spec.origin_id = rng() & 0xffffff;
+                name.spec.app_id = rng() & 0xff;
+                name.spec.path = rng() & 0xff;
+                name.spec.org = rng() & 0x3ffff;
+                name.spec.team = rng() & 0xfffff;
+                name.spec.channel = rng() & 0x3ff;
+                name.spec.device = rng() & 0xfffff;
+                name.spec.msg_id = rng() & 0xfffff;
+                return name;
+            }
+
+            std::mt19937 rng;
+    };
+
+    // Converting either way keeps every field, and the number is the fields in order
+    TEST_F(ShortNameTest, RoundTrip)
+    {
+        for (int i = 0; i < 10000; i++)
+        {
+            const MsgShortName name = RandomName();
+            const ShortName shortName(name);
+            ASSERT_TRUE(Number(shortName) == Number(name));
+
+            ASSERT_EQ(shortName.originID(), name.spec.origin_id);
+            ASSERT_EQ(shortName.appID(), name.spec.app_id);
+            ASSERT_EQ((uint8_t)shortName.path(), name.spec.path);
+            ASSERT_EQ(shortName.org(), name.spec.org);
+            ASSERT_EQ(shortName.team(), name.spec.team);
+            ASSERT_EQ(shortName.channel(), name.spec.channel);
+            ASSERT_EQ(shortName.device(), name.spec.device);
+            ASSERT_EQ(shortName.msgID(), name.spec.msg_id);
+
+            const MsgShortName back = shortName.msgShortName();
+            ASSERT_EQ(std::memcmp(back.data, name.data, sizeof(name.data)), 0);
+            ASSERT_TRUE(ShortName(back) == shortName);
+
+            const uint32_t msgID = rng() & 0xfffff;
+            ASSERT_TRUE(Number(shortName.withMsgID(msgID)) == ((Number(name) & Keep(20)) | msgID));
+        }
+    }
+
+    // Every field set to its largest value stays in its own bits
+    TEST_F(ShortNameTest, FullFields)
+    {
+        MsgShortName name;
+        std::memset(&name, 0xff, sizeof(name));
+        const ShortName shortName(name);
+        ASSERT_EQ(shortName.high(), ~(uint64_t)0);
+        ASSERT_EQ(shortName.low(), ~(uint64_t)0);
+        ASSERT_EQ(shortName.team(), 0xfffffu);
+        ASSERT_EQ(shortName.msgShortName().spec.team, 0xfffffu);
+    }
+
+    // masked and filled clear and set the low mask bits, on both sides of the word boundary
+    TEST_F(ShortNameTest, MaskedFilled)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            const MsgShortName name = RandomName();
+            const ShortName shortName(name);
+            const u128 n = Number(name);
+            for (int mask : masks)
+            {
+                ASSERT_TRUE(Number(shortName.masked(mask)) == (n & Keep(mask))) << "mask " << mask;
+                ASSERT_TRUE(Number(shortName.filled(mask)) == (n | ~Keep(mask))) << "mask " << mask;
+            }
+        }
+        const ShortName zero;
+        ASSERT_TRUE(zero.filled(128) == ShortName(~(uint64_t)0, ~(uint64_t)0));
+        ASSERT_TRUE(zero.filled(0) == zero);
+    }
+
+    // covers matches names that differ only in the low mask bits
+    TEST_F(ShortNameTest, Covers)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            const MsgShortName name = RandomName();
+            const ShortName shortName(name);
+            const u128 n = Number(name);
+            for (int mask : masks)
+            {
+                // one bit flipped at each position, just inside and just outside the mask
+                for (int bit = 0; bit < 128; bit++)
+                {
+                    const u128 other = n ^ ((u128)1 << bit);
+                    const ShortName otherName((uint64_t)(other >> 64), (uint64_t)other);
+                    ASSERT_EQ(shortName.covers(otherName, mask), bit < mask)
+                        << "mask " << mask << " bit " << bit;
+                }
+                ASSERT_TRUE(shortName.covers(shortName, mask));
+
+                const ShortName random(RandomName());
+                const bool same = ((Number(random) ^ n) & Keep(mask)) == 0;
+                ASSERT_EQ(shortName.covers(random, mask), same);
+                ASSERT_TRUE(shortName.covers(shortName.masked(mask), mask));
+                ASSERT_TRUE(shortName.covers(shortName.filled(mask), mask));
+            }
+        }
+    }
+
+    // compare and operator< order names as numbers
+    TEST_F(ShortNameTest, Compare)
+    {
+        for (int i = 0; i < 10000; i++)
+        {
+            ShortName a(RandomName());
+            ShortName b(RandomName());
+            if (i % 3 == 1)
+            {
+                // same high word, so only the low word decides
+                b = ShortName(a.high(), b.low());
+            }
+            else if (i % 3 == 2)
+            {
+                b = a.masked(masks[i % 7]);
+            }
+            const u128 x = Number(a);
+            const u128 y = Number(b);
+            const int expected = (x > y) - (x < y);
+            const int got = a.compare(b);
+            ASSERT_EQ((got > 0) - (got < 0), expected);
+            ASSERT_EQ(b.compare(a) < 0, expected > 0);
+            ASSERT_EQ(a < b, x < y);
+            ASSERT_EQ(a == b, x == y);
+            ASSERT_EQ(a != b, x != y);
+        }
+    }
+
+} // namespace
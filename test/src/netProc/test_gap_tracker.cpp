@@ -0,0 +1,81 @@
+/*
+ *  test_gap_tracker.cpp
+ *
+ *  Copyright (C) 2022
+ *  Cisco Systems, Inc.
+ *  All Rights Reserved
+ *
+ *  Description:
+ *      This module will test how netProc's GapTracker counts the object ids
+ *      of a name missing, and how a jump of more than max_gap ids starts
+ *      the name over.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#include "gap_tracker.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+    const uint64_t max_gap = 256;
+
+    // The fixture feeds one tracker the object ids of a name
+    class NetGapTrackerTest : public ::testing::Test
+    {
+        protected:
+            NetGapTrackerTest()
+                : tracker(std::chrono::milliseconds(20), std::chrono::milliseconds(200), 3, max_gap)
+            {
+            }
+
+            bool Received(uint64_t object_id, const std::string& name = "/msg/1")
+            {
+                return tracker.received(name, object_id, now);
+            }
+
+            GapTracker tracker;
+            GapTracker::clock::time_point now = GapTracker::clock::now();
+    };
+
+    // A jump of max_gap is a gap, a larger one either way starts the name over
+    TEST_F(NetGapTrackerTest, RestartOnLargeJump)
+    {
+        ASSERT_TRUE(Received(10));
+        ASSERT_TRUE(Received(10 + max_gap));
+        ASSERT_EQ(tracker.missing(), max_gap - 1);
+
+        ASSERT_TRUE(Received(10 + 2 * max_gap + 1));
+        ASSERT_EQ(tracker.missing(), 0u);
+        ASSERT_EQ(tracker.lost(), 0u);
+        ASSERT_TRUE(tracker.due_repairs(now + std::chrono::seconds(1)).empty());
+
+        // the ids jumped over are not duplicates, each one arriving starts the name over
+        ASSERT_TRUE(Received(100));
+        ASSERT_TRUE(Received(102));
+        ASSERT_EQ(tracker.missing(), 1u);
+        ASSERT_FALSE(Received(102));
+
+        ASSERT_TRUE(Received(5000));
+        ASSERT_TRUE(Received(3));
+        ASSERT_EQ(tracker.missing(), 0u);
+        ASSERT_TRUE(Received(4));
+        ASSERT_FALSE(Received(3));
+    }
+
+    // Missing ids are handed out for repair once the reorder delay has passed
+    TEST_F(NetGapTrackerTest, DueRepairs)
+    {
+        ASSERT_TRUE(Received(1, "/a"));
+        ASSERT_TRUE(Received(3, "/a"));
+        ASSERT_TRUE(Received(1, "/b"));
+        ASSERT_TRUE(tracker.due_repairs(now).empty());
+        ASSERT_EQ(tracker.due_repairs(now + std::chrono::milliseconds(20)),
+                  std::vector<std::string>({"/a"}));
+        ASSERT_TRUE(Received(2, "/a"));
+        ASSERT_EQ(tracker.repaired(), 1u);
+        ASSERT_TRUE(tracker.due_repairs(now + std::chrono::seconds(1)).empty());
+    }
+
+} // namespace
@@ -0,0 +1,317 @@
+/*
+ *  test_cache_log.cpp
+ *
+ *  Copyright (C) 2022
+ *  Cisco Systems, Inc.
+ *  All Rights Reserved
+ *
+ *  Description:
+ *      This module will test how the relay's CacheLog recovers from a
+ *      crash: a record cut short, a record whose check does not match, a
+ *      segment other than the last left unsealed, and compaction that runs
+ *      out of space part way through.
+ *
+ *  Portability Issues:
+ *      Needs a writable /tmp.
+ */
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cacheLog.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+    const size_t data_len = 100;
+
+    MsgShortName MakeName(uint32_t msg_id)
+    {
+        MsgShortName name;
+        std::memset(&name, 0, sizeof(name));
+        name.spec.team = 7;
+        name.spec.msg_id = msg_id;
+        return name;
+    }
+
+    std::vector<uint8_t> MakeData(uint32_t msg_id)
+    {
+        std::vector<uint8_t> data(data_len);
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            data[i] = (uint8_t)(msg_id * 31 + i);
+        }
+        return data;
+    }
+
+    // Offset of the n'th record, from 0, in a segment of records all data_len long
+    size_t RecordOffset(int n)
+    {
+        const size_t record_len = (sizeof(CacheLogRecord) + data_len + 7) & ~(size_t)7;
+        return sizeof(CacheLogSegmentHeader) + n * record_len;
+    }
+
+    // The fixture gives each test a log directory of its own
+    class CacheLogTest : public ::testing::Test
+    {
+        protected:
+            CacheLogTest()
+            {
+                char name[] = "/tmp/test_cache_log.XXXXXX";
+                dir = mkdtemp(name);
+            }
+
+            ~CacheLogTest()
+            {
+                log.reset();
+                std::string rm = "rm -rf " + dir;
+                if (system(rm.c_str()) != 0)
+                {
+                    perror("could not remove the test directory");
+                }
+            }
+
+            std::string SegmentPath(uint64_t seq, const std::string& in = "") const
+            {
+                char file[32];
+                snprintf(file, sizeof(file), "/cache-%08llx.seg", (unsigned long long)seq);
+                return (in.empty() ? dir : in) + file;
+            }
+
+            // Open the log in dir, returning the msg_ids loaded and checking their data
+            std::vector<uint32_t> Open(const std::string& in = "")
+            {
+                std::vector<uint32_t> loaded;
+                log.reset(new CacheLog(in.empty() ? dir : in, segment_bytes));
+                int err = log->load(1000, [&](const CacheLog::Record& rec) {
+                    const std::vector<uint8_t> expected = MakeData(rec.name.spec.msg_id);
+                    EXPECT_EQ(rec.len, expected.size());
+                    EXPECT_EQ(std::memcmp(rec.data, expected.data(), expected.size()), 0)
+                        << "msg_id " << rec.name.spec.msg_id;
+                    loaded.push_back(rec.name.spec.msg_id);
+                    where[rec.name.spec.msg_id] = rec;
+                });
+                EXPECT_EQ(err, 0);
+                return loaded;
+            }
+
+            bool Append(uint32_t msg_id)
+            {
+                const std::vector<uint8_t> data = MakeData(msg_id);
+                CacheLog::Record rec;
+                rec.name = MakeName(msg_id);
+                rec.expiryMs = 0;
+                rec.fragment = false;
+                rec.len = data.size();
+                if (!log->append(rec, data.data()))
+                {
+                    return false;
+                }
+                where[msg_id] = rec;
+                return true;
+            }
+
+            // Change a segment file as a crash might have left it
+            void Truncate(uint64_t seq, size_t len)
+            {
+                ASSERT_EQ(truncate(SegmentPath(seq).c_str(), len), 0);
+            }
+
+            void Corrupt(uint64_t seq, size_t offset)
+            {
+                int fd = open(SegmentPath(seq).c_str(), O_RDWR);
+                ASSERT_GE(fd, 0);
+                uint8_t byte = 0;
+                ASSERT_EQ(pread(fd, &byte, 1, offset), 1);
+                byte ^= 0x5a;
+                ASSERT_EQ(pwrite(fd, &byte, 1, offset), 1);
+                close(fd);
+            }
+
+            off_t FileSize(const std::string& path) const
+            {
+                struct stat st;
+                return (stat(path.c_str(), &st) == 0) ? st.st_size : -1;
+            }
+
+            size_t segment_bytes = 64 * 1024;
+            std::string dir;
+            std::unique_ptr<CacheLog> log;
+            std::map<uint32_t, CacheLog::Record> where;
+    };
+
+    // A record cut short, in its header or its data, is dropped with nothing after it
+    TEST_F(CacheLogTest, TruncatedRecord)
+    {
+        Open();
+        for (uint32_t id = 1; id <= 5; id++)
+        {
+            ASSERT_TRUE(Append(id));
+        }
+        log.reset();
+
+        Truncate(1, RecordOffset(4) + sizeof(CacheLogRecord) + data_len / 2);
+        ASSERT_EQ(Open(), std::vector<uint32_t>({1, 2, 3, 4}));
+
+        // the next record goes where the cut one was
+        ASSERT_TRUE(Append(6));
+        log.reset();
+        ASSERT_EQ(Open(), std::vector<uint32_t>({1, 2, 3, 4, 6}));
+        log.reset();
+
+        Truncate(1, RecordOffset(2) + sizeof(CacheLogRecord) / 2);
+        ASSERT_EQ(Open(), std::vector<uint32_t>({1, 2}));
+    }
+
+    // A record that does not match its check ends the segment there
+    TEST_F(CacheLogTest, BadCheck)
+    {
+        Open();
+        for (uint32_t id = 1; id <= 5; id++)
+        {
+            ASSERT_TRUE(Append(id));
+        }
+        log.reset();
+
+        Corrupt(1, RecordOffset(2) + sizeof(CacheLogRecord) + 10);
+        ASSERT_EQ(Open(), std::vector<uint32_t>({1, 2}));
+        ASSERT_TRUE(Append(6));
+        log.reset();
+        ASSERT_EQ(Open(), std::vector<uint32_t>({1, 2, 6}));
+        log.reset();
+
+        // a damaged name fails the check as well
+        Corrupt(1, RecordOffset(1) + offsetof(CacheLogRecord, name));
+        ASSERT_EQ(Open(), std::vector<uint32_t>({1}));
+    }
+
+    // A segment left unsealed that is not the last is sealed on load, and loads the same after
+    TEST_F(CacheLogTest, UnsealedSegmentResealed)
+    {
+        Open();
+        for (uint32_t id = 1; id <= 3; id++)
+        {
+            ASSERT_TRUE(Append(id));
+        }
+        log.reset();
+
+        // a later active segment, made in a directory of its own and moved in after this one
+        char name[] = "/tmp/test_cache_log.XXXXXX";
+        const std::string other = mkdtemp(name);
+        Open(other);
+        ASSERT_TRUE(Append(10));
+        ASSERT_TRUE(Append(11));
+        log.reset();
+        ASSERT_EQ(rename(SegmentPath(1, other).c_str(), SegmentPath(2).c_str()), 0);
+        rmdir(other.c_str());
+
+        ASSERT_EQ(FileSize(SegmentPath(1)), (off_t)segment_bytes);
+        ASSERT_EQ(Open(), std::vector<uint32_t>({1, 2, 3, 10, 11}));
+        ASSERT_EQ(log->segments(), 2u);
+
+        // sealed, cut to its records, index and footer
+        const off_t sealed = FileSize(SegmentPath(1));
+        ASSERT_EQ(sealed, (off_t)(RecordOffset(3) + 3 * sizeof(CacheLogIndexEntry) + sizeof(CacheLogFooter)));
+        CacheLogFooter footer;
+        int fd = open(SegmentPath(1).c_str(), O_RDONLY);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(pread(fd, &footer, sizeof(footer), sealed - sizeof(footer)), (ssize_t)sizeof(footer));
+        close(fd);
+        ASSERT_EQ(footer.magic, cacheLogFooterMagic);
+        ASSERT_EQ(footer.count, 3u);
+
+        // new records go on in the last segment, and everything loads again from the index
+        ASSERT_TRUE(Append(12));
+        log.reset();
+        ASSERT_EQ(Open(), std::vector<uint32_t>({1, 2, 3, 10, 11, 12}));
+    }
+
+    // Compaction that cannot open a new segment leaves what it has not copied where it was
+    TEST_F(CacheLogTest, CompactionOutOfSpace)
+    {
+        segment_bytes = 4096;
+        Open();
+
+        // fill the first segment, seal it with the first record of the second
+        uint32_t id = 1;
+        while (log->segments() == 1)
+        {
+            ASSERT_TRUE(Append(id++));
+        }
+        const uint32_t per_segment = id - 2;
+        ASSERT_GE(per_segment, 8u);
+
+        // free half the first segment
+        std::map<uint32_t, bool> live;
+        for (uint32_t i = 1; i < id; i++)
+        {
+            live[i] = !(i <= per_segment && i % 2 == 0);
+            if (!live[i])
+            {
+                log->release(where[i].segment, where[i].len);
+            }
+        }
+
+        // leave room for two more records in the active segment, then take away the directory
+        // so no segment can be made after it
+        for (uint32_t n = 1; n < per_segment - 2; n++)
+        {
+            live[id] = true;
+            ASSERT_TRUE(Append(id++));
+        }
+        ASSERT_EQ(log->segments(), 2u);
+        const std::string moved_dir = dir + ".moved";
+        ASSERT_EQ(rename(dir.c_str(), moved_dir.c_str()), 0);
+
+        size_t moved = 0;
+        size_t reclaimed = log->compact(
+            [&](const CacheLog::Record& rec) { return live[rec.name.spec.msg_id]; },
+            [&](const CacheLog::Record& rec) {
+                where[rec.name.spec.msg_id] = rec;
+                moved++;
+            });
+        ASSERT_EQ(reclaimed, 0u);
+        ASSERT_EQ(moved, 2u);
+        ASSERT_EQ(log->segments(), 2u);
+
+        // every live record is still readable where the log says it is
+        for (const auto& it : live)
+        {
+            if (it.second)
+            {
+                const std::vector<uint8_t> expected = MakeData(it.first);
+                ASSERT_EQ(std::memcmp(where[it.first].data, expected.data(), data_len), 0) << it.first;
+            }
+        }
+
+        // appending fails while there is nowhere to put a segment, then picks up again
+        ASSERT_FALSE(Append(id));
+        ASSERT_EQ(rename(moved_dir.c_str(), dir.c_str()), 0);
+        live[id] = true;
+        ASSERT_TRUE(Append(id++));
+        log.reset();
+
+        // the copies made are loaded as well as what they were copied from
+        std::map<uint32_t, int> loaded;
+        for (uint32_t msg_id : Open())
+        {
+            loaded[msg_id]++;
+        }
+        for (const auto& it : live)
+        {
+            if (it.second)
+            {
+                ASSERT_GE(loaded[it.first], 1) << it.first;
+            }
+        }
+    }
+
+} // namespace
@@ -0,0 +1,232 @@
+/*
+ *  test_remote_table.cpp
+ *
+ *  Copyright (C) 2022
+ *  Cisco Systems, Inc.
+ *  All Rights Reserved
+ *
+ *  Description:
+ *      This module will test the relay's RemoteTable against a std::map
+ *      of the same remotes, with random acquires and releases of IPv4 and
+ *      IPv6 remotes, and the deletes that shift probe runs back.
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#include <cstring>
+#include <map>
+#include <random>
+#include <vector>
+#include <arpa/inet.h>
+#include "remoteTable.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+    SlowerRemote RemoteV4(uint32_t address, uint16_t port)
+    {
+        SlowerRemote remote;
+        std::memset(&remote, 0, sizeof(remote));
+        remote.addrLen = sizeof(remote.addr);
+        remote.addr.sin_family = AF_INET;
+        remote.addr.sin_addr.s_addr = htonl(address);
+        remote.addr.sin_port = htons(port);
+        return remote;
+    }
+
+    SlowerRemote RemoteV6(uint32_t address, uint16_t port)
+    {
+        SlowerRemote remote;
+        std::memset(&remote, 0, sizeof(remote));
+        remote.addrLen = sizeof(remote.addr6);
+        remote.addr6.sin6_family = AF_INET6;
+        remote.addr6.sin6_addr.s6_addr[0] = 0x20;
+        remote.addr6.sin6_addr.s6_addr[1] = 0x01;
+        std::memcpy(&remote.addr6.sin6_addr.s6_addr[12], &address, sizeof(address));
+        remote.addr6.sin6_port = htons(port);
+        return remote;
+    }
+
+    // What the table should hold for a remote
+    struct Held
+    {
+        RemoteID id;
+        uint32_t refs;
+    };
+
+    // The fixture checks a RemoteTable against a map of what it should hold
+    class RemoteTableTest : public ::testing::Test
+    {
+        protected:
+            void Acquire(const SlowerRemote& remote)
+            {
+                const RemoteID id = table.acquire(remote);
+                auto it = model.find(remote);
+                if (it != model.end())
+                {
+                    ASSERT_EQ(id, it->second.id);
+                    it->second.refs++;
+                    return;
+                }
+
+                // a new remote takes the id freed last, or the next one if none is free
+                if (freed.empty())
+                {
+                    ASSERT_EQ(id, next_id);
+                    next_id++;
+                }
+                else
+                {
+                    ASSERT_EQ(id, freed.back());
+                    freed.pop_back();
+                    reused++;
+                }
+                model[remote] = Held{id, 1};
+            }
+
+            void Release(const SlowerRemote& remote)
+            {
+                auto it = model.find(remote);
+                ASSERT_NE(it, model.end());
+                table.release(it->second.id);
+                if (--it->second.refs == 0)
+                {
+                    freed.push_back(it->second.id);
+                    model.erase(it);
+                }
+            }
+
+            void Check(const std::vector<SlowerRemote>& remotes)
+            {
+                ASSERT_EQ(table.size(), model.size());
+                for (const auto& remote : remotes)
+                {
+                    auto it = model.find(remote);
+                    if (it == model.end())
+                    {
+                        ASSERT_EQ(table.find(remote), RemoteTable::none);
+                    }
+                    else
+                    {
+                        ASSERT_EQ(table.find(remote), it->second.id);
+                        ASSERT_TRUE(table[it->second.id] == remote);
+                    }
+                }
+            }
+
+            RemoteTable table;
+            std::map<SlowerRemote, Held> model;
+            std::vector<RemoteID> freed;
+            RemoteID next_id = 0;
+            size_t reused = 0;
+    };
+
+    // Remotes of both families that differ only in address or port are all distinct
+    TEST_F(RemoteTableTest, Families)
+    {
+        std::vector<SlowerRemote> remotes = {RemoteV4(0x7f000001, 5004),
+                                             RemoteV4(0x7f000001, 5005),
+                                             RemoteV4(0x7f000002, 5004),
+                                             RemoteV6(0x7f000001, 5004),
+                                             RemoteV6(0x7f000002, 5004)};
+        for (const auto& remote : remotes)
+        {
+            Acquire(remote);
+        }
+        Check(remotes);
+        ASSERT_EQ(table.size(), remotes.size());
+    }
+
+    // Remotes in one probe run are all found after any one of them is deleted
+    TEST_F(RemoteTableTest, BackwardShiftDelete)
+    {
+        // a fresh table has 64 slots, take six remotes hashing to two neighbouring slots
+        const uint32_t mask = 63;
+        std::vector<SlowerRemote> run;
+        for (uint16_t port = 1; run.size() < 6; port++)
+        {
+            const SlowerRemote remote =
+                (port % 2) ? RemoteV4(0x0a000001, port) : RemoteV6(0x0a000001, port);
+            const uint32_t home = RemoteTable::hash(remote) & mask;
+            if ((home == 10 && run.size() < 4) || (home == 11 && run.size() >= 4))
+            {
+                run.push_back(remote);
+            }
+        }
+
+        for (size_t gone = 0; gone < run.size(); gone++)
+        {
+            for (const auto& remote : run)
+            {
+                Acquire(remote);
+            }
+            Release(run[gone]);
+            Check(run);
+
+            for (size_t i = 0; i < run.size(); i++)
+            {
+                if (i != gone)
+                {
+                    Release(run[i]);
+                }
+            }
+            Check(run);
+        }
+    }
+
+    // Random acquires and releases, through growing the table, match the map
+    TEST_F(RemoteTableTest, Random)
+    {
+        std::mt19937 rng(20231005);
+        std::vector<SlowerRemote> remotes;
+        for (uint32_t i = 0; i < 400; i++)
+        {
+            // few ports and addresses, so remotes share all but one of them
+            const uint32_t address = 0xc0a80000 + i % 37;
+            const uint16_t port = 4000 + i / 37;
+            remotes.push_back((i % 3) ? RemoteV4(address, port) : RemoteV6(address, port));
+        }
+
+        for (int step = 0; step < 200000; step++)
+        {
+            const SlowerRemote& remote = remotes[rng() % remotes.size()];
+            const uint32_t op = rng() % 8;
+            if (op < 3)
+            {
+                Acquire(remote);
+            }
+            else if (op == 3 && model.count(remote))
+            {
+                // another reference to an id already held
+                table.acquire(model[remote].id);
+                model[remote].refs++;
+            }
+            else if (model.count(remote))
+            {
+                Release(remote);
+            }
+            if (HasFatalFailure())
+            {
+                return;
+            }
+            if (step % 1000 == 0)
+            {
+                Check(remotes);
+            }
+        }
+        Check(remotes);
+
+        // everything released leaves the table empty
+        while (!model.empty())
+        {
+            const SlowerRemote remote = model.begin()->first;
+            Release(remote);
+        }
+        Check(remotes);
+        ASSERT_EQ(table.size(), 0);
+        ASSERT_GT(reused, 1000);
+        ASSERT_GT(next_id, 128);   // more than a fresh table holds before it grows
+    }
+
+} // namespace
@@ -0,0 +1,261 @@
+/*
+ *  test_timer_wheel.cpp
+ *
+ *  Copyright (C) 2022
+ *  Cisco Systems, Inc.
+ *  All Rights Reserved
+ *
+ *  Description:
+ *      This module will test the relay's TimerWheel against a reference
+ *      that just records the tick each timer is due, with random schedules,
+ *      cancels and advances, including ones made from inside advance().
+ *
+ *  Portability Issues:
+ *      None.
+ */
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+#include "timerWheel.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+    const uint32_t tick_ms = 10;
+    const int num_timers = 300;
+
+    // Ticks the wheels reach, a timer further out than this fires after it
+    const uint64_t reach = (uint64_t(1) << (TimerWheel::slotBits * TimerWheel::numLevels)) - 1;
+
+    struct TestTimer : public TimerWheel::Timer
+    {
+        int id = 0;
+    };
+
+    // The fixture keeps the tick each timer is due, -1 when it is not scheduled
+    class TimerWheelTest : public ::testing::Test
+    {
+        protected:
+            TimerWheelTest()
+                : rng(20231007),
+                  wheel(tick_ms, start_ms),
+                  timers(new TestTimer[num_timers]),
+                  due(num_timers, -1),
+                  tick(start_ms / tick_ms)
+            {
+                for (int i = 0; i < num_timers; i++)
+                {
+                    timers[i].id = i;
+                }
+            }
+
+            // The tick a timer scheduled for expire_ms at the current tick fires on
+            int64_t DueTick(uint64_t expire_ms) const
+            {
+                const uint64_t at = (expire_ms + tick_ms - 1) / tick_ms;
+                return std::max<int64_t>(at, tick + 1);
+            }
+
+            void Schedule(int id, uint64_t expire_ms)
+            {
+                wheel.schedule(timers[id], expire_ms);
+                due[id] = DueTick(expire_ms);
+            }
+
+            void Cancel(int id)
+            {
+                wheel.cancel(timers[id]);
+                due[id] = -1;
+            }
+
+            // A time from now, mostly soon, some beyond each level and some past the top one
+            uint64_t RandomExpiry()
+            {
+                const uint64_t now_ms = tick * tick_ms;
+                switch (rng() % 8)
+                {
+                    case 0:
+                        return now_ms - rng() % 1000;   // overdue
+                    case 1:
+                    case 2:
+                    case 3:
+                        return now_ms + rng() % (64 * tick_ms);
+                    case 4:
+                        return now_ms + rng() % (4096 * tick_ms);
+                    case 5:
+                        return now_ms + rng() % (262144 * tick_ms);
+                    case 6:
+                        return now_ms + rng() % ((reach + 1) * tick_ms);
+                    default:
+                        return now_ms + (reach + 1 + rng() % (reach / 2)) * tick_ms;
+                }
+            }
+
+            // Advance to now_ms, checking what fires against the reference. Each fired timer
+            // may reschedule itself or change another timer, as the relay's leases do.
+            void Advance(uint64_t now_ms, bool change_while_firing)
+            {
+                const int64_t from = tick;
+                const int64_t target = now_ms / tick_ms;
+                size_t fired = wheel.advance(now_ms, [&](TimerWheel::Timer& timer) {
+                    TestTimer& t = static_cast<TestTimer&>(timer);
+                    ASSERT_FALSE(t.scheduled());
+                    ASSERT_NE(due[t.id], -1) << "timer " << t.id << " was not scheduled";
+                    ASSERT_GT(due[t.id], from) << "timer " << t.id << " fired late";
+                    ASSERT_GE(due[t.id], tick) << "timer " << t.id << " fired out of order";
+                    ASSERT_LE(due[t.id], target) << "timer " << t.id << " fired early";
+
+                    // timers fire in the order they are due, so the wheel is on this one's tick
+                    tick = due[t.id];
+                    due[t.id] = -1;
+
+                    if (change_while_firing)
+                    {
+                        const int other = rng() % num_timers;
+                        switch (rng() % 4)
+                        {
+                            case 0:
+                                Schedule(t.id, RandomExpiry());
+                                break;
+                            case 1:
+                                Cancel(other);
+                                break;
+                            case 2:
+                                Schedule(other, RandomExpiry());
+                                break;
+                            default:
+                                break;
+                        }
+                    }
+                });
+                if (HasFatalFailure())
+                {
+                    return;
+                }
+                tick = std::max<int64_t>(tick, target);
+
+                // nothing due by now is left, and what is left is still scheduled
+                size_t left = 0;
+                for (int i = 0; i < num_timers; i++)
+                {
+                    ASSERT_EQ(timers[i].scheduled(), due[i] != -1) << "timer " << i;
+                    if (due[i] != -1)
+                    {
+                        ASSERT_GT(due[i], target) << "timer " << i << " did not fire";
+                        left++;
+                    }
+                }
+                ASSERT_EQ(wheel.size(), left);
+                total_fired += fired;
+            }
+
+            static const uint64_t start_ms = 123456789;
+
+            std::mt19937 rng;
+            TimerWheel wheel;
+            std::unique_ptr<TestTimer[]> timers;
+            std::vector<int64_t> due;
+            int64_t tick;
+            size_t total_fired = 0;
+    };
+
+    const uint64_t TimerWheelTest::start_ms;
+
+    // A timer due just past each level fires on its tick once the levels above cascade
+    TEST_F(TimerWheelTest, Cascade)
+    {
+        const uint64_t now_ms = tick * tick_ms;
+        const uint64_t deltas[] = {1, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 262145, reach};
+        int id = 0;
+        for (uint64_t delta : deltas)
+        {
+            Schedule(id++, now_ms + delta * tick_ms);
+        }
+
+        // and on and just after the ticks where each level wraps, a level's slot away, so
+        // they come down from the level above in the same tick the level below is spread
+        for (int level = 1; level < TimerWheel::numLevels; level++)
+        {
+            const uint64_t span = uint64_t(1) << (TimerWheel::slotBits * level);
+            const uint64_t wrap = (tick / span + 2) * span;
+            for (uint64_t offset : {uint64_t(0), uint64_t(1), uint64_t(TimerWheel::numSlots - 1)})
+            {
+                Schedule(id++, (wrap + offset) * tick_ms);
+            }
+        }
+        while (wheel.size() > 0)
+        {
+            // one tick at a time while something is close, then straight to the next due
+            int64_t next = -1;
+            for (int64_t d : due)
+            {
+                if (d != -1 && (next == -1 || d < next))
+                {
+                    next = d;
+                }
+            }
+            Advance((next - 1) * tick_ms, false);
+            Advance(next * tick_ms, false);
+            ASSERT_FALSE(HasFatalFailure());
+        }
+        ASSERT_EQ(total_fired, (size_t)id);
+    }
+
+    // A timer further out than the wheels reach is held at the top level and fires on its tick
+    TEST_F(TimerWheelTest, PastTheTopLevel)
+    {
+        const uint64_t now_ms = tick * tick_ms;
+        Schedule(0, now_ms + (reach + 1) * tick_ms);
+        Schedule(1, now_ms + (2 * reach + 5) * tick_ms);
+        Advance(now_ms + reach * tick_ms, false);
+        ASSERT_EQ(wheel.size(), 2u);
+        Advance(now_ms + (reach + 1) * tick_ms, false);
+        ASSERT_EQ(wheel.size(), 1u);
+        Advance(now_ms + (2 * reach + 4) * tick_ms, false);
+        ASSERT_EQ(wheel.size(), 1u);
+        Advance(now_ms + (2 * reach + 5) * tick_ms, false);
+        ASSERT_EQ(wheel.size(), 0u);
+    }
+
+    // Random schedules, cancels and advances, some made while timers fire
+    TEST_F(TimerWheelTest, Random)
+    {
+        for (int step = 0; step < 20000; step++)
+        {
+            const int id = rng() % num_timers;
+            switch (rng() % 6)
+            {
+                case 0:
+                case 1:
+                    Schedule(id, RandomExpiry());
+                    break;
+                case 2:
+                    Cancel(id);
+                    break;
+                case 3:
+                    // a few ticks, often across a level 0 wrap
+                    Advance((tick + rng() % 100) * tick_ms + rng() % tick_ms, step % 2);
+                    break;
+                case 4:
+                    Advance((tick + 1) * tick_ms, step % 2);
+                    break;
+                default:
+                    // now and then far enough to cascade the upper levels
+                    if (rng() % 50 == 0)
+                    {
+                        Advance((tick + rng() % (reach / 8)) * tick_ms, step % 2);
+                    }
+                    break;
+            }
+            ASSERT_FALSE(HasFatalFailure()) << "step " << step;
+        }
+        ASSERT_GT(total_fired, 1000u);
+
+        // run everything out
+        Advance((tick + 2 * reach) * tick_ms, false);
+        ASSERT_EQ(wheel.size(), 0u);
+    }
+
+} // namespace